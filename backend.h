@@ -31,4 +31,9 @@ public:
                                    char *buf, size_t len) = 0;
 };
 
+/* stripe each object over 'count' sub-objects, 'unit' bytes at a
+ * time - see backend_stripe.cc
+ */
+extern backend *make_striped_backend(backend *be, size_t unit, int count);
+
 #endif
@@ -0,0 +1,227 @@
+/*
+ * file:        backend_stripe.cc
+ * description: backend objects striped over several sub-objects
+ *
+ * author:      Peter Desnoyers, Northeastern University
+ * Copyright 2021, 2022 Peter Desnoyers
+ * license:     GNU LGPL v2.1 or newer
+ *              LGPL-2.1-or-later
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+#include "lsvd_types.h"
+
+#include "smartiov.h"
+#include "request.h"
+#include "objname.h"
+#include "backend.h"
+
+/* Object bytes are dealt out 'unit' at a time, round-robin, over
+ * 'count' sub-objects, so the pieces of a large object land on
+ * different PGs and upload in parallel. Sub-object 0 is the object
+ * itself and holds the start of the header; anything that fits in
+ * one unit (superblock, most headers) is laid out exactly as it is
+ * without striping. The layout isn't recorded anywhere, so it has
+ * to stay the same for the life of a volume.
+ *
+ * Sub-object 0 is written last: if it exists, so does the rest of
+ * the object, and replay after a crash never sees a partial one.
+ */
+class striped_backend : public backend {
+    backend *be;
+    size_t unit;
+    int count;
+
+    /* the parts of [offset,offset+bytes) that fall in each
+     * sub-object, as the sub-object offset and a slice of 'iovs'.
+     * Consecutive stripes of a sub-object are contiguous in it.
+     */
+    struct piece {
+	size_t offset = 0;
+	smartiov iovs;
+    };
+    void split(size_t offset, smartiov &iovs, std::vector<piece> &pieces) {
+	pieces.resize(count);
+	size_t len = iovs.bytes();
+	for (size_t pos = 0; pos < len; ) {
+	    size_t stripe = (offset + pos) / unit;
+	    size_t _len = std::min(len - pos, (stripe+1)*unit - offset - pos);
+	    auto &p = pieces[stripe % count];
+	    if (p.iovs.size() == 0)
+		p.offset = (stripe / count) * unit + (offset + pos) % unit;
+	    auto slice = iovs.slice(pos, pos + _len);
+	    auto [iov, iovcnt] = slice.c_iov();
+	    p.iovs.ingest(iov, iovcnt);
+	    pos += _len;
+	}
+    }
+
+    void sub_name(objname &sub, const char *name, int i) {
+	if (i == 0)
+	    sub.init(name);
+	else
+	    sub.init_stripe(name, i);
+    }
+
+    /* fan-out parent: runs every child but 'last' at once, 'last'
+     * (sub-object 0, for writes) once they're done, and notifies the
+     * parent when it's all done.
+     */
+    class stripe_req : public request {
+	std::atomic<int> n;
+	std::atomic<bool> _failed = false;
+	request *parent = NULL;
+    public:
+	std::vector<request*> reqs;
+	request *last = NULL;
+	request *head = NULL;	// sub-object 0; errors elsewhere are short reads
+	stripe_req(int n_) : n(n_) {}
+	~stripe_req() {}
+	void run(request *parent_) {
+	    parent = parent_;
+	    auto v = reqs;	// we may be gone before the loop ends
+	    for (auto r : v)
+		r->run(this);
+	}
+	void notify(request *child) {
+	    if (child && child == head && child->failed())
+		_failed = true;
+	    if (child)
+		child->release();
+	    int left = --n;
+	    if (left == 0) {
+		parent->notify(this);
+		delete this;
+	    }
+	    else if (left == 1 && last != NULL)
+		last->run(this);
+	}
+	void wait() {}
+	void release() {}
+	bool failed() { return _failed; }
+    };
+
+    request *make_req(enum lsvd_op op, const char *name, size_t offset,
+		      smartiov &iovs) {
+	std::vector<piece> pieces;
+	split(offset, iovs, pieces);
+	std::vector<request*> reqs;
+	for (int i = count-1; i >= 0; i--) {
+	    if (pieces[i].iovs.size() == 0)
+		continue;
+	    objname sub;
+	    sub_name(sub, name, i);
+	    auto [iov, iovcnt] = pieces[i].iovs.c_iov();
+	    if (op == OP_WRITE)
+		reqs.push_back(be->make_write_req(sub.c_str(), iov, iovcnt));
+	    else
+		reqs.push_back(be->make_read_req(sub.c_str(), pieces[i].offset,
+						 iov, iovcnt));
+	}
+	if (reqs.size() == 1)
+	    return reqs[0];
+	auto s_req = new stripe_req(reqs.size());
+	s_req->reqs = reqs;
+	if (pieces[0].iovs.size() > 0)
+	    s_req->head = reqs.back();
+	if (op == OP_WRITE) {	// sub-object 0 is at the back
+	    s_req->last = reqs.back();
+	    s_req->reqs.pop_back();
+	}
+	return s_req;
+    }
+
+public:
+    striped_backend(backend *be_, size_t unit_, int count_) {
+	be = be_;
+	unit = unit_;
+	count = count_;
+    }
+    ~striped_backend() {
+	delete be;
+    }
+
+    /* sub-object 0 last, see above
+     */
+    int write_object(const char *name, iovec *iov, int iovcnt) {
+	assert(*((int*)iov[0].iov_base) == LSVD_MAGIC);
+	smartiov iovs(iov, iovcnt);
+	std::vector<piece> pieces;
+	split(0, iovs, pieces);
+	for (int i = count-1; i >= 0; i--) {
+	    if (pieces[i].iovs.size() == 0)
+		continue;
+	    objname sub;
+	    sub_name(sub, name, i);
+	    auto [_iov, _iovcnt] = pieces[i].iovs.c_iov();
+	    int r = be->write_object(sub.c_str(), _iov, _iovcnt);
+	    if (r < 0)
+		return r;
+	}
+	return 0;
+    }
+
+    /* a missing later sub-object is a short read, like reading
+     * past the end of an unstriped object
+     */
+    int read_object(const char *name, iovec *iov, int iovcnt,
+		    size_t offset) {
+	smartiov iovs(iov, iovcnt);
+	std::vector<piece> pieces;
+	split(offset, iovs, pieces);
+	int sum = 0;
+	for (int i = 0; i < count; i++) {
+	    if (pieces[i].iovs.size() == 0)
+		continue;
+	    objname sub;
+	    sub_name(sub, name, i);
+	    auto [_iov, _iovcnt] = pieces[i].iovs.c_iov();
+	    int r = be->read_object(sub.c_str(), _iov, _iovcnt,
+				    pieces[i].offset);
+	    if (r < 0 && i == 0)
+		return r;
+	    if (r < 0)
+		break;
+	    sum += r;
+	}
+	return sum;
+    }
+
+    /* small objects never had the later sub-objects
+     */
+    int delete_object(const char *name) {
+	for (int i = 1; i < count; i++) {
+	    objname sub;
+	    sub.init_stripe(name, i);
+	    be->delete_object(sub.c_str());
+	}
+	return be->delete_object(name);
+    }
+
+    request *make_write_req(const char *name, iovec *iov, int iovcnt) {
+	assert(*((int*)iov[0].iov_base) == LSVD_MAGIC);
+	smartiov iovs(iov, iovcnt);
+	return make_req(OP_WRITE, name, 0, iovs);
+    }
+    request *make_read_req(const char *name, size_t offset,
+			   iovec *iov, int iovcnt) {
+	smartiov iovs(iov, iovcnt);
+	return make_req(OP_READ, name, offset, iovs);
+    }
+    request *make_read_req(const char *name, size_t offset,
+			   char *buf, size_t len) {
+	iovec iov = {buf, len};
+	smartiov iovs(&iov, 1);
+	return make_req(OP_READ, name, offset, iovs);
+    }
+};
+
+backend *make_striped_backend(backend *be, size_t unit, int count) {
+    return new striped_backend(be, unit, count);
+}
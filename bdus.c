@@ -46,6 +46,18 @@ int do_flush(struct bdus_ctx *ctx)
     return rbd_flush(img);
 }
 
+int do_discard(uint64_t offset, uint32_t size, struct bdus_ctx *ctx)
+{
+    rbd_image_t img = ctx->private_data;
+    rbd_completion_t c;
+    rbd_aio_create_completion(NULL, NULL, &c);
+    rbd_aio_discard(img, offset, size, c);
+    rbd_aio_wait_for_complete(c);
+    int rv = rbd_aio_get_return_value(c);
+    rbd_aio_release(c);
+    return rv < 0 ? rv : 0;
+}
+
 /* including all the members in case we compile as C++
  */
 static const struct bdus_ops device_ops =
@@ -59,7 +71,7 @@ static const struct bdus_ops device_ops =
     .write_zeros = NULL,
     .fua_write = NULL,
     .flush      = do_flush,
-    .discard = NULL,
+    .discard = do_discard,
     .secure_erase = NULL,
     .ioctl = NULL
 };
@@ -0,0 +1,295 @@
+/*
+ * file:        bench.cc
+ * description: micro-benchmarks and image-level benchmarks, with JSON
+ *              output for tracking regressions - see bench.sh
+ *
+ * author:      Peter Desnoyers, Northeastern University
+ * Copyright 2021, 2022 Peter Desnoyers
+ * license:     GNU LGPL v2.1 or newer
+ *              LGPL-2.1-or-later
+ *
+ * usage: lsvd-bench [--quick] [--image <name>]
+ *   --quick   1M extents only, fewer ops
+ *   --image   also run the translate / write cache / read cache
+ *             benchmarks against a fresh image (mkdisk.py), using
+ *             whatever LSVD_* settings are in the environment
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <uuid/uuid.h>
+
+#include <vector>
+#include <string>
+#include <map>
+#include <random>
+#include <chrono>
+#include <functional>
+
+#include "lsvd_types.h"
+#include "extent.h"
+#include "smartiov.h"
+#include "crc32c.h"
+#include "fake_rbd.h"
+#include "lsvd_debug.h"
+
+std::mt19937_64 rng(17);	// same sequence every run
+
+struct result {
+    std::string name;
+    long        ops;
+    double      secs;
+    std::vector<std::pair<std::string,double>> extra;
+};
+std::vector<result> results;
+
+static double timeit(std::function<void()> f) {
+    auto t0 = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double> dt = std::chrono::steady_clock::now() - t0;
+    return dt.count();
+}
+
+static void add_result(std::string name, long ops, double secs,
+		       std::vector<std::pair<std::string,double>> extra = {}) {
+    results.push_back((result){name, ops, secs, extra});
+    fprintf(stderr, "%-24s %10ld ops %8.3f s %12.0f ops/s\n", name.c_str(),
+	    ops, secs, ops / secs);
+}
+
+static void print_json(void) {
+    printf("[\n");
+    for (size_t i = 0; i < results.size(); i++) {
+	auto &r = results[i];
+	printf("  {\"name\": \"%s\", \"ops\": %ld, \"secs\": %.6f, "
+	       "\"ops_per_sec\": %.1f", r.name.c_str(), r.ops, r.secs,
+	       r.ops / r.secs);
+	for (auto [k, v] : r.extra)
+	    printf(", \"%s\": %.1f", k.c_str(), v);
+	printf("}%s\n", i+1 < results.size() ? "," : "");
+    }
+    printf("]\n");
+}
+
+/* ------------- micro-benchmarks ------------- */
+
+/* random 4KB overwrites until the map has n extents, then random
+ * lookups
+ */
+static void bench_extmap(long n) {
+    extmap::objmap map;
+    int64_t vol = n * 16;	// sectors
+    std::uniform_int_distribution<int64_t> lba(0, vol/8 - 1);
+    long updates = 0;
+    std::string tag = std::to_string(n / 1000000) + "M";
+
+    double t = timeit([&]() {
+	    for (int64_t obj = 1; (long)map.size() < n; obj++)
+		for (int i = 0; i < 1000; i++, updates++) {
+		    extmap::obj_offset oo = {obj, i*8};
+		    int64_t base = lba(rng) * 8;
+		    map.update(base, base+8, oo);
+		}
+	});
+    add_result("extmap_update_" + tag, updates, t,
+	       {{"extents", (double)map.size()}});
+
+    long lookups = 1000000, found = 0;
+    t = timeit([&]() {
+	    for (long i = 0; i < lookups; i++) {
+		int64_t base = lba(rng) * 8;
+		auto it = map.lookup(base);
+		if (it != map.end() && it->base() < base + 8)
+		    found++;
+	    }
+	});
+    add_result("extmap_lookup_" + tag, lookups, t,
+	       {{"hit_pct", 100.0 * found / lookups}});
+}
+
+/* the copy into the batch buffer that every write goes through in
+ * the translation layer, with and without a CRC pass
+ */
+static void bench_batch_copy(long n_ops) {
+    size_t batch = 8*1024*1024, len = 4096;
+    char *buf = (char*)aligned_alloc(4096, batch);
+    char *src = (char*)aligned_alloc(4096, 64*1024);
+    memset(src, 17, 64*1024);
+    memset(buf, 0, batch);
+
+    for (int with_crc = 0; with_crc < 2; with_crc++) {
+	uint32_t crc = 0;
+	size_t pos = 0;
+	double t = timeit([&]() {
+		for (long i = 0; i < n_ops; i++) {
+		    iovec iov = {src + (i % 16) * len, len};
+		    smartiov iovs(&iov, 1);
+		    if (pos + len > batch)
+			pos = 0;
+		    iovs.copy_out(buf + pos);
+		    if (with_crc)
+			crc = crc32c(crc, buf + pos, len);
+		    pos += len;
+		}
+	    });
+	add_result(with_crc ? "batch_copy_crc_4k" : "batch_copy_4k", n_ops, t,
+		   {{"MB_per_sec", n_ops * len / t / 1e6}});
+	if (crc == 1)		// keep it from being optimized out
+	    printf(" ");
+    }
+    free(buf);
+    free(src);
+}
+
+static void bench_crc(long n_ops) {
+    size_t len = 4096;
+    char *buf = (char*)aligned_alloc(4096, len);
+    memset(buf, 17, len);
+    uint32_t crc = 0;
+    double t = timeit([&]() {
+	    for (long i = 0; i < n_ops; i++)
+		crc = crc32c(crc, buf, len);
+	});
+    add_result("crc32c_4k", n_ops, t, {{"MB_per_sec", n_ops * len / t / 1e6},
+				       {"hw", (double)crc32c_have_hw()}});
+    free(buf);
+}
+
+/* ------------- image benchmarks ------------- */
+
+/* one histogram line from lsvd_get_metrics, e.g. "write_lat"
+ */
+static std::vector<std::pair<std::string,double>>
+get_hist(rbd_image_t img, const char *name) {
+    int len = lsvd_get_metrics(img, NULL, 0) + 1;
+    std::vector<char> buf(len);
+    lsvd_get_metrics(img, buf.data(), len);
+    std::vector<std::pair<std::string,double>> v;
+    for (char *line = strtok(buf.data(), "\n"); line != NULL;
+	 line = strtok(NULL, "\n")) {
+	char _name[64];
+	unsigned long n, mean, p50, p90, p99, p999, max;
+	if (sscanf(line, "%63s %lu %lu %lu %lu %lu %lu %lu", _name, &n, &mean,
+		   &p50, &p90, &p99, &p999, &max) == 8 && !strcmp(_name, name)) {
+	    v = {{std::string(name) + "_p50_us", p50 / 1000.0},
+		 {std::string(name) + "_p99_us", p99 / 1000.0},
+		 {std::string(name) + "_max_us", max / 1000.0}};
+	}
+    }
+    return v;
+}
+
+/* 4KB random I/O at queue depth 'qd' over [base, base+len)
+ */
+static double run_aio(rbd_image_t img, bool write, long n_ops, int qd,
+		      uint64_t base, uint64_t len, std::vector<uint64_t> *offsets) {
+    char *buf = (char*)aligned_alloc(4096, 4096L * qd);
+    memset(buf, 17, 4096L * qd);
+    std::vector<rbd_completion_t> comps(qd, NULL);
+    std::uniform_int_distribution<uint64_t> pg(0, len/4096 - 1);
+
+    double t = timeit([&]() {
+	    for (long i = 0; i < n_ops + qd; i++) {
+		auto &c = comps[i % qd];
+		if (c != NULL) {
+		    rbd_aio_wait_for_complete(c);
+		    rbd_aio_release(c);
+		    c = NULL;
+		}
+		if (i >= n_ops)
+		    continue;
+		uint64_t offset = offsets ? (*offsets)[i % offsets->size()] :
+		    base + pg(rng) * 4096;
+		char *_buf = buf + (i % qd) * 4096L;
+		rbd_aio_create_completion(NULL, NULL, &c);
+		if (write)
+		    rbd_aio_write(img, offset, 4096, _buf, c);
+		else
+		    rbd_aio_read(img, offset, 4096, _buf, c);
+	    }
+	});
+    free(buf);
+    return t;
+}
+
+static void bench_image(const char *name, long n_ops) {
+    /* translation layer alone: 4KB writes into the batch, straight
+     * to the backend. This also gives the read cache benchmark data
+     * that's not in the write cache.
+     */
+    _dbg *xlate = NULL;
+    uint64_t vol = xlate_open((char*)name, 2, false, (void**)&xlate);
+    uint64_t region = std::min(vol / 4, 8UL*1024*1024); // fits the rcache
+    std::uniform_int_distribution<uint64_t> pg(0, region/4096 - 1);
+    char *buf = (char*)aligned_alloc(4096, 4096);
+    memset(buf, 17, 4096);
+    double t = timeit([&]() {
+	    for (uint64_t i = 0; i < region / 4096; i++)
+		xlate_write(xlate, buf, i*4096, 4096);
+	    for (long i = 0; i < n_ops; i++)
+		xlate_write(xlate, buf, pg(rng)*4096, 4096);
+	    xlate_flush(xlate);
+	});
+    add_result("xlate_writev_4k", region/4096 + n_ops, t);
+    xlate_close(xlate);
+    free(buf);
+
+    rbd_image_t img;
+    if (rbd_open(NULL, name, &img, NULL) < 0) {
+	fprintf(stderr, "can't open %s\n", name);
+	exit(1);
+    }
+
+    /* write cache commit path, away from the read cache region
+     */
+    t = run_aio(img, true, n_ops, 32, vol/2, vol/2, NULL);
+    auto extra = get_hist(img, "wcache_commit_lat");
+    auto e2 = get_hist(img, "write_lat");
+    extra.insert(extra.end(), e2.begin(), e2.end());
+    add_result("wcache_write_4k_qd32", n_ops, t, extra);
+    rbd_flush(img);
+
+    /* read cache: the first pass over a set of pages misses and
+     * fills, the second hits
+     */
+    std::vector<uint64_t> offsets;
+    for (long i = 0; i < std::min(n_ops, (long)(region/4096)); i++)
+	offsets.push_back(pg(rng) * 4096);
+    t = run_aio(img, false, offsets.size(), 32, 0, region, &offsets);
+    add_result("rcache_miss_4k_qd32", offsets.size(), t,
+	       get_hist(img, "backend_read_lat"));
+    t = run_aio(img, false, offsets.size(), 32, 0, region, &offsets);
+    add_result("rcache_hit_4k_qd32", offsets.size(), t,
+	       get_hist(img, "rcache_ssd_lat"));
+
+    rbd_close(img);
+}
+
+int main(int argc, char **argv) {
+    bool quick = false;
+    const char *image = NULL;
+    for (int i = 1; i < argc; i++) {
+	if (!strcmp(argv[i], "--quick"))
+	    quick = true;
+	else if (!strcmp(argv[i], "--image") && i+1 < argc)
+	    image = argv[++i];
+	else {
+	    fprintf(stderr, "usage: %s [--quick] [--image <name>]\n", argv[0]);
+	    exit(1);
+	}
+    }
+    long n_ops = quick ? 100000 : 1000000;
+
+    bench_extmap(1000000);
+    if (!quick)
+	bench_extmap(10000000);
+    bench_batch_copy(n_ops);
+    bench_crc(n_ops);
+    if (image)
+	bench_image(image, n_ops / 10);
+
+    print_json();
+    return 0;
+}
@@ -0,0 +1,40 @@
+#!/bin/bash
+# repeatable benchmark run against the file backend:
+#   lsvd-bench micro-benchmarks + image benchmarks -> micro.json
+#   fio profiles in bench.fio                       -> fio.json
+#
+# usage: bench.sh [output dir]
+# environment (optional):
+#   BENCH_DIR      scratch directory for the image and cache (/tmp/lsvd-bench)
+#   BENCH_SIZE     volume size (1g)
+#   BENCH_RUNTIME  seconds per fio profile (30)
+#   BENCH_QUICK    if set, shorter micro-benchmarks
+#   LSVD_*         passed through, e.g. LSVD_CACHE_SIZE
+#
+set -e
+
+out=${1:-bench-results/$(date +%Y%m%d-%H%M%S)}
+dir=${BENCH_DIR:-/tmp/lsvd-bench}
+size=${BENCH_SIZE:-1g}
+export BENCH_RUNTIME=${BENCH_RUNTIME:-30}
+export LSVD_BACKEND=file
+export LSVD_CACHE_DIR=$dir
+
+fresh_image() {
+    mkdir -p $dir
+    rm -f $dir/*
+    python3 mkdisk.py --size $size $dir/obj > /dev/null
+}
+
+mkdir -p $out
+(git rev-parse HEAD; git status --short) > $out/commit.txt 2>/dev/null || true
+env | grep '^LSVD_\|^BENCH_' > $out/env.txt
+
+fresh_image
+./lsvd-bench ${BENCH_QUICK:+--quick} --image $dir/obj > $out/micro.json
+
+fresh_image
+LSVD_IMAGE=$dir/obj LD_PRELOAD=$PWD/liblsvd.so \
+    fio --output-format=json --output=$out/fio.json bench.fio
+
+echo results in $out
@@ -34,7 +34,8 @@ wsup_pp = [['magic', magic], ['type', fieldnames],
                ['seq', '%d'], ['meta_base', '%d'], ['meta_limit', '%d'],
                ['base', '%d'], ['limit', '%d'], ['next', '%d'], ['oldest', '%d'], 
                ['map_start', '%d'], ['map_entries', '%d'],
-               ['len_start', '%d'], ['len_entries', '%d']]
+               ['len_start', '%d'], ['len_entries', '%d'],
+               ['delta_start', '%d'], ['delta_blocks', '%d']]
 
 rsup_pp = [["magic", magic], ["type", fieldnames], ["unit_size", '%d'], 
                ["base", '%d'], ["units", '%d'], ["map_start", '%d'],["map_blocks", '%d'],
@@ -60,7 +60,12 @@ static long parseint(std::string &s)
 }
 
 static std::map<std::string,cfg_backend> m = {{"file", BACKEND_FILE},
-					      {"rados", BACKEND_RADOS}};
+					      {"rados", BACKEND_RADOS},
+					      {"s3", BACKEND_S3}};
+static std::map<std::string,cfg_gc_policy> gcm = {
+    {"greedy", GC_GREEDY}, {"cost-benefit", GC_COST_BENEFIT}};
+static std::map<std::string,cfg_nvme> nvm = {{"aio", NVME_AIO},
+					     {"uring", NVME_URING}};
 
 
 int lsvd_config::read() {
@@ -78,16 +83,110 @@ int lsvd_config::read() {
 		batch_size = parseint(words[1]);
 	    if (words[0] == "wcache_batch")
 		wcache_batch = atoi(words[1].c_str());
+	    if (words[0] == "wcache_batch_bytes")
+		wcache_batch_bytes = parseint(words[1]);
+	    if (words[0] == "wcache_batch_usecs")
+		wcache_batch_usecs = atoi(words[1].c_str());
+	    if (words[0] == "wcache_depth")
+		wcache_depth = atoi(words[1].c_str());
 	    if (words[0] == "cache_dir")
 		cache_dir = words[1];
 	    if (words[0] == "xlate_threads")
 		xlate_threads = atoi(words[1].c_str());
 	    if (words[0] == "xlate_window")
 		xlate_window = atoi(words[1].c_str());
+	    if (words[0] == "xlate_latency")
+		xlate_latency = atoi(words[1].c_str());
+	    if (words[0] == "backend_rate")
+		backend_rate = parseint(words[1]);
+	    if (words[0] == "backend_burst")
+		backend_burst = parseint(words[1]);
+	    if (words[0] == "backend_stripe")
+		backend_stripe = atoi(words[1].c_str());
+	    if (words[0] == "backend_stripe_unit")
+		backend_stripe_unit = parseint(words[1]);
+	    if (words[0] == "backend_compress")
+		backend_compress = atoi(words[1].c_str());
+	    if (words[0] == "compress_chunk")
+		compress_chunk = parseint(words[1]);
+	    if (words[0] == "backend_crc")
+		backend_crc = atoi(words[1].c_str());
 	    if (words[0] == "backend")
 		backend = m[words[1]];
+	    if (words[0] == "file_fds")
+		file_fds = atoi(words[1].c_str());
+	    if (words[0] == "file_direct")
+		file_direct = atoi(words[1].c_str());
+	    if (words[0] == "s3_host")
+		s3_host = words[1];
+	    if (words[0] == "s3_region")
+		s3_region = words[1];
+	    if (words[0] == "s3_access_key")
+		s3_access_key = words[1];
+	    if (words[0] == "s3_secret_key")
+		s3_secret_key = words[1];
+	    if (words[0] == "s3_https")
+		s3_https = atoi(words[1].c_str());
+	    if (words[0] == "s3_connections")
+		s3_connections = atoi(words[1].c_str());
+	    if (words[0] == "s3_part_size")
+		s3_part_size = parseint(words[1]);
+	    if (words[0] == "s3_hedge")
+		s3_hedge = atoi(words[1].c_str());
 	    if (words[0] == "cache_size")
 		cache_size = parseint(words[1]);
+	    if (words[0] == "wcache_size")
+		wcache_size = parseint(words[1]);
+	    if (words[0] == "rcache_size")
+		rcache_size = parseint(words[1]);
+	    if (words[0] == "rcache_dir")
+		rcache_dir = words[1];
+	    if (words[0] == "base_cache_size")
+		base_cache_size = parseint(words[1]);
+	    if (words[0] == "gc_policy")
+		gc_policy = gcm[words[1]];
+	    if (words[0] == "gc_threshold")
+		gc_threshold = atoi(words[1].c_str());
+	    if (words[0] == "gc_max_objs")
+		gc_max_objs = atoi(words[1].c_str());
+	    if (words[0] == "gc_trigger")
+		gc_trigger = parseint(words[1]);
+	    if (words[0] == "gc_ratio")
+		gc_ratio = atoi(words[1].c_str());
+	    if (words[0] == "gc_cold_age")
+		gc_cold_age = atoi(words[1].c_str());
+	    if (words[0] == "replay_window")
+		replay_window = atoi(words[1].c_str());
+	    if (words[0] == "hdr_cache_size")
+		hdr_cache_size = parseint(words[1]);
+	    if (words[0] == "ckpt_deltas")
+		ckpt_deltas = atoi(words[1].c_str());
+	    if (words[0] == "rcache_unit")
+		rcache_unit = parseint(words[1]);
+	    if (words[0] == "rcache_readahead")
+		rcache_readahead = parseint(words[1]);
+	    if (words[0] == "wcache_promote")
+		wcache_promote = atoi(words[1].c_str());
+	    if (words[0] == "rcache_hot")
+		rcache_hot = atoi(words[1].c_str());
+	    if (words[0] == "rcache_hot_interval")
+		rcache_hot_interval = atoi(words[1].c_str());
+	    if (words[0] == "rcache_warm_rate")
+		rcache_warm_rate = parseint(words[1]);
+	    if (words[0] == "nvme_engine")
+		nvme_engine = nvm[words[1]];
+	    if (words[0] == "nvme_depth")
+		nvme_depth = atoi(words[1].c_str());
+	    if (words[0] == "nvme_sqpoll")
+		nvme_sqpoll = atoi(words[1].c_str());
+	    if (words[0] == "queues")
+		queues = atoi(words[1].c_str());
+	    if (words[0] == "completion_threads")
+		completion_threads = atoi(words[1].c_str());
+	    if (words[0] == "wcache_dirs")
+		wcache_dirs = words[1];
+	    if (words[0] == "wcache_stripe")
+		wcache_stripe = parseint(words[1]);
 	}
 	fp.close();
 	break;
@@ -99,18 +198,116 @@ int lsvd_config::read() {
 	cache_dir = std::string(val);
     if ((val = getenv("LSVD_WCACHE_BATCH")))
 	wcache_batch = atoi(val);
+    if ((val = getenv("LSVD_WCACHE_BATCH_BYTES")))
+	wcache_batch_bytes = parseint(val);
+    if ((val = getenv("LSVD_WCACHE_BATCH_USECS")))
+	wcache_batch_usecs = atoi(val);
+    if ((val = getenv("LSVD_WCACHE_DEPTH")))
+	wcache_depth = atoi(val);
     if ((val = getenv("LSVD_CACHE_DIR")))
 	cache_dir = std::string(val);
     if ((val = getenv("LSVD_XLATE_THREADS")))
 	xlate_threads = atoi(val);
     if ((val = getenv("LSVD_XLATE_WINDOW")))
 	xlate_window = atoi(val);
+    if ((val = getenv("LSVD_XLATE_LATENCY")))
+	xlate_latency = atoi(val);
+    if ((val = getenv("LSVD_BACKEND_RATE")))
+	backend_rate = parseint(val);
+    if ((val = getenv("LSVD_BACKEND_BURST")))
+	backend_burst = parseint(val);
+    if ((val = getenv("LSVD_BACKEND_STRIPE")))
+	backend_stripe = atoi(val);
+    if ((val = getenv("LSVD_BACKEND_STRIPE_UNIT")))
+	backend_stripe_unit = parseint(val);
+    if ((val = getenv("LSVD_BACKEND_COMPRESS")))
+	backend_compress = atoi(val);
+    if ((val = getenv("LSVD_COMPRESS_CHUNK")))
+	compress_chunk = parseint(val);
+    if ((val = getenv("LSVD_BACKEND_CRC")))
+	backend_crc = atoi(val);
     if ((val = getenv("LSVD_BACKEND"))) {
 	std::string word(val);
 	backend = m[word];
     }
+    if ((val = getenv("LSVD_FILE_FDS")))
+	file_fds = atoi(val);
+    if ((val = getenv("LSVD_FILE_DIRECT")))
+	file_direct = atoi(val);
+    if ((val = getenv("LSVD_S3_HOST")))
+	s3_host = std::string(val);
+    if ((val = getenv("LSVD_S3_REGION")))
+	s3_region = std::string(val);
+    if ((val = getenv("LSVD_S3_ACCESS_KEY")))
+	s3_access_key = std::string(val);
+    if ((val = getenv("LSVD_S3_SECRET_KEY")))
+	s3_secret_key = std::string(val);
+    if ((val = getenv("LSVD_S3_HTTPS")))
+	s3_https = atoi(val);
+    if ((val = getenv("LSVD_S3_CONNECTIONS")))
+	s3_connections = atoi(val);
+    if ((val = getenv("LSVD_S3_PART_SIZE")))
+	s3_part_size = parseint(val);
+    if ((val = getenv("LSVD_S3_HEDGE")))
+	s3_hedge = atoi(val);
     if ((val = getenv("LSVD_CACHE_SIZE"))) 
 	cache_size = parseint(val);
+    if ((val = getenv("LSVD_WCACHE_SIZE")))
+	wcache_size = parseint(val);
+    if ((val = getenv("LSVD_RCACHE_SIZE")))
+	rcache_size = parseint(val);
+    if ((val = getenv("LSVD_RCACHE_DIR")))
+	rcache_dir = std::string(val);
+    if ((val = getenv("LSVD_BASE_CACHE_SIZE")))
+	base_cache_size = parseint(val);
+    if ((val = getenv("LSVD_GC_POLICY"))) {
+	std::string word(val);
+	gc_policy = gcm[word];
+    }
+    if ((val = getenv("LSVD_GC_THRESHOLD")))
+	gc_threshold = atoi(val);
+    if ((val = getenv("LSVD_GC_MAX_OBJS")))
+	gc_max_objs = atoi(val);
+    if ((val = getenv("LSVD_GC_TRIGGER")))
+	gc_trigger = parseint(val);
+    if ((val = getenv("LSVD_GC_RATIO")))
+	gc_ratio = atoi(val);
+    if ((val = getenv("LSVD_GC_COLD_AGE")))
+	gc_cold_age = atoi(val);
+    if ((val = getenv("LSVD_REPLAY_WINDOW")))
+	replay_window = atoi(val);
+    if ((val = getenv("LSVD_HDR_CACHE_SIZE")))
+	hdr_cache_size = parseint(val);
+    if ((val = getenv("LSVD_CKPT_DELTAS")))
+	ckpt_deltas = atoi(val);
+    if ((val = getenv("LSVD_RCACHE_UNIT")))
+	rcache_unit = parseint(val);
+    if ((val = getenv("LSVD_RCACHE_READAHEAD")))
+	rcache_readahead = parseint(val);
+    if ((val = getenv("LSVD_WCACHE_PROMOTE")))
+	wcache_promote = atoi(val);
+    if ((val = getenv("LSVD_RCACHE_HOT")))
+	rcache_hot = atoi(val);
+    if ((val = getenv("LSVD_RCACHE_HOT_INTERVAL")))
+	rcache_hot_interval = atoi(val);
+    if ((val = getenv("LSVD_RCACHE_WARM_RATE")))
+	rcache_warm_rate = parseint(val);
+    if ((val = getenv("LSVD_NVME_ENGINE"))) {
+	std::string word(val);
+	nvme_engine = nvm[word];
+    }
+    if ((val = getenv("LSVD_NVME_DEPTH")))
+	nvme_depth = atoi(val);
+    if ((val = getenv("LSVD_NVME_SQPOLL")))
+	nvme_sqpoll = atoi(val);
+    if ((val = getenv("LSVD_QUEUES")))
+	queues = atoi(val);
+    if ((val = getenv("LSVD_COMPLETION_THREADS")))
+	completion_threads = atoi(val);
+    if ((val = getenv("LSVD_WCACHE_DIRS")))
+	wcache_dirs = std::string(val);
+    if ((val = getenv("LSVD_WCACHE_STRIPE")))
+	wcache_stripe = parseint(val);
 
     return 0;			// success
 }
@@ -130,3 +327,42 @@ std::string lsvd_config::cache_filename(uuid_t &uuid, const char *name) {
     return std::string((const char*)buf);
 }
 
+/* read cache file to go with cache file 'cache', if rcache_dir is
+ * set; otherwise the read cache is in 'cache' itself
+ */
+std::string lsvd_config::rcache_filename(std::string cache) {
+    if (rcache_dir == "")
+	return cache;
+    std::string file = fs::path(cache).stem();
+    return rcache_dir + "/" + file + ".rcache";
+}
+
+/* read cache for blocks of base image 'base_uuid', shared by all
+ * its clones on this host
+ */
+std::string lsvd_config::base_cache_filename(uuid_t &base_uuid) {
+    char uuid_s[64];
+    uuid_unparse(base_uuid, uuid_s);
+    std::string dir = (rcache_dir == "") ? cache_dir : rcache_dir;
+    return dir + "/" + uuid_s + ".base";
+}
+
+/* extra write cache journals for cache file 'cache', one per
+ * directory in wcache_dirs (ideally each on its own device)
+ */
+std::vector<std::string> lsvd_config::journal_filenames(std::string cache) {
+    std::vector<std::string> files;
+    std::string file = fs::path(cache).stem();
+    std::string dirs = wcache_dirs + ",";
+    for (size_t i = 0, j; (j = dirs.find(',', i)) != std::string::npos;
+	 i = j+1) {
+	if (j == i)
+	    continue;
+	char buf[256]; // PATH_MAX
+	sprintf(buf, "%s/%s.%d.wcache", dirs.substr(i, j-i).c_str(),
+		file.c_str(), (int)files.size() + 1);
+	files.push_back(std::string((const char*)buf));
+    }
+    return files;
+}
+
@@ -12,23 +12,77 @@
 #ifndef __CONFIG_H__
 #define __CONFIG_H__
 
-enum cfg_backend { BACKEND_FILE = 1, BACKEND_RADOS = 2 };
+enum cfg_backend { BACKEND_FILE = 1, BACKEND_RADOS = 2, BACKEND_S3 = 3 };
+enum cfg_gc_policy { GC_GREEDY = 1, GC_COST_BENEFIT = 2 };
+enum cfg_nvme { NVME_AIO = 1, NVME_URING = 2 };
 
 class lsvd_config {
 public:
 
     int         batch_size = 8*1024*1024; // in bytes
-    int         wcache_batch = 8;	  // requests
+    int         wcache_batch = 8;	  // max requests per journal record
+    int         wcache_batch_bytes = 512*1024; // max bytes per record
+    int         wcache_batch_usecs = 100; // max queueing delay
+    int         wcache_depth = 4;	  // journal records in flight
     std::string cache_dir = "/tmp";
     int         xlate_threads = 2;
-    int         xlate_window = 8;
+    int         xlate_window = 8;	  // max data objects in flight
+    int         xlate_latency = 0;	  // target write usecs; 0 = fixed window
+    long        backend_rate = 0;	  // host-wide write bytes/sec; 0 = no limit
+    long        backend_burst = 32*1024*1024; // bytes
+    int         backend_stripe = 1;	  // sub-objects per object; fixed per volume
+    int         backend_stripe_unit = 1024*1024; // bytes; fixed per volume
+    int         backend_compress = 0;	  // LZ4 data objects; keep set once used
+    int         compress_chunk = 64*1024; // bytes, compressed one at a time
+    int         backend_crc = 0;	  // CRC32C in data object headers
     enum cfg_backend backend = BACKEND_RADOS;
+    int         file_fds = 256;	  // file backend: open files cached
+    int         file_direct = 1;	  // file backend: O_DIRECT if possible
+    std::string s3_host = "localhost:9000"; // host[:port], path-style URLs
+    std::string s3_region = "us-east-1";
+    std::string s3_access_key = "";	  // default: $AWS_ACCESS_KEY_ID
+    std::string s3_secret_key = "";	  // default: $AWS_SECRET_ACCESS_KEY
+    int         s3_https = 0;
+    int         s3_connections = 32;	  // keep-alive connection pool
+    long        s3_part_size = 5*1024*1024; // multipart PUT part; 0 = off
+    int         s3_hedge = 95;	  // GET latency percentile to hedge; 0=off
     long        cache_size = 8199*4096; // in bytes
+    long        wcache_size = 0;	  // bytes, new caches; 0 = cache_size/2
+    long        rcache_size = 0;	  // bytes, new caches; 0 = cache_size/2
+    std::string rcache_dir = "";	  // read cache in its own file, here
+    long        base_cache_size = 1024L*1024*1024; // clones: shared cache of
+					  // base image data, bytes; 0 = off
+    enum cfg_gc_policy gc_policy = GC_GREEDY;
+    int         gc_threshold = 50;	  // max utilization to clean, percent
+    int         gc_max_objs = 32;	  // victims per GC cycle
+    long        gc_trigger = 128*1024*1024; // min garbage, bytes
+    int         gc_ratio = 60;	  // run GC below this % live
+    int         gc_cold_age = 0;	  // objects; 0 = don't segregate
+    int         replay_window = 16;	  // header reads in flight at open
+    long        hdr_cache_size = 64*1024*1024; // decoded data object
+					  // headers, bytes; 0 = off
+    int         ckpt_deltas = 8;	  // delta checkpoints between full ones
+    int         rcache_unit = 64*1024; // read cache unit, bytes (new caches)
+    int         rcache_readahead = 4*1024*1024; // max window, bytes; 0=off
+    int         wcache_promote = 0;	  // evicted data that was read -> rcache
+    int         rcache_hot = 0;	  // save rcache hot set, warm up from it
+    int         rcache_hot_interval = 300; // seconds; 0 = only at close
+    long        rcache_warm_rate = 32*1024*1024; // warm-up, bytes/sec
+    enum cfg_nvme nvme_engine = NVME_AIO; // "uring" to opt in
+    int         nvme_depth = 64;	  // SSD queue depth
+    int         nvme_sqpoll = 0;	  // io_uring kernel submit thread
+    int         queues = 1;		  // completion queues per image
+    int         completion_threads = 0; // 0 = callbacks on I/O threads
+    std::string wcache_dirs = "";	  // extra journals, comma-separated
+    int         wcache_stripe = 1024*1024; // bytes, if wcache_dirs is set
     
     lsvd_config(){}
     ~lsvd_config(){ }
     int read();
     std::string cache_filename(uuid_t &uuid, const char *name);
+    std::vector<std::string> journal_filenames(std::string cache);
+    std::string rcache_filename(std::string cache);
+    std::string base_cache_filename(uuid_t &base_uuid);
 };
 
 #endif
@@ -0,0 +1,98 @@
+/*
+ * file:        crc32c.h
+ * description: CRC32C (Castagnoli), using the SSE4.2 or ARMv8 CRC
+ *              instructions when the CPU has them
+ *
+ * author:      Peter Desnoyers, Northeastern University
+ * Copyright 2021, 2022 Peter Desnoyers
+ * license:     GNU LGPL v2.1 or newer
+ *              LGPL-2.1-or-later
+ */
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+/* byte-at-a-time fallback, reflected polynomial 0x82F63B78
+ */
+static inline uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    static const struct tbl {
+	uint32_t t[256];
+	tbl() {
+	    for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++)
+		    c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+		t[i] = c;
+	    }
+	}
+    } table;
+    while (len--)
+	crc = table.t[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c = crc;
+    for (; len >= 8; len -= 8, p += 8) {
+	uint64_t v;
+	memcpy(&v, p, 8);
+	c = _mm_crc32_u64(c, v);
+    }
+    crc = c;
+    for (; len > 0; len--)
+	crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+static inline bool crc32c_have_hw(void) {
+    return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static inline uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    for (; len >= 8; len -= 8, p += 8) {
+	uint64_t v;
+	memcpy(&v, p, 8);
+	crc = __crc32cd(crc, v);
+    }
+    for (; len > 0; len--)
+	crc = __crc32cb(crc, *p++);
+    return crc;
+}
+static inline bool crc32c_have_hw(void) {
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#else
+static inline uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    return crc32c_sw(crc, p, len);
+}
+static inline bool crc32c_have_hw(void) {
+    return false;
+}
+#endif
+
+/* crc32c(0, buf, len) for a new checksum; pass the result back in to
+ * continue it over more data.
+ */
+static inline uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    static const bool hw = crc32c_have_hw();
+    auto p = (const uint8_t*)buf;
+    crc = ~crc;
+    crc = hw ? crc32c_hw(crc, p, len) : crc32c_sw(crc, p, len);
+    return ~crc;
+}
+
+#endif
@@ -22,6 +22,13 @@
 //   set - access() / dirty() - set
 //   get - a() / d()
 // note that D bit is set internally, while A bit is set by the user
+//
+// Searches run over flat arrays of unpacked 64-bit keys rather than
+// the bitfield structs: 'maxes' (the limit of each list) always, and
+// with EXTMAP_KEYS (default 1, or per map with the template argument)
+// a per-list array of extent bases too, so a lookup touches a couple
+// of cache lines of keys per level. Build with -mavx2 (or for arm64)
+// to get a SIMD final step.
 #ifndef EXTENT_H
 #define EXTENT_H
 
@@ -32,6 +39,15 @@
 #include <set>
 #include <tuple>
 #include <cassert>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#ifndef EXTMAP_KEYS
+#define EXTMAP_KEYS 1
+#endif
 
 namespace extmap {
 
@@ -100,6 +116,46 @@ namespace extmap {
 	}
     };
     
+    // order-preserving search keys for the two map input types
+    //
+    static inline int64_t key(int64_t x) {
+        return x;
+    }
+    static inline int64_t key(obj_offset o) {
+	return (int64_t)o.obj * (1L << 28) + (o.offset + (1L << 27));
+    }
+
+    // index of the first of a[0..n) that's > k (n if none), a sorted.
+    // Branchless halving down to a short run, then count the keys in
+    // the run that are <= k.
+    //
+    static inline size_t key_search(const int64_t *a, size_t n, int64_t k) {
+	const int64_t *p = a;
+	while (n > 16) {
+	    size_t half = n / 2;
+	    p = (p[half-1] <= k) ? p + half : p;
+	    n -= half;
+	}
+	size_t i = 0, c = 0;
+#if defined(__AVX2__)
+	__m256i kv = _mm256_set1_epi64x(k);
+	for (; i + 4 <= n; i += 4) {
+	    __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+	    __m256i gt = _mm256_cmpgt_epi64(v, kv);
+	    c += 4 - __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(gt)));
+	}
+#elif defined(__aarch64__)
+	int64x2_t kv = vdupq_n_s64(k);
+	for (; i + 2 <= n; i += 2) {
+	    uint64x2_t le = vcleq_s64(vld1q_s64(p + i), kv);
+	    c += (vgetq_lane_u64(le, 0) & 1) + (vgetq_lane_u64(le, 1) & 1);
+	}
+#endif
+	for (; i < n; i++)
+	    c += (p[i] <= k);
+	return (p - a) + c;
+    }
+
     // These are the three map types we support. There's probably a way to 
     // do this with a template, but I don't think it's worth the effort
     // these are the actual structures stored in the map
@@ -225,20 +281,24 @@ namespace extmap {
 
     // an extent map with entries of type T, which map from T_in to T_out
     //
-    template <class T, class T_in, class T_out>
+    template <class T, class T_in, class T_out, bool flat_keys = EXTMAP_KEYS>
     struct extmap {
 	static const int _load = 256;
 
     public:
 	typedef std::vector<T>      extent_vector;
+	typedef std::vector<int64_t> key_vector;
 	std::vector<extent_vector*> lists;
-	std::vector<T_in>           maxes;
+	std::vector<int64_t>        maxes; // key(limit) of each list
+	std::vector<key_vector*>    keys;  // key(base) of each extent
 	int                         count;
 
 	extmap(){ count = 0; }
 	~extmap(){
 	    for (auto l : lists)
 		delete l;
+	    for (auto k : keys)
+		delete k;
 	}
 	
 	// debug code
@@ -251,10 +311,27 @@ namespace extmap {
 	    vec->reserve(_load);
 	    vec->push_back(_e);
 	    lists.push_back(vec);
-	    maxes.push_back(_e.limit());
+	    maxes.push_back(key(_e.limit()));
+	    if constexpr (flat_keys) {
+		auto kv = new key_vector();
+		kv->reserve(_load);
+		kv->push_back(key(_e.base()));
+		keys.push_back(kv);
+	    }
 	    count = 1;
 	}
 
+	// keep maxes[i] and the key of the extent at 'it' up to date
+	//
+	void _set_max(int i) {
+	    maxes[i] = key(lists[i]->back().limit());
+	}
+	template <class I>
+	void _set_key(I &it) {
+	    if constexpr (flat_keys)
+		(*keys[it.i])[it.it - lists[it.i]->begin()] = key(it->base());
+	}
+
 	// iterator gets used both internally and externally
 	// (returned by lookup function)
 	//
@@ -370,17 +447,24 @@ namespace extmap {
 	    // search maxes to find the list containing @base
 	    // remember that max is 1+highest legal addr
 	    //
-	    auto max_iter = std::lower_bound(maxes.begin(), maxes.end(), base);
-	    if (max_iter != maxes.end() && base == *max_iter)
-		max_iter++; // TODO delete? search base+1?
-	    if (max_iter == maxes.end())
+	    int64_t k = key(base);
+	    int i = key_search(maxes.data(), maxes.size(), k);
+	    if (i == (int)maxes.size())
 		return end();
 
 	    // find lowest entry with base >= @base
 	    //
-	    auto i = max_iter - maxes.begin();
-	    T _key(base);
-	    auto list_iter = std::lower_bound(lists[i]->begin(), lists[i]->end(), _key);
+	    typename extent_vector::iterator list_iter;
+	    if constexpr (flat_keys) {
+		auto kv = keys[i];
+		list_iter = lists[i]->begin() +
+		    key_search(kv->data(), kv->size(), k-1);
+	    }
+	    else {
+		T _key(base);
+		list_iter = std::lower_bound(lists[i]->begin(), lists[i]->end(),
+					     _key);
+	    }
 
 	    // whoops, previous entry could have limit > @base...
 	    //
@@ -405,8 +489,9 @@ namespace extmap {
 	
 	// Python-style list slicing - remove [len]..[end] and return it
 	//
-	static std::vector<T> *_slice(std::vector<T> *A, int len) {
-	    auto half = new std::vector<T>();
+	template <class V>
+	static V *_slice(V *A, int len) {
+	    auto half = new V();
 	    half->reserve(_load);
 	    for (auto it = A->begin()+len; it != A->end(); it++)
 		half->push_back(*it);
@@ -420,9 +505,11 @@ namespace extmap {
 	    if (lists[it.i]->size() >= _load * 2) {
 		int j = it.it - lists[it.i]->begin();
 		auto half = _slice(lists[it.i], _load);
-		maxes[it.i] = lists[it.i]->back().limit();
+		_set_max(it.i);
 		lists.insert(lists.begin()+it.i+1, half);
-		maxes.insert(maxes.begin()+it.i+1, half->back().limit());
+		maxes.insert(maxes.begin()+it.i+1, key(half->back().limit()));
+		if constexpr (flat_keys)
+		    keys.insert(keys.begin()+it.i+1, _slice(keys[it.i], _load));
 		if (j >= _load) {
 		    j -= _load;
 		    it.i++;
@@ -439,8 +526,13 @@ namespace extmap {
 		first(_e);
 		return begin();
 	    }
+	    if constexpr (flat_keys) {
+		auto kv = keys[it.i];
+		kv->insert(kv->begin() + (it.it - lists[it.i]->begin()),
+			   key(_e.base()));
+	    }
 	    it.it = lists[it.i]->insert(it.it, _e);
-	    maxes[it.i] = lists[it.i]->back().limit();
+	    _set_max(it.i);
 	    count++;
 	    return _expand(it);
 	}
@@ -448,15 +540,23 @@ namespace extmap {
 	// sortedlist._delete
 	//
 	iterator _erase(iterator it) {
+	    if constexpr (flat_keys) {
+		auto kv = keys[it.i];
+		kv->erase(kv->begin() + (it.it - lists[it.i]->begin()));
+	    }
 	    it.it = lists[it.i]->erase(it.it);
 
 	    // if there's only one list, this might delete it down to zero
 	    if (lists[it.i]->size() > 0) 
-		maxes[it.i] = lists[it.i]->back().limit();
+		_set_max(it.i);
 	    else {
 		delete lists[it.i];
 		lists.erase(lists.begin()+it.i);
 		maxes.erase(maxes.begin()+it.i);
+		if constexpr (flat_keys) {
+		    delete keys[it.i];
+		    keys.erase(keys.begin()+it.i);
+		}
 	    }
 	    count--;
 	    if (lists.size() == 0)
@@ -473,16 +573,22 @@ namespace extmap {
 
 		lists[prev]->insert(lists[prev]->end(),
 				    lists[pos]->begin(), lists[pos]->end());
-		maxes[prev] = lists[prev]->back().limit();
+		_set_max(prev);
 
 		delete lists[pos];
 		lists.erase(lists.begin()+pos);
 		maxes.erase(maxes.begin()+pos);
+		if constexpr (flat_keys) {
+		    keys[prev]->insert(keys[prev]->end(),
+				       keys[pos]->begin(), keys[pos]->end());
+		    delete keys[pos];
+		    keys.erase(keys.begin()+pos);
+		}
 
 		it = _expand(iterator(this, prev, lists[prev]->begin() + j));
 	    }
 	    else if (lists[it.i]->size() > 0)
-		maxes[it.i] = lists[it.i]->back().limit();
+		_set_max(it.i);
 
 	    if (it.it == lists[it.i]->end() && it.i != (int)lists.size()-1) {
 		it.i++;
@@ -509,10 +615,12 @@ namespace extmap {
 
 	    verify_max();
 
-	    // special case inserting the first entry
+	    // special case inserting the first entry (trimming an
+	    // empty map is a no-op)
 	    //
 	    if (maxes.size() == 0) {
-		first(_e);
+		if (!trim)
+		    first(_e);
 		return;
 	    }
 
@@ -539,7 +647,7 @@ namespace extmap {
 			   it->limit() - limit, /* len */
 			   it->s.ptr + (limit - it->base()));
 		    it->relimit(base);
-		    maxes[it.i] = lists[it.i]->back().limit();
+		    _set_max(it.i);
 		    it = _insert(it+1, _new);
 		    verify_max();
 		}
@@ -556,7 +664,7 @@ namespace extmap {
 			del->push_back(_old);
 		    }
 		    it->relimit(base);
-		    maxes[it.i] = lists[it.i]->back().limit();
+		    _set_max(it.i);
 		    it++;
 		    verify_max();
 		}
@@ -587,6 +695,7 @@ namespace extmap {
 		    }
 		    //it->s.ptr += (limit - it->base()); // TODO is this right???
 		    it->rebase(limit);
+		    _set_key(it);
 		    verify_max();
 		}
 	    }
@@ -602,12 +711,12 @@ namespace extmap {
 		    // we can merge with the previous extent
 		    //
 		    prev->relimit(limit);
-		    maxes[prev.i] = lists[prev.i]->back().limit();
+		    _set_max(prev.i);
 		    if (it != end() && adjacent(*prev, *it)) {
 			// we plug a hole, and can merge with the next extent
 			//
 			prev->relimit(it->limit());
-			maxes[prev.i] = lists[prev.i]->back().limit();
+			_set_max(prev.i);
 			_erase(it);
 			verify_max();
 			return;
@@ -618,6 +727,7 @@ namespace extmap {
 		    //
 		    //it->s.ptr += (base - limit); // subtract
 		    it->rebase(base);
+		    _set_key(it);
 		}
 		else {
 		    // no merging, just insert the damn thing
@@ -639,6 +749,44 @@ namespace extmap {
 		sum += list->capacity();
 	    return sum;
 	}
+
+	// heap bytes held by the map, roughly
+	//
+	size_t bytes() {
+	    size_t sum = lists.capacity() * sizeof(extent_vector*) +
+		maxes.capacity() * sizeof(int64_t) +
+		keys.capacity() * sizeof(key_vector*);
+	    for (auto list : lists)
+		sum += sizeof(*list) + list->capacity() * sizeof(T);
+	    for (auto kv : keys)
+		sum += sizeof(*kv) + kv->capacity() * sizeof(int64_t);
+	    return sum;
+	}
+
+	// lists grow by doubling and split in half, so they hold up to
+	// 2x their size - a big map that's mostly read is mostly slack.
+	// Shrink up to @n lists starting at @pos, which is advanced
+	// (wrapping at the end) so a big map can be done a slice at a
+	// time. Invalidates iterators; returns bytes freed.
+	//
+	size_t compact(int &pos, int n) {
+	    size_t freed = 0;
+	    for (int j = 0; j < n && lists.size() > 0; j++, pos++) {
+		if (pos >= (int)lists.size())
+		    pos = 0;
+		auto l = lists[pos];
+		if (l->capacity() - l->size() <= l->size() / 8)
+		    continue;
+		freed += (l->capacity() - l->size()) * sizeof(T);
+		l->shrink_to_fit();
+		if constexpr (flat_keys) {
+		    freed += (keys[pos]->capacity() - l->size()) *
+			sizeof(int64_t);
+		    keys[pos]->shrink_to_fit();
+		}
+	    }
+	    return freed;
+	}
 	
 	// lookup - returns iterator pointing to one of:
 	// - extent containing @base
@@ -673,8 +821,11 @@ namespace extmap {
 	void reset(void) {
 	    for (auto l : lists)
 		delete l;
+	    for (auto k : keys)
+		delete k;
 	    lists.resize(0);
 	    maxes.resize(0);
+	    keys.resize(0);
 	    count = 0;
 	}
     };
@@ -54,6 +54,18 @@ extern "C" int rbd_poll_io_events(rbd_image_t image,
 
 extern "C" int rbd_set_image_notification(rbd_image_t image, int fd, int type);
 
+/* LSVD-specific: completions go to one of lsvd_queue_count() queues
+ * (config "queues"), picked by the submitting thread - the one given
+ * to lsvd_set_queue, or by CPU. Each queue can have its own eventfd;
+ * rbd_set_image_notification and rbd_poll_io_events cover them all.
+ */
+extern "C" int lsvd_queue_count(rbd_image_t image);
+extern "C" void lsvd_set_queue(int q);
+extern "C" int lsvd_set_queue_notification(rbd_image_t image, int q,
+                                           int fd, int type);
+extern "C" int lsvd_poll_queue_events(rbd_image_t image, int q,
+                                      rbd_completion_t *comps, int numcomp);
+
 extern "C" int rbd_aio_create_completion(void *cb_arg,
                                          rbd_callback_t complete_cb,
                                          rbd_completion_t *c);
@@ -100,6 +112,18 @@ extern "C" int rbd_open(rados_ioctx_t io, const char *name,
 extern "C" int rbd_close(rbd_image_t image);
 extern "C" int rbd_invalidate_cache(rbd_image_t image);
 
+/* LSVD-specific: progress of write cache replay in a concurrent
+ * rbd_open(name). 1 if replaying, 0 if not.
+ */
+extern "C" int lsvd_replay_status(const char *name, uint64_t *done,
+                                  uint64_t *max);
+
+/* LSVD-specific: counters and latency histograms (nsecs) for an open
+ * image, as "name value" and "name count mean p50 p90 p99 p999 max"
+ * lines. Returns the length needed, like snprintf.
+ */
+extern "C" int lsvd_get_metrics(rbd_image_t image, char *buf, size_t len);
+
 /* These RBD functions are unimplemented and return errors
  */
 extern "C" int rbd_create(rados_ioctx_t io, const char *name, uint64_t size, int *order);
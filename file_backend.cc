@@ -5,10 +5,18 @@
  * Copyright 2021, 2022 Peter Desnoyers
  * license:     GNU LGPL v2.1 or newer
  *              LGPL-2.1-or-later
+ *
+ * Open files are kept in an LRU cache, so a read doesn't cost a path
+ * lookup. Files are opened O_DIRECT where the filesystem allows it
+ * (libaio is only really asynchronous for direct I/O); requests that
+ * aren't aligned for it go through a bounce buffer.
  */
 
 #include <fcntl.h>
+#include <stdio.h>
 #include <unistd.h>
+#include <errno.h>
+#include <string.h>
 #include <sys/uio.h>
 
 #include <map>
@@ -20,13 +28,16 @@
 #include "backend.h"
 #include "file_backend.h"
 #include "request.h"
+#include "mempool.h"
 #include "smartiov.h"
 #include "io.h"
 
 
-file_backend::file_backend() {
+file_backend::file_backend(int max_fds_, bool direct_) {
+    max_fds = std::max(max_fds_, 1);
+    direct_io = direct_;
     e_io_running = true;
-    io_queue_init(64, &ioctx);
+    io_queue_init(256, &ioctx);
     const char *name = "file_backend_cb";
     e_io_th = std::thread(e_iocb_runner, ioctx, &e_io_running, name);
 }
@@ -35,54 +46,192 @@ file_backend::~file_backend() {
     e_io_running = false;
     e_io_th.join();
     io_queue_release(ioctx);
+    for (auto f : lru) {
+	close(f->fd);
+	delete f;
+    }
+}
+
+/* caller holds the lock
+ */
+void file_backend::uncache(fd_ref *f) {
+    fds.erase(f->name);
+    lru.erase(f->lru);
+    f->cached = false;
+    if (f->refs == 0) {
+	close(f->fd);
+	delete f;
+    }
+}
+
+fd_ref *file_backend::get_fd(const char *name, bool write) {
+    std::unique_lock lk(m);
+    if (!write) {
+	auto it = fds.find(name);
+	if (it != fds.end()) {
+	    auto f = it->second;
+	    f->refs++;
+	    lru.splice(lru.begin(), lru, f->lru);
+	    return f;
+	}
+    }
+    lk.unlock();
+
+    int mode = write ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDONLY;
+    bool direct = direct_io;
+    int fd = -1;
+    if (direct && (fd = open(name, mode | O_DIRECT, 0777)) < 0 &&
+	errno == EINVAL)
+	direct = direct_io = false; // filesystem doesn't do it
+    if (!direct)
+	fd = open(name, mode, 0777);
+    if (fd < 0)
+	return NULL;
+
+    lk.lock();
+    auto it = fds.find(name);
+    if (it != fds.end()) {
+	if (!write) {		// lost a race with another reader
+	    close(fd);
+	    auto f = it->second;
+	    f->refs++;
+	    return f;
+	}
+	uncache(it->second);
+    }
+    auto f = new fd_ref;
+    f->name = name;
+    f->fd = fd;
+    f->direct = direct;
+    f->refs = 1;
+    f->cached = true;
+    lru.push_front(f);
+    f->lru = lru.begin();
+    fds[f->name] = f;
+    while (lru.size() > max_fds)
+	uncache(lru.back());
+    return f;
+}
+
+void file_backend::put_fd(fd_ref *f) {
+    std::unique_lock lk(m);
+    if (--f->refs == 0 && !f->cached) {
+	close(f->fd);
+	delete f;
+    }
 }
 
+/* O_DIRECT needs aligned buffers, offset and length; if the caller's
+ * aren't, we do the I/O on an aligned superset of the range instead
+ */
+struct dio_bounce {
+    char   *buf = NULL;
+    size_t  len = 0;		// aligned length
+    size_t  offset = 0;		// aligned offset
+    size_t  skip = 0;		// caller's data starts here in buf
+
+    bool setup(fd_ref *f, smartiov &iovs, size_t offset_, bool write) {
+	int a = file_backend::align;
+	bool ok = (offset_ % a) == 0;
+	for (int i = 0; ok && i < iovs.size(); i++)
+	    ok = aligned(iovs[i].iov_base, a) && (iovs[i].iov_len % a) == 0;
+	if (!f->direct || ok)
+	    return false;
+	size_t bytes = iovs.bytes();
+	offset = offset_ & ~(size_t)(a-1);
+	skip = offset_ - offset;
+	len = (skip + bytes + a - 1) & ~(size_t)(a-1);
+	buf = page_alloc(len);
+	if (write) {		// only ever at offset 0
+	    iovs.copy_out(buf + skip);
+	    memset(buf + skip + bytes, 0, len - skip - bytes);
+	}
+	return true;
+    }
+
+    /* res is what the aligned I/O returned; returns <0 on error
+     */
+    long finish(fd_ref *f, smartiov &iovs, long res, bool write) {
+	size_t bytes = iovs.bytes();
+	if (write && res >= 0 && len > bytes)
+	    if (ftruncate(f->fd, offset + skip + bytes) < 0)
+		res = -1;
+	if (!write && res > (long)skip) {
+	    size_t n = std::min(bytes, (size_t)res - skip);
+	    iovs.slice(0, n).copy_in(buf + skip);
+	}
+	page_free(buf, len);
+	return res;
+    }
+};
+
 int file_backend::write_object(const char *name, iovec *iov, int iovcnt) {
-    int fd;
-    if ((fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0777)) < 0)
+    auto f = get_fd(name, true);
+    if (f == NULL)
 	return -1;
-    auto val = writev(fd, iov, iovcnt);
-    close(fd);
+    smartiov iovs(iov, iovcnt);
+    dio_bounce b;
+    long val;
+    if (b.setup(f, iovs, 0, true)) {
+	val = pwrite(f->fd, b.buf, b.len, 0);
+	val = b.finish(f, iovs, val, true);
+    }
+    else
+	val = pwritev(f->fd, iov, iovcnt, 0);
+    put_fd(f);
     return val < 0 ? -1 : 0;
 }
 
 int file_backend::read_object(const char *name, iovec *iov, int iovcnt,
 				  size_t offset) {
-    int fd;
-    if ((fd = open(name, O_RDONLY)) < 0)
-	return -1;
-    if (fd < 0)
+    auto f = get_fd(name, false);
+    if (f == NULL)
 	return -1;
-    int val = lseek(fd, offset, SEEK_SET);
-    if (val >= 0)
-	val = readv(fd, iov, iovcnt);
-    close(fd);
+    smartiov iovs(iov, iovcnt);
+    dio_bounce b;
+    long val;
+    if (b.setup(f, iovs, offset, false)) {
+	val = pread(f->fd, b.buf, b.len, b.offset);
+	val = b.finish(f, iovs, val, false);
+    }
+    else
+	val = preadv(f->fd, iov, iovcnt, offset);
+    put_fd(f);
     return val < 0 ? -1 : 0;
 }
 
 int file_backend::delete_object(const char *name) {
+    std::unique_lock lk(m);
+    auto it = fds.find(name);
+    if (it != fds.end())
+	uncache(it->second);
+    lk.unlock();
     if (unlink(name) < 0)
 	return -1;
     return 0;
 }
 
-class file_backend_req : public request {
+class file_backend_req : public request,
+			 public pooled<file_backend_req> {
     enum lsvd_op    op;
     smartiov        _iovs;
     size_t          offset;
     std::string     name;
-    io_context_t    ioctx;
+    file_backend   *be;
     request        *parent = NULL;
     e_iocb          eio;
-    int             fd;
+    fd_ref         *f = NULL;
+    dio_bounce      bounce;
+    bool            bounced = false;
+    long            res = 0;
     
 public:
     file_backend_req(enum lsvd_op op_, const char *name_,
 		     iovec *iov, int iovcnt, size_t offset_,
-		     io_context_t ioctx_) : _iovs(iov, iovcnt), name(name_) {
+		     file_backend *be_) : _iovs(iov, iovcnt), name(name_) {
 	op = op_;
 	offset = offset_;
-	ioctx = ioctx_;
+	be = be_;
     }
     ~file_backend_req() {}
 
@@ -90,6 +239,7 @@ public:
     void      run(request *parent);
     void      notify(request *child);
     void      release() {};
+    bool      failed() { return res < 0; }
 
     static void rw_cb_fn(void *ptr) {
 	auto req = (file_backend_req*)ptr;
@@ -98,42 +248,57 @@ public:
 };
 
 /* TODO: run() ought to return error/success
+ * Inside an io_batch (e.g. a GC chunk's reads) the submit is
+ * deferred, and they all go to the kernel in one io_submit.
  */
 void file_backend_req::run(request *parent_) {
     parent = parent_;
-    int mode = (op == OP_READ) ? O_RDONLY : O_RDWR | O_CREAT | O_TRUNC;
-    if ((fd = open(name.c_str(), mode, 0777)) < 0)
+    if ((f = be->get_fd(name.c_str(), op == OP_WRITE)) == NULL)
 	throw("file object error");
+    assert(op == OP_WRITE || op == OP_READ);
 
-    auto [iov,iovcnt] = _iovs.c_iov();
-    if (op == OP_WRITE)
-	e_io_prep_pwritev(&eio, fd, iov, iovcnt, offset, rw_cb_fn, this);
-    else if (op == OP_READ) 
-	e_io_prep_preadv(&eio, fd, iov, iovcnt, offset, rw_cb_fn, this);
-    else
-	assert(false);
-    e_io_submit(ioctx, &eio);
+    bounced = bounce.setup(f, _iovs, offset, op == OP_WRITE);
+    if (bounced && op == OP_WRITE)
+	e_io_prep_pwrite(&eio, f->fd, bounce.buf, bounce.len, bounce.offset,
+			 rw_cb_fn, this);
+    else if (bounced)
+	e_io_prep_pread(&eio, f->fd, bounce.buf, bounce.len, bounce.offset,
+			rw_cb_fn, this);
+    else {
+	auto [iov,iovcnt] = _iovs.c_iov();
+	if (op == OP_WRITE)
+	    e_io_prep_pwritev(&eio, f->fd, iov, iovcnt, offset, rw_cb_fn, this);
+	else
+	    e_io_prep_preadv(&eio, f->fd, iov, iovcnt, offset, rw_cb_fn, this);
+    }
+    e_io_submit(be->get_ioctx(), &eio);
 }
 
 /* TODO: this assumes no use of wait/release
  */
 void file_backend_req::notify(request *unused) {
-    close(fd);
+    res = eio.res;
+    if (bounced)
+	res = bounce.finish(f, _iovs, res, op == OP_WRITE);
+    if (res < 0)
+	fprintf(stderr, "%s %s: %s\n", op == OP_WRITE ? "write" : "read",
+		name.c_str(), strerror(-res));
+    be->put_fd(f);
     parent->notify(this);
     delete this;
 }
 
 request *file_backend::make_write_req(const char*name, iovec *iov, int niov) {
-    return new file_backend_req(OP_WRITE, name, iov, niov, 0, ioctx);
+    return new file_backend_req(OP_WRITE, name, iov, niov, 0, this);
 }
 
 request *file_backend::make_read_req(const char *name, size_t offset,
 				     iovec *iov, int iovcnt) {
-    return new file_backend_req(OP_READ, name, iov, iovcnt, offset, ioctx);
+    return new file_backend_req(OP_READ, name, iov, iovcnt, offset, this);
 }
 
 request *file_backend::make_read_req(const char *name, size_t offset,
 				     char *buf, size_t len) {
     iovec iov = {buf, len};
-    return new file_backend_req(OP_READ, name, &iov, 1, offset, ioctx);
+    return new file_backend_req(OP_READ, name, &iov, 1, offset, this);
 }
@@ -12,9 +12,27 @@
 
 #include <libaio.h>
 #include <thread>
+#include <mutex>
+#include <list>
+#include <string>
+#include <unordered_map>
 
 class request;
 
+/* an open object file, shared by the requests using it. Objects
+ * are written once, so a cached fd stays good until the object is
+ * deleted or rewritten (the superblock); either one drops it from
+ * the cache, and the last user closes it.
+ */
+struct fd_ref {
+    std::string name;
+    int         fd;
+    bool        direct;		// opened with O_DIRECT
+    int         refs = 0;
+    bool        cached = false;
+    std::list<fd_ref*>::iterator lru;
+};
+
 /* nevermind separating interface and implementation - this
  * is so simple...
  */
@@ -23,10 +41,31 @@ class file_backend : public backend {
     io_context_t ioctx;
     std::thread e_io_th;
 
+    /* LRU cache of open files, most recently used at the front
+     */
+    std::mutex m;
+    std::unordered_map<std::string,fd_ref*> fds;
+    std::list<fd_ref*> lru;
+    size_t max_fds;
+    bool direct_io;
+
+    void uncache(fd_ref *f);
+
 public:
-    file_backend();
+    file_backend(int max_fds_ = 256, bool direct_ = true);
     ~file_backend();
 
+    /* O_DIRECT alignment for buffers, offsets and lengths; anything
+     * else goes through a bounce buffer
+     */
+    static const int align = 4096;
+    io_context_t get_ioctx(void) { return ioctx; }
+
+    /* writes always open (and truncate) a fresh file
+     */
+    fd_ref *get_fd(const char *name, bool write);
+    void put_fd(fd_ref *f);
+
     /* see backend.h 
      */
     int write_object(const char *name, iovec *iov, int iovcnt);
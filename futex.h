@@ -0,0 +1,67 @@
+/*
+ * file:        futex.h
+ * description: atomic request state with futex wait, in place of a
+ *              mutex + condition variable per request
+ *
+ * author:      Peter Desnoyers, Northeastern University
+ * Copyright 2021, 2022 Peter Desnoyers
+ * license:     GNU LGPL v2.1 or newer
+ *              LGPL-2.1-or-later
+ */
+
+#ifndef FUTEX_H
+#define FUTEX_H
+
+#include <unistd.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <atomic>
+
+/* an int updated with atomic adds. wait_until() sleeps on the futex
+ * after setting WAITING, and add() only makes the wake-up syscall if
+ * that bit is set, so requests nobody waits for never go into the
+ * kernel. Values must stay below WAITING.
+ *
+ * A waiter may free the object as soon as it sees the value it wants,
+ * i.e. before the waker's FUTEX_WAKE; that's harmless (the kernel
+ * doesn't read the word for a private wake, and waiters recheck after
+ * every wakeup).
+ */
+class futex_state {
+    std::atomic<int> v;
+    static const int WAITING = 1 << 30;
+
+    void futex(int op, int val) {
+	syscall(SYS_futex, (int*)&v, op, val, NULL, NULL, 0);
+    }
+
+public:
+    futex_state(int x = 0) : v(x) {}
+
+    int load(void) {
+	return v.load() & ~WAITING;
+    }
+
+    /* returns the new value
+     */
+    int add(int x) {
+	int n = v.fetch_add(x) + x;
+	if (n & WAITING)
+	    futex(FUTEX_WAKE_PRIVATE, INT_MAX);
+	return n & ~WAITING;
+    }
+
+    template <class F>
+    void wait_until(F done) {
+	int x = v.load();
+	while (!done(x & ~WAITING)) {
+	    if (!(x & WAITING) && !v.compare_exchange_weak(x, x | WAITING))
+		continue;
+	    futex(FUTEX_WAIT_PRIVATE, x | WAITING);
+	    x = v.load();
+	}
+    }
+};
+
+#endif
@@ -43,27 +43,76 @@ public:
     }
 };
 
+struct lsvd_completion;
+
+/* multi-producer list of completions, pushed from any thread; one
+ * consumer at a time takes the whole thing.
+ */
+struct completion_list {
+    std::atomic<lsvd_completion*> head = NULL;
+
+    bool push(lsvd_completion *c); /* true if it was empty */
+    lsvd_completion *take(void);   /* oldest first, linked by ->next */
+};
+
+/* a thread that runs completion callbacks, so they don't run on the
+ * SSD or backend completion threads
+ */
+struct completion_worker {
+    completion_list work;
+    int             wake_fd = -1; /* eventfd */
+    std::atomic<bool> running = true;
+    std::thread     th;
+
+    completion_worker();
+    ~completion_worker();
+    void push(lsvd_completion *c);
+    void run(void);
+};
+
+/* one per submitting core or iothread: completed requests wait here
+ * for rbd_poll_io_events / lsvd_poll_queue_events, and the queue's
+ * event fd is written when it goes from empty to non-empty.
+ */
+struct completion_queue {
+    event_socket       ev;
+    completion_list    done;
+    std::mutex         poll_m;	   /* between pollers only */
+    lsvd_completion   *polled = NULL; /* taken from done, not returned */
+    completion_worker *worker = NULL;
+
+    void push(lsvd_completion *c);
+    int poll(rbd_completion_t *comps, int numcomp);
+};
+
 struct rbd_image {
     lsvd_config  cfg;
     ssize_t      size;          // bytes
 
-    std::shared_mutex map_lock;
+    sharded_rwlock    map_lock;
     extmap::objmap    map;
 
     backend     *objstore;
     translate   *xlate;
     write_cache *wcache;
     read_cache  *rcache;
+    read_cache  *base_rcache = NULL; // clones: shared, see open_base_cache
+    int          base_fd = -1;
+
+    std::vector<completion_queue*>  queues;
+    std::vector<completion_worker*> workers;
 
-    std::mutex   m;
-    event_socket ev;
-    std::queue<rbd_completion_t> completions;
+    lsvd_metrics metrics;	/* see lsvd_get_metrics */
 
     rbd_image() {}
-    ~rbd_image() {}
+    ~rbd_image() { stop_queues(); }
 
     int image_open(rados_ioctx_t io, const char *name);
     int image_close(void);
+    int open_base_cache(uuid_t &base_uuid);
+    void start_queues(void);
+    void stop_queues(void);
+    completion_queue *pick_queue(void);
     int poll_io_events(rbd_completion_t *comps, int numcomp);
 };
 
@@ -12,6 +12,7 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <linux/fs.h>
+#include <errno.h>
 
 #include <shared_mutex>
 #include <condition_variable>
@@ -46,6 +47,7 @@ size_t getsize64(int fd)
 void e_iocb_cb(io_context_t ctx, iocb *io, long res, long res2)
 {
     auto iocb = (e_iocb*)io;
+    iocb->res = res;
     iocb->cb(iocb->ptr);
 }
 
@@ -104,9 +106,88 @@ void e_io_prep_preadv(e_iocb *eio, int fd, const struct iovec *iov, int iovcnt,
     io_set_callback(&eio->io, e_iocb_cb);
 }
 
+static thread_local io_batch *cur_batch = NULL;
+
 int e_io_submit(io_context_t ctx, e_iocb *eio)
 {
     iocb *io = &eio->io;
+    if (cur_batch != NULL) {
+	cur_batch->aio.push_back(std::make_pair(ctx, io));
+	return 1;
+    }
     return io_submit(ctx, 1, &io);
 }
 
+bool io_batch_add(io_engine *e, void *io)
+{
+    if (cur_batch == NULL)
+	return false;
+    cur_batch->ios.push_back(std::make_pair(e, io));
+    return true;
+}
+
+io_batch::io_batch()
+{
+    outer = cur_batch;
+    cur_batch = this;
+}
+
+io_batch::~io_batch()
+{
+    submit();
+    cur_batch = outer;
+}
+
+/* io_submit can take fewer than we give it (EAGAIN when the context
+ * is full), in which case wait a bit for completions and retry.
+ */
+static void aio_submit_all(io_context_t ctx, iocb **ios, long n)
+{
+    while (n > 0) {
+	int rv = io_submit(ctx, n, ios);
+	if (rv > 0) {
+	    ios += rv;
+	    n -= rv;
+	}
+	else if (rv == -EAGAIN || rv == 0)
+	    usleep(10);
+	else
+	    break;
+    }
+}
+
+/* one call per context / engine, in the order first seen
+ */
+void io_batch::submit(void)
+{
+    std::vector<iocb*> v;
+    while (aio.size() > 0) {
+	auto ctx = aio[0].first;
+	std::vector<std::pair<io_context_t,iocb*>> rest;
+	for (auto [c, io] : aio) {
+	    if (c == ctx)
+		v.push_back(io);
+	    else
+		rest.push_back(std::make_pair(c, io));
+	}
+	aio_submit_all(ctx, v.data(), v.size());
+	v.clear();
+	aio.swap(rest);
+    }
+
+    std::vector<void*> e_ios;
+    while (ios.size() > 0) {
+	auto e = ios[0].first;
+	std::vector<std::pair<io_engine*,void*>> rest;
+	for (auto [_e, io] : ios) {
+	    if (_e == e)
+		e_ios.push_back(io);
+	    else
+		rest.push_back(std::make_pair(_e, io));
+	}
+	e->submit_batch(e_ios);
+	e_ios.clear();
+	ios.swap(rest);
+    }
+}
+
@@ -13,6 +13,9 @@
 #include <stddef.h>
 #include <libaio.h>
 
+#include <vector>
+#include <utility>
+
 /* TODO: why is this here???
  */
 size_t getsize64(int fd);
@@ -26,6 +29,7 @@ struct e_iocb {
     iocb io;
     void (*cb)(void*) = NULL;
     void *ptr = NULL;
+    long res = 0;		// bytes or -errno, set before cb runs
     e_iocb() {}
 };
 
@@ -51,4 +55,35 @@ void e_io_prep_preadv(e_iocb *eio, int fd, const struct iovec *iov, int iovcnt,
 		    size_t offset, void (*cb)(void*), void *arg);
 int e_io_submit(io_context_t ctx, e_iocb *eio);
 
+/* submission batching. While an io_batch is open on a thread, I/O
+ * started on that thread (e_io_submit, or an engine that calls
+ * io_batch_add) is queued instead of submitted; submit() or the
+ * destructor hands it to each context/engine in a single call.
+ * Batches nest - the inner one submits on its own.
+ *
+ * Don't wait for I/O started inside a batch before submitting it.
+ */
+class io_engine {
+public:
+    virtual void submit_batch(std::vector<void*> &ios) = 0;
+    virtual ~io_engine() {}
+};
+
+class io_batch {
+    io_batch *outer;
+    std::vector<std::pair<io_context_t,iocb*>> aio;
+    std::vector<std::pair<io_engine*,void*>> ios;
+public:
+    io_batch();
+    ~io_batch();
+    void submit(void);
+    friend int e_io_submit(io_context_t ctx, e_iocb *eio);
+    friend bool io_batch_add(io_engine *e, void *io);
+};
+
+/* returns false if there's no open batch and the caller should
+ * submit @io itself
+ */
+bool io_batch_add(io_engine *e, void *io);
+
 #endif
@@ -11,6 +11,8 @@ the how they fit together with rados and s3
 #include <vector>
 #include <uuid/uuid.h>
 
+#include "lsvd_types.h"
+
 struct j_extent {
     uint64_t lba : 40;		// volume LBA (in sectors)
     uint64_t len : 24;		// length (sectors)
@@ -28,22 +30,42 @@ struct j_length {
     int32_t len;		// in pages
 };
 
+/* write cache map changes since the last full map/length checkpoint,
+ * appended after it and applied in order on top. Zero entries (NOP)
+ * pad out each page.
+ */
+enum {J_DELTA_NOP  = 0,
+      J_DELTA_MAP  = 1,		// map [lba,lba+len) -> plba
+      J_DELTA_TRIM = 2,		// unmap [lba,lba+len)
+      J_DELTA_HDR  = 3,		// record header at page lba, len pages
+      J_DELTA_FREE = 4};	// pages [lba,lba+len) evicted
+
+struct j_map_delta {
+    uint64_t lba : 40;		// volume LBA (sectors), or page
+    uint64_t len : 24;		// sectors, or pages
+    uint64_t plba : 61;		// on-SSD LBA (J_DELTA_MAP)
+    uint64_t type : 3;
+};
+
 enum {LSVD_J_DATA    = 10,
       LSVD_J_CKPT    = 11,
       LSVD_J_PAD     = 12,
       LSVD_J_SUPER   = 13,
       LSVD_J_W_SUPER = 14,
-      LSVD_J_R_SUPER = 15};
+      LSVD_J_R_SUPER = 15,
+      LSVD_J_TRIM    = 16};
 
 /* for now we'll assume that all entries are contiguous
+ * LSVD_J_TRIM records are header-only (len=1); the extents are the
+ * discarded LBA ranges.
  */
 struct j_hdr {
     uint32_t magic;
-    uint32_t type;		// LSVD_J_DATA
-    uint32_t version;		// 1
+    uint32_t type;		// LSVD_J_DATA, LSVD_J_TRIM
+    uint32_t version;		// 2 (1: no CRC)
     uint64_t seq;
     uint32_t len;		// in 4KB blocks, including header
-    uint32_t crc32;		// TODO: implement this
+    uint32_t crc32;		// CRC32C, header (this = 0) + extent data
     uint32_t extent_offset;	// in bytes
     uint32_t extent_len;	// in bytes
 };
@@ -88,6 +110,20 @@ struct j_write_super {
     uint32_t len_start;	// type: j_length
     uint32_t len_blocks;
     uint32_t len_entries;
+
+    /* j_map_delta log, following the map and lengths in the same half
+     * of the metadata region. delta_start = 0 if there isn't one.
+     */
+    uint32_t delta_start;
+    uint32_t delta_blocks;
+
+    /* one of stripe_count journals, each holding every stripe_count'th
+     * stripe of the volume; 0 = not striped. Set when the journal is
+     * first used.
+     */
+    uint32_t stripe_sectors;
+    uint32_t stripe_count;
+    uint32_t stripe_index;
 };
 
 /* probably in the third 4KB block, never gets overwritten (overwrite map in place)
@@ -114,11 +150,32 @@ struct j_read_super {
     int32_t map_start;		// extmap::obj_offset
     int32_t map_blocks;
 
-    int32_t evict_type;		// eviction algorithm - TBD
-    int32_t evict_start;	// eviction state - TBD
+    int32_t evict_type;		// LSVD_EVICT_CLOCK or 0 (none saved)
+    int32_t evict_start;	// eviction state, see below
     int32_t evict_blocks;
 };
 
+/* eviction region: int32 CLOCK hand, one reference count byte per
+ * cache unit, then (8-byte aligned) a j_rcache_unit per cache unit.
+ * Units are filled in 4KB pages; 'pages' has a bit for each valid
+ * one, and only counts if 'unit' matches the flat map entry.
+ */
+enum {LSVD_EVICT_CLOCK = 1};
+
+struct j_rcache_unit {
+    uint64_t unit;		// extmap::obj_offset
+    uint64_t pages;
+};
+
+static inline int rcache_evict_units_offset(int units) {
+    return round_up(sizeof(int32_t) + units, 8);
+}
+
+static inline int rcache_evict_blocks(int units) {
+    return div_round_up(rcache_evict_units_offset(units) +
+			units * sizeof(j_rcache_unit), 4096);
+}
+
       
 /* this goes in the first 4KB block in the cache partition, and never
  * gets modified
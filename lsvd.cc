@@ -10,6 +10,10 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/file.h>
+#include <sys/eventfd.h>
 
 #include <uuid/uuid.h>
 
@@ -38,14 +42,20 @@
 #include "misc_cache.h"
 #include "translate.h"
 #include "request.h"
+#include "mempool.h"
+#include "futex.h"
+#include "io.h"
 #include "nvme.h"
 #include "read_cache.h"
 #include "write_cache.h"
 #include "file_backend.h"
 #include "rados_backend.h"
+#include "s3_backend.h"
+#include "obj_compress.h"
 
 #include "fake_rbd.h"
 #include "config.h"
+#include "metrics.h"
 #include "image.h"
 
 /* RBD "image" and completions are only used in this file, so we
@@ -53,57 +63,205 @@
  */
 
 extern int make_cache(std::string name, uuid_t &uuid,
-		      uint32_t wblks, uint32_t rblks);
+		      uint32_t wblks, uint32_t rblks, int unit_sectors);
+
+/* images being opened, for lsvd_replay_status
+ */
+static std::mutex replay_m;
+static std::map<std::string,replay_progress*> replays;
+
+/* open a cache file and check its superblock; returns fd or -1
+ */
+static int open_cache(std::string &file, uuid_t &uuid, j_super *js) {
+    int fd = open(file.c_str(), O_RDWR | O_DIRECT);
+    if (fd < 0)
+	return -1;
+    if (pread(fd, (char*)js, 4096, 0) < 0)
+	return -1;
+    if (js->magic != LSVD_MAGIC || js->type != LSVD_J_SUPER)
+	return -1;
+    if (memcmp(js->vol_uuid, uuid, sizeof(uuid_t)) != 0)
+	throw("object and cache UUIDs don't match");
+    return fd;
+}
 
 int rbd_image::image_open(rados_ioctx_t io, const char *name) {
     if (cfg.read() < 0)
 	return -1;
+    start_queues();
     switch (cfg.backend) {
     case BACKEND_FILE:
-	objstore = new file_backend;
+	objstore = new file_backend(cfg.file_fds, cfg.file_direct);
 	break;
     case BACKEND_RADOS:
 	objstore = make_rados_backend();
 	break;
+    case BACKEND_S3:
+	objstore = make_s3_backend(&cfg);
+	break;
     default:
 	return -1;
     }
+    if (cfg.backend_stripe > 1)
+	objstore = make_striped_backend(objstore, cfg.backend_stripe_unit,
+					cfg.backend_stripe);
+    if (cfg.backend_compress)
+	objstore = make_compressed_backend(objstore);
 
     /* read superblock and initialize translation layer
      */
     xlate = make_translate(objstore, &cfg, &map, &map_lock);
+    xlate->set_metrics(&metrics);
     size = xlate->init(name, cfg.xlate_threads, true);
 
-    /* figure out cache file name, create it if necessary
+    /* figure out cache file names, create them if necessary. The
+     * read cache shares the write cache's file unless rcache_dir is set
      */
     std::string cache = cfg.cache_filename(xlate->uuid, name);
+    std::string r_cache = cfg.rcache_filename(cache);
+    bool split = (r_cache != cache);
+    int cache_pages = cfg.cache_size / 4096;
+    int wblks = (cache_pages - 3) / 2, rblks = wblks;
+    if (cfg.wcache_size > 0)
+	wblks = cfg.wcache_size / 4096;
+    if (cfg.rcache_size > 0)
+	rblks = cfg.rcache_size / 4096;
     if (access(cache.c_str(), R_OK|W_OK) < 0) {
-	int cache_pages = cfg.cache_size / 4096;
-	int wblks = (cache_pages - 3) / 2, rblks = wblks;
-	if (make_cache(cache, xlate->uuid, wblks, rblks) < 0)
+	if (make_cache(cache, xlate->uuid, wblks, split ? 0 : rblks,
+		       cfg.rcache_unit/512) < 0)
+	    return -1;
+    }
+    if (split && access(r_cache.c_str(), R_OK|W_OK) < 0) {
+	if (make_cache(r_cache, xlate->uuid, 0, rblks, cfg.rcache_unit/512) < 0)
 	    return -1;
     }
 
-    int fd = open(cache.c_str(), O_RDWR | O_DIRECT);
-    if (fd < 0)
-	return -1;
-    
     j_super *js =  (j_super*)aligned_alloc(512, 4096);
-    if (pread(fd, (char*)js, 4096, 0) < 0)
-	return -1;
-    if (js->magic != LSVD_MAGIC || js->type != LSVD_J_SUPER)
+    int fd = open_cache(cache, xlate->uuid, js);
+    if (fd < 0)
 	return -1;
-    if (memcmp(js->vol_uuid, xlate->uuid, sizeof(uuid_t)) != 0)
-	throw("object and cache UUIDs don't match");
+    j_super *r_js = js;
+    int r_fd = fd;
+    if (split) {
+	r_js = (j_super*)aligned_alloc(512, 4096);
+	if ((r_fd = open_cache(r_cache, xlate->uuid, r_js)) < 0)
+	    return -1;
+    }
     
-    wcache = make_write_cache(js->write_super, fd, xlate, &cfg);
-    rcache = make_read_cache(js->read_super, fd, false,
-			     xlate, &map, &map_lock, objstore);
+    /* extra journals (wcache_dirs) are caches with no read cache
+     */
+    std::vector<int> fds = {fd};
+    std::vector<uint32_t> blknos = {js->write_super};
+    for (auto file : cfg.journal_filenames(cache)) {
+	if (access(file.c_str(), R_OK|W_OK) < 0 &&
+	    make_cache(file, xlate->uuid, wblks, 0, cfg.rcache_unit/512) < 0)
+	    return -1;
+	j_super *_js = (j_super*)aligned_alloc(512, 4096);
+	int _fd = open_cache(file, xlate->uuid, _js);
+	if (_fd < 0)
+	    return -1;
+	fds.push_back(_fd);
+	blknos.push_back(_js->write_super);
+	free(_js);
+    }
+
+    replay_progress rp;
+    std::string _name(name);
+    {
+	std::unique_lock lk(replay_m);
+	replays[_name] = &rp;
+    }
+    /* journals replay in parallel
+     */
+    int n = fds.size();
+    std::vector<write_cache*> caches(n);
+    if (n == 1)
+	caches[0] = make_write_cache(blknos[0], fd, xlate, &cfg, &rp);
+    else {
+	std::atomic<const char*> err = NULL;
+	std::vector<std::thread> threads;
+	for (int i = 0; i < n; i++)
+	    threads.push_back(std::thread([&,i]{
+			try {
+			    caches[i] = make_write_cache(blknos[i], fds[i],
+							 xlate, &cfg, &rp, i, n);
+			} catch (const char *e) {
+			    err = e;
+			}
+		    }));
+	for (auto &t : threads)
+	    t.join();
+	if (err.load())
+	    throw(err.load());
+    }
+    {
+	std::unique_lock lk(replay_m);
+	replays.erase(_name);
+    }
+    wcache = (n == 1) ? caches[0] :
+	make_striped_wcache(caches, cfg.wcache_stripe / 512);
+    rcache = make_read_cache(r_js->read_super, r_fd, false,
+			     xlate, &map, &map_lock, objstore, &cfg);
+    if (split)
+	free(r_js);
     free(js);
+
+    wcache->set_metrics(&metrics);
+    rcache->set_metrics(&metrics);
+    xlate->add_gc_cache(wcache);
+    xlate->add_gc_cache(rcache);
+    if (cfg.wcache_promote)
+	wcache->set_read_cache(rcache);
+
+    /* base image data goes in a cache shared by all clones of it
+     */
+    uuid_t base_uuid;
+    int base_seq = xlate->base_seq(base_uuid);
+    if (base_seq > 0 && cfg.base_cache_size > 0) {
+	if (open_base_cache(base_uuid) < 0)
+	    return -1;
+	rcache->set_base(base_rcache, base_seq);
+    }
+
+    /* warm up from the hot set saved by the last host to open it
+     */
+    if (cfg.rcache_hot)
+	rcache->load_hot((std::string(name) + ".hot").c_str());
     
     return 0;
 }
 
+/* The file is built under a temporary name and linked into place, so
+ * racing openers never see a partial one. Whoever gets the lock fills
+ * it; it's dropped when base_fd is closed.
+ */
+int rbd_image::open_base_cache(uuid_t &base_uuid) {
+    std::string file = cfg.base_cache_filename(base_uuid);
+    if (access(file.c_str(), R_OK|W_OK) < 0) {
+	std::string tmp = file + "." + std::to_string(getpid()) + "." +
+	    std::to_string((uintptr_t)this);
+	if (make_cache(tmp, base_uuid, 0, cfg.base_cache_size / 4096,
+		       cfg.rcache_unit/512) < 0)
+	    return -1;
+	link(tmp.c_str(), file.c_str()); // fails if someone beat us to it
+	unlink(tmp.c_str());
+    }
+
+    j_super *js = (j_super*)aligned_alloc(512, 4096);
+    base_fd = open_cache(file, base_uuid, js);
+    if (base_fd < 0) {
+	free(js);
+	return -1;
+    }
+    bool filler = (flock(base_fd, LOCK_EX | LOCK_NB) == 0);
+    base_rcache = make_read_cache(js->read_super, base_fd, false, xlate,
+				  &map, &map_lock, objstore, &cfg);
+    base_rcache->set_shared(filler);
+    base_rcache->set_metrics(&metrics);
+    free(js);
+    return 0;
+}
+
 /* for debug use
  */
 rbd_image *make_rbd_image(backend *b, translate *t, write_cache *w,
@@ -113,6 +271,7 @@ rbd_image *make_rbd_image(backend *b, translate *t, write_cache *w,
     img->xlate = t;
     img->wcache = w;
     img->rcache = r;
+    img->start_queues();
     return img;
 }
 
@@ -132,14 +291,46 @@ extern "C" int rbd_open(rados_ioctx_t io, const char *name,
     return 0;
 }
 
+/* returns 1 and fills in done and max (journal pages) if 'name' is in
+ * rbd_open replaying its write cache, 0 otherwise.
+ */
+extern "C" int lsvd_replay_status(const char *name, uint64_t *done,
+				  uint64_t *max) {
+    std::unique_lock lk(replay_m);
+    auto it = replays.find(std::string(name));
+    if (it == replays.end())
+	return 0;
+    *done = it->second->pages;
+    *max = it->second->max;
+    return 1;
+}
+
+/* counters and latency histograms for an open image, as text - see
+ * lsvd_metrics::dump. Returns the length needed, which may be more
+ * than 'len'.
+ */
+extern "C" int lsvd_get_metrics(rbd_image_t image, char *buf, size_t len) {
+    rbd_image *img = (rbd_image*)image;
+    return img->metrics.dump(buf, len);
+}
+
 int rbd_image::image_close(void) {
+    xlate->clear_gc_caches();
+    wcache->set_read_cache(NULL);
+    rcache->save_hot();
     rcache->write_map();
     delete rcache;
+    if (base_rcache != NULL) {
+	base_rcache->write_map();
+	delete base_rcache;
+	close(base_fd);
+    }
     wcache->flush();
     wcache->do_write_checkpoint();
     delete wcache;
     xlate->flush();
     delete xlate;
+    stop_queues();
     return 0;
 }
 
@@ -153,62 +344,170 @@ extern "C" int rbd_close(rbd_image_t image)
 
 /* RBD-level completion structure
  */
-struct lsvd_completion {
+struct lsvd_completion : public pooled<lsvd_completion> {
 public:
     rbd_image *img;
+    completion_queue *q = NULL;
+    lsvd_completion *next = NULL; // on a completion_list
     rbd_callback_t cb;
     void *arg;
     int retval;
-    std::mutex m;
-    std::condition_variable cv;
     /* done: += 1
      * released: += 10
      * caller waiting: += 20
      */
-    std::atomic<int> done_released = 0;
+    futex_state done_released;
     
     lsvd_completion(rbd_callback_t cb_, void *arg_) : cb(cb_), arg(arg_) {}
 
-    /* see Ceph AioCompletion::complete
+    /* rbd_aio_* - the completion goes on the submitting thread's queue
      */
+    void attach(rbd_image *img_) {
+	img = img_;
+	q = img->pick_queue();
+    }
+
     void complete(int val) {
 	retval = val;
+	if (q->worker)
+	    q->worker->push(this);
+	else
+	    finish();
+    }
+
+    /* see Ceph AioCompletion::complete
+     */
+    void finish(void) {
 	if (cb)
 	    cb((rbd_completion_t)this, arg);
-	if (img->ev.is_valid()) {
-	    {
-		std::unique_lock lk(img->m);
-		img->completions.push(this);
-	    }
-	    img->ev.notify();
-	}
-
-	std::unique_lock lk(m);
-	int x = (done_released += 1);
-	cv.notify_all();
-	if (x == 11) {
-	    lk.unlock();
+	if (q->ev.is_valid())
+	    q->push(this);
+	if (done_released.add(1) == 11)
 	    delete this;
-	}
     }
 
+    /* one never passed to rbd_aio_* (q == NULL) is freed right away
+     */
     void release() {
-	int x = (done_released += 10);
-	if (x == 11) 
+	if (q == NULL || done_released.add(10) == 11)
 	    delete this;
     }
 };
 
-int rbd_image::poll_io_events(rbd_completion_t *comps, int numcomp) {
-    std::unique_lock lk(m);
-    int i;
-    for (i = 0; i < numcomp && !completions.empty(); i++) {
-	comps[i] = completions.front();
-	completions.pop();
+bool completion_list::push(lsvd_completion *c) {
+    auto h = head.load();
+    do {
+	c->next = h;
+    } while (!head.compare_exchange_weak(h, c));
+    return h == NULL;
+}
+
+lsvd_completion *completion_list::take(void) {
+    lsvd_completion *c = head.exchange(NULL), *prev = NULL;
+    while (c != NULL) {		// newest first -> oldest first
+	auto next = c->next;
+	c->next = prev;
+	prev = c;
+	c = next;
+    }
+    return prev;
+}
+
+completion_worker::completion_worker() {
+    wake_fd = eventfd(0, 0);
+    th = std::thread(&completion_worker::run, this);
+}
+
+/* anything already pushed gets run before the thread exits
+ */
+completion_worker::~completion_worker() {
+    running = false;
+    uint64_t val = 1;
+    if (write(wake_fd, &val, sizeof(val)) < 0)
+	perror("completion_worker");
+    th.join();
+    close(wake_fd);
+}
+
+void completion_worker::push(lsvd_completion *c) {
+    uint64_t val = 1;
+    if (work.push(c) && write(wake_fd, &val, sizeof(val)) < 0)
+	perror("completion_worker");
+}
+
+void completion_worker::run(void) {
+    pthread_setname_np(pthread_self(), "lsvd_complete");
+    while (true) {
+	uint64_t val;
+	if (read(wake_fd, &val, sizeof(val)) < 0 && errno != EINTR)
+	    break;
+	for (auto c = work.take(); c != NULL; ) {
+	    auto next = c->next; // finish() may reuse c->next, or free c
+	    c->finish();
+	    c = next;
+	}
+	if (!running)
+	    break;
+    }
+}
+
+void completion_queue::push(lsvd_completion *c) {
+    if (done.push(c))
+	ev.notify();
+}
+
+int completion_queue::poll(rbd_completion_t *comps, int numcomp) {
+    std::unique_lock lk(poll_m);
+    int i = 0;
+    while (i < numcomp) {
+	if (polled == NULL && (polled = done.take()) == NULL)
+	    break;
+	comps[i++] = (rbd_completion_t)polled;
+	polled = polled->next;
     }
+    if (polled != NULL)		// no push will signal these
+	ev.notify();
     return i;
 }
 
+void rbd_image::start_queues(void) {
+    for (int i = 0; i < cfg.completion_threads; i++)
+	workers.push_back(new completion_worker);
+    for (int i = 0; i < std::max(1, cfg.queues); i++) {
+	auto q = new completion_queue;
+	if (workers.size() > 0)
+	    q->worker = workers[i % workers.size()];
+	queues.push_back(q);
+    }
+}
+
+void rbd_image::stop_queues(void) {
+    for (auto w : workers)
+	delete w;
+    workers.clear();
+    for (auto q : queues)
+	delete q;
+    queues.clear();
+}
+
+/* set by lsvd_set_queue; otherwise we go by CPU
+ */
+static thread_local int my_queue = -1;
+
+completion_queue *rbd_image::pick_queue(void) {
+    int i = my_queue;
+    if (i < 0 && (i = sched_getcpu()) < 0)
+	i = 0;
+    return queues[i % queues.size()];
+}
+
+int rbd_image::poll_io_events(rbd_completion_t *comps, int numcomp) {
+    int n = 0;
+    for (auto q : queues)
+	n += q->poll(comps + n, numcomp - n);
+    return n;
+}
+
 extern "C" int rbd_poll_io_events(rbd_image_t image,
 				  rbd_completion_t *comps, int numcomp)
 {
@@ -216,51 +515,59 @@ extern "C" int rbd_poll_io_events(rbd_image_t image,
     return img->poll_io_events(comps, numcomp);
 }
 
+/* one fd for all the queues
+ */
 extern "C" int rbd_set_image_notification(rbd_image_t image, int fd, int type)
 {
     rbd_image *img = (rbd_image*)image;
     assert(type == EVENT_TYPE_EVENTFD);
-    return img->ev.init(fd, type);
+    for (auto q : img->queues)
+	q->ev.init(fd, type);
+    return 0;
 }
 
-extern "C" int rbd_aio_create_completion(void *cb_arg,
-					 rbd_callback_t complete_cb,
-					 rbd_completion_t *c)
+extern "C" int lsvd_queue_count(rbd_image_t image)
 {
-    lsvd_completion *p = new lsvd_completion(complete_cb, cb_arg);
-    *c = (rbd_completion_t)p;
-    return 0;
+    rbd_image *img = (rbd_image*)image;
+    return img->queues.size();
 }
 
-extern "C" void rbd_aio_release(rbd_completion_t c)
+extern "C" void lsvd_set_queue(int q)
 {
-    lsvd_completion *p = (lsvd_completion *)c;
-    p->release();
+    my_queue = q;
 }
 
-extern "C" int rbd_aio_discard(rbd_image_t image, uint64_t off,
-			       uint64_t len, rbd_completion_t c)
+extern "C" int lsvd_set_queue_notification(rbd_image_t image, int q,
+					   int fd, int type)
 {
-    lsvd_completion *p = (lsvd_completion *)c;
-    p->img = (rbd_image*)image;
+    rbd_image *img = (rbd_image*)image;
+    if (q < 0 || q >= (int)img->queues.size() || type != EVENT_TYPE_EVENTFD)
+	return -1;
+    return img->queues[q]->ev.init(fd, type);
+}
 
-    /* TODO: implement
-     */
+extern "C" int lsvd_poll_queue_events(rbd_image_t image, int q,
+				      rbd_completion_t *comps, int numcomp)
+{
+    rbd_image *img = (rbd_image*)image;
+    if (q < 0 || q >= (int)img->queues.size())
+	return -1;
+    return img->queues[q]->poll(comps, numcomp);
+}
 
-    p->complete(0);
+extern "C" int rbd_aio_create_completion(void *cb_arg,
+					 rbd_callback_t complete_cb,
+					 rbd_completion_t *c)
+{
+    lsvd_completion *p = new lsvd_completion(complete_cb, cb_arg);
+    *c = (rbd_completion_t)p;
     return 0;
 }
 
-extern "C" int rbd_aio_flush(rbd_image_t image, rbd_completion_t c)
+extern "C" void rbd_aio_release(rbd_completion_t c)
 {
     lsvd_completion *p = (lsvd_completion *)c;
-    p->img = (rbd_image*)image;
-
-    /* TODO: implement
-     */
-
-    p->complete(0);
-    return 0;
+    p->release();
 }
 
 extern "C" int rbd_flush(rbd_image_t image)
@@ -283,12 +590,13 @@ extern "C" ssize_t rbd_aio_get_return_value(rbd_completion_t c)
     return p->retval;
 }
 
-/* rbd_aio_req - state machine for rbd_aio_read, rbd_aio_write
+/* rbd_aio_req - state machine for rbd_aio_read, rbd_aio_write,
+ * rbd_aio_discard, rbd_aio_flush
  *
  * TODO: fix this. I merged separate read & write classes in the
  * ugliest possible way, but it works...
  */
-class rbd_aio_req : public request {
+class rbd_aio_req : public request, public pooled<rbd_aio_req> {
     rbd_image        *img;
     lsvd_completion  *p;
     char             *buf;
@@ -297,110 +605,129 @@ class rbd_aio_req : public request {
     size_t            len;
     lsvd_op           op;
     smartiov          data_iovs;
+    smartiov          user_iovs; // readv/writev: buf is ours, see below
 
     /* note - 'complete' = (n_req == 0) */
     std::atomic<int>  n_req = 0;
 
     /* 1 = complete, 2 = launched, 16 = waited on */
-    std::atomic<int>  status = 0;
-    std::mutex        m;
-    std::condition_variable cv;
+    futex_state       status;
+    uint64_t          t0 = 0;	// for metrics
+
+    /* with a waiter (run_wait) it's 19, and the waiter deletes us
+     */
+    void done(void) {
+	if (status.add(1) == 3)
+	    delete this;
+    }
 
     void notify_w(request *unused) {
         sector_t sectors = div_round_up(len, 512);
-        img->wcache->release_room(sectors);
+	if (op == OP_WRITE) {
+	    img->wcache->release_room(sectors);
+	    img->metrics.add_time(H_WRITE, m_now() - t0);
+	}
 
         if (p != NULL)
             p->complete(len);
 
 	assert(--n_req == 0);
-	std::unique_lock lk(m);
-	auto x = (status += 1);
-	cv.notify_all();
-	lk.unlock();
-
-	if (x == 3)
-	    delete this;
+	done();
     }
     
+    /* n_req is held up until launch, so there's only one last child
+     */
     void notify_r(request *child) {
 	if (child)
 	    child->release();
         if (--n_req > 0)
             return;
 
-	std::unique_lock lk(m);
-	if ((status.load() & 2) == 0)
-	    return; 		// not launched
-        
-	auto x = (status += 1);
         if (aligned_buf != buf) 
             memcpy(buf, aligned_buf, len);
+	if (user_iovs.size() > 0)
+	    user_iovs.copy_in(buf);
+	img->metrics.add_time(H_READ, m_now() - t0);
 
         if (p != NULL) 
             p->complete(len);
-
-	cv.notify_all();
-	if (x == 3)
-	    delete this;
+	done();
     }
     
     void run_w() {
 	n_req++;		// single sub-request for write
 	
         if (!aligned(buf, 512)) {
-            aligned_buf = (char*)aligned_alloc(512, len);
+            aligned_buf = page_alloc(len);
             memcpy(aligned_buf, buf, len);
         }
         data_iovs.push_back((iovec){aligned_buf, len});
         sector_t sectors = div_round_up(len, 512);
         img->wcache->get_room(sectors);
 
-	status += 2;		// launched
+	status.add(2);		// launched
         img->wcache->writev(this, offset/512, &data_iovs);
     }
     
+    /* only whole sectors get discarded; a partial sector at
+     * either end is left alone.
+     */
+    void run_t() {
+	n_req++;
+	status.add(2);		// launched
+	sector_t base = div_round_up(offset, 512),
+	    limit = (offset + len) / 512;
+	if (limit > base)
+	    img->wcache->trim(this, base, limit - base);
+	else
+	    notify(NULL);
+    }
+
+    void run_f() {
+	n_req++;
+	status.add(2);		// launched
+	img->wcache->flush_async(this);
+    }
+
     void run_r() {
         if (!aligned(buf, 512))
-            aligned_buf = (char*)aligned_alloc(512, len);
+            aligned_buf = page_alloc(len);
 
         /* we're not done until n_req == 0 && launched == true
          */
         char *_buf = aligned_buf;       // read and increment this
         size_t _len = len;              // and this
-	bool no_async = true;
-	
+	n_req++;		// held until everything is launched
+
+	/* SSD and backend reads all go out together at the end
+	 */
+	io_batch batch;
         while (_len > 0) {
             auto [skip,wait,rreq] =
                 img->wcache->async_read(offset, _buf, _len);
 	    if (rreq != NULL) {
 		n_req++;
 		rreq->run(this);
-		no_async = false;
 	    }
 
             _len -= skip;
-            while (skip > 0) {
-                auto [skip2, wait2, req] =
-                    img->rcache->async_read(offset, _buf, skip);
-		if (req) {
-		    n_req++;
+            if (skip > 0) {
+		std::vector<request*> reqs;
+		img->rcache->async_readv(offset, _buf, skip, reqs);
+		n_req += reqs.size();
+		for (auto req : reqs)
 		    req->run(this);
-		    no_async = false;
-		}
-                memset(_buf, 0, skip2);
-                skip -= (skip2 + wait2);
-                _buf += (skip2 + wait2);
-                offset += (skip2 + wait2);
+                _buf += skip;
+                offset += skip;
             }
             _buf += wait;
             _len -= wait;
             offset += wait;
 	}
+	batch.submit();
 
-	status += 2;		// launched
-	if (no_async)
-            notify(NULL);
+	status.add(2);		// launched
+	notify(NULL);
     }
     
 public:
@@ -414,9 +741,22 @@ public:
 	len = len_;
 	aligned_buf = buf;
     }
+    /* rbd_aio_readv/writev: data goes through a page-aligned copy
+     */
+    rbd_aio_req(lsvd_op op_, rbd_image *img_, lsvd_completion *p_,
+		const iovec *iov, int iovcnt, uint64_t offset_) :
+	rbd_aio_req(op_, img_, p_, NULL, offset_, 0) {
+	user_iovs.ingest(iov, iovcnt);
+	len = user_iovs.bytes();
+	buf = aligned_buf = page_alloc(len);
+	if (op == OP_WRITE)
+	    user_iovs.copy_out(buf);
+    }
     ~rbd_aio_req() {
 	if (aligned_buf != buf)
-	    free(aligned_buf);
+	    page_free(aligned_buf, len);
+	if (user_iovs.size() > 0)
+	    page_free(buf, len);
     }
 
     /* note that there's no child request until read cache is updated
@@ -431,24 +771,44 @@ public:
 
     /* TODO: this is really gross. To properly fix it I need to integrate this
      * with rbd_aio_completion and use its release() method
+     *
+     * the guard has to go on before run(), or a request that
+     * completes on another thread gets deleted before we wait
      */
+    void run_wait() {
+	status.add(16);		   // guard from deletion
+	run(NULL);
+	wait();
+    }
+
     void wait() {
-	std::unique_lock lk(m);
-	status += 16;		   // guard from deletion
-	while (status.load() != 3+16) // wait for launched+complete
-	    cv.wait(lk);
-	status -= 16;		   // guard from deletion
-	lk.unlock();
+	status.wait_until([](int x){return x == 3+16;}); // launched+complete
 	delete this;
     }
 
     void release() {}
 
     void run(request *parent /* unused */) {
-	if (op == OP_READ)
+	auto &m = img->metrics;
+	t0 = m_now();
+	if (op == OP_READ) {
+	    m.add(M_READ_OPS, 1);
+	    m.add(M_READ_BYTES, len);
 	    run_r();
-	else
+	}
+	else if (op == OP_TRIM) {
+	    m.add(M_TRIM_OPS, 1);
+	    run_t();
+	}
+	else if (op == OP_FLUSH) {
+	    m.add(M_FLUSH_OPS, 1);
+	    run_f();
+	}
+	else {
+	    m.add(M_WRITE_OPS, 1);
+	    m.add(M_WRITE_BYTES, len);
 	    run_w();
+	}
     }
 
     static void aio_read_cb(void *ptr) {
@@ -462,24 +822,73 @@ extern "C" int rbd_aio_read(rbd_image_t image, uint64_t offset,
 {
     rbd_image *img = (rbd_image*)image;
     auto p = (lsvd_completion*)c;
-    p->img = img;
+    p->attach(img);
 
     auto req = new rbd_aio_req(OP_READ, img, p, buf, offset, len);
     req->run(NULL);
     return 0;
 }
 
+/* a single iovec is just rbd_aio_read/write; more than one gets
+ * gathered into (or scattered from) a bounce buffer
+ */
 extern "C" int rbd_aio_readv(rbd_image_t image, const iovec *iov,
 			     int iovcnt, uint64_t off, rbd_completion_t c)
 {
-    /* TODO */
+    if (iovcnt < 1)
+	return -EINVAL;
+    if (iovcnt == 1)
+	return rbd_aio_read(image, off, iov[0].iov_len,
+			    (char*)iov[0].iov_base, c);
+    rbd_image *img = (rbd_image*)image;
+    auto p = (lsvd_completion*)c;
+    p->attach(img);
+
+    auto req = new rbd_aio_req(OP_READ, img, p, iov, iovcnt, off);
+    req->run(NULL);
     return 0;
 }
 
 extern "C" int rbd_aio_writev(rbd_image_t image, const struct iovec *iov,
 			      int iovcnt, uint64_t off, rbd_completion_t c)
 {
-    /* TODO */
+    if (iovcnt < 1)
+	return -EINVAL;
+    if (iovcnt == 1)
+	return rbd_aio_write(image, off, iov[0].iov_len,
+			     (const char*)iov[0].iov_base, c);
+    rbd_image *img = (rbd_image*)image;
+    lsvd_completion *p = (lsvd_completion *)c;
+    p->attach(img);
+
+    auto req = new rbd_aio_req(OP_WRITE, img, p, iov, iovcnt, off);
+    req->run(NULL);
+    return 0;
+}
+
+extern "C" int rbd_aio_discard(rbd_image_t image, uint64_t off,
+			       uint64_t len, rbd_completion_t c)
+{
+    rbd_image *img = (rbd_image*)image;
+    lsvd_completion *p = (lsvd_completion *)c;
+    p->attach(img);
+
+    auto req = new rbd_aio_req(OP_TRIM, img, p, NULL, off, len);
+    req->run(NULL);
+    return 0;
+}
+
+/* barrier: completes when every write and discard issued before it
+ * is in the write cache journal. The backend is flushed lazily.
+ */
+extern "C" int rbd_aio_flush(rbd_image_t image, rbd_completion_t c)
+{
+    rbd_image *img = (rbd_image*)image;
+    lsvd_completion *p = (lsvd_completion *)c;
+    p->attach(img);
+
+    auto req = new rbd_aio_req(OP_FLUSH, img, p, NULL, 0, 0);
+    req->run(NULL);
     return 0;
 }
 
@@ -488,7 +897,7 @@ extern "C" int rbd_aio_write(rbd_image_t image, uint64_t offset, size_t len,
 {
     rbd_image *img = (rbd_image*)image;
     lsvd_completion *p = (lsvd_completion *)c;
-    p->img = img;
+    p->attach(img);
 
     auto req = new rbd_aio_req(OP_WRITE, img, p, (char*)buf, offset, len);
     req->run(NULL);
@@ -501,8 +910,7 @@ extern "C" int rbd_read(rbd_image_t image, uint64_t off, size_t len, char *buf)
 {
     rbd_image *img = (rbd_image*)image;
     auto req = new rbd_aio_req(OP_READ, img, NULL, buf, off, len);
-    req->run(NULL);
-    req->wait();
+    req->run_wait();
     return 0;
 }
 
@@ -510,23 +918,17 @@ extern "C" int rbd_write(rbd_image_t image, uint64_t off, size_t len, const char
 {
     rbd_image *img = (rbd_image*)image;
     auto req = new rbd_aio_req(OP_WRITE, img, NULL, (char*)buf, off, len);
-    req->run(NULL);
-    req->wait();
+    req->run_wait();
     return 0;
 }
 
 extern "C" int rbd_aio_wait_for_complete(rbd_completion_t c)
 {
     lsvd_completion *p = (lsvd_completion *)c;
-    p->done_released += 20;
-    std::unique_lock lk(p->m);
-    while ((p->done_released.load() % 1) == 0)
-	p->cv.wait(lk);
-    int x = (p->done_released -= 20);
-    if (x == 11) {
-	lk.unlock();
+    p->done_released.add(20);
+    p->done_released.wait_until([](int x){return (x % 10) != 0;});
+    if (p->done_released.add(-20) == 11)
 	delete p;
-    }
     return 0;
 }
 
@@ -571,25 +973,54 @@ extern "C" int rbd_resize(rbd_image_t image, uint64_t size)
     return -1;
 }
 
+/* Snapshots are full checkpoints, kept (with everything they point
+ * to) until removed; the id is the checkpoint's sequence number. To
+ * use one, clone it - see mkdisk.py --clone
+ */
 extern "C" int rbd_snap_create(rbd_image_t image, const char *snapname)
 {
-    return -1;
+    rbd_image *img = (rbd_image*)image;
+    return img->xlate->snap_create(snapname);
 }
+
+/* like librbd, the list ends with an entry with name == NULL
+ */
 extern "C" int rbd_snap_list(rbd_image_t image, rbd_snap_info_t *snaps,
                                int *max_snaps)
 {
-    return -1;
+    rbd_image *img = (rbd_image*)image;
+    std::vector<std::pair<std::string,int>> v;
+    img->xlate->snap_list(v);
+    if (*max_snaps < (int)v.size() + 1) {
+	*max_snaps = v.size() + 1;
+	return -ERANGE;
+    }
+    for (size_t i = 0; i < v.size(); i++)
+	snaps[i] = (rbd_snap_info_t){.id = (uint64_t)v[i].second,
+				     .size = (uint64_t)img->size,
+				     .name = strdup(v[i].first.c_str())};
+    snaps[v.size()] = (rbd_snap_info_t){.id = 0, .size = 0, .name = NULL};
+    return v.size();
 }
 extern "C" void rbd_snap_list_end(rbd_snap_info_t *snaps)
 {
+    for (; snaps->name != NULL; snaps++) {
+	free((void*)snaps->name);
+	snaps->name = NULL;
+    }
 }
 extern "C" int rbd_snap_remove(rbd_image_t image, const char *snapname)
 {
-    return -1;
+    rbd_image *img = (rbd_image*)image;
+    return img->xlate->snap_remove(snapname);
 }
+
+/* rolling back an open image would mean throwing away the write
+ * cache, read cache and map underneath it
+ */
 extern "C" int rbd_snap_rollback(rbd_image_t image, const char *snapname)
 {
-    return -1;
+    return -EOPNOTSUPP;
 }
 
 #if 0				// librados replacement
@@ -174,6 +174,12 @@ class read_cache:
         buf = (c_char * nbytes)()
         lsvd_lib.rcache_read2(self.rcache, buf, c_ulong(offset), c_ulong(nbytes))
         return buf[0:nbytes]
+
+    def readv(self, offset, nbytes):
+        assert (nbytes % 512) == 0 and (offset % 512) == 0
+        buf = (c_char * nbytes)()
+        lsvd_lib.rcache_readv(self.rcache, buf, c_ulong(offset), c_ulong(nbytes))
+        return buf[0:nbytes]
     
     def add(self, obj, blk, data):
         if type(data) != bytes:
@@ -240,4 +246,11 @@ def rbd_write(img, off, data):
 def rbd_flush(img):
     lsvd_lib.rbd_flush(img)
 
+def rbd_aio_flush(img):
+    c = c_void_p()
+    lsvd_lib.rbd_aio_create_completion(None, None, byref(c))
+    lsvd_lib.rbd_aio_flush(img, c)
+    lsvd_lib.rbd_aio_wait_for_complete(c)
+    lsvd_lib.rbd_aio_release(c)
+
 
@@ -8,6 +8,7 @@
 #include <shared_mutex>
 #include <condition_variable>
 #include <atomic>
+#include <thread>
 
 #include "lsvd_types.h"
 #include "smartiov.h"
@@ -19,12 +20,13 @@
 #include "read_cache.h"
 #include "journal.h"
 #include "write_cache.h"
+#include "misc_cache.h"
+#include "metrics.h"
 #include "image.h"
 
 #include "objects.h"
 #include "request.h"
 
-#include "misc_cache.h"
 #include "nvme.h"
 
 #include "file_backend.h"
@@ -40,7 +42,7 @@ public:
     translate   *lsvd;
     write_cache *wcache;
     extmap::objmap    obj_map;
-    std::shared_mutex obj_lock;
+    sharded_rwlock    obj_lock;
     read_cache  *rcache;
     backend     *io;
     uuid_t       uuid;
@@ -128,6 +130,11 @@ extern "C" int xlate_write(_dbg *d, char *buffer, uint64_t offset, uint32_t size
     size_t val = d->lsvd->writev(offset, &iov, 1);
     return val < 0 ? -1 : 0;
 }
+extern "C" int xlate_trim(_dbg *d, uint64_t offset, uint32_t size)
+{
+    size_t val = d->lsvd->trim(offset, size);
+    return val < 0 ? -1 : 0;
+}
 int getmap_cb(void *ptr, int base, int limit, int obj, int offset)
 {
     getmap_s *s = (getmap_s*)ptr;
@@ -238,7 +245,8 @@ extern "C" void rcache_init(_dbg *d,
 			    uint32_t blkno, int fd, void **val_p)
 {
     auto rcache = make_read_cache(blkno, fd, false,
-				  d->lsvd, &d->obj_map, &d->obj_lock, d->io);
+				  d->lsvd, &d->obj_map, &d->obj_lock, d->io,
+				  &d->cfg);
     *val_p = (void*)rcache;
 }
 extern "C" void rcache_shutdown(read_cache *rcache)
@@ -388,6 +396,29 @@ extern "C" void rcache_read2(read_cache *rcache, char *buf,
     delete req;
 }
 
+/* whole range in one call, using read2_req to wait for the pieces
+ */
+extern "C" void rcache_readv(read_cache *rcache, char *buf,
+			     uint64_t offset, uint64_t len)
+{
+    char *buf2 = (char*)aligned_alloc(512, len); // just assume it's not
+    auto req = new read2_req();
+    std::vector<request*> reqs;
+
+    rcache->async_readv(offset, buf2, len, reqs);
+    for (auto r : reqs) {
+	req->add_ref();
+	r->run(req);
+    }
+    req->run(NULL);
+    req->wait();
+    for (auto r : reqs)
+	r->release();
+    memcpy(buf, buf2, len);
+    free(buf2);
+    delete req;
+}
+
 extern "C" void rcache_add(read_cache *rcache, int object, int block, char *buf, size_t len)
 {
     assert(len == 65536);
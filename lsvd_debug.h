@@ -63,6 +63,7 @@ extern "C" int xlate_flush(_dbg *d);
 extern "C" int xlate_size(_dbg *d);
 extern "C" int xlate_read(_dbg *d, char *buffer, uint64_t offset, uint32_t size);
 extern "C" int xlate_write(_dbg *d, char *buffer, uint64_t offset, uint32_t size);
+extern "C" int xlate_trim(_dbg *d, uint64_t offset, uint32_t size);
 extern "C" int xlate_getmap(_dbg *d, int base, int limit, int max, struct tuple *t);
 extern "C" int xlate_frontier(_dbg *d);
 extern "C" int xlate_seq(_dbg *d);
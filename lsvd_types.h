@@ -18,7 +18,9 @@ typedef int page_t;
 
 enum lsvd_op {
     OP_READ = 2,
-    OP_WRITE = 4
+    OP_WRITE = 4,
+    OP_TRIM = 8,
+    OP_FLUSH = 16
 };
 
 enum { LSVD_MAGIC = 0x4456534c };
@@ -10,6 +10,7 @@ class tuple(Structure):
 LSVD_SUPER = 1
 LSVD_DATA = 2
 LSVD_CKPT = 3
+LSVD_HOT = 4
 LSVD_MAGIC = 0x4456534c
 
 # these match version 453d93 of objects.cc
@@ -49,8 +50,9 @@ sizeof_clone = sizeof(clone) # 21
 
 class snap(Structure):
     _fields_ = [("snap_uuid",           c_ubyte*16),
-                ("seq",                 c_uint)]
-sizeof_snap = sizeof(snap) # 20
+                ("seq",                 c_uint),
+                ("name",                c_char*32)]
+sizeof_snap = sizeof(snap) # 52
 
 class data_hdr(Structure):
     _fields_ = [("last_data_obj",       c_uint),
@@ -59,8 +61,25 @@ class data_hdr(Structure):
                 ("objs_cleaned_offset", c_uint),
                 ("objs_cleaned_len",    c_uint),
                 ("map_offset",          c_uint),
-                ("map_len",             c_uint)]
-sizeof_data_hdr = sizeof(data_hdr) # 28
+                ("map_len",             c_uint),
+                ("trims_offset",        c_uint),
+                ("trims_len",           c_uint),
+                ("chunk_sectors",       c_uint),
+                ("chunks_offset",       c_uint),
+                ("chunks_len",          c_uint),
+                ("hdr_crc",             c_uint)]
+sizeof_data_hdr = sizeof(data_hdr) # 52
+
+class hot_hdr(Structure):
+    _fields_ = [("unit_sectors",        c_uint),
+                ("units_offset",        c_uint),
+                ("units_len",           c_uint)]
+sizeof_hot_hdr = sizeof(hot_hdr) # 12
+
+class hot_unit(Structure):
+    _fields_ = [("seq",                 c_uint),
+                ("unit",                c_uint)]
+sizeof_hot_unit = sizeof(hot_unit) # 8
 
 class obj_cleaned(Structure):
     _fields_ = [("seq",                 c_uint),
@@ -130,6 +149,9 @@ LSVD_J_PAD     = 12
 LSVD_J_SUPER   = 13
 LSVD_J_W_SUPER = 14
 LSVD_J_R_SUPER = 15
+LSVD_J_TRIM    = 16
+
+LSVD_EVICT_CLOCK = 1
 
 class j_hdr(Structure):
     _fields_ = [("magic",         c_uint),
@@ -158,7 +180,12 @@ class j_write_super(Structure):
                 ("map_entries", c_uint),
                 ("len_start",   c_uint),
                 ("len_blocks",  c_uint),
-                ("len_entries", c_uint)]
+                ("len_entries", c_uint),
+                ("delta_start", c_uint),
+                ("delta_blocks", c_uint),
+                ("stripe_sectors", c_uint),
+                ("stripe_count", c_uint),
+                ("stripe_index", c_uint)]
 sizeof_j_write_super = sizeof(j_write_super)
 
 class j_read_super(Structure):
@@ -0,0 +1,149 @@
+/*
+ * file:        mempool.h
+ * description: freelists for per-I/O allocations
+ *              -block_pool: fixed-size blocks, per-thread + shared
+ *              -pooled<T>: operator new/delete for request classes
+ *              -page_alloc/page_free: 4K-aligned buffers
+ *
+ * author:      Peter Desnoyers, Northeastern University
+ * Copyright 2021, 2022 Peter Desnoyers
+ * license:     GNU LGPL v2.1 or newer
+ *              LGPL-2.1-or-later
+ */
+
+#ifndef MEMPOOL_H
+#define MEMPOOL_H
+
+#include <stdlib.h>
+#include <mutex>
+#include <vector>
+#include <new>
+
+/* free blocks of N bytes (aligned to A) are kept on a per-thread
+ * list. Requests are typically allocated on one thread and freed on
+ * a completion thread, so a thread with too many free blocks moves
+ * half of them to a shared list, and a thread that runs out takes
+ * a handful back. Both lists are capped; past that blocks are freed.
+ */
+template <size_t N, size_t A>
+class block_pool {
+    static constexpr size_t bytes = (N + A - 1) / A * A;
+    static constexpr size_t max_local = (1<<20)/bytes > 8 ? (1<<20)/bytes : 8;
+    static constexpr size_t max_shared = (16<<20)/bytes > 64 ?
+	(16<<20)/bytes : 64;
+
+    struct shared_list {
+	std::mutex m;
+	std::vector<void*> v;
+	~shared_list() {
+	    for (auto p : v)
+		::free(p);
+	}
+    };
+    static inline shared_list shared;
+
+    struct local_list {
+	std::vector<void*> v;
+	~local_list() {
+	    std::unique_lock lk(shared.m);
+	    for (auto p : v) {
+		if (shared.v.size() < max_shared)
+		    shared.v.push_back(p);
+		else
+		    ::free(p);
+	    }
+	}
+    };
+    static inline thread_local local_list local;
+
+public:
+    static void *alloc(void) {
+	auto &l = local.v;
+	if (l.empty()) {
+	    std::unique_lock lk(shared.m);
+	    while (l.size() < max_local/2 && !shared.v.empty()) {
+		l.push_back(shared.v.back());
+		shared.v.pop_back();
+	    }
+	}
+	if (l.empty()) {
+	    void *p = aligned_alloc(A, bytes);
+	    if (p == NULL)
+		throw std::bad_alloc();
+	    return p;
+	}
+	void *p = l.back();
+	l.pop_back();
+	return p;
+    }
+
+    static void free(void *p) {
+	auto &l = local.v;
+	l.push_back(p);
+	if (l.size() < max_local)
+	    return;
+	std::unique_lock lk(shared.m);
+	while (l.size() > max_local/2) {
+	    if (shared.v.size() < max_shared)
+		shared.v.push_back(l.back());
+	    else
+		::free(l.back());
+	    l.pop_back();
+	}
+    }
+};
+
+/* class rbd_aio_req : public request, public pooled<rbd_aio_req> { ...
+ * a subclass of a pooled class is bigger than T, and goes to the
+ * regular heap; the sized delete sorts out which is which.
+ */
+template <class T>
+class pooled {
+public:
+    static void *operator new(size_t sz) {
+	if (sz != sizeof(T))
+	    return ::operator new(sz);
+	return block_pool<sizeof(T),alignof(T)>::alloc();
+    }
+    static void operator delete(void *p, size_t sz) {
+	if (sz != sizeof(T))
+	    ::operator delete(p);
+	else
+	    block_pool<sizeof(T),alignof(T)>::free(p);
+    }
+};
+
+/* 4K-aligned buffers for journal headers and bounce buffers; sizes up
+ * to 64K come from pools of 4/8/16/32/64K, larger ones straight from
+ * aligned_alloc. Must be freed with the size they were allocated with.
+ */
+static inline char *page_alloc(size_t bytes) {
+    if (bytes <= 4096)
+	return (char*)block_pool<4096,4096>::alloc();
+    if (bytes <= 8192)
+	return (char*)block_pool<8192,4096>::alloc();
+    if (bytes <= 16384)
+	return (char*)block_pool<16384,4096>::alloc();
+    if (bytes <= 32768)
+	return (char*)block_pool<32768,4096>::alloc();
+    if (bytes <= 65536)
+	return (char*)block_pool<65536,4096>::alloc();
+    return (char*)aligned_alloc(4096, (bytes + 4095) & ~4095UL);
+}
+
+static inline void page_free(char *buf, size_t bytes) {
+    if (bytes <= 4096)
+	block_pool<4096,4096>::free(buf);
+    else if (bytes <= 8192)
+	block_pool<8192,4096>::free(buf);
+    else if (bytes <= 16384)
+	block_pool<16384,4096>::free(buf);
+    else if (bytes <= 32768)
+	block_pool<32768,4096>::free(buf);
+    else if (bytes <= 65536)
+	block_pool<65536,4096>::free(buf);
+    else
+	::free(buf);
+}
+
+#endif
@@ -0,0 +1,52 @@
+/*
+ * file:        metrics.cc
+ * description: per-image counters and latency histograms
+ *
+ * author:      Peter Desnoyers, Northeastern University
+ * Copyright 2021, 2022 Peter Desnoyers
+ * license:     GNU LGPL v2.1 or newer
+ *              LGPL-2.1-or-later
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include "metrics.h"
+
+static const char *m_counter_names[] = {
+    "read_ops", "read_bytes", "write_ops", "write_bytes",
+    "trim_ops", "flush_ops",
+    "rcache_local_sectors", "rcache_ssd_sectors", "rcache_queued_sectors",
+    "rcache_fill_sectors", "rcache_direct_sectors",
+    "wcache_records", "wcache_bytes",
+    "crc_bytes", "crc_nsecs",
+    "backend_objs", "backend_bytes",
+    "gc_cycles", "gc_sectors_read", "gc_sectors_cached",
+    "gc_sectors_written"
+};
+static_assert(sizeof(m_counter_names) / sizeof(char*) == M_N_COUNTERS);
+
+static const char *m_hist_names[] = {
+    "read_lat", "write_lat", "wcache_commit_lat", "backend_write_lat",
+    "backend_read_lat", "rcache_ssd_lat", "gc_read_lat", "gc_write_lat"
+};
+static_assert(sizeof(m_hist_names) / sizeof(char*) == M_N_HISTS);
+
+size_t lsvd_metrics::dump(char *buf, size_t len) {
+    size_t n = 0;
+    auto out = [&](const char *fmt, auto... args) {
+	int r = snprintf(buf + std::min(n, len), len - std::min(n, len),
+			 fmt, args...);
+	n += r;
+    };
+    for (int i = 0; i < M_N_COUNTERS; i++)
+	out("%s %lu\n", m_counter_names[i], counters[i].sum());
+    for (int i = 0; i < M_N_HISTS; i++) {
+	auto &h = hists[i];
+	out("%s %lu %lu %lu %lu %lu %lu %lu\n", m_hist_names[i], h.count(),
+	    h.mean(), h.percentile(0.5), h.percentile(0.9),
+	    h.percentile(0.99), h.percentile(0.999), h.get_max());
+    }
+    return n;
+}
@@ -0,0 +1,163 @@
+/*
+ * file:        metrics.h
+ * description: per-image counters and latency histograms
+ *
+ * author:      Peter Desnoyers, Northeastern University
+ * Copyright 2021, 2022 Peter Desnoyers
+ * license:     GNU LGPL v2.1 or newer
+ *              LGPL-2.1-or-later
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <sched.h>
+#include <atomic>
+#include <chrono>
+
+/* counters - see m_counter_names in metrics.cc
+ */
+enum m_counter {
+    M_READ_OPS = 0, M_READ_BYTES, M_WRITE_OPS, M_WRITE_BYTES,
+    M_TRIM_OPS, M_FLUSH_OPS,
+    M_RC_LOCAL,			// read cache, sectors by RCACHE_* state:
+    M_RC_SSD,			//  hits...
+    M_RC_QUEUED,
+    M_RC_FILL,			//  ...and misses
+    M_RC_DIRECT,
+    M_WC_RECORDS, M_WC_BYTES,	// write cache journal
+    M_CRC_BYTES, M_CRC_NSECS,
+    M_XLATE_OBJS, M_XLATE_BYTES, // backend data objects
+    M_GC_CYCLES, M_GC_SECTORS_READ, M_GC_SECTORS_CACHED,
+    M_GC_SECTORS_WRITTEN,
+    M_N_COUNTERS
+};
+
+/* latency histograms, in nanoseconds
+ */
+enum m_hist {
+    H_READ = 0, H_WRITE,	// rbd_aio_*, submit to completion
+    H_WC_COMMIT,		// journal record, submit to SSD ack
+    H_XLATE_ACK,		// data object, sealed to backend ack
+    H_BACKEND_READ,		// read cache fills and direct reads
+    H_RC_SSD_READ,
+    H_GC_READ,			// GC chunk: start to all data in
+    H_GC_WRITE,			//  and object write to ack
+    M_N_HISTS
+};
+
+/* Adds go to one of n_slots cache lines picked by the CPU we're on,
+ * so counters bumped on every I/O don't bounce between cores.
+ */
+class pcpu_counter {
+    static const int n_slots = 32;
+    struct alignas(64) slot {
+	std::atomic<uint64_t> val = 0;
+    } slots[n_slots];
+
+public:
+    void add(uint64_t n) {
+	int cpu = sched_getcpu();
+	slots[(cpu < 0 ? 0 : cpu) % n_slots].val.fetch_add(
+	    n, std::memory_order_relaxed);
+    }
+    uint64_t sum(void) {
+	uint64_t total = 0;
+	for (auto &s : slots)
+	    total += s.val.load(std::memory_order_relaxed);
+	return total;
+    }
+};
+
+/* log-linear (HDR-style) buckets: 8 per power of two, so a
+ * percentile is within 12.5% of the true value
+ */
+class lat_hist {
+    static const int sub_bits = 3;
+    static const int n_buckets = 64 << sub_bits;
+    std::atomic<uint64_t> counts[n_buckets];
+    std::atomic<uint64_t> total = 0;
+    std::atomic<uint64_t> max = 0;
+
+    static int bucket(uint64_t v) {
+	if (v < (1 << sub_bits))
+	    return v;
+	int msb = 63 - __builtin_clzll(v);
+	return ((msb - sub_bits + 1) << sub_bits) +
+	    ((v >> (msb - sub_bits)) & ((1 << sub_bits) - 1));
+    }
+    static uint64_t bucket_base(int i) {
+	if (i < (1 << sub_bits))
+	    return i;
+	int msb = (i >> sub_bits) + sub_bits - 1;
+	uint64_t sub = i & ((1 << sub_bits) - 1);
+	return (1ULL << msb) + (sub << (msb - sub_bits));
+    }
+
+public:
+    lat_hist() {
+	for (auto &c : counts)
+	    c = 0;
+    }
+    void add(uint64_t nsecs) {
+	counts[bucket(nsecs)].fetch_add(1, std::memory_order_relaxed);
+	total.fetch_add(nsecs, std::memory_order_relaxed);
+	uint64_t m = max.load(std::memory_order_relaxed);
+	while (nsecs > m && !max.compare_exchange_weak(m, nsecs))
+	    ;
+    }
+
+    /* count, mean, percentiles (0 < p < 1) and max
+     */
+    uint64_t count(void) {
+	uint64_t n = 0;
+	for (auto &c : counts)
+	    n += c.load(std::memory_order_relaxed);
+	return n;
+    }
+    uint64_t mean(void) {
+	uint64_t n = count();
+	return n ? total.load() / n : 0;
+    }
+    uint64_t percentile(double p) {
+	uint64_t n = count(), seen = 0;
+	for (int i = 0; i < n_buckets; i++) {
+	    seen += counts[i].load(std::memory_order_relaxed);
+	    if (n > 0 && seen >= p * n)
+		return bucket_base(i);
+	}
+	return 0;
+    }
+    uint64_t get_max(void) {
+	return max.load();
+    }
+};
+
+/* one per image; components get a pointer with set_metrics, and
+ * leave it NULL (count nothing) in tests and tools
+ */
+struct lsvd_metrics {
+    pcpu_counter counters[M_N_COUNTERS];
+    lat_hist     hists[M_N_HISTS];
+
+    void add(m_counter c, uint64_t n) {
+	counters[c].add(n);
+    }
+    void add_time(m_hist h, uint64_t nsecs) {
+	hists[h].add(nsecs);
+    }
+
+    /* "name value" lines, then one line per histogram:
+     * "name count mean p50 p90 p99 p999 max" (nsecs). Returns the
+     * length it needed, like snprintf.
+     */
+    size_t dump(char *buf, size_t len);
+};
+
+static inline uint64_t m_now(void) {
+    auto t = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(t).count();
+}
+
+#endif
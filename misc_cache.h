@@ -4,6 +4,7 @@
  *              -thread_pool
  *		-sized_vector for caches
  *		-objmap (map shared by translate, read_cache)
+ *		-sharded_rwlock (lock for objmap)
  *
  * author:      Peter Desnoyers, Northeastern University
  * Copyright 2021, 2022 Peter Desnoyers
@@ -18,6 +19,8 @@
 #include <thread>
 #include <queue>
 #include <mutex>
+#include <shared_mutex>
+#include <atomic>
 #include <condition_variable>
 
 /* implements a thread pool with a work queue of type T
@@ -74,6 +77,43 @@ public:
     }
 };
 
+/* reader/writer lock for the object map, which is read by every I/O
+ * and written once per batch. Readers take one of n_shards locks
+ * (fixed per thread) so they don't all bounce the same cache line;
+ * writers take all of them, in order. Drop-in for std::shared_mutex
+ * with std::shared_lock / std::unique_lock - shared lock and unlock
+ * must be in the same thread.
+ */
+class sharded_rwlock {
+    static const int n_shards = 16;
+    struct alignas(64) shard {
+	std::shared_mutex m;
+    };
+    shard shards[n_shards];
+
+    static int my_shard(void) {
+	static std::atomic<int> next_shard;
+	thread_local int i = next_shard++ % n_shards;
+	return i;
+    }
+
+public:
+    void lock(void) {
+	for (auto &s : shards)
+	    s.m.lock();
+    }
+    void unlock(void) {
+	for (int i = n_shards-1; i >= 0; i--)
+	    shards[i].m.unlock();
+    }
+    void lock_shared(void) {
+	shards[my_shard()].m.lock_shared();
+    }
+    void unlock_shared(void) {
+	shards[my_shard()].m.unlock_shared();
+    }
+};
+
 /* nice error messages
  */
 #include <experimental/filesystem>
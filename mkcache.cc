@@ -20,7 +20,8 @@
 
 /* translated from mkcache.py version 461b997f
  */
-int make_cache(std::string name, uuid_t &uuid, uint32_t wblks, uint32_t rblks) {
+int make_cache(std::string name, uuid_t &uuid, uint32_t wblks, uint32_t rblks,
+	       int unit_sectors) {
     FILE *fp = fopen(name.c_str(), "wb");
     if (fp == NULL)
 	return -1;
@@ -60,24 +61,27 @@ int make_cache(std::string name, uuid_t &uuid, uint32_t wblks, uint32_t rblks) {
     fwrite(buf, 4096, 1, fp);
 
     int rbase = wblks+mblks+3;
-    int units = rblks / 16;
+    int units = rblks / (unit_sectors / 8);
     int map_blks = div_round_up(units*sizeof(extmap::obj_offset), 4096);
+    int evict_blks = rcache_evict_blocks(units);
 
     memset(buf, 0, sizeof(buf));
     auto rsup = (j_read_super*)buf;
     *rsup = (j_read_super){LSVD_MAGIC,
 			   LSVD_J_R_SUPER,
 			   1,
-			   128,	// unit size
-			   rbase+map_blks, // base
+			   unit_sectors, // unit size
+			   rbase+map_blks+evict_blks, // base
 			   units,	   // units
 			   rbase,	   // map_start
 			   map_blks,	   // map_blocks
-			   0,0,0};	   // unused (eviction)
+			   LSVD_EVICT_CLOCK,
+			   rbase+map_blks, // evict_start
+			   evict_blks};	   // evict_blocks
     fwrite(buf, 4096, 1, fp);
 
     memset(buf, 0, 4096);
-    for (unsigned i = 0; i < 3 + mblks + wblks + map_blks + rblks; i++)
+    for (unsigned i = 0; i < 3 + mblks + wblks + map_blks + evict_blks + rblks; i++)
 	fwrite(buf, 4096, 1, fp);
     fclose(fp);
 
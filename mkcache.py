@@ -33,7 +33,8 @@ def parse_size(size):
 
 # backend batch size is 8MB, write cache should be >= 2 batches
 # 
-def mkcache(name, uuid=b'\0'*16, write_zeros=True, wblks=4096, rblks=4096):
+def mkcache(name, uuid=b'\0'*16, write_zeros=True, wblks=4096, rblks=4096,
+                unit_sectors=128):
     fd = os.open(name, os.O_RDWR | os.O_CREAT, 0o777)
 
     sup = lsvd.j_super(magic=lsvd.LSVD_MAGIC, type=lsvd.LSVD_J_SUPER,
@@ -62,14 +63,19 @@ def mkcache(name, uuid=b'\0'*16, write_zeros=True, wblks=4096, rblks=4096):
     os.write(fd, data) # page 1
 
     rbase = wblks+mblks+3
-    units = rblks // 16
+    units = rblks // (unit_sectors // 8)
     map_blks = div_round_up(units*lsvd.sizeof_obj_offset, 4096)
+    # CLOCK hand, counts, then 16 bytes/unit of page bitmaps
+    evict_blks = div_round_up(div_round_up(4 + units, 8)*8 + 16*units, 4096)
     
     # 1 page for map
     rsup = lsvd.j_read_super(magic=lsvd.LSVD_MAGIC, type=lsvd.LSVD_J_R_SUPER,
-                                unit_size=128, units=units,
+                                unit_size=unit_sectors, units=units,
                                 map_start=rbase, map_blocks=map_blks,
-                                base=rbase+map_blks)
+                                evict_type=lsvd.LSVD_EVICT_CLOCK,
+                                evict_start=rbase+map_blks,
+                                evict_blocks=evict_blks,
+                                base=rbase+map_blks+evict_blks)
 
     data = bytearray() + rsup
     data += b'\0' * (4096-len(data))
@@ -80,10 +86,10 @@ def mkcache(name, uuid=b'\0'*16, write_zeros=True, wblks=4096, rblks=4096):
 
     data = bytearray(b'\0'*4096)
     if (write_zeros):
-        for i in range(3 + mblks + wblks + map_blks + rblks):
+        for i in range(3 + mblks + wblks + map_blks + evict_blks + rblks):
             os.write(fd, data)
     else:
-        for i in range(rbase,rbase+map_blks):
+        for i in range(rbase,rbase+map_blks+evict_blks):
             os.pwrite(fd, data, i*4096)
     
     os.close(fd)
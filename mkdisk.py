@@ -10,6 +10,10 @@ try:
     import rados
 except:
     pass
+try:
+    import boto3
+except:
+    pass
 
 # based on https://stackoverflow.com/a/42865957/2002471
 units = {"B": 1, "KB": 2**10, "MB": 2**20, "GB": 2**30, "TB": 2**40}
@@ -19,18 +23,36 @@ def parse_size(size):
     number, unit = [string.strip() for string in size.split()]
     return int(float(number)*units[unit])
 
-def mkdisk(name, sectors, uuid=b'\0'*16, use_rados=False):
+# S3: same LSVD_S3_* settings as the library, names are bucket/key
+#
+def s3_client():
+    scheme = 'https' if os.getenv('LSVD_S3_HTTPS', '0') != '0' else 'http'
+    host = os.getenv('LSVD_S3_HOST', 'localhost:9000')
+    return boto3.client('s3', endpoint_url=scheme + '://' + host,
+                        region_name=os.getenv('LSVD_S3_REGION', 'us-east-1'),
+                        aws_access_key_id=os.getenv('LSVD_S3_ACCESS_KEY'),
+                        aws_secret_access_key=os.getenv('LSVD_S3_SECRET_KEY'))
+
+def mkdisk(name, sectors, uuid=b'\0'*16, use_rados=False, next_obj=1,
+               clones=b'', use_s3=False):
     _hdr = hdr(magic=LSVD_MAGIC, version=1, type=LSVD_SUPER,
                   hdr_sectors=8, data_sectors=0)
     _hdr.vol_uuid[:] = uuid
     data = bytearray() + _hdr
     
-    super = super_hdr(vol_size=sectors, next_obj=1)
+    super = super_hdr(vol_size=sectors, next_obj=next_obj)
+    if clones:
+        super.clones_offset = sizeof_hdr + sizeof_super_hdr
+        super.clones_len = len(clones)
     data += super
+    data += clones
 
     data += b'\0' * (4096-len(data))
 
-    if use_rados:
+    if use_s3:
+        bucket,key = name.split("/", 1)
+        s3_client().put_object(Bucket=bucket, Key=key, Body=bytes(data))
+    elif use_rados:
         cluster = rados.Rados(conffile='')
         cluster.connect();
         pool,prefix = name.split("/")
@@ -46,6 +68,49 @@ def mkdisk(name, sectors, uuid=b'\0'*16, use_rados=False):
         fp.write(data) # page 1
         fp.close()
 
+def read_super(name, use_rados=False, use_s3=False):
+    if use_s3:
+        bucket,key = name.split("/", 1)
+        obj = s3_client().get_object(Bucket=bucket, Key=key, Range='bytes=0-4095')
+        data = obj['Body'].read()
+    elif use_rados:
+        cluster = rados.Rados(conffile='')
+        cluster.connect();
+        pool,prefix = name.split("/")
+        ioctx = cluster.open_ioctx(pool)
+        data = ioctx.read(prefix, 4096)
+        ioctx.close()
+        cluster.shutdown()
+    else:
+        fp = open(name, 'rb')
+        data = fp.read(4096)
+        fp.close()
+    return bytearray(data)
+
+# a clone of snapshot 'snapname' of 'base': returns its size (sectors),
+# first object number, and clone list - the base's, plus the base
+#
+def clone_info(base, snapname, use_rados=False, use_s3=False):
+    data = read_super(base, use_rados, use_s3)
+    h = hdr.from_buffer(data[0:sizeof_hdr])
+    if h.magic != LSVD_MAGIC or h.type != LSVD_SUPER:
+        raise RuntimeError('Not an LSVD image: ' + base)
+    sh = super_hdr.from_buffer(data[sizeof_hdr:sizeof_hdr+sizeof_super_hdr])
+    seq = 0
+    for i in range(sh.snaps_len // sizeof_snap):
+        o = sh.snaps_offset + i*sizeof_snap
+        s = snap.from_buffer(data[o:o+sizeof_snap])
+        if s.name.decode() == snapname:
+            seq = s.seq
+    if seq == 0:
+        raise RuntimeError('Snapshot not found: %s@%s' % (base, snapname))
+
+    clones = data[sh.clones_offset:sh.clones_offset+sh.clones_len]
+    c = clone(sequence=seq, name_len=len(base))
+    c.vol_uuid[:] = h.vol_uuid
+    clones += bytes(c) + base.encode()
+    return sh.vol_size, seq+1, bytes(clones)
+
 def cleanup(name):
     d = os.path.dirname(name)
     b = os.path.basename(name)
@@ -61,6 +126,10 @@ if __name__ == '__main__':
     parser.add_argument('--uuid', help='volume UUID',
                             default='00000000-0000-0000-0000-000000000000')
     parser.add_argument('--rados', help='use RADOS backend', action='store_true');
+    parser.add_argument('--s3', help='use S3 backend (LSVD_S3_* settings)',
+                            action='store_true');
+    parser.add_argument('--clone', help='clone of snapshot (same size)',
+                            metavar='BASE@SNAP')
     parser.add_argument('prefix', help='superblock name')
     args = parser.parse_args()
 
@@ -69,7 +138,15 @@ if __name__ == '__main__':
     if _uuid == b'\0'*16:
         _uuid = uuid.uuid1().bytes
 
-    if not args.rados:
+    next_obj, clones = 1, b''
+    if args.clone:
+        base, snapname = args.clone.split('@')
+        sectors, next_obj, clones = clone_info(base, snapname, args.rados,
+                                                   args.s3)
+        size = sectors * 512
+
+    if not args.rados and not args.s3:
         cleanup(args.prefix)
-    mkdisk(args.prefix, size//512, _uuid, args.rados)
+    mkdisk(args.prefix, size//512, _uuid, args.rados, next_obj, clones,
+               args.s3)
 
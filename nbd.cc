@@ -0,0 +1,334 @@
+/*
+ * file:        nbd.cc
+ * description: kernel NBD frontend - serves an LSVD image as /dev/nbdX
+ *              through rbd_aio_*, with many requests in flight
+ *
+ * author:      Peter Desnoyers, Northeastern University
+ * Copyright 2021, 2022 Peter Desnoyers
+ * license:     GNU LGPL v2.1 or newer
+ *              LGPL-2.1-or-later
+ *
+ * usage: lsvd-nbd [--connections N] /dev/nbdX SSD OBJ_PREFIX
+ *
+ * Each connection is a socketpair handed to the kernel with
+ * NBD_SET_SOCK; the kernel spreads its hardware queues over them.
+ * A receiver thread per connection reads requests and submits them
+ * on LSVD completion queue (connection % queues), and a thread per
+ * queue picks up completions with lsvd_poll_queue_events and sends
+ * the replies, so nothing waits on any one I/O. Reads, writes, trim
+ * and flush go straight to rbd_aio_readv/writev/discard/flush.
+ *
+ * Writes are durable when they complete (write cache journal), so
+ * FUA needs nothing extra. Needs the nbd module, e.g. 'modprobe nbd'.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <argp.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <linux/nbd.h>
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+#include "fake_rbd.h"
+
+rbd_image_t img;
+int nbd_fd;
+
+struct nbd_conn {
+    int              sock;
+    int              queue;
+    std::mutex       m;		// replies from receiver and completer
+    std::atomic<int> inflight = 0;
+};
+
+struct nbd_io {
+    nbd_conn  *conn;
+    nbd_reply  reply;
+    uint32_t   cmd;
+    char      *buf = NULL;
+    size_t     len = 0;
+};
+
+struct nbd_queue {
+    int               efd;
+    std::atomic<bool> running = true;
+};
+
+static bool read_all(int fd, void *buf, size_t len) {
+    char *p = (char*)buf;
+    while (len > 0) {
+	ssize_t n = read(fd, p, len);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return false;
+	p += n;
+	len -= n;
+    }
+    return true;
+}
+
+static bool write_all(int fd, iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+	ssize_t n = writev(fd, iov, iovcnt);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return false;
+	while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+	    n -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {
+	    iov->iov_base = (char*)iov->iov_base + n;
+	    iov->iov_len -= n;
+	}
+    }
+    return true;
+}
+
+static void send_reply(nbd_io *io, int err) {
+    io->reply.error = htonl(err);
+    iovec iov[] = {{&io->reply, sizeof(io->reply)}, {io->buf, io->len}};
+    int iovcnt = (io->cmd == NBD_CMD_READ && err == 0) ? 2 : 1;
+    std::unique_lock lk(io->conn->m);
+    if (!write_all(io->conn->sock, iov, iovcnt))
+	perror("nbd reply");
+}
+
+static void io_done(nbd_io *io) {
+    io->conn->inflight--;
+    free(io->buf);
+    delete io;
+}
+
+/* completions for one LSVD queue, from any connection using it
+ */
+static void completer(int q, nbd_queue *nq) {
+    pthread_setname_np(pthread_self(), "nbd_complete");
+    rbd_completion_t comps[64];
+    for (;;) {
+	uint64_t val;
+	if (read(nq->efd, &val, sizeof(val)) < 0 && errno != EINTR)
+	    break;
+	int n;
+	while ((n = lsvd_poll_queue_events(img, q, comps, 64)) > 0)
+	    for (int i = 0; i < n; i++) {
+		auto io = (nbd_io*)rbd_aio_get_arg(comps[i]);
+		int rv = rbd_aio_get_return_value(comps[i]);
+		rbd_aio_release(comps[i]);
+		send_reply(io, rv < 0 ? EIO : 0);
+		io_done(io);
+	    }
+	if (!nq->running)
+	    break;
+    }
+}
+
+/* requests from one connection, until the kernel disconnects it
+ */
+static void receiver(nbd_conn *c) {
+    pthread_setname_np(pthread_self(), "nbd_receive");
+    lsvd_set_queue(c->queue);
+    nbd_request req;
+    while (read_all(c->sock, &req, sizeof(req))) {
+	if (ntohl(req.magic) != NBD_REQUEST_MAGIC) {
+	    fprintf(stderr, "nbd: bad request magic\n");
+	    break;
+	}
+	auto io = new nbd_io;
+	io->conn = c;
+	io->cmd = ntohl(req.type) & 0xffff; // flags (FUA) in the top half
+	io->reply.magic = htonl(NBD_REPLY_MAGIC);
+	memcpy(io->reply.handle, req.handle, sizeof(req.handle));
+	uint64_t offset = be64toh(req.from);
+	uint32_t len = ntohl(req.len);
+
+	if (io->cmd == NBD_CMD_DISC) {
+	    delete io;
+	    break;
+	}
+	if (io->cmd == NBD_CMD_READ || io->cmd == NBD_CMD_WRITE) {
+	    io->len = len;
+	    io->buf = (char*)aligned_alloc(4096, (len + 4095) & ~4095UL);
+	}
+	if (io->cmd == NBD_CMD_WRITE && !read_all(c->sock, io->buf, len)) {
+	    free(io->buf);
+	    delete io;
+	    break;
+	}
+	c->inflight++;
+	if (io->cmd != NBD_CMD_READ && io->cmd != NBD_CMD_WRITE &&
+	    io->cmd != NBD_CMD_TRIM && io->cmd != NBD_CMD_FLUSH) {
+	    send_reply(io, EINVAL);
+	    io_done(io);
+	    continue;
+	}
+
+	rbd_completion_t comp;
+	rbd_aio_create_completion(io, NULL, &comp);
+	iovec iov = {io->buf, io->len};
+	int rv;
+	if (io->cmd == NBD_CMD_READ)
+	    rv = rbd_aio_readv(img, &iov, 1, offset, comp);
+	else if (io->cmd == NBD_CMD_WRITE)
+	    rv = rbd_aio_writev(img, &iov, 1, offset, comp);
+	else if (io->cmd == NBD_CMD_TRIM)
+	    rv = rbd_aio_discard(img, offset, len, comp);
+	else
+	    rv = rbd_aio_flush(img, comp);
+	if (rv < 0) {		// never submitted, so release frees it
+	    rbd_aio_release(comp);
+	    send_reply(io, EIO);
+	    io_done(io);
+	}
+    }
+}
+
+static void on_signal(int sig) {
+    ioctl(nbd_fd, NBD_DISCONNECT);
+}
+
+static char args_doc[] = "NBD_DEVICE SSD OBJ_PREFIX";
+static struct argp_option options[] = {
+    {"connections", 'c', "N", 0, "sockets to the kernel (default 4)"},
+    {0},
+};
+static char *dev, *ssd, *prefix;
+static int n_conns = 4;
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state)
+{
+    switch (key) {
+    case 'c':
+	n_conns = atoi(arg);
+	break;
+    case ARGP_KEY_ARG:
+	if (dev == NULL)
+	    dev = arg;
+	else if (ssd == NULL)
+	    ssd = arg;
+	else if (prefix == NULL)
+	    prefix = arg;
+	else
+	    return ARGP_ERR_UNKNOWN;
+	break;
+    case ARGP_KEY_END:
+	if (!dev || !ssd || !prefix || n_conns < 1)
+	    argp_usage(state);
+	break;
+    default:
+	return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+static struct argp argp = { options, parse_opt, NULL, args_doc};
+
+int main(int argc, char **argv)
+{
+    argp_parse(&argp, argc, argv, ARGP_LONG_ONLY, 0, NULL);
+
+    /* a completion queue per connection, unless configured otherwise
+     */
+    char buf[16];
+    sprintf(buf, "%d", n_conns);
+    setenv("LSVD_QUEUES", buf, 0);
+
+    char rbd_name[128];
+    if (snprintf(rbd_name, sizeof(rbd_name), "%s,%s", ssd, prefix)
+	>= (int)sizeof(rbd_name))
+	fprintf(stderr, "image name too long: %s,%s\n", ssd, prefix), exit(1);
+    if (rbd_open(NULL, rbd_name, &img, NULL) < 0)
+	fprintf(stderr, "failed to open\n"), exit(1);
+    rbd_image_info_t info;
+    rbd_stat(img, &info, sizeof(info));
+
+    if ((nbd_fd = open(dev, O_RDWR)) < 0)
+	perror(dev), exit(1);
+    ioctl(nbd_fd, NBD_CLEAR_SOCK);
+    if (ioctl(nbd_fd, NBD_SET_BLKSIZE, 4096UL) < 0 ||
+	ioctl(nbd_fd, NBD_SET_SIZE_BLOCKS, info.size / 4096) < 0 ||
+	ioctl(nbd_fd, NBD_SET_FLAGS, NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH |
+	      NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_TRIM |
+	      NBD_FLAG_CAN_MULTI_CONN) < 0)
+	perror("nbd setup"), exit(1);
+
+    int n_queues = lsvd_queue_count(img);
+    std::vector<nbd_queue*> queues;
+    std::vector<std::thread> completers;
+    for (int i = 0; i < n_queues; i++) {
+	auto nq = new nbd_queue;
+	nq->efd = eventfd(0, 0);
+	lsvd_set_queue_notification(img, i, nq->efd, EVENT_TYPE_EVENTFD);
+	queues.push_back(nq);
+	completers.push_back(std::thread(completer, i, nq));
+    }
+
+    std::vector<nbd_conn*> conns;
+    std::vector<std::thread> receivers;
+    for (int i = 0; i < n_conns; i++) {
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+	    perror("socketpair"), exit(1);
+	if (ioctl(nbd_fd, NBD_SET_SOCK, sv[0]) < 0)
+	    perror("NBD_SET_SOCK"), exit(1);
+	auto c = new nbd_conn;
+	c->sock = sv[1];
+	c->queue = i % n_queues;
+	conns.push_back(c);
+	receivers.push_back(std::thread(receiver, c));
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    /* returns on disconnect (signal, or 'nbd-client -d')
+     */
+    if (ioctl(nbd_fd, NBD_DO_IT) < 0 && errno != EPIPE)
+	perror("NBD_DO_IT");
+    ioctl(nbd_fd, NBD_CLEAR_QUE);
+    ioctl(nbd_fd, NBD_CLEAR_SOCK);
+
+    for (auto c : conns)
+	shutdown(c->sock, SHUT_RD);
+    for (auto &t : receivers)
+	t.join();
+    for (auto c : conns)
+	while (c->inflight > 0)
+	    usleep(1000);
+    for (auto nq : queues) {
+	nq->running = false;
+	uint64_t val = 1;
+	if (write(nq->efd, &val, sizeof(val)) < 0)
+	    perror("eventfd");
+    }
+    for (auto &t : completers)
+	t.join();
+
+    rbd_close(img);
+    for (auto c : conns) {
+	close(c->sock);
+	delete c;
+    }
+    for (auto nq : queues) {
+	close(nq->efd);
+	delete nq;
+    }
+    close(nbd_fd);
+    return 0;
+}
@@ -24,12 +24,15 @@
 #include "backend.h"
 #include "io.h"
 #include "request.h"
+#include "mempool.h"
+#include "futex.h"
+#include "config.h"
 
 #include "nvme.h"
 
 class nvme_impl;
 
-class nvme_request : public request {
+class nvme_request : public request, public pooled<nvme_request> {
 public:
     e_iocb      eio;
     smartiov    _iovs;
@@ -38,10 +41,8 @@ public:
     nvme_impl  *nvme_ptr;
     request    *parent;
 
-    bool        released = false;
-    bool        complete = false;
-    std::mutex  m;
-    std::condition_variable cv;
+    /* 1 = complete, 2 = released */
+    futex_state state;
     
 public:
     nvme_request(smartiov *iov, size_t offset, int type, nvme_impl* nvme_w);
@@ -114,7 +115,12 @@ public:
     }
 };
 
-nvme *make_nvme(int fd, const char* name) {
+nvme *make_nvme(int fd, const char* name, lsvd_config *cfg) {
+    if (cfg->nvme_engine == NVME_URING) {
+	auto nv = make_nvme_uring(fd, name, cfg);
+	if (nv != NULL)
+	    return nv;
+    }
     return (nvme*) new nvme_impl(fd, name);
 }
 
@@ -156,29 +162,17 @@ void nvme_request::run(request* parent_) {
 void nvme_request::notify(request *child) {
     if (parent)
 	parent->notify(this);
-
-    std::unique_lock lk(m);
-    complete = true;
-    cv.notify_one();
-    if (released) {
-	lk.unlock();
+    if (state.add(1) & 2)
 	delete this;
-    }
 }
 
 void nvme_request::wait() {
-    std::unique_lock lk(m);
-    while (!complete)
-	cv.wait(lk);
+    state.wait_until([](int x){return (x & 1) != 0;});
 }
 
 void nvme_request::release() {
-    std::unique_lock lk(m);
-    released = true;
-    if (complete) {		// TODO: atomic swap?
-	lk.unlock();
+    if (state.add(2) & 1)
 	delete this;
-    }
 }
 
 nvme_request::~nvme_request() {}
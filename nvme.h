@@ -33,6 +33,12 @@ enum {
     READ_REQ = 3
 };
 
-nvme *make_nvme(int fd, const char* name);
+class lsvd_config;
+
+/* cfg->nvme_engine picks io_uring or libaio; falls back to libaio
+ * if the kernel won't set up a ring
+ */
+nvme *make_nvme(int fd, const char* name, lsvd_config *cfg);
+nvme *make_nvme_uring(int fd, const char* name, lsvd_config *cfg);
 
 #endif
@@ -0,0 +1,373 @@
+/*
+ * file:        nvme_uring.cc
+ * description: io_uring implementation of the nvme interface
+ *              uses the raw syscalls from <linux/io_uring.h>, so
+ *              there's no dependency on liburing
+ * author:      Peter Desnoyers, Northeastern University
+ * Copyright 2021, 2022 Peter Desnoyers
+ * license:     GNU LGPL v2.1 or newer
+ *              LGPL-2.1-or-later
+ */
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <uuid/uuid.h>
+
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <cassert>
+#include <string>
+#include <algorithm>
+
+#include "lsvd_types.h"
+#include "smartiov.h"
+#include "request.h"
+#include "mempool.h"
+#include "futex.h"
+#include "config.h"
+#include "io.h"
+
+#include "nvme.h"
+
+static int uring_setup(unsigned entries, io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		       unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		   flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg,
+			  unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+class nvme_uring;
+
+class uring_request : public request, public pooled<uring_request> {
+public:
+    smartiov    _iovs;
+    size_t      ofs;
+    int         t;
+    nvme_uring *nvme_ptr;
+    request    *parent = NULL;
+
+    /* 1 = complete, 2 = released */
+    futex_state state;
+
+    uring_request(smartiov *iov, size_t offset, int type, nvme_uring *nv) :
+	_iovs(iov->data(), iov->size()) {
+	ofs = offset;
+	t = type;
+	nvme_ptr = nv;
+    }
+    uring_request(char *buf, size_t len, size_t offset, int type,
+		  nvme_uring *nv) {
+	_iovs.push_back((iovec){buf, len});
+	ofs = offset;
+	t = type;
+	nvme_ptr = nv;
+    }
+    ~uring_request() {}
+
+    void wait();
+    void run(request *parent);
+    void notify(request *child);
+    void release();
+};
+
+/* one ring per nvme instance. Submitters fill SQEs under m; whoever
+ * finds nobody else in io_uring_enter submits everything queued so
+ * far, so concurrent requests go to the kernel in batches, as do
+ * requests run inside an io_batch. With
+ * SQPOLL the kernel thread picks them up and we only have to wake it
+ * now and then. A completion thread blocks in io_uring_enter, so
+ * there's no polling; a NOP with user_data==0 tells it to quit.
+ */
+class nvme_uring : public nvme, public io_engine {
+public:
+    int fd;
+    int ring_fd = -1;
+    bool fixed_file = false;
+    bool sqpoll = false;
+
+    /* mapped rings */
+    void     *sq_ptr = NULL, *cq_ptr = NULL;
+    size_t    sq_len = 0, cq_len = 0;
+    io_uring_sqe *sqes = NULL;
+    size_t    sqes_len = 0;
+    unsigned  sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, *sq_flags;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_cqe *cqes;
+
+    std::mutex m;
+    std::condition_variable room_cv;
+    int       depth;
+    int       inflight = 0;	// SQEs queued or in the kernel
+    unsigned  pending = 0;	// SQEs not yet passed to io_uring_enter
+    bool      submitting = false;
+    std::thread cq_th;
+
+    nvme_uring(int fd_) : fd(fd_) {}
+    ~nvme_uring();
+
+    int setup(int depth_, bool sqpoll_);
+    void queue(std::unique_lock<std::mutex> &lk, uring_request *r);
+    void enter(std::unique_lock<std::mutex> &lk);
+    void submit(uring_request *r);
+    void submit_batch(std::vector<void*> &ios);
+    void completion_thread(const char *name);
+
+    int read(void *buf, size_t count, off_t offset) {
+	return pread(fd, buf, count, offset);
+    }
+    int write(const void *buf, size_t count, off_t offset) {
+	return pwrite(fd, buf, count, offset);
+    }
+    int writev(const struct iovec *iov, int iovcnt, off_t offset) {
+	return pwritev(fd, iov, iovcnt, offset);
+    }
+    int readv(const struct iovec *iov, int iovcnt, off_t offset) {
+	return preadv(fd, iov, iovcnt, offset);
+    }
+
+    request* make_write_request(smartiov *iov, size_t offset) {
+	assert(offset != 0);
+	return new uring_request(iov, offset, WRITE_REQ, this);
+    }
+    request* make_write_request(char *buf, size_t len, size_t offset) {
+	assert(offset != 0);
+	return new uring_request(buf, len, offset, WRITE_REQ, this);
+    }
+    request* make_read_request(smartiov *iov, size_t offset) {
+	return new uring_request(iov, offset, READ_REQ, this);
+    }
+    request* make_read_request(char *buf, size_t len, size_t offset) {
+	return new uring_request(buf, len, offset, READ_REQ, this);
+    }
+};
+
+/* returns -1 if the kernel won't give us a ring
+ */
+int nvme_uring::setup(int depth_, bool sqpoll_) {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    if (sqpoll_) {
+	p.flags = IORING_SETUP_SQPOLL;
+	p.sq_thread_idle = 100;	// ms
+    }
+    if ((ring_fd = uring_setup(depth_, &p)) < 0)
+	return -1;
+    sqpoll = sqpoll_;
+    depth = sq_entries = p.sq_entries;
+
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+	sq_len = cq_len = std::max(sq_len, cq_len);
+
+    sq_ptr = mmap(NULL, sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		  ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+	return -1;
+    if (single)
+	cq_ptr = sq_ptr;
+    else {
+	cq_ptr = mmap(NULL, cq_len, PROT_READ|PROT_WRITE,
+		      MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+	if (cq_ptr == MAP_FAILED)
+	    return -1;
+    }
+    sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+    sqes = (io_uring_sqe*)mmap(NULL, sqes_len, PROT_READ|PROT_WRITE,
+			       MAP_SHARED|MAP_POPULATE, ring_fd,
+			       IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+	return -1;
+
+    char *sq = (char*)sq_ptr, *cq = (char*)cq_ptr;
+    sq_head = (unsigned*)(sq + p.sq_off.head);
+    sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    sq_array = (unsigned*)(sq + p.sq_off.array);
+    sq_flags = (unsigned*)(sq + p.sq_off.flags);
+    cq_head = (unsigned*)(cq + p.cq_off.head);
+    cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    /* saves a file table lookup per I/O. Registered buffers would
+     * need all I/O to come from a few fixed regions, which it doesn't
+     */
+    fixed_file = uring_register(ring_fd, IORING_REGISTER_FILES, &fd, 1) == 0;
+    return 0;
+}
+
+nvme_uring::~nvme_uring() {
+    if (cq_th.joinable()) {
+	submit(NULL);
+	cq_th.join();
+    }
+    if (sqes != NULL && sqes != MAP_FAILED)
+	munmap(sqes, sqes_len);
+    if (cq_ptr != NULL && cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+	munmap(cq_ptr, cq_len);
+    if (sq_ptr != NULL && sq_ptr != MAP_FAILED)
+	munmap(sq_ptr, sq_len);
+    if (ring_fd >= 0)
+	close(ring_fd);
+}
+
+/* fill one SQE, waiting for room if the ring is full. Anything we
+ * (or a batch) queued earlier has to go in first, or it can't drain.
+ * The completion thread (e.g. write cache group commit) can't wait
+ * for completions, so it only waits for a free SQE and may go over
+ * depth; the CQ ring has room for twice that.
+ */
+void nvme_uring::queue(std::unique_lock<std::mutex> &lk, uring_request *r) {
+    bool cq_thread = std::this_thread::get_id() == cq_th.get_id();
+    while (!cq_thread && inflight >= depth) {
+	if (sqpoll || (pending > 0 && !submitting))
+	    enter(lk);
+	if (inflight >= depth)
+	    room_cv.wait(lk);
+    }
+    while (*sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+	enter(lk);
+	lk.unlock();
+	std::this_thread::yield();
+	lk.lock();
+    }
+    inflight++;
+
+    unsigned tail = *sq_tail, idx = tail & *sq_mask;
+    io_uring_sqe *sqe = &sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_NOP;
+    if (r != NULL) {
+	sqe->opcode = (r->t == WRITE_REQ) ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = fixed_file ? 0 : fd;
+	sqe->flags = fixed_file ? IOSQE_FIXED_FILE : 0;
+	sqe->addr = (uint64_t)r->_iovs.data();
+	sqe->len = r->_iovs.size();
+	sqe->off = r->ofs;
+    }
+    sqe->user_data = (uint64_t)r;
+    sq_array[idx] = idx;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    pending++;
+}
+
+/* pass queued SQEs to the kernel. If another thread is already in
+ * io_uring_enter it'll pick ours up on its next pass.
+ */
+void nvme_uring::enter(std::unique_lock<std::mutex> &lk) {
+    if (sqpoll) {
+	pending = 0;
+	if (__atomic_load_n(sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP)
+	    uring_enter(ring_fd, 0, 0, IORING_ENTER_SQ_WAKEUP);
+	return;
+    }
+    if (submitting)
+	return;
+    submitting = true;
+    while (pending > 0) {
+	unsigned n = pending;
+	pending = 0;
+	lk.unlock();
+	int rv;
+	while ((rv = uring_enter(ring_fd, n, 0, 0)) < 0 && errno == EINTR)
+	    ;
+	if (rv < 0)
+	    throw("io_uring_enter");
+	n -= rv;
+	lk.lock();
+	pending += n;
+    }
+    submitting = false;
+}
+
+void nvme_uring::submit(uring_request *r) {
+    std::unique_lock lk(m);
+    queue(lk, r);
+    enter(lk);
+}
+
+void nvme_uring::submit_batch(std::vector<void*> &ios) {
+    std::unique_lock lk(m);
+    for (auto io : ios)
+	queue(lk, (uring_request*)io);
+    enter(lk);
+}
+
+void nvme_uring::completion_thread(const char *name) {
+    pthread_setname_np(pthread_self(), name);
+    for (;;) {
+	unsigned head = *cq_head;
+	unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+	if (head == tail) {
+	    uring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+	    continue;
+	}
+	bool done = false;
+	for (; head != tail; head++) {
+	    auto r = (uring_request*)cqes[head & *cq_mask].user_data;
+	    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+	    std::unique_lock lk(m);
+	    inflight--;
+	    room_cv.notify_one();
+	    lk.unlock();
+	    if (r == NULL)
+		done = true;
+	    else
+		r->notify(NULL);
+	}
+	if (done)
+	    return;
+    }
+}
+
+nvme *make_nvme_uring(int fd, const char *name, lsvd_config *cfg) {
+    auto nv = new nvme_uring(fd);
+    if (nv->setup(cfg->nvme_depth, cfg->nvme_sqpoll != 0) < 0) {
+	delete nv;
+	return NULL;
+    }
+    nv->cq_th = std::thread(&nvme_uring::completion_thread, nv, name);
+    return nv;
+}
+
+/* ------- uring_request implementation -------- */
+
+void uring_request::run(request *parent_) {
+    parent = parent_;
+    if (!io_batch_add(nvme_ptr, this))
+	nvme_ptr->submit(this);
+}
+
+void uring_request::notify(request *child) {
+    if (parent)
+	parent->notify(this);
+    if (state.add(1) & 2)
+	delete this;
+}
+
+void uring_request::wait() {
+    state.wait_until([](int x){return (x & 1) != 0;});
+}
+
+void uring_request::release() {
+    if (state.add(2) & 1)
+	delete this;
+}
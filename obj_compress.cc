@@ -0,0 +1,369 @@
+/*
+ * file:        obj_compress.cc
+ * description: compressed data objects - see obj_data_hdr
+ *
+ * author:      Peter Desnoyers, Northeastern University
+ * Copyright 2021, 2022 Peter Desnoyers
+ * license:     GNU LGPL v2.1 or newer
+ *              LGPL-2.1-or-later
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <uuid/uuid.h>
+#include <lz4.h>
+
+#include <vector>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+
+#include "lsvd_types.h"
+
+#include "smartiov.h"
+#include "request.h"
+#include "backend.h"
+#include "objects.h"
+#include "obj_compress.h"
+
+/* a chunk that won't shrink is stored as-is
+ */
+std::pair<char*,size_t> compress_chunks(smartiov &data, int chunk_sectors,
+					uint32_t *chunks) {
+    size_t len = data.bytes(), chunk = chunk_sectors * 512L;
+    size_t max = round_up(len, 512);
+    char *out = (char*)malloc(max);
+    char *tmp = NULL;
+    uint32_t pos = 0;
+    int i = 0;
+
+    for (size_t base = 0; base < len; base += chunk, i++) {
+	size_t ulen = std::min(chunk, len - base);
+	auto slice = data.slice(base, base + ulen);
+	char *src = (char*)slice[0].iov_base;
+	if (slice.size() > 1) {
+	    if (tmp == NULL)
+		tmp = (char*)malloc(chunk);
+	    slice.copy_out(tmp);
+	    src = tmp;
+	}
+	chunks[i] = pos;
+	int clen = LZ4_compress_default(src, out + pos, ulen, ulen - 1);
+	if (clen <= 0) {
+	    memcpy(out + pos, src, ulen);
+	    clen = ulen;
+	}
+	pos += clen;
+    }
+    chunks[i] = pos;
+    free(tmp);
+
+    size_t padded = round_up(pos, 512);
+    memset(out + pos, 0, padded - pos);
+    return std::make_pair(out, padded);
+}
+
+/* Chunk tables are kept for recently used objects: they come from
+ * the headers of objects we write, and from an extra header read
+ * the first time we see any other object. Everything else about the
+ * object format is left to the layers above.
+ */
+class compressed_backend : public backend {
+    backend *be;
+
+    struct table {
+	size_t hdr_bytes = 0;	// data starts here
+	size_t data_bytes = 0;	// uncompressed
+	size_t chunk = 0;	// bytes; 0 = not compressed
+	std::vector<uint32_t> chunks;
+    };
+    typedef std::shared_ptr<table> table_ptr;
+
+    std::mutex m;
+    std::list<std::pair<std::string,table_ptr>> lru; // most recent first
+    std::map<std::string,decltype(lru)::iterator> tables;
+    static const size_t max_tables = 4096;
+
+    friend class unzip_req;
+
+public:
+    /* NULL if the header isn't all there yet
+     */
+    static table_ptr parse(char *hdr, size_t len) {
+	auto h = (obj_hdr*)hdr;
+	auto t = std::make_shared<table>();
+	if (len < sizeof(obj_hdr) || h->magic != LSVD_MAGIC)
+	    return t;
+	if (len < h->hdr_sectors * 512L)
+	    return NULL;
+	t->hdr_bytes = h->hdr_sectors * 512L;
+	t->data_bytes = h->data_sectors * 512L;
+	uint32_t *c = obj_chunks(hdr);
+	if (c != NULL) {
+	    auto dh = (obj_data_hdr*)(h+1);
+	    t->chunk = dh->chunk_sectors * 512L;
+	    t->chunks.assign(c, c + dh->chunks_len / sizeof(uint32_t));
+	}
+	return t;
+    }
+
+    table_ptr lookup(const char *name) {
+	std::unique_lock lk(m);
+	auto it = tables.find(name);
+	if (it == tables.end())
+	    return NULL;
+	lru.splice(lru.begin(), lru, it->second);
+	return it->second->second;
+    }
+
+    void insert(const char *name, table_ptr t) {
+	std::unique_lock lk(m);
+	auto it = tables.find(name);
+	if (it != tables.end()) {
+	    lru.erase(it->second);
+	    tables.erase(it);
+	}
+	lru.push_front(std::make_pair(std::string(name), t));
+	tables[name] = lru.begin();
+	if (lru.size() > max_tables) {
+	    tables.erase(lru.back().first);
+	    lru.pop_back();
+	}
+    }
+
+    void forget(const char *name) {
+	std::unique_lock lk(m);
+	auto it = tables.find(name);
+	if (it != tables.end()) {
+	    lru.erase(it->second);
+	    tables.erase(it);
+	}
+    }
+
+    /* bytes [base,limit) of the stored object hold uncompressed
+     * [offset,offset+len)
+     */
+    static std::pair<size_t,size_t> phys_range(table_ptr t, size_t offset,
+					       size_t len) {
+	size_t base = offset, limit = offset + len;
+	if (t->chunk == 0 || limit <= t->hdr_bytes)
+	    return std::make_pair(base, limit);
+	size_t n = t->chunks.size() - 1;
+	size_t c0 = std::min(n-1, (std::max(offset, t->hdr_bytes) -
+				   t->hdr_bytes) / t->chunk);
+	size_t c1 = std::min(n-1, (limit - 1 - t->hdr_bytes) / t->chunk);
+	if (offset >= t->hdr_bytes)
+	    base = t->hdr_bytes + t->chunks[c0];
+	limit = t->hdr_bytes + t->chunks[c1+1];
+	return std::make_pair(base, limit);
+    }
+
+    /* 'buf' holds the stored bytes from phys_range; copy out the
+     * header part and decompress the chunks. Anything past the end
+     * of the object is left alone, like a short read.
+     */
+    static void unpack(table_ptr t, size_t offset, smartiov &iovs,
+		       char *buf, size_t base) {
+	size_t len = iovs.bytes(), limit = offset + len;
+	if (offset < t->hdr_bytes) {
+	    size_t _len = std::min(limit, t->hdr_bytes) - offset;
+	    iovs.slice(0, _len).copy_in(buf);
+	}
+	if (limit <= t->hdr_bytes)
+	    return;
+
+	size_t start = std::max(offset, t->hdr_bytes) - t->hdr_bytes;
+	size_t end = std::min(limit - t->hdr_bytes, t->data_bytes);
+	char *tmp = (char*)malloc(t->chunk);
+	for (size_t c = start / t->chunk; c * t->chunk < end; c++) {
+	    size_t u0 = c * t->chunk;
+	    size_t ulen = std::min(t->chunk, t->data_bytes - u0);
+	    char *src = buf + (t->hdr_bytes + t->chunks[c] - base);
+	    int clen = t->chunks[c+1] - t->chunks[c];
+	    char *data = src;
+	    if ((size_t)clen != ulen) {
+		if (LZ4_decompress_safe(src, tmp, clen, ulen) != (int)ulen)
+		    throw("corrupt compressed object");
+		data = tmp;
+	    }
+	    size_t a = std::max(u0, start), b = std::min(u0 + ulen, end);
+	    size_t iov_off = t->hdr_bytes + a - offset;
+	    iovs.slice(iov_off, iov_off + (b - a)).copy_in(data + (a - u0));
+	}
+	free(tmp);
+    }
+
+    table_ptr read_table(const char *name) {
+	size_t len = 4096;
+	char *hdr = (char*)malloc(len);
+	for (;;) {
+	    iovec iov = {hdr, len};
+	    if (be->read_object(name, &iov, 1, 0) < 0) {
+		free(hdr);
+		return NULL;
+	    }
+	    auto t = parse(hdr, len);
+	    if (t != NULL) {
+		free(hdr);
+		if (t->hdr_bytes > 0)
+		    insert(name, t);
+		return t;
+	    }
+	    len = ((obj_hdr*)hdr)->hdr_sectors * 512L;
+	    hdr = (char*)realloc(hdr, len);
+	}
+    }
+
+    void note_write(const char *name, iovec *iov) {
+	auto t = parse((char*)iov[0].iov_base, iov[0].iov_len);
+	if (t != NULL && t->hdr_bytes > 0)
+	    insert(name, t);
+	else
+	    forget(name);
+    }
+
+    compressed_backend(backend *be_) : be(be_) {}
+    ~compressed_backend() {
+	delete be;
+    }
+
+    int write_object(const char *name, iovec *iov, int iovcnt) {
+	note_write(name, iov);
+	return be->write_object(name, iov, iovcnt);
+    }
+
+    int read_object(const char *name, iovec *iov, int iovcnt,
+		    size_t offset) {
+	auto t = lookup(name);
+	if (t == NULL && (t = read_table(name)) == NULL)
+	    return -1;
+	if (t->chunk == 0)
+	    return be->read_object(name, iov, iovcnt, offset);
+
+	smartiov iovs(iov, iovcnt);
+	auto [base, limit] = phys_range(t, offset, iovs.bytes());
+	char *buf = (char*)malloc(limit - base);
+	iovec _iov = {buf, limit - base};
+	int r = be->read_object(name, &_iov, 1, base);
+	if (r >= 0) {
+	    unpack(t, offset, iovs, buf, base);
+	    r = iovs.bytes();
+	}
+	free(buf);
+	return r;
+    }
+
+    int delete_object(const char *name) {
+	forget(name);
+	return be->delete_object(name);
+    }
+
+    request *make_write_req(const char *name, iovec *iov, int iovcnt) {
+	note_write(name, iov);
+	return be->make_write_req(name, iov, iovcnt);
+    }
+    request *make_read_req(const char *name, size_t offset,
+			   iovec *iov, int iovcnt);
+    request *make_read_req(const char *name, size_t offset,
+			   char *buf, size_t len) {
+	iovec iov = {buf, len};
+	return make_read_req(name, offset, &iov, 1);
+    }
+};
+
+/* async read of a compressed object: header first if we don't have
+ * its chunk table, then the stored bytes, then decompress.
+ */
+class unzip_req : public request {
+    compressed_backend *cb;
+    std::string name;
+    size_t offset;
+    smartiov iovs;
+    compressed_backend::table_ptr t;
+    request *parent = NULL;
+    char *hdr = NULL;
+    size_t hdr_len = 0;
+    char *buf = NULL;
+    size_t base = 0;
+    bool _failed = false;
+
+    void read_hdr(void) {
+	hdr = (char*)realloc(hdr, hdr_len);
+	auto req = cb->be->make_read_req(name.c_str(), 0, hdr, hdr_len);
+	req->run(this);
+    }
+    void read_data(void) {
+	auto [_base, limit] = cb->phys_range(t, offset, iovs.bytes());
+	base = _base;
+	buf = (char*)malloc(limit - base);
+	auto req = cb->be->make_read_req(name.c_str(), base, buf, limit - base);
+	req->run(this);
+    }
+
+public:
+    unzip_req(compressed_backend *cb_, const char *name_, size_t offset_,
+	      iovec *iov, int iovcnt, compressed_backend::table_ptr t_) :
+	cb(cb_), name(name_), offset(offset_), iovs(iov, iovcnt), t(t_) {}
+    ~unzip_req() {
+	free(hdr);
+	free(buf);
+    }
+
+    void run(request *parent_) {
+	parent = parent_;
+	if (t == NULL) {
+	    hdr_len = 4096;
+	    read_hdr();
+	}
+	else
+	    read_data();
+    }
+
+    void notify(request *child) {
+	if (child && child->failed())
+	    _failed = true;
+	if (child)
+	    child->release();
+	if (_failed) {
+	    parent->notify(this);
+	    delete this;
+	    return;
+	}
+	if (buf == NULL) {
+	    t = cb->parse(hdr, hdr_len);
+	    if (t == NULL) {	// header is longer than 4KB
+		hdr_len = ((obj_hdr*)hdr)->hdr_sectors * 512L;
+		read_hdr();
+		return;
+	    }
+	    if (t->hdr_bytes > 0)	// not a missing object
+		cb->insert(name.c_str(), t);
+	    read_data();
+	    return;
+	}
+	if (t->chunk == 0)
+	    iovs.copy_in(buf + (offset - base));
+	else
+	    cb->unpack(t, offset, iovs, buf, base);
+	parent->notify(this);
+	delete this;
+    }
+
+    void wait() {}
+    void release() {}
+    bool failed() { return _failed; }
+};
+
+request *compressed_backend::make_read_req(const char *name, size_t offset,
+					   iovec *iov, int iovcnt) {
+    auto t = lookup(name);
+    if (t != NULL && t->chunk == 0)
+	return be->make_read_req(name, offset, iov, iovcnt);
+    return new unzip_req(this, name, offset, iov, iovcnt, t);
+}
+
+backend *make_compressed_backend(backend *be) {
+    return new compressed_backend(be);
+}
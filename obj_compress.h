@@ -0,0 +1,32 @@
+/*
+ * file:        obj_compress.h
+ * description: compressed data objects - see obj_data_hdr
+ *
+ * author:      Peter Desnoyers, Northeastern University
+ * Copyright 2021, 2022 Peter Desnoyers
+ * license:     GNU LGPL v2.1 or newer
+ *              LGPL-2.1-or-later
+ */
+
+#ifndef OBJ_COMPRESS_H
+#define OBJ_COMPRESS_H
+
+#include <stdint.h>
+#include <utility>
+
+class backend;
+class smartiov;
+
+/* compress 'data' one chunk of 'chunk_sectors' at a time into a new
+ * buffer, filling in the n+1 entry chunk table 'chunks'. Returns
+ * the buffer (caller frees) and its length, padded to a sector.
+ */
+extern std::pair<char*,size_t> compress_chunks(smartiov &data,
+                                               int chunk_sectors,
+                                               uint32_t *chunks);
+
+/* reads from 'be' return uncompressed data, at uncompressed offsets
+ */
+extern backend *make_compressed_backend(backend *be);
+
+#endif
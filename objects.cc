@@ -13,6 +13,7 @@
 #include "lsvd_types.h"
 #include "backend.h"
 #include "objects.h"
+#include "crc32c.h"
 
 char *object_reader::read_object_hdr(const char *name, bool fast) {
     obj_hdr *h = (obj_hdr*)malloc(4096);
@@ -75,6 +76,32 @@ object_reader::read_super(const char *name, std::vector<uint32_t> &ckpts,
     return std::make_pair(super_buf,super_sh->vol_size * 512);
 }
 
+/* decode a data object header, false if it isn't one (or fails
+ * its CRC)
+ */
+static bool decode_data_hdr(char *buf, data_hdr_info &d) {
+    auto tmp_h = (obj_hdr*)buf;
+    auto tmp_dh = (obj_data_hdr*)(tmp_h+1);
+    if (tmp_h->type != LSVD_DATA || !obj_hdr_check(buf))
+	return false;
+
+    d.h = *tmp_h;
+    d.dh = *tmp_dh;
+
+    decode_offset_len<uint32_t>(buf, tmp_dh->ckpts_offset,
+				tmp_dh->ckpts_len, d.ckpts);
+    decode_offset_len<obj_cleaned>(buf, tmp_dh->objs_cleaned_offset,
+				   tmp_dh->objs_cleaned_len, d.cleaned);
+    decode_offset_len<data_map>(buf, tmp_dh->data_map_offset,
+				tmp_dh->data_map_len, d.dmap);
+    decode_offset_len<data_map>(buf, tmp_dh->trims_offset,
+				tmp_dh->trims_len, d.trims);
+    if (tmp_h->version >= 2)
+	decode_offset_len<uint32_t>(buf, tmp_dh->chunks_offset,
+				    tmp_dh->chunks_len, d.chunks);
+    return true;
+}
+
 /* read and decode the header of an object. Copies into arguments,
  * frees all allocated memory
  */
@@ -82,29 +109,94 @@ ssize_t object_reader::read_data_hdr(const char *name, obj_hdr &h,
 				     obj_data_hdr &dh,
 				     std::vector<uint32_t> &ckpts,
 				     std::vector<obj_cleaned> &cleaned,
-				     std::vector<data_map> &dmap) {
+				     std::vector<data_map> &dmap,
+				     std::vector<data_map> *trims,
+				     std::vector<uint32_t> *chunks) {
     char *buf = read_object_hdr(name, false);
     if (buf == NULL)
 	return -1;
-    auto tmp_h = (obj_hdr*)buf;
-    auto tmp_dh = (obj_data_hdr*)(tmp_h+1);
-    if (tmp_h->type != LSVD_DATA) {
-	free(buf);
+    data_hdr_info d;
+    bool ok = decode_data_hdr(buf, d);
+    free(buf);
+    if (!ok)
 	return -1;
+
+    h = d.h;
+    dh = d.dh;
+    ckpts = std::move(d.ckpts);
+    cleaned = std::move(d.cleaned);
+    dmap = std::move(d.dmap);
+    if (trims != NULL)
+	*trims = std::move(d.trims);
+    if (chunks != NULL)
+	*chunks = std::move(d.chunks);
+    return 0;
+}
+
+/* caller doesn't hold the lock. Replaces any existing entry
+ */
+void object_reader::cache_add(int seq, hdr_ptr p) {
+    std::unique_lock lk(m);
+    auto it = cache.find(seq);
+    if (it != cache.end()) {
+	cache_bytes -= it->second.first->bytes();
+	lru.erase(it->second.second);
+	cache.erase(it);
     }
+    lru.push_front(seq);
+    cache[seq] = std::make_pair(p, lru.begin());
+    cache_bytes += p->bytes();
 
-    h = *tmp_h;
-    dh = *tmp_dh;
+    while (cache_bytes > cache_max && lru.size() > 0) {
+	auto victim = cache.find(lru.back());
+	cache_bytes -= victim->second.first->bytes();
+	cache.erase(victim);
+	lru.pop_back();
+    }
+}
 
-    decode_offset_len<uint32_t>(buf, tmp_dh->ckpts_offset,
-				tmp_dh->ckpts_len, ckpts);
-    decode_offset_len<obj_cleaned>(buf, tmp_dh->objs_cleaned_offset,
-				   tmp_dh->objs_cleaned_len, cleaned);
-    decode_offset_len<data_map>(buf, tmp_dh->data_map_offset,
-				tmp_dh->data_map_len, dmap);
+object_reader::hdr_ptr object_reader::cached_data_hdr(int seq) {
+    std::unique_lock lk(m);
+    auto it = cache.find(seq);
+    if (it == cache.end())
+	return NULL;
+    lru.splice(lru.begin(), lru, it->second.second);
+    return it->second.first;
+}
 
+object_reader::hdr_ptr object_reader::data_hdr(int seq, const char *name) {
+    auto p = cached_data_hdr(seq);
+    if (p != NULL)
+	return p;
+    char *buf = read_object_hdr(name, false);
+    if (buf == NULL)
+	return NULL;
+    auto d = std::make_shared<data_hdr_info>();
+    bool ok = decode_data_hdr(buf, *d);
     free(buf);
-    return 0;
+    if (!ok)
+	return NULL;
+    if (cache_max > 0)
+	cache_add(seq, d);
+    return d;
+}
+
+void object_reader::add_data_hdr(int seq, char *hdr) {
+    if (cache_max == 0)
+	return;
+    auto d = std::make_shared<data_hdr_info>();
+    if (decode_data_hdr(hdr, *d))
+	cache_add(seq, d);
+}
+
+void object_reader::forget(int seq) {
+    std::unique_lock lk(m);
+    auto it = cache.find(seq);
+    if (it == cache.end())
+	return;
+    cache_bytes -= it->second.first->bytes();
+    lru.erase(it->second.second);
+    cache.erase(it);
 }
 
 /* read and decode a checkpoint object identified by sequence number
@@ -136,32 +228,75 @@ ssize_t object_reader::read_checkpoint(const char *name,
 }
 
 /* How many bytes will we need for an object header if we 
- * have @n_entries extent entries. 
+ * have @n_entries extent entries and @n_trims discarded extents.
  * list of checkpoints = [] if ckpt == 0, else [ckpt]
+ * @n_chunks: compressed data chunks, 0 if not compressed
  */
-size_t obj_hdr_len(int n_entries, int ckpt) {
+size_t obj_hdr_len(int n_entries, int ckpt, int n_trims, int n_chunks) {
     return sizeof(obj_hdr) +
 	sizeof(obj_data_hdr) +
-	n_entries * sizeof(data_map) +
-	((ckpt == 0) ? 0 : sizeof(int));
+	(n_entries + n_trims) * sizeof(data_map) +
+	((ckpt == 0) ? 0 : sizeof(int)) +
+	((n_chunks == 0) ? 0 : (n_chunks + 1) * sizeof(uint32_t));
+}
+
+uint32_t *obj_chunks(char *hdr) {
+    auto h = (obj_hdr*)hdr;
+    auto dh = (obj_data_hdr*)(h+1);
+    if (h->type != LSVD_DATA || h->version < 2)
+	return NULL;
+    return (uint32_t*)(hdr + dh->chunks_offset);
+}
+
+/* headers written before hdr_crc was added end before it, which
+ * we can tell from where the ckpts list starts
+ */
+static bool has_hdr_crc(obj_hdr *h, obj_data_hdr *dh) {
+    return h->type == LSVD_DATA &&
+	dh->ckpts_offset >= sizeof(obj_hdr) + sizeof(obj_data_hdr);
+}
+
+void obj_hdr_seal(char *hdr) {
+    auto h = (obj_hdr*)hdr;
+    auto dh = (obj_data_hdr*)(h+1);
+    dh->hdr_crc = 0;
+    dh->hdr_crc = crc32c(0, hdr, h->hdr_sectors * 512L);
+}
+
+bool obj_hdr_check(char *hdr) {
+    auto h = (obj_hdr*)hdr;
+    auto dh = (obj_data_hdr*)(h+1);
+    if (!has_hdr_crc(h, dh) || dh->hdr_crc == 0)
+	return true;
+    uint32_t crc = dh->hdr_crc;
+    dh->hdr_crc = 0;
+    uint32_t _crc = crc32c(0, hdr, h->hdr_sectors * 512L);
+    dh->hdr_crc = crc;
+    return crc == _crc;
 }
 
 /* create header for a data object, returns size in bytes
  * unfortunately we need the length earlier in the code, so
  * we duplicate some of this logic in obj_hdr_len()
+ * With n_chunks > 0 it's a compressed object, and the caller fills
+ * in the chunk table (obj_chunks) once the data is compressed.
  */
 size_t make_data_hdr(char *hdr, size_t bytes, uint32_t last_ckpt,
 		     std::vector<data_map> *entries, uint32_t seq,
-		     uuid_t *uuid) {
+		     uuid_t *uuid, std::vector<data_map> *trims,
+		     int n_chunks, int chunk_sectors) {
     auto h = (obj_hdr*)hdr;
     auto dh = (obj_data_hdr*)(h+1);
     uint32_t o1 = sizeof(*h) + sizeof(*dh),
 	l1 = (last_ckpt == 0) ? 0 : sizeof(uint32_t),
 	o2 = o1 + l1, l2 = entries->size() * sizeof(data_map),
-	hdr_bytes = o2 + l2;
+	o3 = o2 + l2, l3 = (trims == NULL) ? 0 : trims->size() * sizeof(data_map),
+	o4 = o3 + l3, l4 = (n_chunks == 0) ? 0 : (n_chunks+1) * sizeof(uint32_t),
+	hdr_bytes = o4 + l4;
     uint32_t hdr_sectors = div_round_up(hdr_bytes, 512);
 
-    *h = (obj_hdr){.magic = LSVD_MAGIC, .version = 1, .vol_uuid = {0},
+    *h = (obj_hdr){.magic = LSVD_MAGIC, .version = (n_chunks ? 2u : 1u),
+		   .vol_uuid = {0},
 		   .type = LSVD_DATA, .seq = seq,
 		   .hdr_sectors = hdr_sectors,
 		   .data_sectors = (uint32_t)(bytes / 512)};
@@ -170,7 +305,9 @@ size_t make_data_hdr(char *hdr, size_t bytes, uint32_t last_ckpt,
     *dh = (obj_data_hdr){.last_data_obj = seq, .ckpts_offset = o1,
 			 .ckpts_len = l1, .objs_cleaned_offset = 0, .
 			 objs_cleaned_len = 0, .data_map_offset = o2,
-			 .data_map_len = l2};
+			 .data_map_len = l2, .trims_offset = (l3 ? o3 : 0),
+			 .trims_len = l3, .chunk_sectors = (uint32_t)chunk_sectors,
+			 .chunks_offset = (l4 ? o4 : 0), .chunks_len = l4};
 
     auto dm = (data_map*)(dh+1);
     if (l1 != 0) {
@@ -181,6 +318,10 @@ size_t make_data_hdr(char *hdr, size_t bytes, uint32_t last_ckpt,
 
     for (auto e : *entries)
 	*dm++ = e;
+    if (trims != NULL)
+	for (auto t : *trims)
+	    *dm++ = t;
+    memset((char*)dm, 0, l4);
 
-    return (char*)dm - (char*)hdr;
+    return (char*)dm - (char*)hdr + l4;
 }
@@ -15,6 +15,10 @@
 #include <stdlib.h>
 #include <vector>
 #include <tuple>
+#include <list>
+#include <map>
+#include <mutex>
+#include <memory>
 #include <cassert>
 #include <uuid/uuid.h>
 
@@ -28,7 +32,8 @@
 enum obj_type {
     LSVD_SUPER = 1,
     LSVD_DATA = 2,
-    LSVD_CKPT = 3
+    LSVD_CKPT = 3,
+    LSVD_HOT = 4		// read cache hot set, see obj_hot_hdr
 };
 
 // hdr :	header structure used to contain data for separate objects in translation and write cache layers
@@ -63,7 +68,11 @@ struct super_hdr {
 
 /* ckpts: list of active checkpoints: array of uint32_t */
 
-/* variable-length structure */
+/* clones: the chain of base images, oldest first. Objects up to
+ * 'sequence' (a full checkpoint in 'name', see snap_info) belong to
+ * that image; the clone's own objects start after the last one.
+ * variable-length structure
+ */
 struct clone_info {
     uuid_t   vol_uuid;
     uint32_t sequence;
@@ -71,9 +80,13 @@ struct clone_info {
     char     name[0];
 } __attribute__((packed));
 
+/* snapshots: 'seq' is a full checkpoint. It and every object before
+ * it are kept (no GC) until the snapshot is removed.
+ */
 struct snap_info {
     uuid_t   snap_uuid;
     uint32_t seq;
+    char     name[32];		// null-terminated
 };
 
 
@@ -85,6 +98,35 @@ struct obj_data_hdr {
     uint32_t objs_cleaned_len;
     uint32_t data_map_offset;
     uint32_t data_map_len;
+    uint32_t trims_offset;	// discarded extents: array of data_map,
+    uint32_t trims_len;		//  applied after data_map
+    uint32_t chunk_sectors;	// compressed objects (obj_hdr.version 2),
+    uint32_t chunks_offset;	//  see below
+    uint32_t chunks_len;
+    uint32_t hdr_crc;		// CRC32C of the header with this = 0;
+};				//  0 if not checksummed (backend_crc)
+
+/* A compressed data object has the same header, but its data is cut
+ * into chunks of chunk_sectors (the last may be short) compressed
+ * one at a time. chunks is uint32_t[n+1]: chunk i is stored at bytes
+ * [c[i],c[i+1]) past the header, and one stored at full size isn't
+ * compressed. Object offsets (obj_offset, data_sectors) are always
+ * uncompressed ones.
+ */
+
+/* read cache hot set, '<image>.hot' (read_cache::save_hot). It's all
+ * header - hdr_sectors covers the object, data_sectors is 0, seq 0.
+ * Units are obj_offset units of unit_sectors, hottest first.
+ */
+struct obj_hot_hdr {
+    uint32_t unit_sectors;
+    uint32_t units_offset;	// array of hot_unit
+    uint32_t units_len;
+};
+
+struct hot_unit {
+    uint32_t seq;
+    uint32_t unit;		// object offset / unit_sectors
 };
 
 struct obj_cleaned {
@@ -131,11 +173,43 @@ struct ckpt_mapentry {
 
 class backend;
 
+/* a decoded data object header, as kept in the header cache
+ */
+struct data_hdr_info {
+    obj_hdr                  h;
+    obj_data_hdr             dh;
+    std::vector<uint32_t>    ckpts;
+    std::vector<obj_cleaned> cleaned;
+    std::vector<data_map>    dmap;
+    std::vector<data_map>    trims;
+    std::vector<uint32_t>    chunks;
+    size_t bytes(void) const {
+	return sizeof(*this) + ckpts.size() * sizeof(uint32_t) +
+	    cleaned.size() * sizeof(obj_cleaned) +
+	    (dmap.size() + trims.size()) * sizeof(data_map) +
+	    chunks.size() * sizeof(uint32_t);
+    }
+};
+
 class object_reader {
     backend *objstore;
 
+    /* data object headers by sequence number, LRU, up to
+     * cache_max bytes. Objects are never rewritten, so entries only
+     * go away when the object is deleted (forget) or by eviction.
+     */
+    typedef std::shared_ptr<const data_hdr_info> hdr_ptr;
+    std::mutex m;
+    std::list<int> lru;		// most recent at front
+    std::map<int,std::pair<hdr_ptr,std::list<int>::iterator>> cache;
+    size_t cache_bytes = 0;
+    size_t cache_max;
+
+    void cache_add(int seq, hdr_ptr p);
+
 public:
-    object_reader(backend *be) : objstore(be) {}
+    object_reader(backend *be, size_t cache_max_ = 0) :
+	objstore(be), cache_max(cache_max_) {}
 
     char *read_object_hdr(const char *name, bool fast);
 
@@ -148,19 +222,51 @@ public:
     ssize_t read_data_hdr(const char *name, obj_hdr &h, obj_data_hdr &dh,
 			  std::vector<uint32_t> &ckpts,
 			  std::vector<obj_cleaned> &cleaned,
-			  std::vector<data_map> &dmap);
+			  std::vector<data_map> &dmap,
+			  std::vector<data_map> *trims = NULL,
+			  std::vector<uint32_t> *chunks = NULL);
 
     ssize_t read_checkpoint(const char *name,
 			    std::vector<uint32_t> &ckpts,
 			    std::vector<ckpt_obj> &objects, 
 			    std::vector<deferred_delete> &deletes,
 			    std::vector<ckpt_mapentry> &dmap);
+
+    /* header of data object 'seq', from the cache or else read from
+     * 'name' and cached. NULL if missing, not a data object or bad.
+     */
+    hdr_ptr data_hdr(int seq, const char *name);
+
+    /* cache only - no backend I/O. NULL on a miss
+     */
+    hdr_ptr cached_data_hdr(int seq);
+
+    /* a header we just wrote - saves reading it back later
+     */
+    void add_data_hdr(int seq, char *hdr);
+
+    /* the object's been deleted
+     */
+    void forget(int seq);
 };
 
-extern size_t obj_hdr_len(int n_entries, int ckpt);
+extern size_t obj_hdr_len(int n_entries, int ckpt, int n_trims = 0,
+                          int n_chunks = 0);
 
 extern size_t make_data_hdr(char *hdr, size_t bytes, uint32_t last_ckpt, 
                             std::vector<data_map> *entries, uint32_t seq,
-                            uuid_t *uuid);
+                            uuid_t *uuid, std::vector<data_map> *trims = NULL,
+                            int n_chunks = 0, int chunk_sectors = 0);
+
+/* chunk table of a compressed object's header, NULL if it isn't one
+ */
+extern uint32_t *obj_chunks(char *hdr);
+
+/* header CRC (obj_data_hdr.hdr_crc): set it once the header is
+ * complete; check returns false only for a checksummed header that
+ * doesn't match.
+ */
+extern void obj_hdr_seal(char *hdr);
+extern bool obj_hdr_check(char *hdr);
 
 #endif
@@ -23,6 +23,20 @@ public:
         memcpy(buf, prefix, len);
         sprintf(buf + len, ".%08x", seq);
     }
+    void init(const char *name) {
+        size_t len = strlen(name);
+        assert(len < sizeof(buf));
+        memcpy(buf, name, len+1);
+    }
+    /* sub-object 'i' (> 0) of striped object 'name', see
+     * backend_stripe.cc; sub-object 0 is the object itself
+     */
+    void init_stripe(const char *name, int i) {
+        size_t len = strlen(name);
+        assert(len + 4 < sizeof(buf));
+        memcpy(buf, name, len);
+        sprintf(buf + len, ".%d", i);
+    }
     const char *c_str() {
         return buf;
     }
@@ -85,8 +85,16 @@ if h.type == lsvd.LSVD_SUPER:
     if sh.ckpts_offset > sh.ckpts_len:
         ckpts = read_ckpts(bytearray(obj), sh.ckpts_offset, sh.ckpts_len)
         print('ckpts:         ', ','.join(map(lambda x: '%08x' % x, ckpts)))
-    print('clones:        ', '[tbd]')
-    print('snaps:         ', '[tbd]')
+    o = sh.clones_offset
+    while o < sh.clones_offset + sh.clones_len:
+        c = lsvd.clone.from_buffer(bytearray(obj[o:o+lsvd.sizeof_clone]))
+        name = obj[o+lsvd.sizeof_clone:o+lsvd.sizeof_clone+c.name_len]
+        print('clone of:      ', '%s (%08x)' % (name.decode(), c.sequence))
+        o += lsvd.sizeof_clone + c.name_len
+    for i in range(sh.snaps_len // lsvd.sizeof_snap):
+        o = sh.snaps_offset + i*lsvd.sizeof_snap
+        sn = lsvd.snap.from_buffer(bytearray(obj[o:o+lsvd.sizeof_snap]))
+        print('snap:          ', '%s (%08x)' % (sn.name.decode(), sn.seq))
     
 elif h.type == lsvd.LSVD_DATA:
     o3 = o2+lsvd.sizeof_data_hdr
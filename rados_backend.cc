@@ -22,6 +22,7 @@
 #include "smartiov.h"
 #include "extent.h"
 #include "request.h"
+#include "mempool.h"
 #include "backend.h"
 #include "rados_backend.h"
 
@@ -99,30 +100,58 @@ char* rados_backend::pool_init(const char *pool_) {
     return (char*)pool_ + pool_len + 1;
 }
 
+/* librados has no iovec calls, but a compound op can carry one
+ * write (or read) extent per iovec, so multi-buffer I/O goes to
+ * RADOS without flattening it into a bounce buffer first.
+ */
+static rados_write_op_t mk_write_op(smartiov &iovs) {
+    auto op = rados_create_write_op();
+    uint64_t offset = 0;
+    for (int i = 0; i < iovs.size(); i++) {
+	rados_write_op_write(op, (char*)iovs[i].iov_base,
+			     iovs[i].iov_len, offset);
+	offset += iovs[i].iov_len;
+    }
+    return op;
+}
+
+static rados_read_op_t mk_read_op(smartiov &iovs, size_t offset,
+				  size_t *lens, int *rvals) {
+    auto op = rados_create_read_op();
+    for (int i = 0; i < iovs.size(); i++) {
+	rados_read_op_read(op, offset, iovs[i].iov_len,
+			   (char*)iovs[i].iov_base, &lens[i], &rvals[i]);
+	offset += iovs[i].iov_len;
+    }
+    return op;
+}
+
 int rados_backend::write_object(const char *name, iovec *iov, int iovcnt) {
     auto oname = pool_init(name);
-    assert(*((int*)iov[0].iov_base) == LSVD_MAGIC);
-    smartiov iovs(iov, iovcnt);
-    char *buf = (char*)malloc(iovs.bytes());
-    iovs.copy_out(buf);
-
-    int r = rados_write(io_ctx, oname, buf, iovs.bytes(), 0);
+    if (iovcnt == 1)
+	return rados_write(io_ctx, oname, (char*)iov[0].iov_base,
+			   iov[0].iov_len, 0);
 
-    free(buf);
+    smartiov iovs(iov, iovcnt);
+    auto op = mk_write_op(iovs);
+    int r = rados_write_op_operate(op, io_ctx, oname, NULL, 0);
+    rados_release_write_op(op);
     return r;
 }
 
 int rados_backend::read_object(const char *name, iovec *iov,
 				   int iovcnt, size_t offset) {
     auto oname = pool_init(name);
-    
-    smartiov iovs(iov, iovcnt);
-    char *buf = (char*)malloc(iovs.bytes());
-
-    int r = rados_read(io_ctx, oname, buf, iovs.bytes(), offset);
+    if (iovcnt == 1)
+	return rados_read(io_ctx, oname, (char*)iov[0].iov_base,
+			  iov[0].iov_len, offset);
 
-    iovs.copy_in(buf);
-    free(buf);
+    smartiov iovs(iov, iovcnt);
+    std::vector<size_t> lens(iovcnt);
+    std::vector<int> rvals(iovcnt);
+    auto op = mk_read_op(iovs, offset, lens.data(), rvals.data());
+    int r = rados_read_op_operate(op, io_ctx, oname, 0);
+    rados_release_read_op(op);
     return r;
 }
 
@@ -131,14 +160,18 @@ int rados_backend::delete_object(const char *name) {
     return rados_remove(io_ctx, oname);
 }
 
-class rados_be_request : public request {
+class rados_be_request : public request,
+			 public pooled<rados_be_request> {
     smartiov       _iovs;
-    char          *buf = NULL;
     request       *parent = NULL;
     char          *oid = NULL;
     size_t         offset = 0;
     rados_ioctx_t  io_ctx;
     rados_completion_t c;
+    rados_write_op_t w_op = NULL;
+    rados_read_op_t  r_op = NULL;
+    std::vector<size_t> lens;	// per-iovec read results
+    std::vector<int>    rvals;
 
 public:
     enum lsvd_op   op;
@@ -154,11 +187,11 @@ public:
     ~rados_be_request() {}
 
     void notify(request *unused) {
-	if (op == OP_READ && buf != NULL)
-	    _iovs.copy_in(buf);
 	parent->notify(this);
-	if (buf != NULL)
-	    free(buf);
+	if (w_op != NULL)
+	    rados_release_write_op(w_op);
+	if (r_op != NULL)
+	    rados_release_read_op(r_op);
 	rados_aio_release(c);
 	delete this;
     }
@@ -171,31 +204,39 @@ public:
     void run(request *parent_) {
 	parent = parent_;
 	assert(op == OP_READ || op == OP_WRITE);
-	
-	/* damn C interface doesn't handle iovecs
-	 */
-	char *_buf = (char*)_iovs.data()->iov_base;
-	if (_iovs.size() > 1) {
-	    _buf = buf = (char*)malloc(_iovs.bytes());
-	    if (op == OP_WRITE)
-		_iovs.copy_out(buf);
-	}
-
 	rados_aio_create_completion(this, rados_be_notify, NULL, &c);
-	if (op == OP_READ)
-	    rados_aio_read(io_ctx, oid, c, _buf, _iovs.bytes(), offset);
-	else
-	    rados_aio_write(io_ctx, oid, c, _buf, _iovs.bytes(), offset);
+
+	if (_iovs.size() == 1) {
+	    char *_buf = (char*)_iovs[0].iov_base;
+	    size_t len = _iovs[0].iov_len;
+	    if (op == OP_READ)
+		rados_aio_read(io_ctx, oid, c, _buf, len, offset);
+	    else
+		rados_aio_write(io_ctx, oid, c, _buf, len, offset);
+	}
+	else if (op == OP_READ) {
+	    lens.resize(_iovs.size());
+	    rvals.resize(_iovs.size());
+	    r_op = mk_read_op(_iovs, offset, lens.data(), rvals.data());
+	    rados_aio_read_op_operate(r_op, io_ctx, c, oid, 0);
+	}
+	else {
+	    assert(offset == 0);
+	    w_op = mk_write_op(_iovs);
+	    rados_aio_write_op_operate(w_op, io_ctx, c, oid, NULL, 0);
+	}
     }
 
     void release() {}
     void wait() {}
+    bool failed() {
+	return rados_aio_get_return_value(c) < 0;
+    }
 };
 
 request *rados_backend::make_write_req(const char *name, iovec *iov,
 				       int iovcnt) {
     auto oid = pool_init(name);
-    assert(*((int*)iov[0].iov_base) == LSVD_MAGIC);
     return new rados_be_request(OP_WRITE, oid, iov, iovcnt, 0, io_ctx);
 }
 
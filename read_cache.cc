@@ -14,6 +14,7 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include <shared_mutex>
 #include <mutex>
@@ -25,9 +26,9 @@
 #include <queue>
 #include <map>
 #include <stack>
+#include <set>
 #include <vector>
 
-#include <random>
 #include <algorithm>		// std::min
 
 #include "lsvd_types.h"
@@ -38,18 +39,23 @@
 #include "misc_cache.h"
 
 #include "request.h"
+#include "mempool.h"
 #include "journal.h"
 #include "config.h"
 #include "translate.h"
 #include "nvme.h"
+#include "objects.h"
 
 #include "read_cache.h"
 #include "objname.h"
+#include "metrics.h"
 
 #if 0
 #include "io.h"
 #endif
 
+class rcache_req;
+
 class read_cache_impl : public read_cache {
     
     std::mutex m;
@@ -59,11 +65,12 @@ class read_cache_impl : public read_cache {
     extmap::obj_offset *flat_map;
 
     extmap::objmap     *obj_map;
-    std::shared_mutex  *obj_lock;
+    sharded_rwlock     *obj_lock;
     
     translate          *be;
     backend            *io;
     nvme               *ssd;
+    int                 fd;
     
     friend class rcache_req;
     
@@ -71,6 +78,14 @@ class read_cache_impl : public read_cache {
     std::vector<int>  free_blks;
     bool              map_dirty = false;
 
+    /* see set_base, set_shared
+     */
+    read_cache_impl  *base_rc = NULL;
+    int               base_seq = 0;
+    bool              shared = false;
+    bool              filler = false;
+    void reload_map(std::unique_lock<std::mutex> &lk);
+
 
     // new idea for hit rate - require that sum(backend reads) is no
     // more than 2 * sum(read sectors) (or 3x?), using 64bit counters 
@@ -85,44 +100,119 @@ class read_cache_impl : public read_cache {
 
     /* if map[obj,offset] = n:
      *   in_use[n] - not eligible for eviction
-     *   written[n] - safe to read from cache
+     *   valid[n] - bitmap of 4KB pages that are safe to read from SSD
      *   buffer[n] - in-memory data for block n
-     *   pending[n] - continuations to invoke when buffer[n] becomes valid
+     *   buf_valid[n] - pages of buffer[n] holding valid data
+     *   filling[n] - pages being read from backend (at most one fill)
+     *   pending[n] - continuations to invoke when the fill arrives
      * buf_loc - FIFO queue of {n | buffer[n] != NULL}
      */
     sized_vector<std::atomic<int>>   in_use;
-    sized_vector<char>               written; // can't use vector<bool> here
+    sized_vector<uint64_t>           valid;
     sized_vector<char*>              buffer;
+    sized_vector<uint64_t>           buf_valid;
+    sized_vector<uint64_t>           filling;
     sized_vector<std::vector<request*>> pending;
     std::queue<int>    buf_loc;
+
+    uint64_t page_mask(sector_t base, sector_t limit) {
+	int lo = base / 8, hi = div_round_up(limit, 8);
+	uint64_t top = (hi == 64) ? ~0UL : (1UL << hi) - 1;
+	return top & ~((1UL << lo) - 1);
+    }
+    uint64_t full_mask(void) {
+	return page_mask(0, unit_sectors);
+    }
+    rcache_req *read_unit(extmap::obj_offset oo, char *buf,
+			  sector_t &sectors, rcache_req *prev);
+    rcache_req *start_fill(int n, extmap::obj_offset unit,
+			   sector_t blk_offset, sector_t blk_top_offset,
+			   char *buf, rcache_req *prev);
+    void make_sub_req(rcache_req *r);
+    rcache_req *plan_reads(extmap::obj_offset oo, char *buf,
+			   sector_t sectors, rcache_req *prev,
+			   std::vector<rcache_req*> &planned);
+    void read_objs(std::vector<std::tuple<char*,sector_t,
+		   extmap::obj_offset>> &v, std::vector<request*> &reqs);
+    void get_extents(sector_t base, sector_t limit,
+		     std::vector<std::tuple<sector_t,sector_t,
+					    extmap::obj_offset>> &extents);
+    static const size_t max_iovs = 64; // per merged request
     
-    /* possible CLOCK implementation - queue holds <block,ojb/offset> 
-     * pairs so that we can evict blocks without having to remove them 
-     * from the CLOCK queue
+    /* CLOCK with small reference counts (GCLOCK): a hit bumps
+     * a_bit[n] up to CLOCK_MAX, the hand decrements it and evicts
+     * at zero. New blocks come in at zero, so a one-pass scan gets
+     * evicted before anything that's been re-read. Hand and counts
+     * are saved in the eviction region along with the map.
      */
+    static const int CLOCK_MAX = 3;
     sized_vector<char> a_bit;
-#if 0
-    sized_vector<int>  block_version;
-    std::queue<std::pair<int,extmap::obj_offset>> clock_queue;
-#endif
+    int                hand = 0;
+    char              *evict_buf = NULL; // NULL if cache has no region
+
+    /* sequential read-ahead. We track a few streams by where their
+     * next read should start; a read that continues one prefetches
+     * whole units ahead of it, following the object map. The window
+     * (in units) grows by one for each prefetched unit that gets read
+     * and halves when an eviction pass finds any unread.
+     */
+    struct ra_stream {
+	sector_t next = -1;	// LBA the next sequential read starts at
+	sector_t ra_limit = 0;	// prefetched up to here
+    };
+    static const int ra_streams = 4;
+    static const int ra_min = 2;
+    ra_stream          streams[ra_streams];
+    int                ra_victim = 0;	// round-robin replacement
+    int                ra_window;
+    int                ra_max;		// units, 0 = disabled
+    sized_vector<char> prefetched; // filled by read-ahead, not yet read
+    std::atomic<int>   ra_inflight = 0; // nobody else waits for these
+
+    bool ra_check(sector_t base, sector_t limit,
+		  sector_t &ra_base, sector_t &ra_limit);
+    void readahead(sector_t base, sector_t limit);
+    void prefetch(std::vector<std::tuple<sector_t,sector_t,
+		  extmap::obj_offset>> &extents);
+    rcache_req *prefetch_unit(extmap::obj_offset oo, sector_t &sectors,
+			      rcache_req *prev);
     
-    /* evict 'n' blocks - random replacement
+    /* evict 'n' blocks - CLOCK replacement
      */
 // evict :	Frees n number of blocks and erases oo from the map
     void evict(int n);
 
     void evict_thread(thread_pool<int> *p);
+
+    /* hot set - see load_hot. Saved only once load_hot has named it.
+     */
+    typedef std::vector<std::tuple<sector_t,sector_t,
+				   extmap::obj_offset>> extent_list;
+    std::string        hot_name;
+    int                hot_interval; // seconds
+    long               warm_rate;	 // bytes/sec, 0 = no warm-up
+    void warm_thread(thread_pool<int> *p, extent_list units);
     
     char *get_cacheline_buf(int n); /* TODO: document this */
 
 public:
     read_cache_impl(uint32_t blkno, int _fd, bool nt,
 		    translate *_be, extmap::objmap *map,
-		    std::shared_mutex *m, backend *_io);
+		    sharded_rwlock *m, backend *_io, lsvd_config *cfg);
     ~read_cache_impl();
     
     std::tuple<size_t,size_t,request*> async_read(size_t offset,
 						  char *buf, size_t len);
+    void async_readv(size_t offset, char *buf, size_t len,
+		     std::vector<request*> &reqs);
+
+    std::tuple<int64_t,int64_t,request*>
+	gc_read(int64_t lba, extmap::obj_offset oo, int64_t sectors,
+		char *buf);
+    void gc_add(int64_t obj, smartiov *data,
+		std::vector<std::pair<int64_t,int64_t>> &hot);
+    void promote(sector_t lba, sector_t sectors, nvme *src_ssd, int src_fd,
+		 off_t nvme_offset, int obj_seq, int obj_limit);
 
     /* debugging. 
      */
@@ -137,22 +227,34 @@ public:
     void do_add(extmap::obj_offset unit, char *buf); /* TODO: document */
     void do_evict(int n);       /* TODO: document */
     void write_map(void);
+
+    lsvd_metrics *metrics = NULL;
+    void set_metrics(lsvd_metrics *m) { metrics = m; }
+    void set_base(read_cache *base, int seq);
+    void set_shared(bool filler);
+    void load_hot(const char *name);
+    int save_hot(void);
+    void count(m_counter c, uint64_t n) {
+	if (metrics)
+	    metrics->add(c, n);
+    }
 };
 
 /* factory function so we can hide implementation
  */
 read_cache *make_read_cache(uint32_t blkno, int _fd, bool nt, translate *_be,
-			    extmap::objmap *map, std::shared_mutex *m,
-			    backend *_io) {
-    return new read_cache_impl(blkno, _fd, nt, _be, map, m, _io);
+			    extmap::objmap *map, sharded_rwlock *m,
+			    backend *_io, lsvd_config *cfg) {
+    return new read_cache_impl(blkno, _fd, nt, _be, map, m, _io, cfg);
 }
 
 /* constructor - allocate, read the superblock and map, start threads
  */
 read_cache_impl::read_cache_impl(uint32_t blkno, int fd_, bool nt,
 				 translate *be_, extmap::objmap *omap,
-				 std::shared_mutex *maplock,
-				 backend *io_) : misc_threads(&m) {
+				 sharded_rwlock *maplock,
+				 backend *io_, lsvd_config *cfg) :
+    misc_threads(&m) {
     obj_map = omap;
     obj_lock = maplock;
     be = be_;
@@ -160,15 +262,18 @@ read_cache_impl::read_cache_impl(uint32_t blkno, int fd_, bool nt,
     nothreads = nt;
 
     const char *name = "read_cache_cb";
-    ssd = make_nvme(fd_, name);
+    ssd = make_nvme(fd_, name, cfg);
+    fd = fd_;
     
     char *buf = (char*)aligned_alloc(512, 4096);
     if (ssd->read(buf, 4096, 4096L*blkno) < 0)
 	throw("read cache superblock");
     super = (j_read_super*)buf;
 
-    assert(super->unit_size == 128); // 64KB, in sectors
-    unit_sectors = super->unit_size; // todo: fixme
+    /* units are filled 4KB at a time, tracked in a 64-bit mask
+     */
+    assert(super->unit_size % 8 == 0 && super->unit_size <= 64*8);
+    unit_sectors = super->unit_size;
 
     int oos_per_pg = 4096 / sizeof(extmap::obj_offset);
     assert(div_round_up(super->units, oos_per_pg) == super->map_blocks);
@@ -178,19 +283,60 @@ read_cache_impl::read_cache_impl(uint32_t blkno, int fd_, bool nt,
 		  super->map_start*4096L) < 0)
 	throw("read flatmap");
 
+    in_use.init(super->units);
+    valid.init(super->units);
+    buffer.init(super->units);
+    buf_valid.init(super->units);
+    filling.init(super->units);
+    pending.init(super->units);
+    a_bit.init(super->units);
+    prefetched.init(super->units);
+
+    ra_max = cfg->rcache_readahead / (unit_sectors * 512);
+    if (ra_max < ra_min)
+	ra_max = 0;
+    ra_window = std::min(ra_min, ra_max);
+
+    hot_interval = cfg->rcache_hot_interval;
+    warm_rate = cfg->rcache_warm_rate;
+
+    /* older caches don't have room for eviction state, and only
+     * ever held full units
+     */
+    j_rcache_unit *units = NULL;
+    if (super->evict_type == LSVD_EVICT_CLOCK &&
+	super->evict_blocks >= rcache_evict_blocks(super->units)) {
+	size_t evict_bytes = 4096L * super->evict_blocks;
+	evict_buf = (char*)aligned_alloc(512, evict_bytes);
+	if (ssd->read(evict_buf, evict_bytes, 4096L*super->evict_start) < 0)
+	    throw("read eviction state");
+	hand = *(int32_t*)evict_buf;
+	if (hand < 0 || hand >= super->units)
+	    hand = 0;
+	char *counts = evict_buf + sizeof(int32_t);
+	for (int i = 0; i < super->units; i++)
+	    a_bit[i] = std::min((int)counts[i], CLOCK_MAX);
+	units = (j_rcache_unit*)(evict_buf +
+				 rcache_evict_units_offset(super->units));
+    }
+
     for (int i = 0; i < super->units; i++) {
+	if (flat_map[i].obj != 0 && units != NULL) {
+	    /* the map and the page bitmaps are separate writes
+	     */
+	    if (memcmp(&units[i].unit, &flat_map[i], sizeof(flat_map[i])))
+		flat_map[i] = (extmap::obj_offset){0, 0};
+	    else
+		valid[i] = units[i].pages & full_mask();
+	}
+	else
+	    valid[i] = full_mask();
 	if (flat_map[i].obj != 0) 
 	    map[flat_map[i]] = i;
 	else 
 	    free_blks.push_back(i);
     }
 
-    in_use.init(super->units);
-    written.init(super->units);
-    buffer.init(super->units);
-    pending.init(super->units);
-    a_bit.init(super->units);
-
     map_dirty = false;
 
     misc_threads.pool.push(std::thread(&read_cache_impl::evict_thread,
@@ -199,8 +345,12 @@ read_cache_impl::read_cache_impl(uint32_t blkno, int fd_, bool nt,
 
 read_cache_impl::~read_cache_impl() {
     misc_threads.stop();	// before we free anything threads might touch
+    while (ra_inflight > 0)	//  (and so warm-up stops prefetching)
+	std::this_thread::sleep_for(std::chrono::milliseconds(1));
 	
     free((void*)flat_map);
+    if (evict_buf != NULL)
+	free(evict_buf);
     for (auto i = 0; i < super->units; i++)
 	if (buffer[i] != NULL)
 	    free(buffer[i]);
@@ -208,33 +358,41 @@ read_cache_impl::~read_cache_impl() {
     delete ssd;
 }
 
-#if 0
-static std::random_device rd; // to initialize RNG
-static std::mt19937 rng(rd());
-#else
-static std::mt19937 rng(17);      // for deterministic testing
-#endif
-
-/* evict 'n' blocks from cache, using random eviction
+/* evict 'n' blocks from cache, using CLOCK. Gives up after enough
+ * passes to drain every count, i.e. if everything is in use.
  */
 void read_cache_impl::evict(int n) {
     // assert(!m.try_lock());       // m must be locked
-    std::uniform_int_distribution<int> uni(0,super->units - 1);
-    for (int i = 0; i < n; i++) {
-	int j = uni(rng);
-	while (flat_map[j].obj == 0 || in_use[j] > 0)
-	    j = uni(rng);
+    int64_t max_steps = (int64_t)super->units * (CLOCK_MAX + 1);
+    bool wasted = false;
+    for (int64_t i = 0; n > 0 && i < max_steps; i++) {
+	int j = hand;
+	hand = (hand + 1) % super->units;
+	if (flat_map[j].obj == 0 || in_use[j] > 0)
+	    continue;
+	if (a_bit[j] > 0) {
+	    a_bit[j]--;
+	    continue;
+	}
+	if (prefetched[j]) {	// read-ahead went unused
+	    prefetched[j] = 0;
+	    wasted = true;
+	}
 	auto oo = flat_map[j];
 	flat_map[j] = (extmap::obj_offset){0, 0};
 	map.erase(oo);
 	free_blks.push_back(j);
+	n--;
     }
+    if (wasted)
+	ra_window = std::max(std::min(ra_min, ra_max), ra_window / 2);
 }
 
 void read_cache_impl::evict_thread(thread_pool<int> *p) {
     auto wait_time = std::chrono::milliseconds(500);
     auto t0 = std::chrono::system_clock::now();
     auto timeout = std::chrono::seconds(2);
+    auto t_hot = t0;
 
     std::unique_lock<std::mutex> lk(m);
 
@@ -243,19 +401,36 @@ void read_cache_impl::evict_thread(thread_pool<int> *p) {
 	if (!p->running)
 	    return;
 
+	if (shared && !filler) {
+	    auto t = std::chrono::system_clock::now();
+	    if (t - t0 > timeout) {
+		reload_map(lk);
+		t0 = t;
+	    }
+	    continue;
+	}
+
 	int n = 0;
-	if ((int)free_blks.size() < super->units / 16)
+	if (!shared && (int)free_blks.size() < super->units / 16)
 	    n = super->units / 4 - free_blks.size();
 	if (n)
 	    evict(n);
 
+	auto t = std::chrono::system_clock::now();
+	if (hot_name != "" && hot_interval > 0 &&
+	    t - t_hot > std::chrono::seconds(hot_interval)) {
+	    lk.unlock();
+	    save_hot();
+	    lk.lock();
+	    t_hot = t;
+	}
+
 	if (!map_dirty)     // free list didn't change
 	    continue;
 
 	/* write the map (a) immediately if we evict something, or 
 	 * (b) occasionally if the map is dirty
 	 */
-	auto t = std::chrono::system_clock::now();
 	if (n > 0 || (t - t0) > timeout) {
 	    lk.unlock();
 	    write_map();
@@ -269,26 +444,28 @@ void read_cache_impl::evict_thread(thread_pool<int> *p) {
     /* state machine for block obj,offset can be represented by the tuple:
      *  map=n - i.e. exists(n) | map[obj,offset] = n
      *  in_use[n] - 0 / >0
-     *  written[n] - n/a, F, T
+     *  filling[n] - 0, P (pages being read)
      *  buffer[n] - n/a, NULL, <p>
      *  pending[n] - n/a, [], [...]
+     * (valid[n] / buf_valid[n] say which pages SSD / buffer can serve)
      *
      * if not cached                          -> {!map, n/a}
-     * first read will:
+     * first read (or read of missing pages, if no fill running) will:
      *   - add to map
-     *   - increment in_use
-     *   - launch read                        -> {map=n, >0, F, NULL, []}
-     * following reads will 
-     *   queue lambdas to copy from buffer[n] -> {map=n, >0, F, NULL, [..]}
+     *   - attach a buffer, increment in_use
+     *   - launch read of needed pages        -> {map=n, >0, P, <p>, []}
+     * following reads of pages in P will 
+     *   queue lambdas to copy from buffer[n] -> {map=n, >0, P, <p>, [..]}
+     *   (reads of other missing pages go directly to the backend)
      * read complete will:
-     *   - set buffer[n]
+     *   - add P to buf_valid[n]
      *   - invoke lambdas from pending[*]
-     *   - launch write                       -> {map=n, >0, F, <p>, []}
+     *   - launch write of P                  -> {map=n, >0, P, <p>, []}
      * write complete will:
-     *   - set 'written' to true              -> {map=n, >0, T, <p>, []}
-     * eviction of buffer will:
+     *   - add P to valid[n]                  -> {map=n, >0, 0, <p>, []}
+     * eviction of buffer (never while filling) will:
      *   - decr in_use
-     *   - remove buffer                      -> {map=n, 0, NULL, []}
+     *   - remove buffer                      -> {map=n, 0, 0, NULL, []}
      * further reads will temporarily increment in_use
      * eviction will remove from map:         -> {!map, n/a}
      */
@@ -297,21 +474,30 @@ void read_cache_impl::evict_thread(thread_pool<int> *p) {
 /* TODO: WTF is this?
  */
 char *read_cache_impl::get_cacheline_buf(int n) {
-    char *buf;
-    int len = 65536;
+    char *buf = NULL;
+    int len = unit_sectors * 512;
     const int maxbufs = 48;
-    if (buf_loc.size() < maxbufs) {
+
+    /* take the oldest buffer, skipping any with a fill in progress
+     */
+    if (buf_loc.size() >= maxbufs) {
+	for (size_t i = 0; i < buf_loc.size() && buf == NULL; i++) {
+	    int j = buf_loc.front();
+	    buf_loc.pop();
+	    if (filling[j] != 0) {
+		buf_loc.push(j);
+		continue;
+	    }
+	    assert(buffer[j] != NULL);
+	    buf = buffer[j];
+	    buffer[j] = NULL;
+	    in_use[j]--;
+	}
+    }
+    if (buf == NULL) {
 	buf = (char*)aligned_alloc(512, len);
 	memset(buf, 0, len);
     }
-    else {
-	int j = buf_loc.front();
-	buf_loc.pop();
-	assert(buffer[j] != NULL);
-	buf = buffer[j];
-	buffer[j] = NULL;
-	in_use[j]--;
-    }
     buf_loc.push(n);
     assert(buf != NULL);
     return buf;
@@ -341,7 +527,7 @@ enum req_type {
     RCACHE_DONE = 7
 };
 
-class rcache_req : public request {
+class rcache_req : public request, public pooled<rcache_req> {
     request *parent = NULL;
     read_cache_impl *rci;
 
@@ -356,17 +542,44 @@ class rcache_req : public request {
     sector_t blk_offset = -1;
     size_t   bytes = 0;
 
-    /* closure line 424 */
-    off_t nvme_offset;
-    off_t buf_offset;
-    char *_buf = NULL;
+    /* SSD_READ: 'bytes' at nvme_offset into iovs, holding 'blocks'
+     * in use
+     */
+    std::vector<int> blocks;
+    off_t    nvme_offset;
+
+    /* DIRECT_READ, BACKEND_WAIT: one backend read covering all of
+     * obj_sectors starting at obj_offset. For a fill, that's the
+     * needed pages of one or more consecutive units.
+     */
+    int64_t  obj = 0;
+    sector_t obj_offset = 0;
+    sector_t obj_sectors = 0;
+
+    struct unit_fill {
+	int     n;
+	char   *buf;		// caller's buffer
+	size_t  bytes;
+	char   *_buf;		// buffer[n]
+	off_t   buf_offset;	// caller's data, within the unit
+	off_t   fill_offset;	// pages being filled, within the unit
+	size_t  fill_len;
+    };
+    std::vector<unit_fill> fills;
+    std::vector<iovec> iovs;
+    int      writes = 0;	// BLOCK_WRITE: SSD writes outstanding
+    uint64_t t0 = 0;		// sub_req started, for metrics
+    bool     prefetch = false;	// counted in rci->ra_inflight
 
     std::mutex m;
 //    std::condition_variable cv;
     
 public:
     rcache_req(read_cache_impl *rcache_) : rci(rcache_) {}
-    ~rcache_req() {}
+    ~rcache_req() {
+	if (prefetch)
+	    rci->ra_inflight--;
+    }
 
     void run(request *parent);
     void notify(request *child);
@@ -399,14 +612,22 @@ void rcache_req::notify(request *child) {
     
     bool notify_parent = false;
     enum req_type next_state = state;
+    std::vector<request*> wr;
 
     if (child != NULL)
 	child->release();
+
+    if (rci->metrics && t0 != 0) {
+	auto h = (state == RCACHE_SSD_READ) ? H_RC_SSD_READ : H_BACKEND_READ;
+	rci->metrics->add_time(h, m_now() - t0);
+	t0 = 0;
+    }
     
     /* direct read from nvme, line 375
      */
     if (state == RCACHE_SSD_READ) {
-	rci->in_use[n]--;
+	for (auto i : blocks)
+	    rci->in_use[i]--;
 	next_state = RCACHE_DONE;
 	notify_parent = true;
     }
@@ -420,30 +641,49 @@ void rcache_req::notify(request *child) {
     /* cache block read completion
      */
     else if (state == RCACHE_BACKEND_WAIT) { 
-	 memcpy(buf, _buf + buf_offset, bytes);
-
-	 std::unique_lock lk(rci->m);
-	 rci->buffer[n] = _buf;
-	 std::vector<request*>
-	     v(std::make_move_iterator(rci->pending[n].begin()),
-	       std::make_move_iterator(rci->pending[n].end()));
-	     
-	 rci->pending[n].erase(rci->pending[n].begin(), rci->pending[n].end());
-	 lk.unlock();
-
-	 notify_parent = true;
-	 for (auto p : v) {
-	     p->notify(NULL);	// they're in state LINE_386
-	 }
-
-	 sub_req = rci->ssd->make_write_request(_buf, rci->unit_sectors*512L,
-						nvme_offset);
-	 next_state = RCACHE_BLOCK_WRITE; // write_done closure
-	 sub_req->run(this);
+	for (auto &f : fills)
+	    if (f.buf != NULL)
+		memcpy(f.buf, f._buf + f.buf_offset, f.bytes);
+
+	std::vector<request*> v;
+	std::unique_lock lk(rci->m);
+	for (auto &f : fills) {
+	    rci->buf_valid[f.n] |= rci->filling[f.n];
+	    v.insert(v.end(), rci->pending[f.n].begin(),
+		     rci->pending[f.n].end());
+	    rci->pending[f.n].clear();
+	}
+	lk.unlock();
+
+	notify_parent = true;
+	for (auto p : v) {
+	    p->notify(NULL);	// they're in state LINE_386
+	}
+
+	/* each unit goes to its own cache block. They're started
+	 * after we drop 'm': submitting can wait for room in the SSD
+	 * queue, and the first completion needs 'm' to get in.
+	 */
+	writes = fills.size();
+	next_state = RCACHE_BLOCK_WRITE; // write_done closure
+	for (auto &f : fills) {
+	    off_t nvme_base = (rci->super->base*8 + f.n*rci->unit_sectors) * 512L;
+	    auto req = rci->ssd->make_write_request(f._buf + f.fill_offset,
+						    f.fill_len,
+						    nvme_base + f.fill_offset);
+	    wr.push_back(req);
+	}
     }
     else if (state == RCACHE_BLOCK_WRITE) {
-	rci->written[n] = true;
-	next_state = RCACHE_DONE;
+	if (--writes == 0) {
+	    std::unique_lock lk(rci->m);
+	    for (auto &f : fills) {
+		rci->valid[f.n] |= rci->filling[f.n];
+		rci->filling[f.n] = 0;
+	    }
+	    rci->map_dirty = true;
+	    next_state = RCACHE_DONE;
+	}
     }
     else if (state == RCACHE_DIRECT_READ) {
 	notify_parent = true;
@@ -455,7 +695,13 @@ void rcache_req::notify(request *child) {
     if (notify_parent && parent != NULL) 
 	parent->notify(this);
 
-    if (next_state == RCACHE_DONE && released) {
+    if (wr.size() > 0) {
+	state = next_state;
+	lk.unlock();
+	for (auto req : wr)
+	    req->run(this);
+    }
+    else if (next_state == RCACHE_DONE && released) {
 	lk.unlock();
 	delete this;
     }
@@ -464,23 +710,224 @@ void rcache_req::notify(request *child) {
 }
 
 void rcache_req::run(request *parent_) {
+    std::unique_lock lk(m);
     parent = parent_;
 
     if (state == RCACHE_QUEUED)
 	/* nothing */ ;
-    else if (state == RCACHE_LOCAL_BUFFER) {
+    else if (state == RCACHE_DONE) { // queued read finished before run()
+	lk.unlock();
 	parent->notify(this);
+    }
+    else if (state == RCACHE_LOCAL_BUFFER) {
 	state = RCACHE_DONE;
+	lk.unlock();
+	parent->notify(this);
     }
     else if (state == RCACHE_SSD_READ ||
 	     state == RCACHE_BACKEND_WAIT ||
 	     state == RCACHE_DIRECT_READ) {
+	t0 = m_now();
+	lk.unlock();
 	sub_req->run(this);
     }
     else
 	assert(false);
 }
 
+/* plan the part of a read that falls in the cache unit holding 'oo',
+ * up to 'sectors' long; on return 'sectors' is the length planned. If
+ * the I/O can be merged onto the end of 'prev' (not yet launched) it's
+ * added there and 'prev' is returned; a copy from the unit's buffer
+ * returns NULL; anything else returns a new request. m held.
+ */
+rcache_req *read_cache_impl::read_unit(extmap::obj_offset oo, char *buf,
+				       sector_t &sectors, rcache_req *prev) {
+    extmap::obj_offset unit = {oo.obj, oo.offset / unit_sectors};
+    sector_t blk_offset = oo.offset % unit_sectors;
+    sector_t blk_top_offset = std::min(blk_offset + sectors,
+				       (sector_t)unit_sectors);
+    sectors = blk_top_offset - blk_offset;
+    size_t bytes = 512L * sectors;
+    uint64_t want = page_mask(blk_offset, blk_top_offset);
+
+    /* protection against random reads - read-around when hit rate is too low.
+     * A shared cache is for blocks lots of images read, so it always
+     * fills (if it's the filler) or never does.
+     */
+    bool hit_ok = shared ? filler : hit_stats.user * 3 > hit_stats.backend * 2;
+    int n = -1;             // cache block number
+
+    auto it = map.find(unit);
+    if (it != map.end()) {
+	n = it->second;
+	if (a_bit[n] < CLOCK_MAX)
+	    a_bit[n]++;
+	if (prefetched[n]) {	// read-ahead paid off
+	    prefetched[n] = 0;
+	    ra_window = std::min(ra_window + 1, ra_max);
+	}
+
+	if (buffer[n] != NULL && (want & ~buf_valid[n]) == 0) {
+	    hit_stats.user += sectors;
+	    count(M_RC_LOCAL, sectors);
+	    memcpy(buf, buffer[n] + blk_offset*512, bytes);
+	    return NULL;
+	}
+	if ((want & ~valid[n]) == 0) {
+	    hit_stats.user += sectors;
+	    count(M_RC_SSD, sectors);
+	    in_use[n]++;
+	    off_t nvme_offset =
+		512L * (super->base*8 + n*unit_sectors + blk_offset);
+	    iovec iov = {buf, bytes};
+
+	    /* blocks are handed out from the top down, so a sequential
+	     * read may walk backwards through the SSD
+	     */
+	    if (prev != NULL && prev->state == RCACHE_SSD_READ &&
+		prev->iovs.size() < max_iovs) {
+		if (prev->nvme_offset + (off_t)prev->bytes == nvme_offset) {
+		    prev->iovs.push_back(iov);
+		    prev->bytes += bytes;
+		    prev->blocks.push_back(n);
+		    return prev;
+		}
+		if (nvme_offset + (off_t)bytes == prev->nvme_offset) {
+		    prev->iovs.insert(prev->iovs.begin(), iov);
+		    prev->nvme_offset = nvme_offset;
+		    prev->bytes += bytes;
+		    prev->blocks.push_back(n);
+		    return prev;
+		}
+	    }
+	    auto r = new rcache_req(this);
+	    r->state = RCACHE_SSD_READ;
+	    r->iovs.push_back(iov);
+	    r->bytes = bytes;
+	    r->nvme_offset = nvme_offset;
+	    r->blocks.push_back(n);
+	    return r;
+	}
+	if ((want & ~filling[n]) == 0) { // prior read is pending
+	    hit_stats.user += sectors;
+	    count(M_RC_QUEUED, sectors);
+	    auto r = new rcache_req(this);
+	    r->state = RCACHE_QUEUED;
+	    r->n = n;
+	    r->buf = buf;
+	    r->blk_offset = blk_offset;
+	    r->bytes = bytes;
+	    pending[n].push_back(r);
+	    return r;
+	}
+	if (filling[n] == 0 && hit_ok) {
+	    hit_stats.user += sectors;
+	    count(M_RC_FILL, sectors);
+	    return start_fill(n, unit, blk_offset, blk_top_offset, buf, prev);
+	}
+    }
+    else if (free_blks.size() > 0 && hit_ok) {
+	/* assign a location in cache before we start reading (and while
+	 * we're still holding the lock)
+	 */
+	map_dirty = true;
+	n = free_blks.back();
+	free_blks.pop_back();
+	valid[n] = 0;
+	a_bit[n] = 0;
+	map[unit] = n;
+	flat_map[n] = unit;
+	prefetched[n] = 0;
+	hit_stats.user += sectors;
+	count(M_RC_FILL, sectors);
+	return start_fill(n, unit, blk_offset, blk_top_offset, buf, prev);
+    }
+
+    /* read around the cache
+     */
+    hit_stats.user += sectors;
+    hit_stats.backend += sectors;
+    count(M_RC_DIRECT, sectors);
+    if (prev != NULL && prev->state == RCACHE_DIRECT_READ &&
+	prev->obj == oo.obj && prev->buf + prev->bytes == buf &&
+	prev->obj_offset + prev->obj_sectors == oo.offset) {
+	prev->bytes += bytes;
+	prev->obj_sectors += sectors;
+	return prev;
+    }
+    auto r = new rcache_req(this);
+    r->state = RCACHE_DIRECT_READ;
+    r->buf = buf;
+    r->bytes = bytes;
+    r->obj = oo.obj;
+    r->obj_offset = oo.offset;
+    r->obj_sectors = sectors;
+    return r;
+}
+
+/* read just the pages of unit n that this request needs, into the
+ * unit's buffer (and into 'buf', unless it's a prefetch). If the previous unit's fill ends where this one
+ * starts in the same object, it becomes part of the same read. m held.
+ */
+rcache_req *read_cache_impl::start_fill(int n, extmap::obj_offset unit,
+					sector_t blk_offset,
+					sector_t blk_top_offset, char *buf,
+					rcache_req *prev) {
+    if (buffer[n] == NULL) {
+	in_use[n]++;		// dropped when the buffer is reclaimed
+	buffer[n] = get_cacheline_buf(n);
+	buf_valid[n] = 0;
+    }
+    sector_t fill_base = (blk_offset / 8) * 8,
+	fill_limit = round_up(blk_top_offset, 8);
+    filling[n] = page_mask(blk_offset, blk_top_offset);
+
+    sector_t sectors = blk_top_offset - blk_offset;
+    hit_stats.backend += fill_limit - fill_base;
+
+    rcache_req::unit_fill f = {n, buf, 512L * (size_t)sectors, buffer[n],
+			       blk_offset * 512L, fill_base * 512L,
+			       512L * (size_t)(fill_limit - fill_base)};
+    sector_t obj_offset = unit.offset*unit_sectors + fill_base;
+
+    if (prev != NULL && prev->state == RCACHE_BACKEND_WAIT &&
+	prev->fills.size() < max_iovs && prev->obj == unit.obj &&
+	prev->obj_offset + prev->obj_sectors == obj_offset) {
+	prev->fills.push_back(f);
+	prev->obj_sectors += fill_limit - fill_base;
+	return prev;
+    }
+    auto r = new rcache_req(this);
+    r->state = RCACHE_BACKEND_WAIT;
+    r->obj = unit.obj;
+    r->obj_offset = obj_offset;
+    r->obj_sectors = fill_limit - fill_base;
+    r->fills.push_back(f);
+    return r;
+}
+
+/* create the single SSD or backend read for a planned request
+ */
+void read_cache_impl::make_sub_req(rcache_req *r) {
+    if (r->state == RCACHE_SSD_READ) {
+	smartiov iov(r->iovs.data(), r->iovs.size());
+	r->sub_req = ssd->make_read_request(&iov, r->nvme_offset);
+    }
+    else if (r->state == RCACHE_DIRECT_READ) {
+	objname name(be->prefix(r->obj), r->obj);
+	r->sub_req = io->make_read_req(name.c_str(), 512L*r->obj_offset,
+				       r->buf, r->bytes);
+    }
+    else if (r->state == RCACHE_BACKEND_WAIT) {
+	for (auto &f : r->fills)
+	    r->iovs.push_back((iovec){f._buf + f.fill_offset, f.fill_len});
+	objname name(be->prefix(r->obj), r->obj);
+	r->sub_req = io->make_read_req(name.c_str(), 512L*r->obj_offset,
+				       r->iovs.data(), r->iovs.size());
+    }
+}
+
 std::tuple<size_t,size_t,request*>
 read_cache_impl::async_read(size_t offset, char *buf, size_t len) {
     sector_t base = offset/512, sectors = len/512, limit = base+sectors;
@@ -505,106 +952,624 @@ read_cache_impl::async_read(size_t offset, char *buf, size_t len) {
     if (read_len == 0)
 	return std::make_tuple(skip_len, read_len, (request*)NULL);
 
-    auto r = new rcache_req(this);
-    
-    extmap::obj_offset unit = {oo.obj, oo.offset / unit_sectors};
-    sector_t blk_base = unit.offset * unit_sectors;
-    sector_t blk_offset = oo.offset % unit_sectors;
-    sector_t blk_top_offset = std::min({(int)(blk_offset+sectors),
-		round_up(blk_offset+1,unit_sectors),
-		(int)(blk_offset + (limit-base))});
-    int n = -1;             // cache block number
+    sector_t n = read_len / 512;
+    std::unique_lock lk2(m);
+    auto r = read_unit(oo, buf, n, NULL);
+    lk2.unlock();
+
+    if (r != NULL)
+	make_sub_req(r);
+    return std::make_tuple(skip_len, 512L * n, (request*)r);
+}
+
+/* read the whole range, zeroing unmapped sectors. Contiguous pieces
+ * are merged, so a sequential read gives one request per contiguous
+ * run in an object (backend) or in the cache (SSD), not per unit.
+ */
+void read_cache_impl::async_readv(size_t offset, char *buf, size_t len,
+				  std::vector<request*> &reqs) {
+    sector_t base = offset/512, limit = base + len/512;
+    std::vector<std::tuple<sector_t,sector_t,extmap::obj_offset>> extents;
+    get_extents(base, limit, extents);
+
+    std::vector<rcache_req*> planned;
+    rcache_req *prev = NULL;
+    sector_t done = base;
+
+    std::vector<std::tuple<char*,sector_t,extmap::obj_offset>> base_objs;
 
     std::unique_lock lk2(m);
-    bool in_cache = false;
-    auto it2 = map.find(unit);
-    if (it2 != map.end()) {
-	r->n = n = it2->second;
-	in_cache = true;
+    for (auto [_base, _limit, ptr] : extents) {
+	if (_base > done)
+	    memset(buf + 512L*(done - base), 0, 512L*(_base - done));
+	char *_buf = buf + 512L*(_base - base);
+	if (base_rc != NULL && ptr.obj <= base_seq) {
+	    base_objs.push_back(std::make_tuple(_buf, _limit - _base, ptr));
+	    prev = NULL;
+	}
+	else
+	    prev = plan_reads(ptr, _buf, _limit - _base, prev, planned);
+	done = _limit;
     }
+    sector_t ra_base, ra_limit;
+    bool ra = ra_check(base, limit, ra_base, ra_limit);
+    lk2.unlock();
 
-    /* protection against random reads - read-around when hit rate is too low
-     */
-    bool use_cache = free_blks.size() > 0 &&
-	hit_stats.user * 3 > hit_stats.backend * 2;
+    if (done < limit)
+	memset(buf + 512L*(done - base), 0, 512L*(limit - done));
 
-    if (in_cache) {		// lk2 held through this section
-	sector_t blk_in_ssd = super->base*8 + n*unit_sectors,
-	    start = blk_in_ssd + blk_offset,
-	    finish = start + (blk_top_offset - blk_offset);
-	size_t bytes = 512 * (finish - start);
+    for (auto r : planned) {
+	make_sub_req(r);
+	reqs.push_back(r);
+    }
+    if (base_objs.size() > 0)
+	base_rc->read_objs(base_objs, reqs);
+    if (ra)
+	readahead(ra_base, ra_limit);
+}
 
-	a_bit[n] = true;
-	hit_stats.user += bytes/512;
+/* read_unit for each unit of [oo, oo+sectors); returns the new 'prev'.
+ * m held.
+ */
+rcache_req *read_cache_impl::plan_reads(extmap::obj_offset oo, char *buf,
+					sector_t sectors, rcache_req *prev,
+					std::vector<rcache_req*> &planned) {
+    for (sector_t s = 0; s < sectors; ) {
+	sector_t n = sectors - s;
+	extmap::obj_offset _oo = {oo.obj, oo.offset + s};
+	auto r = read_unit(_oo, buf + 512L*s, n, prev);
+	if (r != NULL && r != prev)
+	    planned.push_back(r);
+	/* queued requests can complete at any time */
+	prev = (r != NULL && r->state != RCACHE_QUEUED) ? r : NULL;
+	s += n;
+    }
+    return prev;
+}
 
-	if (buffer[n] != NULL) {
-	    lk2.unlock();
-	    memcpy(buf, buffer[n] + blk_offset*512, bytes);
-	    r->state = RCACHE_LOCAL_BUFFER;
-	}
-	else if (written[n]) {
-	    in_use[n]++;
-	    r->sub_req = ssd->make_read_request(buf, bytes, 512L*start);
-	    r->state = RCACHE_SSD_READ;
-	}
-	else {              // prior read is pending
-	    r->state = RCACHE_QUEUED;
-	    r->buf = buf;
-	    r->blk_offset = blk_offset;
-	    r->bytes = bytes;
-	    pending[n].push_back(r);
+/* {buf, sectors, location} reads of base image objects for a clone's
+ * cache - see set_base
+ */
+void read_cache_impl::read_objs(std::vector<std::tuple<char*,sector_t,
+				extmap::obj_offset>> &v,
+				std::vector<request*> &reqs) {
+    std::vector<rcache_req*> planned;
+    rcache_req *prev = NULL;
+    std::unique_lock lk(m);
+    for (auto [buf, sectors, oo] : v)
+	prev = plan_reads(oo, buf, sectors, prev, planned);
+    lk.unlock();
+    for (auto r : planned) {
+	make_sub_req(r);
+	reqs.push_back(r);
+    }
+}
+
+void read_cache_impl::get_extents(sector_t base, sector_t limit,
+				  std::vector<std::tuple<sector_t,sector_t,
+				  extmap::obj_offset>> &extents) {
+    std::shared_lock lk(*obj_lock);
+    for (auto it = obj_map->lookup(base);
+	 it != obj_map->end() && it->base() < limit; it++) {
+	auto [_base, _limit, _ptr] = it->vals(base, limit);
+	extents.push_back(std::make_tuple(_base, _limit, _ptr));
+    }
+}
+
+/* a read of [base,limit) just got planned. If it continues a stream
+ * and the stream is less than half a window ahead, return the range
+ * to prefetch next. m held.
+ */
+bool read_cache_impl::ra_check(sector_t base, sector_t limit,
+			       sector_t &ra_base, sector_t &ra_limit) {
+    if (ra_max == 0)
+	return false;
+    ra_stream *s = NULL;
+    for (int i = 0; i < ra_streams; i++)
+	if (streams[i].next == base)
+	    s = &streams[i];
+    if (s == NULL) {
+	s = &streams[ra_victim];
+	ra_victim = (ra_victim + 1) % ra_streams;
+	s->next = s->ra_limit = limit;
+	return false;
+    }
+    s->next = limit;
+    sector_t window = (sector_t)ra_window * unit_sectors;
+    if (s->ra_limit < limit)
+	s->ra_limit = limit;
+    if (s->ra_limit - limit > window / 2)
+	return false;
+    ra_base = s->ra_limit;
+    ra_limit = s->ra_limit = limit + window;
+    return true;
+}
+
+/* fill whatever isn't cached yet in [base,limit), merging like
+ * async_readv. Nobody waits for these, so they clean up after
+ * themselves.
+ */
+void read_cache_impl::readahead(sector_t base, sector_t limit) {
+    std::vector<std::tuple<sector_t,sector_t,extmap::obj_offset>> extents;
+    get_extents(base, limit, extents);
+
+    if (base_rc != NULL) {
+	decltype(extents) own, theirs;
+	for (auto e : extents)
+	    (std::get<2>(e).obj <= base_seq ? theirs : own).push_back(e);
+	base_rc->prefetch(theirs);
+	prefetch(own);
+    }
+    else
+	prefetch(extents);
+}
+
+/* prefetch_unit for each unit of a list of extents
+ */
+void read_cache_impl::prefetch(std::vector<std::tuple<sector_t,sector_t,
+			       extmap::obj_offset>> &extents) {
+    std::vector<rcache_req*> planned;
+    rcache_req *prev = NULL;
+
+    std::unique_lock lk(m);
+    if (shared ? !filler : hit_stats.user * 3 <= hit_stats.backend * 2)
+	return;			// in read-around mode
+    for (auto [_base, _limit, ptr] : extents) {
+	for (sector_t s = _base; s < _limit; ) {
+	    sector_t n = _limit - s;
+	    extmap::obj_offset oo = {ptr.obj, ptr.offset + (s - _base)};
+	    auto r = prefetch_unit(oo, n, prev);
+	    if (r != NULL && r != prev)
+		planned.push_back(r);
+	    prev = r;
+	    s += n;
 	}
-	read_len = bytes;
     }
-    else if (use_cache) {
-	/* assign a location in cache before we start reading (and while we're
-	 * still holding the lock)
-	 */
-	map_dirty = true;
-	r->n = n = free_blks.back();
+    if (!shared && (int)free_blks.size() <= super->units / 32)
+	misc_threads.cv.notify_all(); // evict now, not in 500ms
+    lk.unlock();
+
+    for (auto r : planned) {
+	make_sub_req(r);
+	r->prefetch = true;
+	ra_inflight++;
+	r->released = true;
+	r->run(NULL);
+    }
+}
+
+/* like read_unit for a miss, but leaves some free blocks for real
+ * reads. m held.
+ */
+rcache_req *read_cache_impl::prefetch_unit(extmap::obj_offset oo,
+					   sector_t &sectors,
+					   rcache_req *prev) {
+    extmap::obj_offset unit = {oo.obj, oo.offset / unit_sectors};
+    sector_t blk_offset = oo.offset % unit_sectors;
+    sector_t blk_top_offset = std::min(blk_offset + sectors,
+				       (sector_t)unit_sectors);
+    sectors = blk_top_offset - blk_offset;
+
+    if (map.find(unit) != map.end() ||
+	(int)free_blks.size() <= super->units / 32)
+	return NULL;
+
+    map_dirty = true;
+    int n = free_blks.back();
+    free_blks.pop_back();
+    valid[n] = 0;
+    a_bit[n] = 1;		// survive one pass of the hand
+    map[unit] = n;
+    flat_map[n] = unit;
+    prefetched[n] = 1;
+    return start_fill(n, unit, blk_offset, blk_top_offset, NULL, prev);
+}
+
+/* GC: copy from in-memory buffer or read from SSD if we have it.
+ * Only blocks already written to SSD; in_use[n] holds off eviction
+ * until the read is done. Doesn't count towards hit_stats.
+ */
+std::tuple<int64_t,int64_t,request*>
+read_cache_impl::gc_read(int64_t lba, extmap::obj_offset oo,
+			 int64_t sectors, char *buf) {
+    extmap::obj_offset unit = {oo.obj, oo.offset / unit_sectors};
+    sector_t blk_offset = oo.offset % unit_sectors;
+    int64_t n = std::min(sectors, (int64_t)(unit_sectors - blk_offset));
+
+    std::unique_lock lk(m);
+    auto it = map.find(unit);
+    if (it == map.end())
+	return std::make_tuple(-n, 0, (request*)NULL);
+    int i = it->second;
+    uint64_t want = page_mask(blk_offset, blk_offset + n);
+    if (buffer[i] != NULL && (want & ~buf_valid[i]) == 0) {
+	memcpy(buf, buffer[i] + blk_offset*512, n*512);
+	return std::make_tuple(n, 0, (request*)NULL);
+    }
+    if ((want & ~valid[i]) != 0)
+	return std::make_tuple(-n, 0, (request*)NULL);
+
+    in_use[i]++;
+    auto r = new rcache_req(this);
+    r->blocks.push_back(i);
+    r->state = RCACHE_SSD_READ;
+    off_t nvme_offset = 512L * (super->base*8 + i*unit_sectors + blk_offset);
+    r->sub_req = ssd->make_read_request(buf, n*512, nvme_offset);
+    return std::make_tuple(n, 0, (request*)r);
+}
+
+/* GC relocated cached data into object 'obj', so add full cache
+ * blocks of it that overlap the 'hot' ranges. Blocks go into the
+ * map only after they're on SSD.
+ */
+void read_cache_impl::gc_add(int64_t obj, smartiov *data,
+			     std::vector<std::pair<int64_t,int64_t>> &hot) {
+    int64_t obj_units = data->bytes() / 512 / unit_sectors;
+    std::set<int64_t> units;
+    for (auto [base, limit] : hot)
+	for (auto u = base / unit_sectors; u*unit_sectors < limit; u++)
+	    if (u < obj_units)
+		units.insert(u);
+
+    char *buf = (char*)aligned_alloc(512, unit_sectors*512L);
+    for (auto u : units) {
+	extmap::obj_offset unit = {obj, u};
+	std::unique_lock lk(m);
+	if (free_blks.size() == 0)
+	    break;
+	int n = free_blks.back();
 	free_blks.pop_back();
-	written[n] = false;
-	in_use[n]++;
+	lk.unlock();
+
+	size_t offset = u*unit_sectors*512L;
+	data->slice(offset, offset + unit_sectors*512L).copy_out(buf);
+	off_t nvme_offset = (super->base*8 + n*unit_sectors)*512L;
+	if (ssd->write(buf, unit_sectors*512L, nvme_offset) < 0)
+	    throw("write data");
+
+	lk.lock();
+	if (map.find(unit) != map.end()) { // a reader got there first
+	    free_blks.push_back(n);
+	    continue;
+	}
+	valid[n] = full_mask();
+	a_bit[n] = 1;		// GC found it recently used
+	prefetched[n] = 0;
 	map[unit] = n;
 	flat_map[n] = unit;
-	auto _buf = get_cacheline_buf(n);
-
-	hit_stats.backend += unit_sectors;
-	sector_t sectors = blk_top_offset - blk_offset;
-	hit_stats.user += sectors;
-	lk2.unlock();
+	map_dirty = true;
+    }
+    free(buf);
+}
 
-	r->nvme_offset = (super->base*8 + n*unit_sectors) * 512L;
-	r->buf_offset = blk_offset * 512L;
-	r->bytes = 512L * sectors;
+/* copy within one file; false if the kernel won't (e.g. it's a
+ * block device), and the caller falls back to read + write
+ */
+static bool copy_in_file(int fd, off_t from, off_t to, size_t bytes) {
+    while (bytes > 0) {
+	ssize_t n = copy_file_range(fd, &from, fd, &to, bytes, 0);
+	if (n <= 0)
+	    return false;
+	bytes -= n;
+    }
+    return true;
+}
 
-	r->_buf = _buf;
-	r->buf = buf;
-	r->state = RCACHE_BACKEND_WAIT;
+/* data leaving the write cache. The object map must point at this
+ * write (not an older one still in the map because its batch hasn't
+ * been processed, nor a newer one written since it was evicted) and
+ * the object must be durable. Block allocation is like gc_add, except
+ * that we can add pages to a unit already cached: object data never
+ * changes, so racing with a fill is harmless, and in_use keeps the
+ * block from being evicted while we write it. It's only a cache, so
+ * an I/O error just skips the unit.
+ */
+void read_cache_impl::promote(sector_t lba, sector_t sectors, nvme *src_ssd,
+			      int src_fd, off_t nvme_offset, int obj_seq,
+			      int obj_limit) {
+    std::vector<std::tuple<sector_t,sector_t,extmap::obj_offset>> extents;
+    get_extents(lba, lba + sectors, extents);
+    int durable = be->durable_seq();
+
+    struct stat sb1, sb2;
+    bool same_file = (fstat(fd, &sb1) == 0 && fstat(src_fd, &sb2) == 0 &&
+		      sb1.st_dev == sb2.st_dev && sb1.st_ino == sb2.st_ino);
+
+    char *buf = NULL;
+    for (auto [_base, _limit, ptr] : extents) {
+	if (ptr.obj < obj_seq || ptr.obj >= obj_limit || ptr.obj >= durable)
+	    continue;
+	for (sector_t s = _base; s < _limit; ) {
+	    extmap::obj_offset oo = {ptr.obj, ptr.offset + (s - _base)};
+	    extmap::obj_offset unit = {oo.obj, oo.offset / unit_sectors};
+	    sector_t blk_offset = oo.offset % unit_sectors;
+	    sector_t blk_top = std::min(blk_offset + (_limit - s),
+					(sector_t)unit_sectors);
+	    sector_t src = s - lba;
+	    s += blk_top - blk_offset;
+
+	    /* whole pages only */
+	    sector_t p_base = round_up(blk_offset, 8),
+		p_limit = (blk_top / 8) * 8;
+	    if (p_limit <= p_base)
+		continue;
+	    uint64_t pages = page_mask(p_base, p_limit);
+	    src += p_base - blk_offset;
+
+	    std::unique_lock lk(m);
+	    int n;
+	    bool fresh = false;
+	    auto it = map.find(unit);
+	    if (it != map.end()) {
+		n = it->second;
+		if ((pages & ~valid[n]) == 0)
+		    continue;
+		in_use[n]++;
+	    }
+	    else {
+		if ((int)free_blks.size() <= super->units / 32)
+		    continue;
+		n = free_blks.back();
+		free_blks.pop_back();
+		fresh = true;
+	    }
+	    lk.unlock();
 
-	objname name(be->prefix(), unit.obj);
-	r->sub_req = io->make_read_req(name.c_str(), 512L*blk_base,
-				       _buf, 512L*unit_sectors);
-	read_len = r->bytes;
-    }
-    else {
-	hit_stats.user += read_len / 512;
-	hit_stats.backend += read_len / 512;
-	lk2.unlock();
+	    size_t bytes = 512L * (p_limit - p_base);
+	    off_t from = nvme_offset + 512L*src;
+	    off_t blk_nvme = 512L * (super->base*8 + n*unit_sectors + p_base);
+	    bool ok = same_file && copy_in_file(fd, from, blk_nvme, bytes);
+	    if (!ok) {
+		if (buf == NULL)
+		    buf = (char*)aligned_alloc(512, unit_sectors*512L);
+		ok = (src_ssd->read(buf, bytes, from) == (ssize_t)bytes &&
+		      ssd->write(buf, bytes, blk_nvme) == (ssize_t)bytes);
+	    }
 
-	objname name(be->prefix(), oo.obj);
-	r->sub_req = io->make_read_req(name.c_str(), 512L*oo.offset,
-				       buf, read_len);
-	r->state = RCACHE_DIRECT_READ;
-	// read_len unchanged
+	    lk.lock();
+	    if (!ok) {
+		if (fresh)
+		    free_blks.push_back(n);
+		else
+		    in_use[n]--;
+		continue;
+	    }
+	    if (fresh) {
+		if (map.find(unit) != map.end()) { // a reader got there first
+		    free_blks.push_back(n);
+		    continue;
+		}
+		valid[n] = pages;
+		a_bit[n] = 1;	// it was read while in the write cache
+		prefetched[n] = 0;
+		map[unit] = n;
+		flat_map[n] = unit;
+	    }
+	    else {
+		valid[n] |= pages;
+		in_use[n]--;
+	    }
+	    map_dirty = true;
+	}
     }
-    return std::make_tuple(skip_len, read_len, r);
+    if (buf != NULL)
+	free(buf);
 }
 
 void read_cache_impl::write_map(void) {
+    if (shared && !filler)
+	return;
     if (ssd->write(flat_map, 4096 * super->map_blocks,
 		   4096L * super->map_start) < 0)
 	throw("write flatmap");
+    if (evict_buf == NULL)
+	return;
+    *(int32_t*)evict_buf = hand;
+    char *counts = evict_buf + sizeof(int32_t);
+    auto units = (j_rcache_unit*)(evict_buf +
+				  rcache_evict_units_offset(super->units));
+    for (int i = 0; i < super->units; i++) {
+	counts[i] = a_bit[i];
+	memcpy(&units[i].unit, &flat_map[i], sizeof(units[i].unit));
+	units[i].pages = valid[i];
+    }
+    if (ssd->write(evict_buf, 4096L * super->evict_blocks,
+		   4096L * super->evict_start) < 0)
+	throw("write eviction state");
+}
+
+void read_cache_impl::set_base(read_cache *base, int seq) {
+    std::unique_lock lk(m);
+    base_rc = (read_cache_impl*)base;
+    base_seq = seq;
+}
+
+void read_cache_impl::set_shared(bool _filler) {
+    std::unique_lock lk(m);
+    shared = true;
+    filler = _filler;
+    if (!filler)
+	free_blks.clear();
+}
+
+/* shared cache, not the filler: add the filler's new blocks. Blocks
+ * are only ever added there, and write_map saves the page bitmaps
+ * only after the pages are on SSD. m held, dropped for the reads.
+ */
+void read_cache_impl::reload_map(std::unique_lock<std::mutex> &lk) {
+    if (evict_buf == NULL)	// no page bitmaps
+	return;
+    size_t map_bytes = 4096L * super->map_blocks,
+	evict_bytes = 4096L * super->evict_blocks;
+    auto _flat = (extmap::obj_offset*)aligned_alloc(512, map_bytes);
+    auto _evict = (char*)aligned_alloc(512, evict_bytes);
+
+    lk.unlock();
+    bool ok = ssd->read((char*)_flat, map_bytes, 4096L*super->map_start) >= 0 &&
+	ssd->read(_evict, evict_bytes, 4096L*super->evict_start) >= 0;
+    lk.lock();
+
+    auto units = (j_rcache_unit*)(_evict +
+				  rcache_evict_units_offset(super->units));
+    for (int i = 0; ok && i < super->units; i++) {
+	if (_flat[i].obj == 0 ||
+	    memcmp(&units[i].unit, &_flat[i], sizeof(_flat[i])))
+	    continue;
+	if (flat_map[i].obj == 0) {
+	    flat_map[i] = _flat[i];
+	    map[_flat[i]] = i;
+	    valid[i] = 0;
+	}
+	if (flat_map[i] == _flat[i])
+	    valid[i] |= units[i].pages & full_mask();
+    }
+    free(_flat);
+    free(_evict);
+}
+
+/* units with some pages on SSD, by CLOCK count and then location, so
+ * warm-up reads of equally hot units are in object order
+ */
+int read_cache_impl::save_hot(void) {
+    std::unique_lock lk(m);
+    if (shared || hot_name == "")
+	return 0;
+    std::vector<std::tuple<int,uint32_t,uint32_t>> units;
+    for (int i = 0; i < super->units; i++)
+	if (flat_map[i].obj != 0 && valid[i] != 0)
+	    units.push_back(std::make_tuple(-a_bit[i],
+					    (uint32_t)flat_map[i].obj,
+					    (uint32_t)flat_map[i].offset));
+    lk.unlock();
+    std::sort(units.begin(), units.end());
+
+    size_t units_offset = sizeof(obj_hdr) + sizeof(obj_hot_hdr);
+    size_t bytes = units_offset + units.size() * sizeof(hot_unit);
+    uint32_t sectors = round_up(bytes, 4096) / 512;
+    char *buf = (char*)calloc(sectors, 512);
+
+    auto h = (obj_hdr*)buf;
+    *h = (obj_hdr){.magic = LSVD_MAGIC, .version = 1, .vol_uuid = {0},
+		   .type = LSVD_HOT, .seq = 0,
+		   .hdr_sectors = sectors, .data_sectors = 0};
+    memcpy(h->vol_uuid, be->uuid, sizeof(uuid_t));
+    auto hh = (obj_hot_hdr*)(h+1);
+    *hh = (obj_hot_hdr){.unit_sectors = (uint32_t)unit_sectors,
+			.units_offset = (uint32_t)units_offset,
+			.units_len = (uint32_t)(units.size() * sizeof(hot_unit))};
+    auto hu = (hot_unit*)(buf + units_offset);
+    for (auto [a, seq, unit] : units)
+	*hu++ = (hot_unit){.seq = seq, .unit = unit};
+
+    iovec iov = {buf, sectors * 512UL};
+    int rv = io->write_object(hot_name.c_str(), &iov, 1);
+    free(buf);
+    return rv;
+}
+
+/* The saved units may be a different size, and objects may have
+ * been cleaned since, so the list is checked against the object map:
+ * each unit is warmed up only if something still points into it, and
+ * only the part from the first to the last sector in use.
+ */
+void read_cache_impl::load_hot(const char *name) {
+    std::unique_lock lk(m);
+    hot_name = name;
+    if (shared || warm_rate <= 0 || nothreads)
+	return;
+    lk.unlock();
+
+    object_reader reader(io);
+    char *buf = reader.read_object_hdr(name, false);
+    if (buf == NULL)		// nothing saved yet
+	return;
+    auto h = (obj_hdr*)buf;
+    auto hh = (obj_hot_hdr*)(h+1);
+    if (h->magic != LSVD_MAGIC || h->type != LSVD_HOT ||
+	memcmp(h->vol_uuid, be->uuid, sizeof(uuid_t)) != 0 ||
+	hh->unit_sectors == 0 ||
+	(size_t)hh->units_offset + hh->units_len > h->hdr_sectors * 512UL) {
+	free(buf);
+	return;
+    }
+
+    /* our units, in rank order, and the range in use in each
+     */
+    std::vector<extmap::obj_offset> order;
+    std::map<extmap::obj_offset,std::pair<sector_t,sector_t>> live;
+    auto hu = (hot_unit*)(buf + hh->units_offset);
+    int n_saved = hh->units_len / sizeof(hot_unit);
+    for (int i = 0; i < n_saved; i++) {
+	sector_t base = (sector_t)hu[i].unit * hh->unit_sectors,
+	    limit = base + hh->unit_sectors;
+	for (auto u = base / unit_sectors; u * unit_sectors < limit; u++) {
+	    extmap::obj_offset unit = {hu[i].seq, u};
+	    if (live.find(unit) != live.end())
+		continue;
+	    live[unit] = std::make_pair((sector_t)unit_sectors, (sector_t)0);
+	    order.push_back(unit);
+	}
+    }
+    free(buf);
+
+    std::shared_lock lk2(*obj_lock);
+    for (auto it = obj_map->begin(); it != obj_map->end(); it++) {
+	auto [base, limit, ptr] = it->vals();
+	sector_t lo = ptr.offset, hi = lo + (limit - base);
+	extmap::obj_offset first = {ptr.obj, lo / unit_sectors};
+	for (auto l_it = live.lower_bound(first);
+	     l_it != live.end() && l_it->first.obj == ptr.obj &&
+		 l_it->first.offset * unit_sectors < hi; l_it++) {
+	    sector_t u_base = l_it->first.offset * unit_sectors;
+	    auto &[u_lo, u_hi] = l_it->second;
+	    u_lo = std::min(u_lo, std::max(lo, u_base) - u_base);
+	    u_hi = std::max(u_hi, std::min(hi, u_base + unit_sectors) - u_base);
+	}
+    }
+    lk2.unlock();
+
+    extent_list units;
+    for (auto unit : order) {
+	auto [u_lo, u_hi] = live[unit];
+	if (u_lo >= u_hi)
+	    continue;
+	extmap::obj_offset oo = {unit.obj, unit.offset * unit_sectors + u_lo};
+	units.push_back(std::make_tuple((sector_t)0, u_hi - u_lo, oo));
+    }
+    if (units.size() == 0)
+	return;
+
+    lk.lock();
+    misc_threads.pool.push(std::thread(&read_cache_impl::warm_thread,
+				       this, &misc_threads, units));
+}
+
+/* prefetch the hot set, a tick's worth of units at a time. Stops
+ * before the cache is full enough to evict, so it never pushes out
+ * anything the new host has read itself; whatever is left gets
+ * read in on demand.
+ */
+void read_cache_impl::warm_thread(thread_pool<int> *p, extent_list units) {
+    pthread_setname_np(pthread_self(), "rcache_warm");
+    auto tick = std::chrono::milliseconds(100);
+    size_t per_tick = std::max(1L, warm_rate / 10 / (unit_sectors * 512L));
+
+    std::unique_lock<std::mutex> lk(m);
+    for (size_t i = 0; i < units.size() && p->running; ) {
+	if ((int)free_blks.size() <= super->units / 16)
+	    break;
+	size_t j = std::min(i + per_tick, units.size());
+	extent_list own, theirs;
+	for (; i < j; i++)
+	    (base_rc != NULL && std::get<2>(units[i]).obj <= base_seq ?
+	     theirs : own).push_back(units[i]);
+	lk.unlock();
+	if (theirs.size() > 0)
+	    base_rc->prefetch(theirs);
+	prefetch(own);
+	lk.lock();
+	p->cv.wait_for(lk, tick);
+    }
 }
 
 /* --------- Debug methods ----------- */
@@ -625,11 +1590,13 @@ void read_cache_impl::get_info(j_read_super **p_super,
 
 void read_cache_impl::do_add(extmap::obj_offset unit, char *buf) {
     std::unique_lock lk(m);
-    char *_buf = (char*)aligned_alloc(512, 65536);
-    memcpy(_buf, buf, 65536);
+    char *_buf = (char*)aligned_alloc(512, unit_sectors*512L);
+    memcpy(_buf, buf, unit_sectors*512L);
     int n = free_blks.back();
     free_blks.pop_back();
-    written[n] = true;
+    valid[n] = full_mask();
+    a_bit[n] = 0;
+    prefetched[n] = 0;
     map[unit] = n;
     flat_map[n] = unit;
     off_t nvme_offset = (super->base*8 + n*unit_sectors)*512L;
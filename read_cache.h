@@ -17,14 +17,17 @@
 #include <map>
 
 class translate;
+class sharded_rwlock;
 class objmap;
 class backend;
 class nvme;
+class lsvd_config;
+struct lsvd_metrics;
 
 struct j_read_super;
 #include "extent.h"
 
-class read_cache {
+class read_cache : public gc_cache {
 public:
 
     virtual ~read_cache() {};
@@ -32,6 +35,25 @@ public:
     virtual std::tuple<size_t,size_t,request*>
         async_read(size_t offset, char *buf, size_t len) = 0;
 
+    /* read all of [offset,offset+len), zero-filling unmapped sectors.
+     * Appends one request per merged I/O to 'reqs'; run each, and
+     * each will notify once.
+     */
+    virtual void async_readv(size_t offset, char *buf, size_t len,
+                             std::vector<request*> &reqs) = 0;
+
+    /* the write cache is dropping [lba,lba+sectors), a copy of which
+     * is still on its SSD 'src_ssd' (file src_fd) at byte offset
+     * nvme_offset. Objects in [obj_seq,obj_limit) hold that write.
+     * Copies whatever whole 4KB pages it can into the cache;
+     * synchronous. If the write cache shares our file, the kernel
+     * copies within it (copy_file_range), remapping the pages in place
+     * where the filesystem supports it.
+     */
+    virtual void promote(sector_t lba, sector_t sectors, nvme *src_ssd,
+                         int src_fd, off_t nvme_offset, int obj_seq,
+                         int obj_limit) = 0;
+
     /* debugging. 
      * TODO: document the first three methods
      */
@@ -45,11 +67,39 @@ public:
     virtual void get_info(j_read_super **p_super, extmap::obj_offset **p_flat, 
                           std::vector<int> **p_free_blks,
                           std::map<extmap::obj_offset,int> **p_map) = 0;
+
+    /* counters and latencies are added here, if not NULL
+     */
+    virtual void set_metrics(lsvd_metrics *m) = 0;
+
+    /* clones: reads of objects up to 'seq' (the base image's) go to
+     * 'base', a cache shared with other clones of the same image
+     */
+    virtual void set_base(read_cache *base, int seq) = 0;
+
+    /* a cache shared between images. The filler (whoever holds the
+     * lock on the file) adds blocks but never evicts, so blocks never
+     * move; everyone else only reads what's there, picking up the
+     * filler's additions from its saved map every few seconds.
+     */
+    virtual void set_shared(bool filler) = 0;
+
+    /* hot set, so a cache on a new host (live migration, replaced
+     * SSD) doesn't start cold. load_hot reads backend object 'name'
+     * if it exists and prefetches the units it lists that are still
+     * in use, hottest first, in the background at rcache_warm_rate;
+     * save_hot writes the cached units there, ranked by CLOCK count.
+     * After load_hot it's saved every rcache_hot_interval seconds.
+     * Neither does anything for a shared cache.
+     */
+    virtual void load_hot(const char *name) = 0;
+    virtual int save_hot(void) = 0;
 };
 
 extern read_cache *make_read_cache(uint32_t blkno, int _fd, bool nt,
                                    translate *_be, extmap::objmap *map,
-                                   std::shared_mutex *m, backend *_io);
+                                   sharded_rwlock *m, backend *_io,
+                                   lsvd_config *cfg);
 
 #endif
 
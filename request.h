@@ -15,6 +15,8 @@
  *  - run(parent): begin execution
  *  - notify(rv): notification of completion
  *  - TODO: wait(): wait for completion
+ *  - failed(): backend I/O error, for the parent to check in
+ *    notify(child). Everything else always succeeds.
  */
 class request {
 public:
@@ -22,6 +24,7 @@ public:
     virtual void run(request *parent) = 0;
     virtual void notify(request *child) = 0;
     virtual void release() = 0;
+    virtual bool failed() { return false; }
     virtual ~request(){}
     request() {}
 };
@@ -0,0 +1,798 @@
+/*
+ * file:        s3_backend.cc
+ * description: backend interface using S3 objects, via the libcurl
+ *              multi interface
+ * author:      Peter Desnoyers, Northeastern University
+ * Copyright 2021, 2022 Peter Desnoyers
+ * license:     GNU LGPL v2.1 or newer
+ *              LGPL-2.1-or-later
+ *
+ * All HTTP traffic runs on one thread, which owns the curl multi
+ * handle and its pool of keep-alive connections (s3_connections).
+ * Requests are signed with AWS SigV4, with an unsigned payload - data
+ * objects carry their own CRCs (see backend_crc).
+ *  - reads are one ranged GET, scattered into the caller's iovecs.
+ *    A GET that takes longer than the s3_hedge percentile of recent
+ *    reads gets a second copy sent, and the first one back wins.
+ *  - writes bigger than s3_part_size are multipart uploads, with
+ *    the parts sent in parallel
+ *  - 5xx, 429 and connection errors are retried with backoff
+ */
+
+#include <curl/curl.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <uuid/uuid.h>
+
+#include <vector>
+#include <string>
+#include <set>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cassert>
+
+#include "lsvd_types.h"
+#include "smartiov.h"
+#include "request.h"
+#include "backend.h"
+#include "config.h"
+#include "s3_backend.h"
+#include "metrics.h"		// m_now
+
+enum s3_kind { S3_GET, S3_PUT, S3_DELETE,
+	       S3_MP_CREATE, S3_MP_PART, S3_MP_COMPLETE, S3_MP_ABORT };
+
+class s3_backend;
+class s3_op;
+
+/* one HTTP request; a hedged GET has two of them racing. Both
+ * write into the same buffers, which is harmless - objects never
+ * change, and all the callbacks run on the one curl thread.
+ */
+struct s3_xfer {
+    s3_op      *op;
+    s3_kind     kind;
+    int         part = 0;	// multipart: part number (from 1)
+    CURL       *h = NULL;
+    curl_slist *hdrs = NULL;
+    smartiov    iovs;		// PUT source, GET destination
+    int         iov_i = 0;	// cursor into iovs
+    size_t      iov_off = 0;
+    size_t      got = 0;	// GET bytes received
+    std::string body;		// POST body
+    size_t      body_pos = 0;
+    std::string resp;		// response body, if not object data
+    std::string etag;
+    uint64_t    t0 = 0;
+
+    /* copy up to len bytes at the cursor; to_iov: into iovs
+     */
+    size_t copy(char *buf, size_t len, bool to_iov) {
+	size_t done = 0;
+	while (done < len && iov_i < iovs.size()) {
+	    auto &v = iovs[iov_i];
+	    size_t n = std::min(len - done, v.iov_len - iov_off);
+	    if (to_iov)
+		memcpy((char*)v.iov_base + iov_off, buf + done, n);
+	    else
+		memcpy(buf + done, (char*)v.iov_base + iov_off, n);
+	    done += n;
+	    iov_off += n;
+	    if (iov_off == v.iov_len) {
+		iov_i++;
+		iov_off = 0;
+	    }
+	}
+	return done;
+    }
+    void rewind(void) {
+	iov_i = iov_off = got = body_pos = 0;
+	resp.clear();
+	etag.clear();
+    }
+};
+
+/* one object operation - GET, PUT (single or multipart) or DELETE.
+ * Async ones notify 'parent' and delete themselves when done, sync
+ * ones wake up the caller.
+ */
+class s3_op : public request {
+public:
+    s3_backend *be;
+    s3_kind     kind;		// S3_GET, S3_PUT, S3_DELETE
+    std::string bucket;
+    std::string key;
+    smartiov    iovs;
+    size_t      offset = 0;	// GET
+    request    *parent = NULL;
+    int         status = 0;	// 0 / -1
+    uint64_t    t0 = 0;
+    int         tries = 0;
+    std::vector<s3_xfer*> active;
+
+    /* multipart upload */
+    std::string upload_id;
+    std::vector<std::string> etags;
+    int         parts_left = 0;
+
+    /* sync */
+    bool        sync = false;
+    bool        done = false;
+    std::mutex  m;
+    std::condition_variable cv;
+
+    s3_op(s3_backend *be_, s3_kind kind_, const char *name,
+	  iovec *iov, int iovcnt, size_t offset_);
+    ~s3_op() {}
+
+    void run(request *parent_);
+    void notify(request *child) {}
+    void wait(void) {
+	std::unique_lock lk(m);
+	while (!done)
+	    cv.wait(lk);
+    }
+    void release(void) {}
+    bool failed(void) { return status < 0; }
+};
+
+class s3_backend : public backend {
+    std::string host;
+    std::string region;
+    std::string access_key;
+    std::string secret_key;
+    bool        https;
+    int         connections;
+    size_t      part_size;
+    int         hedge_pct;
+
+    CURLM      *multi;
+    std::vector<CURL*> idle;	// easy handles for reuse
+    std::thread th;
+    std::atomic<bool> running = true;
+
+    std::mutex  m;		// incoming
+    std::vector<s3_op*> incoming;
+
+    /* transient failures, relaunched at 'when'
+     */
+    struct retry {
+	uint64_t when;
+	s3_op   *op;
+	s3_kind  kind;
+	int      part;
+    };
+    std::vector<retry> retries;
+    static const int max_tries = 10;
+
+    /* hedging - primary GETs that could still get a twin, recent
+     * (unhedged-equivalent) GET latencies, and the current delay
+     */
+    static const size_t hedge_max = 1024*1024;
+    std::set<s3_xfer*> hedgeable;
+    std::vector<uint64_t> lat;
+    size_t      lat_n = 0;
+    uint64_t    hedge_nsecs = 0;	// 0 = not hedging (yet)
+    int         hedges_inflight = 0;
+
+    void loop(void);
+    void start(s3_op *op);
+    void launch(s3_op *op, s3_kind kind, int part);
+    void finish(s3_xfer *x, CURLcode result);
+    void complete(s3_op *op, int status);
+    void fail(s3_op *op);
+    void drop(s3_xfer *x);
+    void check_hedges(uint64_t now);
+    void add_latency(uint64_t nsecs);
+    void sign(s3_xfer *x, const char *method, std::string &path,
+	      std::string &query);
+    int sync_op(s3_op *op);
+
+public:
+    s3_backend(lsvd_config *cfg);
+    ~s3_backend();
+
+    void submit(s3_op *op);
+
+    int write_object(const char *name, iovec *iov, int iovcnt);
+    int read_object(const char *name, iovec *iov, int iovcnt,
+                    size_t offset);
+    int delete_object(const char *name);
+
+    request *make_write_req(const char *name, iovec *iov, int iovcnt);
+    request *make_read_req(const char *name, size_t offset,
+                           iovec *iov, int iovcnt);
+    request *make_read_req(const char *name, size_t offset,
+                           char *buf, size_t len);
+};
+
+backend *make_s3_backend(lsvd_config *cfg) {
+    return new s3_backend(cfg);
+}
+
+s3_op::s3_op(s3_backend *be_, s3_kind kind_, const char *name,
+	     iovec *iov, int iovcnt, size_t offset_) : iovs(iov, iovcnt) {
+    be = be_;
+    kind = kind_;
+    offset = offset_;
+    const char *slash = strchr(name, '/');
+    if (slash == NULL)
+	throw("S3 object name must be bucket/key");
+    bucket = std::string(name, slash - name);
+    key = std::string(slash+1);
+}
+
+void s3_op::run(request *parent_) {
+    parent = parent_;
+    be->submit(this);
+}
+
+/* ---------- SigV4 ---------- */
+
+static std::string hex(const unsigned char *p, int len) {
+    static const char *digits = "0123456789abcdef";
+    std::string s;
+    for (int i = 0; i < len; i++) {
+	s += digits[p[i] >> 4];
+	s += digits[p[i] & 15];
+    }
+    return s;
+}
+
+static std::string hmac(const std::string &key, const std::string &data) {
+    unsigned char out[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    HMAC(EVP_sha256(), key.data(), key.size(),
+	 (const unsigned char*)data.data(), data.size(), out, &len);
+    return std::string((char*)out, len);
+}
+
+static std::string sha256_hex(const std::string &data) {
+    unsigned char out[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char*)data.data(), data.size(), out);
+    return hex(out, sizeof(out));
+}
+
+/* RFC 3986 unreserved characters stay as-is
+ */
+static std::string uri_encode(const std::string &s, bool keep_slash) {
+    std::string out;
+    char buf[4];
+    for (unsigned char c : s) {
+	if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' ||
+	    (c == '/' && keep_slash))
+	    out += c;
+	else {
+	    sprintf(buf, "%%%02X", c);
+	    out += buf;
+	}
+    }
+    return out;
+}
+
+/* adds the x-amz-* and Authorization headers to x->hdrs. 'query'
+ * must already be in canonical (sorted, encoded) form.
+ */
+void s3_backend::sign(s3_xfer *x, const char *method, std::string &path,
+		      std::string &query) {
+    char date[32], day[16];
+    time_t t = time(NULL);
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(date, sizeof(date), "%Y%m%dT%H%M%SZ", &tm);
+    strftime(day, sizeof(day), "%Y%m%d", &tm);
+
+    std::string payload = "UNSIGNED-PAYLOAD";
+    std::string canonical = std::string(method) + "\n" + path + "\n" +
+	query + "\n" +
+	"host:" + host + "\n" +
+	"x-amz-content-sha256:" + payload + "\n" +
+	"x-amz-date:" + date + "\n\n" +
+	"host;x-amz-content-sha256;x-amz-date\n" + payload;
+    std::string scope = std::string(day) + "/" + region + "/s3/aws4_request";
+    std::string to_sign = std::string("AWS4-HMAC-SHA256\n") + date + "\n" +
+	scope + "\n" + sha256_hex(canonical);
+
+    std::string k = hmac("AWS4" + secret_key, day);
+    k = hmac(k, region);
+    k = hmac(k, "s3");
+    k = hmac(k, "aws4_request");
+    std::string sig = hmac(k, to_sign);
+
+    std::string auth = "Authorization: AWS4-HMAC-SHA256 Credential=" +
+	access_key + "/" + scope +
+	", SignedHeaders=host;x-amz-content-sha256;x-amz-date, Signature=" +
+	hex((unsigned char*)sig.data(), sig.size());
+    x->hdrs = curl_slist_append(x->hdrs, auth.c_str());
+    x->hdrs = curl_slist_append(x->hdrs,
+				("x-amz-content-sha256: " + payload).c_str());
+    x->hdrs = curl_slist_append(x->hdrs,
+				(std::string("x-amz-date: ") + date).c_str());
+}
+
+/* ---------- curl callbacks ---------- */
+
+static size_t write_cb(char *ptr, size_t size, size_t nmemb, void *arg) {
+    auto x = (s3_xfer*)arg;
+    size_t len = size * nmemb;
+    long status = 0;
+    curl_easy_getinfo(x->h, CURLINFO_RESPONSE_CODE, &status);
+    if (x->kind == S3_GET && status / 100 == 2)
+	x->got += x->copy(ptr, len, true);
+    else
+	x->resp.append(ptr, len);
+    return len;
+}
+
+static size_t read_cb(char *ptr, size_t size, size_t nmemb, void *arg) {
+    auto x = (s3_xfer*)arg;
+    size_t len = size * nmemb;
+    if (x->kind == S3_PUT || x->kind == S3_MP_PART)
+	return x->copy(ptr, len, false);
+    size_t n = std::min(len, x->body.size() - x->body_pos);
+    memcpy(ptr, x->body.data() + x->body_pos, n);
+    x->body_pos += n;
+    return n;
+}
+
+/* curl rewinds an upload if it has to resend it
+ */
+static int seek_cb(void *arg, curl_off_t offset, int origin) {
+    auto x = (s3_xfer*)arg;
+    if (origin != SEEK_SET)
+	return CURL_SEEKFUNC_CANTSEEK;
+    x->iov_i = x->iov_off = 0;
+    x->body_pos = 0;
+    if (x->kind == S3_PUT || x->kind == S3_MP_PART) {
+	std::vector<char> skip(64*1024);
+	for (curl_off_t done = 0; done < offset; ) {
+	    size_t n = std::min((curl_off_t)skip.size(), offset - done);
+	    x->copy(skip.data(), n, false);
+	    done += n;
+	}
+    }
+    else
+	x->body_pos = offset;
+    return CURL_SEEKFUNC_OK;
+}
+
+static size_t header_cb(char *buf, size_t size, size_t nitems, void *arg) {
+    auto x = (s3_xfer*)arg;
+    size_t len = size * nitems;
+    if (len > 5 && !strncasecmp(buf, "etag:", 5)) {
+	std::string v(buf+5, len-5);
+	auto a = v.find_first_not_of(" \t"), b = v.find_last_not_of(" \t\r\n");
+	if (a != std::string::npos)
+	    x->etag = v.substr(a, b - a + 1);
+    }
+    return len;
+}
+
+/* text between <tag> and </tag>, or "" */
+static std::string xml_get(std::string &xml, const char *tag) {
+    std::string open = std::string("<") + tag + ">",
+	close = std::string("</") + tag + ">";
+    auto a = xml.find(open);
+    if (a == std::string::npos)
+	return "";
+    a += open.size();
+    auto b = xml.find(close, a);
+    return (b == std::string::npos) ? "" : xml.substr(a, b - a);
+}
+
+/* ---------- the curl thread ---------- */
+
+s3_backend::s3_backend(lsvd_config *cfg) {
+    static std::once_flag once;
+    std::call_once(once, []{ curl_global_init(CURL_GLOBAL_ALL); });
+
+    host = cfg->s3_host;
+    region = cfg->s3_region;
+    access_key = cfg->s3_access_key;
+    secret_key = cfg->s3_secret_key;
+    const char *val;
+    if (access_key == "" && (val = getenv("AWS_ACCESS_KEY_ID")))
+	access_key = val;
+    if (secret_key == "" && (val = getenv("AWS_SECRET_ACCESS_KEY")))
+	secret_key = val;
+    https = cfg->s3_https;
+    connections = std::max(cfg->s3_connections, 1);
+    part_size = cfg->s3_part_size;
+    if (part_size > 0 && part_size < 5*1024*1024)
+	part_size = 5*1024*1024;	// S3 minimum, except the last part
+    hedge_pct = cfg->s3_hedge;
+    lat.resize(512);
+
+    multi = curl_multi_init();
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)connections);
+    curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)connections);
+    curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, (long)connections);
+    th = std::thread(&s3_backend::loop, this);
+}
+
+s3_backend::~s3_backend() {
+    running = false;
+    curl_multi_wakeup(multi);
+    th.join();
+    for (auto h : idle)
+	curl_easy_cleanup(h);
+    curl_multi_cleanup(multi);
+}
+
+void s3_backend::submit(s3_op *op) {
+    std::unique_lock lk(m);
+    incoming.push_back(op);
+    lk.unlock();
+    curl_multi_wakeup(multi);
+}
+
+void s3_backend::loop(void) {
+    pthread_setname_np(pthread_self(), "s3_backend");
+    while (running) {
+	/* short timeouts only while something's waiting on the clock
+	 */
+	int timeout = (retries.size() || hedgeable.size()) ? 1 : 100;
+	curl_multi_poll(multi, NULL, 0, timeout, NULL);
+
+	std::vector<s3_op*> ops;
+	std::unique_lock lk(m);
+	ops.swap(incoming);
+	lk.unlock();
+	for (auto op : ops)
+	    start(op);
+
+	uint64_t now = m_now();
+	std::vector<retry> due;
+	for (auto it = retries.begin(); it != retries.end(); ) {
+	    if (it->when <= now) {
+		due.push_back(*it);
+		it = retries.erase(it);
+	    }
+	    else
+		it++;
+	}
+	for (auto r : due)
+	    launch(r.op, r.kind, r.part);
+
+	int n;
+	curl_multi_perform(multi, &n);
+	CURLMsg *msg;
+	while ((msg = curl_multi_info_read(multi, &n)) != NULL) {
+	    if (msg->msg != CURLMSG_DONE)
+		continue;
+	    s3_xfer *x;
+	    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&x);
+	    finish(x, msg->data.result);
+	}
+	check_hedges(m_now());
+    }
+}
+
+void s3_backend::start(s3_op *op) {
+    op->t0 = m_now();
+    if (op->kind == S3_PUT && part_size > 0 && op->iovs.bytes() > part_size)
+	launch(op, S3_MP_CREATE, 0);
+    else
+	launch(op, op->kind, 0);
+}
+
+/* build, sign and start one HTTP request for 'op'
+ */
+void s3_backend::launch(s3_op *op, s3_kind kind, int part) {
+    auto x = new s3_xfer;
+    x->op = op;
+    x->kind = kind;
+    x->part = part;
+    x->t0 = m_now();
+
+    CURL *h;
+    if (idle.size() > 0) {
+	h = idle.back();
+	idle.pop_back();
+	curl_easy_reset(h);
+    }
+    else
+	h = curl_easy_init();
+    x->h = h;
+
+    std::string path = "/" + uri_encode(op->bucket, false) + "/" +
+	uri_encode(op->key, true);
+    std::string query;
+    const char *method = "GET";
+    size_t len = op->iovs.bytes();
+
+    switch (kind) {
+    case S3_GET: {
+	x->iovs = op->iovs;
+	char range[64];
+	if (len > 0) {
+	    sprintf(range, "Range: bytes=%zu-%zu", op->offset,
+		    op->offset + len - 1);
+	    x->hdrs = curl_slist_append(x->hdrs, range);
+	}
+	break;
+    }
+    case S3_PUT:
+	method = "PUT";
+	x->iovs = op->iovs;
+	break;
+    case S3_DELETE:
+	method = "DELETE";
+	break;
+    case S3_MP_CREATE:
+	method = "POST";
+	query = "uploads=";
+	break;
+    case S3_MP_PART: {
+	method = "PUT";
+	size_t base = (part-1) * part_size;
+	x->iovs = op->iovs.slice(base, std::min(base + part_size, len));
+	query = "partNumber=" + std::to_string(part) + "&uploadId=" +
+	    uri_encode(op->upload_id, false);
+	break;
+    }
+    case S3_MP_COMPLETE:
+	method = "POST";
+	query = "uploadId=" + uri_encode(op->upload_id, false);
+	x->body = "<CompleteMultipartUpload>";
+	for (size_t i = 0; i < op->etags.size(); i++)
+	    x->body += "<Part><PartNumber>" + std::to_string(i+1) +
+		"</PartNumber><ETag>" + op->etags[i] + "</ETag></Part>";
+	x->body += "</CompleteMultipartUpload>";
+	break;
+    case S3_MP_ABORT:
+	method = "DELETE";
+	query = "uploadId=" + uri_encode(op->upload_id, false);
+	break;
+    }
+
+    sign(x, method, path, query);
+    x->hdrs = curl_slist_append(x->hdrs, "Expect:"); // no 100-continue
+    std::string url = std::string(https ? "https://" : "http://") + host +
+	path + (query.size() ? "?" + query : "");
+
+    curl_easy_setopt(h, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(h, CURLOPT_PRIVATE, (char*)x);
+    curl_easy_setopt(h, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(h, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(h, CURLOPT_CONNECTTIMEOUT_MS, 5000L);
+    curl_easy_setopt(h, CURLOPT_LOW_SPEED_LIMIT, 1L); // stalled for 30s
+    curl_easy_setopt(h, CURLOPT_LOW_SPEED_TIME, 30L);
+    curl_easy_setopt(h, CURLOPT_WRITEFUNCTION, write_cb);
+    curl_easy_setopt(h, CURLOPT_WRITEDATA, x);
+    curl_easy_setopt(h, CURLOPT_HEADERFUNCTION, header_cb);
+    curl_easy_setopt(h, CURLOPT_HEADERDATA, x);
+
+    if (kind == S3_PUT || kind == S3_MP_PART) {
+	curl_easy_setopt(h, CURLOPT_UPLOAD, 1L);
+	curl_easy_setopt(h, CURLOPT_INFILESIZE_LARGE,
+			 (curl_off_t)x->iovs.bytes());
+	curl_easy_setopt(h, CURLOPT_READFUNCTION, read_cb);
+	curl_easy_setopt(h, CURLOPT_READDATA, x);
+	curl_easy_setopt(h, CURLOPT_SEEKFUNCTION, seek_cb);
+	curl_easy_setopt(h, CURLOPT_SEEKDATA, x);
+    }
+    else if (kind == S3_MP_CREATE || kind == S3_MP_COMPLETE) {
+	curl_easy_setopt(h, CURLOPT_POST, 1L);
+	curl_easy_setopt(h, CURLOPT_POSTFIELDSIZE, (long)x->body.size());
+	curl_easy_setopt(h, CURLOPT_READFUNCTION, read_cb);
+	curl_easy_setopt(h, CURLOPT_READDATA, x);
+	curl_easy_setopt(h, CURLOPT_SEEKFUNCTION, seek_cb);
+	curl_easy_setopt(h, CURLOPT_SEEKDATA, x);
+    }
+    else if (kind == S3_DELETE || kind == S3_MP_ABORT)
+	curl_easy_setopt(h, CURLOPT_CUSTOMREQUEST, "DELETE");
+    curl_easy_setopt(h, CURLOPT_HTTPHEADER, x->hdrs);
+
+    op->active.push_back(x);
+    if (kind == S3_GET && hedge_nsecs > 0 && len <= hedge_max &&
+	op->active.size() == 1)
+	hedgeable.insert(x);
+    curl_multi_add_handle(multi, h);
+}
+
+/* take an xfer out of curl and its op, keeping the handle
+ */
+void s3_backend::drop(s3_xfer *x) {
+    curl_multi_remove_handle(multi, x->h);
+    idle.push_back(x->h);
+    curl_slist_free_all(x->hdrs);
+    hedgeable.erase(x);
+    auto &a = x->op->active;
+    a.erase(std::find(a.begin(), a.end(), x));
+    delete x;
+}
+
+void s3_backend::finish(s3_xfer *x, CURLcode result) {
+    auto op = x->op;
+    long status = 0;
+    curl_easy_getinfo(x->h, CURLINFO_RESPONSE_CODE, &status);
+    bool ok = (result == CURLE_OK && status / 100 == 2);
+
+    /* CompleteMultipartUpload can fail after sending "200 OK"
+     */
+    if (ok && x->kind == S3_MP_COMPLETE && x->resp.find("<Error>") !=
+	std::string::npos)
+	ok = false, status = 500;
+
+    auto kind = x->kind;
+    int part = x->part;
+    size_t got = x->got;
+    std::string etag = x->etag, resp = x->resp;
+    drop(x);
+
+    if (!ok) {
+	if (op->active.size() > 0 && kind == S3_GET) { // its twin may do better
+	    hedges_inflight--;
+	    return;
+	}
+	bool transient = (result != CURLE_OK || status >= 500 ||
+			  status == 429 || status == 408);
+	if (transient && ++op->tries < max_tries) {
+	    uint64_t backoff = std::min(50000000UL << op->tries, 5000000000UL);
+	    retries.push_back((retry){m_now() + backoff, op, kind, part});
+	    return;
+	}
+	if (!op->sync && status != 404)
+	    fprintf(stderr, "S3 %s/%s: %s status %ld (%s)\n", op->bucket.c_str(),
+		    op->key.c_str(), curl_easy_strerror(result), status,
+		    xml_get(resp, "Code").c_str());
+	fail(op);
+	return;
+    }
+
+    switch (kind) {
+    case S3_GET:
+	/* first one back wins
+	 */
+	while (op->active.size() > 0) {
+	    hedges_inflight--;
+	    drop(op->active.back());
+	}
+	if (op->iovs.bytes() <= hedge_max)
+	    add_latency(m_now() - op->t0);
+	complete(op, got > 0 || op->iovs.bytes() == 0 ? 0 : -1);
+	break;
+    case S3_PUT:
+    case S3_DELETE:
+	complete(op, 0);
+	break;
+    case S3_MP_CREATE: {
+	op->upload_id = xml_get(resp, "UploadId");
+	if (op->upload_id == "") {
+	    fail(op);
+	    break;
+	}
+	int n = (op->iovs.bytes() + part_size - 1) / part_size;
+	op->etags.resize(n);
+	op->parts_left = n;
+	for (int i = 1; i <= n; i++)
+	    launch(op, S3_MP_PART, i);
+	break;
+    }
+    case S3_MP_PART:
+	op->etags[part-1] = etag;
+	if (--op->parts_left == 0)
+	    launch(op, S3_MP_COMPLETE, 0);
+	break;
+    case S3_MP_COMPLETE:
+	complete(op, 0);
+	break;
+    case S3_MP_ABORT:
+	complete(op, -1);
+	break;
+    }
+}
+
+/* give up; a multipart upload gets aborted first, so the parts
+ * don't linger (and cost money)
+ */
+void s3_backend::fail(s3_op *op) {
+    while (op->active.size() > 0)	// other parts
+	drop(op->active.back());
+    retries.erase(std::remove_if(retries.begin(), retries.end(),
+				 [&](retry &r) { return r.op == op; }),
+		  retries.end());
+    if (op->upload_id != "" && op->kind == S3_PUT && op->tries < max_tries+1) {
+	op->tries = max_tries+1;	// abort only once
+	launch(op, S3_MP_ABORT, 0);
+	return;
+    }
+    complete(op, -1);
+}
+
+void s3_backend::complete(s3_op *op, int status) {
+    op->status = status;
+    if (op->sync) {
+	std::unique_lock lk(op->m);
+	op->done = true;
+	op->cv.notify_all();
+    }
+    else {
+	op->parent->notify(op);
+	delete op;
+    }
+}
+
+/* second copy of any GET that's been out longer than hedge_nsecs,
+ * with at most a quarter of the connections going to hedges
+ */
+void s3_backend::check_hedges(uint64_t now) {
+    if (hedge_nsecs == 0 || hedgeable.size() == 0)
+	return;
+    std::vector<s3_xfer*> late;
+    for (auto x : hedgeable)
+	if (now - x->t0 > hedge_nsecs)
+	    late.push_back(x);
+    for (auto x : late) {
+	if (hedges_inflight >= connections / 4)
+	    break;
+	hedgeable.erase(x);
+	hedges_inflight++;
+	launch(x->op, S3_GET, 0);
+    }
+}
+
+/* every 64 reads, the hedge delay becomes the s3_hedge percentile
+ * of the last lat.size() reads. Hedged ones count as however long
+ * the first copy had been out, so the tail doesn't shrink just
+ * because we're hedging it.
+ */
+void s3_backend::add_latency(uint64_t nsecs) {
+    if (hedge_pct <= 0)
+	return;
+    lat[lat_n++ % lat.size()] = nsecs;
+    if (lat_n % 64 != 0)
+	return;
+    std::vector<uint64_t> v(lat.begin(),
+			    lat.begin() + std::min(lat_n, lat.size()));
+    size_t i = v.size() * hedge_pct / 100;
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    hedge_nsecs = v[i];
+}
+
+/* ---------- backend methods ---------- */
+
+int s3_backend::sync_op(s3_op *op) {
+    op->sync = true;
+    submit(op);
+    op->wait();
+    int val = op->status;
+    delete op;
+    return val;
+}
+
+int s3_backend::write_object(const char *name, iovec *iov, int iovcnt) {
+    return sync_op(new s3_op(this, S3_PUT, name, iov, iovcnt, 0));
+}
+
+int s3_backend::read_object(const char *name, iovec *iov, int iovcnt,
+			    size_t offset) {
+    return sync_op(new s3_op(this, S3_GET, name, iov, iovcnt, offset));
+}
+
+int s3_backend::delete_object(const char *name) {
+    return sync_op(new s3_op(this, S3_DELETE, name, NULL, 0, 0));
+}
+
+request *s3_backend::make_write_req(const char *name, iovec *iov,
+				    int iovcnt) {
+    return new s3_op(this, S3_PUT, name, iov, iovcnt, 0);
+}
+
+request *s3_backend::make_read_req(const char *name, size_t offset,
+				   iovec *iov, int iovcnt) {
+    return new s3_op(this, S3_GET, name, iov, iovcnt, offset);
+}
+
+request *s3_backend::make_read_req(const char *name, size_t offset,
+				   char *buf, size_t len) {
+    iovec iov = {buf, len};
+    return new s3_op(this, S3_GET, name, &iov, 1, offset);
+}
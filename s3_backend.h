@@ -0,0 +1,20 @@
+/*
+ * file:        s3_backend.h
+ * description: backend interface using S3 objects
+ * author:      Peter Desnoyers, Northeastern University
+ * Copyright 2021, 2022 Peter Desnoyers
+ * license:     GNU LGPL v2.1 or newer
+ *              LGPL-2.1-or-later
+ */
+
+#ifndef S3_BACKEND_H
+#define S3_BACKEND_H
+
+class backend;
+class lsvd_config;
+
+/* object names are <bucket>/<key>, like <pool>/<object> for RADOS
+ */
+extern backend *make_s3_backend(lsvd_config *cfg);
+
+#endif
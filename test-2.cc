@@ -253,6 +253,32 @@ TEST_CASE("Checkpoint") {
     xlate_close(xlate);
 }
 
+/* data objects written after the last checkpoint get replayed
+ */
+TEST_CASE("Recover after checkpoint") {
+    cleanup();
+    write_super(img, 0, 1);
+    _dbg *xlate;
+    xlate_open((char*)img.c_str(), 1, true, (void**)&xlate);
+    std::vector<char> d(4096,'X');
+    xlate_write(xlate, d.data(), 0, d.size());
+    xlate_flush(xlate);
+    CHECK(xlate_checkpoint(xlate) == 2);
+    xlate_close(xlate);
+
+    for (int i = 3; i < 7; i++) {
+	std::string oname = img + "." + hex(i);
+	write_data_1(oname, 0, i);
+    }
+    xlate_open((char*)img.c_str(), 1, true, (void**)&xlate);
+    CHECK(xlate_seq(xlate) == 7);
+
+    char buf[512];
+    xlate_read(xlate, buf, 0, 512);
+    CHECK(verify_bytes(buf, 0, 512, 'A'));
+    xlate_close(xlate);
+}
+
 TEST_CASE("Flush thread") {
     cleanup();
     write_super(img, 0, 1);
@@ -372,3 +398,84 @@ TEST_CASE("More object/checkpoint tests") {
 
     xlate_close(xlate);
 }
+
+TEST_CASE("Trim") {
+    cleanup();
+    write_super(img, 0, 1);
+    _dbg *xlate;
+    xlate_open((char*)img.c_str(), 1, true, (void**)&xlate);
+
+    std::vector<char> d(8192,'T');
+    xlate_write(xlate, d.data(), 0, d.size());
+    xlate_flush(xlate);
+    xlate_trim(xlate, 0, 4096);
+    xlate_flush(xlate);
+    int n = xlate_checkpoint(xlate);
+
+    obj_hdr          hdr;
+    obj_ckpt_hdr     ckpt_hdr;
+    std::vector<int> ckpts;
+    std::vector<x_mapentry> entries;
+    std::vector<ckpt_obj> objs;
+    read_ckpt((img + "." + hex(n)).c_str(), &hdr, &ckpt_hdr,
+	      ckpts, entries, objs);
+    CHECK(objs.size() == 2);
+    CHECK(objs[0].seq == 1);
+    CHECK(objs[0].data_sectors == 16);
+    CHECK(objs[0].live_sectors == 8);
+    CHECK(objs[1].data_sectors == 0);
+    CHECK(entries.size() == 1);
+    CHECK(entries[0] == (x_mapentry){8,8,1,9});
+
+    std::vector<char> buf(8192,0xFF);
+    xlate_read(xlate, buf.data(), 0, 8192);
+    CHECK(verify_bytes(buf.data(), 0, 4096, 0));
+    CHECK(verify_bytes(buf.data(), 4096, 4096, 'T'));
+    xlate_close(xlate);
+
+    /* replay the trim from the data object header, i.e. without
+     * the checkpoint
+     */
+    unlink((img + "." + hex(n)).c_str());
+    write_super(img, 0, 1);
+    xlate_open((char*)img.c_str(), 1, true, (void**)&xlate);
+    std::fill(buf.begin(), buf.end(), 0xFF);
+    xlate_read(xlate, buf.data(), 0, 8192);
+    CHECK(verify_bytes(buf.data(), 0, 4096, 0));
+    CHECK(verify_bytes(buf.data(), 4096, 4096, 'T'));
+    xlate_close(xlate);
+}
+
+TEST_CASE("Coalesce") {
+    cleanup();
+    write_super(img, 0, 1);
+    _dbg *xlate;
+    xlate_open((char*)img.c_str(), 1, true, (void**)&xlate);
+
+    std::vector<char> d1(4096,'A'), d2(4096,'B'), d3(4096,'C');
+    xlate_write(xlate, d1.data(), 4096, d1.size());
+    xlate_write(xlate, d2.data(), 4096, d2.size());
+    xlate_write(xlate, d3.data(), 0, d3.size());
+    xlate_flush(xlate);
+    int n = xlate_checkpoint(xlate);
+
+    obj_hdr          hdr;
+    obj_ckpt_hdr     ckpt_hdr;
+    std::vector<int> ckpts;
+    std::vector<x_mapentry> entries;
+    std::vector<ckpt_obj> objs;
+    read_ckpt((img + "." + hex(n)).c_str(), &hdr, &ckpt_hdr,
+	      ckpts, entries, objs);
+    CHECK(objs.size() == 1);
+    CHECK(objs[0].data_sectors == 16);
+    CHECK(objs[0].live_sectors == 16);
+    CHECK(entries.size() == 2);	// data stays in write order
+    CHECK(entries[0] == (x_mapentry){0,8,1,9});
+    CHECK(entries[1] == (x_mapentry){8,8,1,1});
+
+    std::vector<char> buf(8192,0xFF);
+    xlate_read(xlate, buf.data(), 0, 8192);
+    CHECK(verify_bytes(buf.data(), 0, 4096, 'C'));
+    CHECK(verify_bytes(buf.data(), 4096, 4096, 'B'));
+    xlate_close(xlate);
+}
@@ -173,6 +173,31 @@ class tests(unittest.TestCase):
         self.assertEqual(d, b'W'*4096 + b'X'*4096 + b'Y'*4096)
         time.sleep(0.01)
 
+    def test_6_delta_ckpt(self):
+        global wcache
+        restart()
+        for i in range(8):
+            wcache.write(i*8192, b'A'*4096)
+        wcache.checkpoint()
+        m1 = wcache.getmap(0, 1000)
+        self.assertEqual(wcache.getsuper().delta_blocks, 0)
+
+        # second checkpoint only logs the changes
+        wcache.write(8192, b'B'*8192)
+        wcache.write(5*8192, b'C'*512)
+        wcache.checkpoint()
+        ws = wcache.getsuper()
+        self.assertGreater(ws.delta_blocks, 0)
+        self.assertEqual(ws.map_entries, len(m1))
+        m2 = wcache.getmap(0, 1000)
+
+        wcache.shutdown()
+        wcache = lsvd.write_cache(nvme)
+        wcache.init(xlate,1)
+        self.assertEqual(wcache.getmap(0, 1000), m2)
+        self.assertEqual(wcache.read(8192, 8192), b'B'*8192)
+        time.sleep(0.01)
+
 
 if __name__ == '__main__':
     lsvd.io_start()
@@ -125,6 +125,44 @@ class tests(unittest.TestCase):
 
         finish()
         
+    # rcache.readv - whole range at once, with a hole in the middle
+    def test_4a_readv(self):
+        startup()
+        t2.write_data_1(img + '.00000001', 0, 1)
+        xlate.fakemap_update(0, 64, 1, 33)
+        xlate.fakemap_update(128, 320, 1, 33 + 128)
+        expected = b''.join([bytes(chr(65 + _%26), 'utf-8') * 512
+                                 if _ < 64 or _ >= 128 else b'\0' * 512
+                                 for _ in range(320)])
+        d = rcache.readv(0, 320*512)
+        self.assertEqual(d, expected)
+
+        time.sleep(0.1)
+        m = rcache.getmap()
+        self.assertEqual([_[0] for _ in m], [[1,0], [1,1], [1,2]])
+
+        d = rcache.readv(0, 320*512)
+        self.assertEqual(d, expected)
+        finish()
+
+    # second sequential readv prefetches the next two units' worth
+    # (object offset 32 isn't unit aligned, so that touches 3 units)
+    def test_4b_readahead(self):
+        startup()
+        t2.write_data_1(img + '.00000001', 0, 1)
+        xlate.fakemap_update(0, 1024, 1, 32)
+        d = rcache.readv(0, 65536)
+        d = rcache.readv(65536, 65536)
+        self.assertEqual(d, b''.join([bytes(chr(65 + (_+127)%26), 'utf-8') * 512
+                                          for _ in range(128)]))
+        time.sleep(0.1)
+        m = rcache.getmap()
+        self.assertEqual([_[0] for _ in m], [[1,0], [1,1], [1,2], [1,3], [1,4]])
+        d = rcache.readv(2*65536, 2*65536)
+        self.assertEqual(d, b''.join([bytes(chr(65 + (_+255)%26), 'utf-8') * 512
+                                          for _ in range(256)]))
+        finish()
+
     def test_5_evict(self):
         #print('Test 5')
         startup()
@@ -76,6 +76,21 @@ class tests(unittest.TestCase):
         
         rbd_finish(_img)
 
+    def test_3a_aio_flush(self):
+        _img = rbd_startup()
+        lsvd.rbd_aio_flush(_img)        # nothing outstanding
+        c = ord('A')
+        for i in range(26):
+            data = bytes(chr(c + i), 'utf-8') * 4096
+            lsvd.rbd_write(_img, i*4096, data)
+        lsvd.rbd_aio_flush(_img)
+
+        for i in range(26):
+            data = bytes(chr(c + i), 'utf-8') * 4096
+            d2 = lsvd.rbd_read(_img, i*4096, 4096)
+            self.assertEqual(d2, data)
+        rbd_finish(_img)
+
     # write cache is 125 pages = 1000 sectors
     # read cache is 16 * 64k blocks = 2048 sectors
     # volume is 10MiB = 20480 sectors = 2650 4KB pages
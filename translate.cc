@@ -11,6 +11,7 @@
 #include <unistd.h>
 #include <sys/uio.h>
 #include <string.h>
+#include <errno.h>
 
 #include <uuid/uuid.h>
 
@@ -24,12 +25,15 @@
 #include <map>
 
 #include <algorithm>
+#include <climits>
 
 #include <thread>
+#include <chrono>
 
 #include "extent.h"
 #include "lsvd_types.h"
 #include "request.h"
+#include "mempool.h"
 #include "objects.h"
 #include "objname.h"
 #include "config.h"
@@ -38,21 +42,69 @@
 #include "backend.h"
 #include "smartiov.h"
 #include "misc_cache.h"
+#include "obj_compress.h"
+#include "metrics.h"
+#include "io.h"
+#include "futex.h"
 
 
 /* ----------- Object translation layer -------------- */
 
+/* host-wide limit on backend write bandwidth, shared by every image
+ * in the process so that a burst on one volume can't swamp the OSDs
+ * for the rest. Writers go into debt and sleep it off, so an object
+ * bigger than the bucket still gets through, and images waiting at
+ * the same time are served roughly in order.
+ */
+class token_bucket {
+    std::mutex m;
+    double rate = 0;		// bytes/sec, 0 = unlimited
+    double depth = 0;
+    double tokens = 0;
+    std::chrono::steady_clock::time_point last;
+
+public:
+    void configure(long rate_, long depth_) {
+	std::unique_lock lk(m);
+	if (rate_ <= 0 || (rate_ == rate && depth_ == depth))
+	    return;
+	rate = rate_;
+	depth = depth_;
+	tokens = depth;
+	last = std::chrono::steady_clock::now();
+    }
+    void take(size_t bytes) {
+	std::unique_lock lk(m);
+	if (rate == 0)
+	    return;
+	auto now = std::chrono::steady_clock::now();
+	std::chrono::duration<double> dt = now - last;
+	last = now;
+	tokens = std::min(depth, tokens + dt.count() * rate) - bytes;
+	double debt = -tokens;
+	lk.unlock();
+	if (debt > 0)
+	    std::this_thread::sleep_for(
+		std::chrono::duration<double>(debt / rate));
+    }
+};
+static token_bucket host_bucket;
+
+class gc_chunk;
+class gc_write_req;
+
 class translate_impl : public translate {
     /* lock ordering: lock m before *map_lock
      */
     std::mutex         m;	// for things in this instance
     extmap::objmap    *map;	// shared object map
-    std::shared_mutex *map_lock; // locks the object map
+    sharded_rwlock *map_lock; // locks the object map
     lsvd_config       *cfg;
 
     std::atomic<int> seq;
 
     friend class translate_req;
+    friend class gc_write_req;
     
     class batch {
     public:
@@ -60,7 +112,9 @@ class translate_impl : public translate {
 	size_t len = 0;		// current data size
 	size_t max;		// done when len hits here
 	std::vector<data_map> entries;
+	extmap::cachemap2 trims; // discarded LBAs, applied after entries
 	int    seq = 0;		// sequence number for backend
+	futex_state writers;	// copying in, see reserve()
 
 	batch(size_t bytes){
 	    buf = (char*)malloc(bytes);
@@ -69,13 +123,32 @@ class translate_impl : public translate {
 	~batch(){
 	    free(buf);
 	}
-	void append(uint64_t lba, smartiov *iov) {
-	    auto bytes = iov->bytes();
+	/* reserve space for a write, with the lock held; the caller
+	 * copies into it after dropping the lock, then calls
+	 * done_writing(). Entries stay in reservation order.
+	 */
+	char *reserve(uint64_t lba, size_t bytes) {
 	    entries.push_back((data_map){lba, bytes/512});
 	    char *ptr = buf + len;
-	    iov->copy_out(ptr);
 	    len += bytes;
+	    writers.add(1);
+	    if (trims.size() > 0)	// later write wins over earlier trim
+		trims.trim(lba, lba + bytes/512);
+	    return ptr;
 	}
+	void done_writing(void) {
+	    writers.add(-1);
+	}
+	void wait_writers(void) {
+	    writers.wait_until([](int n) { return n == 0; });
+	}
+	void trim(int64_t base, int64_t limit) {
+	    trims.update(base, limit, base);
+	}
+	bool empty(void) {
+	    return len == 0 && trims.size() == 0;
+	}
+	void coalesce(void);
     };
     batch *b = NULL;
     
@@ -85,10 +158,17 @@ class translate_impl : public translate {
 	int data;		// sectors
 	int live;		// sectors
 	enum obj_type type;	// LSVD_DATA or LSVD_CKPT
+	int stored;		// data sectors in backend, compressed
     };
     std::map<int,obj_info> object_info;
 
     std::queue<uint32_t> checkpoints;
+    std::vector<uint32_t> ckpt_chain; // last full checkpoint + deltas
+
+    /* LBAs changed since the last checkpoint, for delta checkpoints.
+     * protected by *map_lock
+     */
+    extmap::cachemap2 *ckpt_dirty = new extmap::cachemap2;
     
     /* tracking completions for flush()
      */
@@ -99,29 +179,92 @@ class translate_impl : public translate {
     std::vector<bool> done;
     std::condition_variable cv;
 
+    /* write pacing: data objects in flight are limited to pace_window
+     * objects (and as many batches' worth of bytes). With xlate_latency
+     * set the window adapts - halved at most once a round trip when
+     * a write takes longer than that, else grown by one per window.
+     */
+    double    pace_window;
+    int       inflight = 0;
+    size_t    inflight_bytes = 0;
+    std::chrono::steady_clock::time_point last_cut;
+
+    bool pace_room(void) {
+	return inflight == 0 ||
+	    (inflight < (int)pace_window &&
+	     inflight_bytes < pace_window * cfg->batch_size);
+    }
+    void pace_complete(size_t bytes, long usecs);
+
     /* various constant state
      */
     char      single_prefix[128];
 
-    /* superblock has two sections: [obj_hdr] [super_hdr]
+    /* clones: {last object, name} for each image in the base chain,
+     * oldest first. Objects up to base_last aren't ours - they're
+     * never cleaned, and don't count in object_info.
+     */
+    std::vector<std::pair<int,std::string>> bases;
+    int       base_last = 0;
+    uuid_t    base_uuid = {0};
+    int load_base(void);
+
+    /* snapshots - objects up to snap_pin are in one, so GC leaves
+     * them alone (and stays out completely while snap_create is
+     * picking its checkpoint). Protected by m.
+     */
+    std::vector<snap_info> snaps;
+    int       snap_pin = 0;
+    bool      snap_pending = false;
+    void set_snap_pin(void);
+
+    /* superblock: [obj_hdr] [super_hdr] [ckpt] [clones] [snaps]
      */
     char      *super_name;
     char      *super_buf = NULL;
     obj_hdr   *super_h = NULL;
     super_hdr *super_sh = NULL;
     size_t     super_len;
+    int        super_ckpt = 0;	// latest checkpoint, 0 if none
+    std::vector<char> super_clones;
+    std::mutex super_m;		// super_buf
+    void write_super(void);
 
     thread_pool<batch*> workers;
     thread_pool<int>    misc_threads;
+    std::vector<batch*> sealed;	// in workers.q, not processed yet
+
+    /* map compaction - ckpt_thread frees slack in the object map a
+     * slice at a time, so the exclusive lock is only held briefly
+     */
+    int compact_pos = 0;
+    static const int compact_slice = 256; // lists per pass
 
     /* for triggering GC
      */
     sector_t total_sectors = 0;
     sector_t total_live_sectors = 0;
+    sector_t total_stored = 0;	// total_sectors after compression
     int gc_cycles = 0;
     int gc_sectors_read = 0;
     int gc_sectors_written = 0;
     int gc_deleted = 0;
+    int gc_sectors_cached = 0;
+    lsvd_metrics *metrics = NULL;
+    void count(m_counter c, uint64_t n) {
+	if (metrics)
+	    metrics->add(c, n);
+    }
+    std::vector<gc_cache*> gc_caches;
+    bool gc_running = false;
+    int  gc_writes = 0;		// outstanding GC object writes
+
+    /* trim-only objects (no data) are never GC victims; they get
+     * deleted once a full checkpoint past them is on the backend,
+     * as replay doesn't need them any more.
+     */
+    std::set<int> trim_objs;
+    void delete_trim_objs(std::unique_lock<std::mutex> &lk);
 
     object_reader *parser;
     
@@ -129,12 +272,22 @@ class translate_impl : public translate {
      *  https://stackoverflow.com/questions/15843525/how-do-you-insert-the-value-in-a-sorted-vector
      */
 
-    void write_checkpoint(int seq);
+    void write_checkpoint(int seq, bool full);
+    int do_checkpoint(bool full);
+    void load_ckpt_map(std::vector<ckpt_mapentry> &entries);
+    int replay_data_hdrs(int first);
 
     sector_t make_gc_hdr(char *buf, uint32_t seq, sector_t sectors,
-			 data_map *extents, int n_extents);
+			 data_map *extents, int n_extents, int n_chunks);
+    int compress_chunks_for(size_t bytes);
+    void set_stored(int seq, int sectors);
 
+    void trim_map(int64_t base, int64_t limit);
     void do_gc(std::unique_lock<std::mutex> &lk);
+    void gc_read(gc_chunk *c);
+    void gc_recheck(gc_chunk *c);
+    void gc_write(gc_chunk *c, std::unique_lock<std::mutex> &lk);
+    void gc_commit(gc_write_req *w);
     void gc_thread(thread_pool<int> *p);
     void process_batch(batch *b, std::unique_lock<std::mutex> &lk);
     void worker_thread(thread_pool<batch*> *p);
@@ -160,7 +313,7 @@ class translate_impl : public translate {
 
 public:
     translate_impl(backend *_io, lsvd_config *cfg_,
-		   extmap::objmap *map, std::shared_mutex *m);
+		   extmap::objmap *map, sharded_rwlock *m);
     ~translate_impl();
 
     ssize_t init(const char *name, int nthreads, bool timedflush);
@@ -170,10 +323,22 @@ public:
     int checkpoint(void);       /* flush, then write checkpoint */
 
     ssize_t writev(size_t offset, iovec *iov, int iovcnt);
+    void writev_list(std::vector<std::pair<size_t,iovec>> &w);
+    ssize_t trim(size_t offset, size_t len);
     void wait_for_room(void);
     ssize_t readv(size_t offset, iovec *iov, int iovcnt);
 
     const char *prefix() { return single_prefix; }
+    const char *prefix(int seq);
+    int base_seq(uuid_t &uuid);
+
+    int snap_create(const char *name);
+    int snap_remove(const char *name);
+    void snap_list(std::vector<std::pair<std::string,int>> &snaps);
+
+    void add_gc_cache(gc_cache *c);
+    void clear_gc_caches(void);
+    void set_metrics(lsvd_metrics *m) { metrics = m; }
     
     /* debug functions
      */
@@ -183,20 +348,23 @@ public:
     void reset(void);
     int frontier(void);
     int batch_seq(void);
+    int durable_seq(void);
 };
 
 translate_impl::translate_impl(backend *_io, lsvd_config *cfg_,
-			       extmap::objmap *map_, std::shared_mutex *m_) :
+			       extmap::objmap *map_, sharded_rwlock *m_) :
     done(128,false), workers(&m), misc_threads(&m) {
     objstore = _io;
-    parser = new object_reader(objstore);
+    parser = new object_reader(objstore, cfg_->hdr_cache_size);
     map = map_;
     map_lock = m_;
     cfg = cfg_;
+    pace_window = cfg->xlate_window;
+    host_bucket.configure(cfg->backend_rate, cfg->backend_burst);
 }
 
 translate *make_translate(backend *_io, lsvd_config *cfg,
-			  extmap::objmap *map, std::shared_mutex *m) {
+			  extmap::objmap *map, sharded_rwlock *m) {
     return (translate*) new translate_impl(_io, cfg, map, m);
 }
 
@@ -204,15 +372,133 @@ translate_impl::~translate_impl() {
     if (b) 
 	delete b;
     delete parser;
+    delete ckpt_dirty;
     if (super_buf)
 	free(super_buf);
 }
 
+/* one prefetched data object header, see replay_data_hdrs
+ */
+struct replay_hdr {
+    bool                     ok;
+    std::shared_ptr<const data_hdr_info> hdr;
+};
+
+/* replay data object headers starting at 'first', stopping at the
+ * first missing object. Up to cfg->replay_window headers are read
+ * in parallel (sync reads from a few threads, since the async
+ * backend requests can't report a missing object) but they are
+ * applied to the map strictly in sequence order. They stay in the
+ * header cache for GC.
+ *  returns: sequence number of the first missing object
+ */
+int translate_impl::replay_data_hdrs(int first) {
+    std::mutex rm;
+    std::condition_variable rcv;
+    std::map<int,replay_hdr*> ready;
+    int window = std::max(cfg->replay_window, 1);
+    int next_fetch = first, applied = first, stop = INT_MAX;
+
+    auto fetcher = [&]() {
+	std::unique_lock lk(rm);
+	for (;;) {
+	    while (next_fetch < stop && next_fetch - applied >= window)
+		rcv.wait(lk);
+	    if (next_fetch >= stop)
+		return;
+	    int i = next_fetch++;
+	    lk.unlock();
+	    auto r = new replay_hdr;
+	    objname name(prefix(i), i);
+	    r->hdr = parser->data_hdr(i, name.c_str());
+	    r->ok = (r->hdr != NULL);
+	    lk.lock();
+	    if (!r->ok)
+		stop = std::min(stop, i);
+	    ready[i] = r;
+	    rcv.notify_all();
+	}
+    };
+    std::vector<std::thread> fetchers;
+    for (int j = 0; j < window; j++)
+	fetchers.push_back(std::thread(fetcher));
+
+    int i;
+    for (i = first; ; i++) {
+	std::unique_lock lk(rm);
+	while (ready.find(i) == ready.end())
+	    rcv.wait(lk);
+	auto r = ready[i];
+	ready.erase(i);
+	lk.unlock();
+	if (!r->ok) {
+	    delete r;
+	    break;
+	}
+
+	auto &h = r->hdr->h;
+	auto &chunks = r->hdr->chunks;
+	int stored = chunks.size() ? div_round_up(chunks.back(), 512) :
+	    h.data_sectors;
+	object_info[i] = (obj_info){.hdr = (int)h.hdr_sectors,
+				    .data = (int)h.data_sectors,
+				    .live = (int)h.data_sectors,
+				    .type = LSVD_DATA, .stored = stored};
+	total_sectors += h.data_sectors;
+	total_live_sectors += h.data_sectors;
+	total_stored += stored;
+	if (h.data_sectors == 0)
+	    trim_objs.insert(i);
+	int offset = 0, hdr_len = h.hdr_sectors;
+	for (auto m : r->hdr->dmap) {
+	    std::vector<extmap::lba2obj> deleted;
+	    extmap::obj_offset oo = {i, offset + hdr_len};
+	    map->update(m.lba, m.lba + m.len, oo, &deleted);
+	    ckpt_dirty->update(m.lba, m.lba + m.len, m.lba);
+	    offset += m.len;
+	    for (auto d : deleted) {
+		auto [base, limit, ptr] = d.vals();
+		if (ptr.obj <= base_last)
+		    continue;
+		object_info[ptr.obj].live -= (limit - base);
+		assert(object_info[ptr.obj].live >= 0);
+		total_live_sectors -= (limit - base);
+	    }
+	}
+	for (auto t : r->hdr->trims)
+	    trim_map(t.lba, t.lba + t.len);
+	delete r;
+
+	lk.lock();
+	applied = i+1;
+	rcv.notify_all();
+    }
+
+    for (auto &t : fetchers)
+	t.join();
+    for (auto [j, r] : ready)
+	delete r;
+    return i;
+}
+
+/* checkpoint map entries, full or delta. In a delta, obj 0 marks
+ * a range that was unmapped since the previous checkpoint.
+ */
+void translate_impl::load_ckpt_map(std::vector<ckpt_mapentry> &entries) {
+    for (auto m : entries) {
+	if (m.obj == 0)
+	    map->trim(m.lba, m.lba + m.len);
+	else
+	    map->update(m.lba, m.lba + m.len,
+			(extmap::obj_offset){.obj = m.obj,
+				.offset = m.offset});
+    }
+}
+
 ssize_t translate_impl::init(const char *prefix_,
 			     int nthreads, bool timedflush) {
     std::vector<uint32_t>    ckpts;
     std::vector<clone_info*> clones;
-    std::vector<snap_info>   snaps;
 
     /* note prefix = superblock name
      */
@@ -230,67 +516,90 @@ ssize_t translate_impl::init(const char *prefix_,
     super_sh = (super_hdr*)(super_h+1);
 
     memcpy(&uuid, super_h->vol_uuid, sizeof(uuid));
+
+    /* clones point into super_buf, which gets rewritten
+     */
+    for (auto c : clones) {
+	bases.push_back(std::make_pair((int)c->sequence,
+				       std::string(c->name, c->name_len)));
+	base_last = c->sequence;
+	memcpy(base_uuid, c->vol_uuid, sizeof(uuid_t));
+    }
+    char *clones_ptr = super_buf + super_sh->clones_offset;
+    super_clones.assign(clones_ptr, clones_ptr + super_sh->clones_len);
+    set_snap_pin();
     
     seq = next_compln = super_sh->next_obj;
     b = new batch(cfg->batch_size);
     
+    /* the latest checkpoint lists its chain - the full checkpoint
+     * it's based on, any deltas since then, and itself (oldest first).
+     * Its object list is complete, so that's the only one we use.
+     */
     int _ckpt = 1;
-    for (auto ck : ckpts) {
-	ckpts.resize(0);
+    if (ckpts.size() > 0) {
+	_ckpt = super_ckpt = ckpts.back();
+	std::vector<uint32_t> chain;
 	std::vector<ckpt_obj> objects;
 	std::vector<deferred_delete> deletes;
 	std::vector<ckpt_mapentry> entries;
-	objname name(prefix(), ck);
-	if (parser->read_checkpoint(name.c_str(), ckpts, objects,
+	objname name(prefix(), _ckpt);
+	if (parser->read_checkpoint(name.c_str(), chain, objects,
 				    deletes, entries) < 0)
 	    return -1;
+	for (auto ck : chain) {
+	    if (ck != (uint32_t)_ckpt) {
+		std::vector<uint32_t> _chain;
+		std::vector<ckpt_obj> _objects;
+		std::vector<ckpt_mapentry> _entries;
+		objname name(prefix(), ck);
+		if (parser->read_checkpoint(name.c_str(), _chain, _objects,
+					    deletes, _entries) < 0)
+		    return -1;
+		load_ckpt_map(_entries);
+	    }
+	    else
+		load_ckpt_map(entries);
+	    checkpoints.push(ck);
+	    ckpt_chain.push_back(ck);
+	}
+	/* checkpoints don't record compressed sizes
+	 */
 	for (auto o : objects) {
 	    object_info[o.seq] = (obj_info){.hdr = (int)o.hdr_sectors,
 					    .data = (int)o.data_sectors,
 					    .live = (int)o.live_sectors,
-					    .type = LSVD_DATA};
+					    .type = LSVD_DATA,
+					    .stored = (int)o.data_sectors};
 	    total_sectors += o.data_sectors;
 	    total_live_sectors += o.live_sectors;
+	    total_stored += o.data_sectors;
+	    if (o.data_sectors == 0)
+		trim_objs.insert(o.seq);
 	}
-	for (auto m : entries) {
-	    map->update(m.lba, m.lba + m.len,
-			    (extmap::obj_offset){.obj = m.obj,
-				    .offset = m.offset});
-	}
-	_ckpt = ck;
     }
 
-    for (int i = _ckpt; ; i++) {
-	std::vector<uint32_t>    ckpts;
-	std::vector<obj_cleaned> cleaned;
-	std::vector<data_map>    entries;
-	obj_hdr h; obj_data_hdr dh;
-	seq = next_compln = i;
-	objname name(prefix(), i);
-	if (parser->read_data_hdr(name.c_str(), h, dh, ckpts,
-				  cleaned, entries) < 0)
-	    break;
-	object_info[i] = (obj_info){.hdr = (int)h.hdr_sectors,
-				    .data = (int)h.data_sectors,
-				    .live = (int)h.data_sectors,
-				    .type = LSVD_DATA};
-	total_sectors += h.data_sectors;
-	total_live_sectors += h.data_sectors;
-	int offset = 0, hdr_len = h.hdr_sectors;
-	for (auto m : entries) {
-	    std::vector<extmap::lba2obj> deleted;
-	    extmap::obj_offset oo = {i, offset + hdr_len};
-	    map->update(m.lba, m.lba + m.len, oo, &deleted);
-	    offset += m.len;
-	    for (auto d : deleted) {
-		auto [base, limit, ptr] = d.vals();
-		object_info[ptr.obj].live -= (limit - base);
-		assert(object_info[ptr.obj].live >= 0);
-		total_live_sectors -= (limit - base);
-	    }
-	}
+    /* a clone that hasn't written a checkpoint yet starts from the
+     * base image's map (its checkpoint covers everything before it)
+     */
+    else if (bases.size() > 0) {
+	if (load_base() < 0)
+	    return -1;
+	_ckpt = base_last;
     }
 
+    /* data objects written since the last checkpoint. Starting at
+     * the checkpoint itself would stop immediately (it's not a data
+     * header) and then reuse its sequence number.
+     */
+    int first = (ckpts.size() || bases.size()) ? _ckpt + 1 : _ckpt;
+    seq = next_compln = replay_data_hdrs(first);
+
+    /* map is built, nothing else running yet
+     */
+    int pos = 0;
+    map->compact(pos, map->lists.size());
+
     for (int i = 0; i < nthreads; i++) 
 	workers.pool.push(std::thread(&translate_impl::worker_thread,
 				      this, &workers));
@@ -305,9 +614,51 @@ ssize_t translate_impl::init(const char *prefix_,
     return bytes;
 }
 
+/* map from the base image's snapshot checkpoint (and any deltas it
+ * depends on, if it was made by hand). Its objects aren't ours, so
+ * object_info stays empty.
+ */
+int translate_impl::load_base(void) {
+    std::vector<uint32_t> chain;
+    std::vector<ckpt_obj> objects;
+    std::vector<deferred_delete> deletes;
+    std::vector<ckpt_mapentry> entries;
+    objname name(prefix(base_last), base_last);
+    if (parser->read_checkpoint(name.c_str(), chain, objects,
+				deletes, entries) < 0)
+	return -1;
+    for (auto ck : chain) {
+	if (ck != (uint32_t)base_last) {
+	    std::vector<uint32_t> _chain;
+	    std::vector<ckpt_obj> _objects;
+	    std::vector<ckpt_mapentry> _entries;
+	    objname name(prefix(ck), ck);
+	    if (parser->read_checkpoint(name.c_str(), _chain, _objects,
+					deletes, _entries) < 0)
+		return -1;
+	    load_ckpt_map(_entries);
+	}
+	else
+	    load_ckpt_map(entries);
+    }
+    return 0;
+}
+
 void translate_impl::shutdown(void) {
 }
 
+const char *translate_impl::prefix(int _seq) {
+    for (auto &[last, name] : bases)
+	if (_seq <= last)
+	    return name.c_str();
+    return single_prefix;
+}
+
+int translate_impl::base_seq(uuid_t &_uuid) {
+    memcpy(_uuid, base_uuid, sizeof(uuid_t));
+    return base_last;
+}
+
 /* ----------- parsing and serializing various objects -------------*/
 
 /* read object header
@@ -316,18 +667,22 @@ void translate_impl::shutdown(void) {
  */
 
 
-/* create header for a GC object
+/* create header for a GC object; with n_chunks > 0 it's compressed,
+ * see make_data_hdr
  */
 sector_t translate_impl::make_gc_hdr(char *buf, uint32_t _seq, sector_t sectors,
-				     data_map *extents, int n_extents) {
+				     data_map *extents, int n_extents,
+				     int n_chunks) {
     auto h = (obj_hdr*)buf;
     auto dh = (obj_data_hdr*)(h+1);
     uint32_t o1 = sizeof(*h) + sizeof(*dh), l1 = sizeof(uint32_t),
 	o2 = o1 + l1, l2 = n_extents * sizeof(data_map),
-	hdr_bytes = o2 + l2;
+	o3 = o2 + l2, l3 = n_chunks ? (n_chunks+1) * sizeof(uint32_t) : 0,
+	hdr_bytes = o3 + l3;
     sector_t hdr_sectors = div_round_up(hdr_bytes, 512);
 
-    *h = (obj_hdr){.magic = LSVD_MAGIC, .version = 1, .vol_uuid = {0},
+    *h = (obj_hdr){.magic = LSVD_MAGIC, .version = (n_chunks ? 2u : 1u),
+		   .vol_uuid = {0},
 		   .type = LSVD_DATA, .seq = _seq,
 		   .hdr_sectors = (uint32_t)hdr_sectors,
 		   .data_sectors = (uint32_t)sectors};
@@ -336,7 +691,10 @@ sector_t translate_impl::make_gc_hdr(char *buf, uint32_t _seq, sector_t sectors,
     *dh = (obj_data_hdr){.last_data_obj = _seq, .ckpts_offset = o1,
 			 .ckpts_len = l1,
 			 .objs_cleaned_offset = 0, .objs_cleaned_len = 0,
-			 .data_map_offset = o2, .data_map_len = l2};
+			 .data_map_offset = o2, .data_map_len = l2,
+			 .trims_offset = 0, .trims_len = 0,
+			 .chunk_sectors = (uint32_t)cfg->compress_chunk / 512,
+			 .chunks_offset = l3 ? o3 : 0, .chunks_len = l3};
 
     uint32_t *p_ckpt = (uint32_t*)(dh+1);
     *p_ckpt = last_ckpt;
@@ -344,8 +702,9 @@ sector_t translate_impl::make_gc_hdr(char *buf, uint32_t _seq, sector_t sectors,
     data_map *dm = (data_map*)(p_ckpt+1);
     for (int i = 0; i < n_extents; i++)
 	*dm++ = extents[i];
+    memset((char*)dm, 0, l3);	// chunk table, filled in later
 
-    assert(hdr_bytes == ((char*)dm - buf));
+    assert(hdr_bytes == ((char*)dm - buf) + l3);
     memset(buf + hdr_bytes, 0, 512*hdr_sectors - hdr_bytes); // valgrind
 
     return hdr_sectors;
@@ -355,29 +714,139 @@ sector_t translate_impl::make_gc_hdr(char *buf, uint32_t _seq, sector_t sectors,
 
 /* NOTE: offset is in bytes
  */
+/* only space allocation in the batch is done under 'm'; the copy is
+ * done unlocked, so that writers don't serialize on the memcpy.
+ * worker_thread waits for copies to finish before using the batch.
+ */
 ssize_t translate_impl::writev(size_t offset, iovec *iov, int iovcnt) {
-    std::unique_lock<std::mutex> lk(m);
     smartiov siov(iov, iovcnt);
     size_t len = siov.bytes();
 
+    std::unique_lock<std::mutex> lk(m);
     if (b->len + len > b->max) {
 	b->seq = last_sent = seq++;
+	sealed.push_back(b);
 	workers.put_locked(b);
 	b = new batch(cfg->batch_size);
     }
 
-    b->append(offset / 512, &siov);
+    auto _b = b;
+    char *ptr = _b->reserve(offset / 512, len);
+    lk.unlock();
+
+    siov.copy_out(ptr);
+    _b->done_writing();
 
     return len;
 }
 
+void translate_impl::writev_list(std::vector<std::pair<size_t,iovec>> &w) {
+    std::vector<std::tuple<batch*,char*,iovec>> copies;
+
+    std::unique_lock<std::mutex> lk(m);
+    for (auto [offset, iov] : w) {
+	if (b->len + iov.iov_len > b->max) {
+	    b->seq = last_sent = seq++;
+	    sealed.push_back(b);
+	    workers.put_locked(b);
+	    b = new batch(cfg->batch_size);
+	}
+	char *ptr = b->reserve(offset / 512, iov.iov_len);
+	copies.push_back(std::make_tuple(b, ptr, iov));
+    }
+    lk.unlock();
+
+    for (auto [_b, ptr, iov] : copies) {
+	memcpy(ptr, iov.iov_base, iov.iov_len);
+	_b->done_writing();
+    }
+}
+
+/* discard [offset,offset+len) - both in bytes. The map is trimmed
+ * right away so reads return zeros, and the trim is recorded in the
+ * current batch so that replay applies it in order with the writes.
+ * Batches waiting for a worker get it too, or their map updates
+ * would bring the old data back.
+ */
+ssize_t translate_impl::trim(size_t offset, size_t len) {
+    std::unique_lock<std::mutex> lk(m);
+    int64_t base = offset / 512, limit = base + len / 512;
+
+    b->trim(base, limit);
+    for (auto _b : sealed)
+	_b->trim(base, limit);
+    std::unique_lock objlock(*map_lock);
+    trim_map(base, limit);
+    return len;
+}
+
+/* remove [base,limit) from the map, and take the discarded sectors
+ * out of the live counts. Caller holds m and *map_lock (or is in init)
+ */
+void translate_impl::trim_map(int64_t base, int64_t limit) {
+    std::vector<extmap::lba2obj> deleted;
+    map->trim(base, limit, &deleted);
+    if (deleted.size() > 0)
+	ckpt_dirty->update(base, limit, base);
+    for (auto d : deleted) {
+	auto [_base, _limit, ptr] = d.vals();
+	if (ptr.obj <= base_last)
+	    continue;
+	assert(object_info.find(ptr.obj) != object_info.end());
+	object_info[ptr.obj].live -= (_limit - _base);
+	assert(object_info[ptr.obj].live >= 0);
+	total_live_sectors -= (_limit - _base);
+    }
+}
+
+/* data chunks for an object of 'bytes', 0 if not compressing
+ */
+int translate_impl::compress_chunks_for(size_t bytes) {
+    if (!cfg->backend_compress)
+	return 0;
+    return div_round_up(bytes, cfg->compress_chunk);
+}
+
+/* 'seq' took 'sectors' of data once compressed
+ */
+void translate_impl::set_stored(int _seq, int sectors) {
+    std::unique_lock<std::mutex> lk(m);
+    auto it = object_info.find(_seq);
+    if (it == object_info.end())
+	return;
+    total_stored += sectors - it->second.stored;
+    it->second.stored = sectors;
+}
+
 void translate_impl::wait_for_room(void) {
     std::unique_lock<std::mutex> lk(m);
-    while (next_compln - last_sent > cfg->xlate_window)
+    while (!pace_room())
 	cv.wait(lk);
 }
 
-class translate_req : public trivial_request {
+/* a data object write took 'usecs'; see pace_window
+ */
+void translate_impl::pace_complete(size_t bytes, long usecs) {
+    std::unique_lock<std::mutex> lk(m);
+    inflight--;
+    inflight_bytes -= bytes;
+    if (cfg->xlate_latency > 0) {
+	auto now = std::chrono::steady_clock::now();
+	if (usecs > cfg->xlate_latency) {
+	    if (now - last_cut > std::chrono::microseconds(usecs)) {
+		pace_window = std::max(1.0, pace_window / 2);
+		last_cut = now;
+	    }
+	}
+	else
+	    pace_window = std::min((double)cfg->xlate_window,
+				   pace_window + 1 / pace_window);
+    }
+    cv.notify_all();
+}
+
+class translate_req : public trivial_request,
+		      public pooled<translate_req> {
     uint32_t seq;
     translate_impl *tx;
     friend class translate_impl;
@@ -386,6 +855,8 @@ class translate_req : public trivial_request {
      */
     std::vector<char*> to_free;
     translate_impl::batch *b = NULL;
+    size_t bytes = 0;		// for pacing
+    std::chrono::steady_clock::time_point t0;
     
 public:
     translate_req(uint32_t seq_, translate_impl *tx_) {
@@ -397,6 +868,15 @@ public:
     void notify(request *child) {
 	if (child)
 	    child->release();
+	auto dt = std::chrono::steady_clock::now() - t0;
+	tx->pace_complete(bytes, std::chrono::duration_cast<
+			  std::chrono::microseconds>(dt).count());
+	if (tx->metrics) {
+	    tx->metrics->add_time(H_XLATE_ACK, std::chrono::duration_cast<
+				  std::chrono::nanoseconds>(dt).count());
+	    tx->metrics->add(M_XLATE_OBJS, 1);
+	    tx->metrics->add(M_XLATE_BYTES, bytes);
+	}
 	tx->notify_complete(seq);
 	for (auto ptr : to_free)
 	    free(ptr);
@@ -406,27 +886,70 @@ public:
     }
 };
 
+/* drop overwritten and discarded data from a sealed batch, so only
+ * the last version of each LBA gets uploaded. Live data is packed
+ * down in place (memory order, so memmove never clobbers unread
+ * data) and LBA-adjacent pieces share a single data_map entry.
+ */
+void translate_impl::batch::coalesce(void) {
+    extmap::bufmap bmap;
+    std::vector<extmap::lba2buf> dead;
+    char *ptr = buf;
+    for (auto e : entries) {
+	bmap.update(e.lba, e.lba + e.len, ptr, &dead);
+	ptr += e.len * 512;
+    }
+    for (auto it = trims.begin(); it != trims.end(); it++)
+	bmap.trim(it->base(), it->limit(), &dead);
+    if (dead.size() == 0 && entries.size() < 2)
+	return;
+
+    std::vector<std::tuple<char*,int64_t,int64_t>> live; // ptr,lba,len
+    for (auto it = bmap.begin(); it != bmap.end(); it++)
+	live.push_back(std::make_tuple(it->s.ptr.buf, it->s.base+0,
+				       it->s.len+0));
+    std::sort(live.begin(), live.end());
+
+    entries.clear();
+    char *out = buf;
+    for (auto [p, lba, sectors] : live) {
+	if (p != out)
+	    memmove(out, p, sectors*512);
+	out += sectors*512;
+	if (entries.size() > 0 &&
+	    entries.back().lba + entries.back().len == (uint64_t)lba)
+	    entries.back().len += sectors;
+	else
+	    entries.push_back((data_map){(uint64_t)lba, (uint64_t)sectors});
+    }
+    len = out - buf;
+}
+
 void translate_impl::process_batch(batch *b, std::unique_lock<std::mutex> &lk) {
-    /* TODO: coalesce writes: 
-     *   bufmap m
-     *   for e in entries
-     *      m.insert(lba, len, ptr)
-     *   for e in m:
-     *      (lba, iovec) -> output
-     */
+    b->coalesce();
 
     /* make the following updates:
      * - object_info - hdrlen, total/live data sectors
      * - map - LBA to obj/offset map
      * - object_info, totals - adjust for new garbage
      */
-    size_t hdr_bytes = obj_hdr_len(b->entries.size(), last_ckpt);
+    std::vector<data_map> trims;
+    for (auto it = b->trims.begin(); it != b->trims.end(); it++)
+	trims.push_back((data_map){(uint64_t)it->base(),
+		    (uint64_t)(it->limit() - it->base())});
+
+    int n_chunks = compress_chunks_for(b->len);
+    size_t hdr_bytes = obj_hdr_len(b->entries.size(), last_ckpt, trims.size(),
+				   n_chunks);
     int hdr_sectors = div_round_up(hdr_bytes, 512);
 
     std::unique_lock objlock(*map_lock);
     obj_info oi = {.hdr = hdr_sectors, .data = (int)b->len/512,
-		   .live = (int)b->len/512, .type = LSVD_DATA};
+		   .live = (int)b->len/512, .type = LSVD_DATA,
+		   .stored = (int)b->len/512};
     object_info[b->seq] = oi;
+    if (b->len == 0)
+	trim_objs.insert(b->seq);
 
     /* note that we update the map before the object is written,
      * and count on the write cache preventing any reads until
@@ -438,26 +961,44 @@ void translate_impl::process_batch(batch *b, std::unique_lock<std::mutex> &lk) {
     for (auto e : b->entries) {
 	extmap::obj_offset oo = {b->seq, sector_offset};
 	map->update(e.lba, e.lba+e.len, oo, &deleted);
+	ckpt_dirty->update(e.lba, e.lba+e.len, e.lba);
 	sector_offset += e.len;
     }
 
     for (auto d : deleted) {
 	auto [base, limit, ptr] = d.vals();
+	if (ptr.obj <= base_last)
+	    continue;
 	assert(object_info.find(ptr.obj) != object_info.end());
 	object_info[ptr.obj].live -= (limit - base);
 	assert(object_info[ptr.obj].live >= 0);
 	total_live_sectors -= (limit - base);
     }
+
+    /* the map was already trimmed in trim(), but these have to come
+     * after any earlier writes in this batch
+     */
+    total_live_sectors += b->len/512;
+    for (auto t : trims)
+	trim_map(t.lba, t.lba + t.len);
     objlock.unlock();
 
     total_sectors += b->len/512;
-    total_live_sectors += b->len/512;
+    total_stored += b->len/512;
     if (next_compln == -1)
 	next_compln = b->seq;
+
+    /* the map already points here, so reads are fine while we wait
+     */
+    while (!pace_room())
+	cv.wait(lk);
+    inflight++;
+    inflight_bytes += b->len;
     lk.unlock();
 
     char *hdr = (char*)calloc(hdr_sectors*512, 1);
-    make_data_hdr(hdr, b->len, last_ckpt, &b->entries, b->seq, &uuid);
+    make_data_hdr(hdr, b->len, last_ckpt, &b->entries, b->seq, &uuid, &trims,
+		  n_chunks, cfg->compress_chunk / 512);
     iovec iov[] = {{hdr, (size_t)(hdr_sectors*512)},
 		   {b->buf, b->len}};
 
@@ -466,6 +1007,23 @@ void translate_impl::process_batch(batch *b, std::unique_lock<std::mutex> &lk) {
     auto t_req = new translate_req(b->seq, this);
     t_req->to_free.push_back(hdr);
     t_req->b = b;
+    t_req->bytes = b->len;
+
+    if (n_chunks > 0) {
+	smartiov data(&iov[1], 1);
+	auto [zbuf, zlen] = compress_chunks(data, cfg->compress_chunk / 512,
+					    obj_chunks(hdr));
+	iov[1] = (iovec){zbuf, zlen};
+	t_req->to_free.push_back(zbuf);
+	set_stored(b->seq, zlen / 512);
+    }
+
+    if (cfg->backend_crc)
+	obj_hdr_seal(hdr);
+    parser->add_data_hdr(b->seq, hdr);
+
+    host_bucket.take(hdr_sectors*512 + iov[1].iov_len);
+    t_req->t0 = std::chrono::steady_clock::now();
 	
     objname name(prefix(), b->seq);
     auto req = objstore->make_write_req(name.c_str(), iov, 2);
@@ -483,6 +1041,19 @@ void translate_impl::worker_thread(thread_pool<batch*> *p) {
 	if (!p->get_locked(lk, b)) 
 	    return;
 
+	/* wait for copies into the batch without m, so writes to the
+	 * next one don't stall behind it. It stays in 'sealed' (trims
+	 * still reach it) until it's the oldest, which keeps map
+	 * updates in batch order when there's more than one worker.
+	 */
+	lk.unlock();
+	b->wait_writers();
+	lk.lock();
+	while (sealed.front() != b)
+	    cv.wait(lk);
+	sealed.erase(sealed.begin());
+	cv.notify_all();
+
 	process_batch(b, lk);
     }
 }
@@ -494,8 +1065,9 @@ void translate_impl::worker_thread(thread_pool<batch*> *p) {
 int translate_impl::flush() {
     std::unique_lock<std::mutex> lk(m);
     
-    if (b->len > 0) {
+    if (!b->empty()) {
 	b->seq = last_sent = seq++;
+	sealed.push_back(b);
 	workers.put_locked(b);
 	b = new batch(cfg->batch_size);
     }
@@ -520,7 +1092,7 @@ void translate_impl::flush_thread(thread_pool<int> *p) {
     while (p->running) {
 	std::unique_lock<std::mutex> lk(*p->m);
 	p->cv.wait_for(lk, wait_time);
-	if (p->running && seq0 == seq.load() && b->len > 0) {
+	if (p->running && seq0 == seq.load() && !b->empty()) {
 	    if (std::chrono::system_clock::now() - t0 > timeout) {
 		lk.unlock();
 		flush();
@@ -537,32 +1109,72 @@ void translate_impl::flush_thread(thread_pool<int> *p) {
 
 /* synchronously write a checkpoint
  */
-void translate_impl::write_checkpoint(int ckpt_seq) {
+/* a full checkpoint has the whole map; a delta only has the ranges
+ * that changed since the previous checkpoint, and lists the chain
+ * back to its full checkpoint in the ckpts field. After ckpt_deltas
+ * deltas the next one is full again.
+ */
+void translate_impl::write_checkpoint(int ckpt_seq, bool full) {
     std::vector<ckpt_mapentry> entries;
     std::vector<ckpt_obj> objects;
+    std::vector<extmap::lba2obj> snap;
 
     /* hold the translation layer lock until we get a copy of object_info
      */
     std::unique_lock lk(m);
 
-    /* hold the map lock while we get a copy of the map.
+    /* wait until all prior objects have been acked by backend. GC
+     * objects only go into the map when their write completes, so
+     * copying the map any earlier could miss one that replay (which
+     * starts after this checkpoint) would then skip.
      */
-    std::unique_lock objlock(*map_lock);
+    while (next_compln < ckpt_seq)
+	cv.wait(lk);
+
+    if (ckpt_chain.size() == 0 || (int)ckpt_chain.size() > cfg->ckpt_deltas)
+	full = true;
+
+    /* hold the map lock (shared - reads can continue) only while we
+     * copy the raw extents; they get encoded after it's dropped.
+     */
+    std::shared_lock objlock(*map_lock);
 
     last_ckpt = ckpt_seq;
-    for (auto it = map->begin(); it != map->end(); it++) {
-	auto [base, limit, ptr] = it->vals();
-	entries.push_back((ckpt_mapentry){.lba = base,
-		    .len = limit-base, .obj = (int32_t)ptr.obj,
-		    .offset = (int32_t)ptr.offset});
+    auto dirty = ckpt_dirty;
+    ckpt_dirty = new extmap::cachemap2;
+    if (full) {
+	for (auto l : map->lists)
+	    snap.insert(snap.end(), l->begin(), l->end());
+    }
+    else {
+	extmap::obj_offset hole = {0, 0};
+	for (auto it = dirty->begin(); it != dirty->end(); it++) {
+	    int64_t base = it->base(), limit = it->limit();
+	    for (auto it2 = map->lookup(base);
+		 it2 != map->end() && it2->base() < limit; it2++) {
+		auto [_base, _limit, ptr] = it2->vals(base, limit);
+		if (_base > base)
+		    snap.push_back(extmap::lba2obj(base, _base - base, hole));
+		snap.push_back(extmap::lba2obj(_base, _limit - _base, ptr));
+		base = _limit;
+	    }
+	    if (base < limit)
+		snap.push_back(extmap::lba2obj(base, limit - base, hole));
+	}
     }
     objlock.unlock();
+    delete dirty;
+
+    if (full)
+	ckpt_chain.clear();
+    ckpt_chain.push_back(ckpt_seq);
+    std::vector<uint32_t> chain(ckpt_chain);
 
-    size_t map_bytes = entries.size() * sizeof(ckpt_mapentry);
+    size_t map_bytes = snap.size() * sizeof(ckpt_mapentry);
 
     for (auto it = object_info.begin(); it != object_info.end(); it++) {
 	auto obj_num = it->first;
-	auto [hdr, data, live, type] = it->second;
+	auto [hdr, data, live, type, stored] = it->second;
 	if (type == LSVD_DATA)
 	    objects.push_back((ckpt_obj){.seq = (uint32_t)obj_num,
 			.hdr_sectors = (uint32_t)hdr,
@@ -574,18 +1186,21 @@ void translate_impl::write_checkpoint(int ckpt_seq) {
      */
     size_t objs_bytes = objects.size() * sizeof(ckpt_obj);
     size_t hdr_bytes = sizeof(obj_hdr) + sizeof(obj_ckpt_hdr);
-    int sectors = div_round_up(hdr_bytes + sizeof(ckpt_seq) + map_bytes +
+    size_t chain_bytes = chain.size() * sizeof(uint32_t);
+    int sectors = div_round_up(hdr_bytes + chain_bytes + map_bytes +
 			       objs_bytes, 512);
     object_info[ckpt_seq] = (obj_info){.hdr = sectors, .data = 0, .live = 0,
-				   .type = LSVD_CKPT};
+				   .type = LSVD_CKPT, .stored = 0};
     checkpoints.push(ckpt_seq);
-    
-    /* wait until all prior objects have been acked by backend
-     */
-    while (next_compln < ckpt_seq)
-	cv.wait(lk);
     lk.unlock();
 
+    for (auto e : snap) {
+	auto [base, limit, ptr] = e.vals();
+	entries.push_back((ckpt_mapentry){.lba = base,
+		    .len = limit-base, .obj = (int32_t)ptr.obj,
+		    .offset = (int32_t)ptr.offset});
+    }
+
     /* put it all together in memory
      */
     auto buf = (char*)calloc(hdr_bytes, 1);
@@ -596,15 +1211,15 @@ void translate_impl::write_checkpoint(int ckpt_seq) {
     memcpy(h->vol_uuid, uuid, sizeof(uuid_t));
     auto ch = (obj_ckpt_hdr*)(h+1);
 
-    uint32_t o1 = sizeof(obj_hdr)+sizeof(obj_ckpt_hdr), o2 = o1 + sizeof(ckpt_seq),
+    uint32_t o1 = sizeof(obj_hdr)+sizeof(obj_ckpt_hdr), o2 = o1 + chain_bytes,
 	o3 = o2 + objs_bytes;
-    *ch = (obj_ckpt_hdr){.ckpts_offset = o1, .ckpts_len = sizeof(ckpt_seq),
+    *ch = (obj_ckpt_hdr){.ckpts_offset = o1, .ckpts_len = (uint32_t)chain_bytes,
 			 .objs_offset = o2, .objs_len = o3-o2,
 			 .deletes_offset = 0, .deletes_len = 0,
 			 .map_offset = o3, .map_len = (uint32_t)map_bytes};
 
     iovec iov[] = {{.iov_base = buf, .iov_len = hdr_bytes},
-		   {.iov_base = (char*)&ckpt_seq, .iov_len = sizeof(ckpt_seq)},
+		   {.iov_base = (char*)chain.data(), .iov_len = chain_bytes},
 		   {.iov_base = (char*)objects.data(), objs_bytes},
 		   {.iov_base = (char*)entries.data(), map_bytes}};
 
@@ -616,17 +1231,123 @@ void translate_impl::write_checkpoint(int ckpt_seq) {
     
     free(buf);
 
-    /* Now re-write the superblock with the new list of checkpoints
+    /* Now re-write the superblock with the new checkpoint
      */
-    size_t offset = sizeof(*super_h) + sizeof(*super_sh);
+    lk.lock();
+    super_ckpt = ckpt_seq;
+    lk.unlock();
+    write_super();
+}
+
+/* rebuild the variable-length part of the superblock and write it.
+ * This is the only place we modify *super_sh
+ */
+void translate_impl::write_super(void) {
+    std::unique_lock lk(m);
+    int ckpt = super_ckpt;
+    std::vector<snap_info> _snaps(snaps);
+    lk.unlock();
+
+    std::unique_lock slk(super_m);
+    uint32_t o1 = sizeof(*super_h) + sizeof(*super_sh),
+	l1 = ckpt ? sizeof(uint32_t) : 0,
+	o2 = o1 + l1, l2 = super_clones.size(),
+	o3 = o2 + l2, l3 = _snaps.size() * sizeof(snap_info);
+    assert(o3 + l3 <= super_len);
+
+    memset(super_buf + o1, 0, super_len - o1);
+    if (ckpt)
+	*(uint32_t*)(super_buf + o1) = ckpt;
+    memcpy(super_buf + o2, super_clones.data(), l2);
+    memcpy(super_buf + o3, _snaps.data(), l3);
+    super_sh->ckpts_offset = o1;
+    super_sh->ckpts_len = l1;
+    super_sh->clones_offset = l2 ? o2 : 0;
+    super_sh->clones_len = l2;
+    super_sh->snaps_offset = l3 ? o3 : 0;
+    super_sh->snaps_len = l3;
+
+    struct iovec iov = {super_buf, super_len};
+    objstore->write_object(super_name, &iov, 1);
+}
+
+/* m held */
+void translate_impl::set_snap_pin(void) {
+    snap_pin = 0;
+    for (auto &s : snaps)
+	snap_pin = std::max(snap_pin, (int)s.seq);
+}
+
+/* a full checkpoint, kept along with everything it points to. GC is
+ * held off from before the checkpoint's map is copied until the
+ * snapshot is in snaps, so nothing in it gets cleaned in between.
+ */
+int translate_impl::snap_create(const char *name) {
+    if (strlen(name) >= sizeof(snap_info::name))
+	return -ENAMETOOLONG;
+
+    std::unique_lock lk(m);
+    for (auto &s : snaps)
+	if (!strcmp(s.name, name))
+	    return -EEXIST;
+    if (sizeof(obj_hdr) + sizeof(super_hdr) + sizeof(uint32_t) +
+	super_clones.size() + (snaps.size()+1) * sizeof(snap_info) > super_len)
+	return -ENOSPC;
+    if (snap_pending)
+	return -EBUSY;
+    snap_pending = true;
+    while (gc_running)
+	cv.wait(lk);
+    lk.unlock();
+
+    int ckpt = do_checkpoint(true);
+
+    snap_info si = {.snap_uuid = {0}, .seq = (uint32_t)ckpt, .name = {0}};
+    uuid_generate(si.snap_uuid);
+    strcpy(si.name, name);
+    lk.lock();
+    snaps.push_back(si);
+    set_snap_pin();
+    snap_pending = false;
+    lk.unlock();
+    write_super();
+    return 0;
+}
 
-    /* this is the only place we modify *super_sh
+/* objects in the snapshot become fair game for GC. Nothing here
+ * knows about clones of it - removing a snapshot that a clone is
+ * based on breaks the clone.
+ */
+int translate_impl::snap_remove(const char *name) {
+    std::unique_lock lk(m);
+    auto it = std::find_if(snaps.begin(), snaps.end(),
+			   [&](snap_info &s) { return !strcmp(s.name, name); });
+    if (it == snaps.end())
+	return -ENOENT;
+    int ckpt = it->seq;
+    snaps.erase(it);
+    set_snap_pin();
+
+    /* GC only deletes checkpoints it finds in 'checkpoints'
      */
-    super_sh->ckpts_offset = offset;
-    super_sh->ckpts_len = sizeof(ckpt_seq);
-    *(int*)(super_buf + offset) = ckpt_seq;
-    struct iovec iov2 = {super_buf, 4096};
-    objstore->write_object(super_name, &iov2, 1);
+    bool in_use = std::find(ckpt_chain.begin(), ckpt_chain.end(),
+			    (uint32_t)ckpt) != ckpt_chain.end();
+    for (auto q = checkpoints; !in_use && q.size() > 0; q.pop())
+	in_use = (q.front() == (uint32_t)ckpt);
+    lk.unlock();
+
+    write_super();
+    if (!in_use) {
+	objname oname(prefix(), ckpt);
+	objstore->delete_object(oname.c_str());
+    }
+    return 0;
+}
+
+void translate_impl::snap_list(std::vector<std::pair<std::string,int>> &v) {
+    std::unique_lock lk(m);
+    for (auto &s : snaps)
+	v.push_back(std::make_pair(std::string(s.name), (int)s.seq));
 }
 
 void translate_impl::ckpt_thread(thread_pool<int> *p) {
@@ -642,78 +1363,479 @@ void translate_impl::ckpt_thread(thread_pool<int> *p) {
 	if (p->running && seq.load() - seq0 > ckpt_interval) {
 	    seq0 = seq.load();
 	    lk.unlock();
-	    checkpoint();
+	    do_checkpoint(false);
+	}
+	else if (p->running) {
+	    lk.unlock();
+	    std::unique_lock objlock(*map_lock);
+	    map->compact(compact_pos, compact_slice);
 	}
     }
 }
 
+/* explicit checkpoints are full ones, compacting any delta chain;
+ * ckpt_thread writes deltas
+ */
 int translate_impl::checkpoint(void) {
+    return do_checkpoint(true);
+}
+
+int translate_impl::do_checkpoint(bool full) {
     std::unique_lock<std::mutex> lk(m);
-    if (b->len > 0) {
+    if (!b->empty()) {
 	b->seq = seq++;
+	sealed.push_back(b);
 	workers.put_locked(b);
 	b = new batch(cfg->batch_size);
     }
     int _seq = seq++;
     lk.unlock();
-    write_checkpoint(_seq);
+    write_checkpoint(_seq, full);
     return _seq;
 }
 
 
 /* -------------- Garbage collection ---------------- */
 
-/* Needs a lot of work. Note that all reads/writes are synchronous
- * for now...
+/* GC: live extents copied from victim objects, read with async
+ * range reads. Each gc_chunk becomes one output object; extents
+ * contiguous in the source object share a single read buffer.
+ */
+struct gc_extent {
+    int64_t base;
+    int64_t limit;
+    extmap::obj_offset ptr;
+    char   *buf;		// data for [base,limit), once read
+    bool    hot;		// some of it was cached
+};
+
+class gc_chunk {
+public:
+    std::vector<gc_extent> extents;
+    std::vector<char*>     bufs;
+    sector_t               sectors = 0;
+    struct hit {		// cached data, to re-check after reading
+	gc_cache *cache;
+	int64_t   lba;
+	int64_t   sectors;
+	int64_t   tag;
+	extmap::obj_offset ptr;
+	char     *buf;
+    };
+    std::vector<hit>       hits;
+    std::mutex             m;
+    std::condition_variable cv;
+    int                    reads = 0; // outstanding
+    bool                   failed = false; // a backend read did
+    uint64_t               t0 = 0;    // for metrics
+
+    void wait(void) {
+	std::unique_lock lk(m);
+	while (reads > 0)
+	    cv.wait(lk);
+    }
+};
+
+class gc_read_req : public trivial_request {
+    gc_chunk *c;
+public:
+    gc_read_req(gc_chunk *c_) : c(c_) {}
+    ~gc_read_req() {}
+    void notify(request *child) {
+	bool failed = (child && child->failed());
+	if (child)
+	    child->release();
+	{
+	    std::unique_lock lk(c->m);
+	    if (failed)
+		c->failed = true;
+	    if (--c->reads == 0)
+		c->cv.notify_all();
+	}
+	delete this;
+    }
+};
+
+/* issue reads for all extents in a chunk. No locks held.
+ * Extents contiguous in the source object get one buffer; within
+ * that, anything the caches have is read from them, and the rest
+ * from the backend.
+ */
+void translate_impl::gc_read(gc_chunk *c) {
+    c->t0 = m_now();
+    std::vector<std::tuple<int64_t,sector_t,sector_t,char*>> reads;
+    std::vector<request*> cache_reqs;
+    
+    for (size_t i = 0; i < c->extents.size(); ) {
+	auto obj = c->extents[i].ptr.obj;
+	auto start = c->extents[i].ptr.offset, end = start;
+	size_t j = i;
+	for (; j < c->extents.size(); j++) {
+	    auto &e = c->extents[j];
+	    if (e.ptr.obj != obj || e.ptr.offset != end)
+		break;
+	    end += (e.limit - e.base);
+	}
+	char *buf = (char*)aligned_alloc(512, (end - start) * 512);
+	c->bufs.push_back(buf);
+
+	for (; i < j; i++) {
+	    auto &e = c->extents[i];
+	    e.buf = buf + (e.ptr.offset - start) * 512;
+	    int64_t done = 0, len = e.limit - e.base;
+	    while (done < len) {
+		int64_t miss = len - done;
+		bool hit = false;
+		char *ptr = e.buf + done*512;
+		for (auto gcc : gc_caches) {
+		    auto [n, tag, req] = gcc->gc_read(e.base + done,
+						      e.ptr + done,
+						      len - done, ptr);
+		    if (n > 0) {
+			c->hits.push_back((gc_chunk::hit){gcc, e.base+done, n,
+				    tag, e.ptr + done, ptr});
+			if (req)
+			    cache_reqs.push_back(req);
+			gc_sectors_cached += n;
+			count(M_GC_SECTORS_CACHED, n);
+			done += n;
+			hit = e.hot = true;
+			break;
+		    }
+		    miss = std::min(miss, -n);
+		}
+		if (hit)
+		    continue;
+		sector_t offset = e.ptr.offset + done;
+		if (reads.size() > 0) { // merge with previous backend read?
+		    auto &[_obj, _offset, _sectors, _buf] = reads.back();
+		    if (_obj == obj && _offset + _sectors == offset &&
+			_buf + _sectors*512 == ptr) {
+			_sectors += miss;
+			done += miss;
+			gc_sectors_read += miss;
+			count(M_GC_SECTORS_READ, miss);
+			continue;
+		    }
+		}
+		reads.push_back(std::make_tuple(obj, offset, miss, ptr));
+		gc_sectors_read += miss;
+		count(M_GC_SECTORS_READ, miss);
+		done += miss;
+	    }
+	}
+    }
+
+    c->reads = reads.size() + cache_reqs.size();
+    io_batch batch;		// all of the chunk's reads in one submit
+    for (auto req : cache_reqs)
+	req->run(new gc_read_req(c));
+    for (auto [obj, offset, sectors, buf] : reads) {
+	objname name(prefix(obj), obj);
+	auto req = objstore->make_read_req(name.c_str(), offset*512,
+					   buf, sectors*512);
+	req->run(new gc_read_req(c));
+    }
+}
+
+/* cached data that changed while we read it (e.g. write cache
+ * eviction) gets re-read from the backend, the same way gc_read
+ * does. No locks held.
+ */
+void translate_impl::gc_recheck(gc_chunk *c) {
+    std::vector<gc_chunk::hit> stale;
+    for (auto h : c->hits)
+	if (!h.cache->gc_check(h.lba, h.sectors, h.tag))
+	    stale.push_back(h);
+    if (stale.size() == 0)
+	return;
+
+    c->reads = stale.size();
+    {
+	io_batch batch;
+	for (auto h : stale) {
+	    objname name(prefix(h.ptr.obj), h.ptr.obj);
+	    auto req = objstore->make_read_req(name.c_str(), h.ptr.offset*512,
+					       h.buf, h.sectors*512);
+	    req->run(new gc_read_req(c));
+	    gc_sectors_read += h.sectors;
+	    count(M_GC_SECTORS_READ, h.sectors);
+	}
+    }
+    c->wait();
+}
+
+/* GC output object. The map isn't pointed at it until the write
+ * completes, so that no one tries to read it before it exists.
+ */
+class gc_write_req : public trivial_request {
+    translate_impl *tx;
+    int32_t seq;
+    int hdr_sectors;
+    std::vector<data_map> extents;
+    std::vector<extmap::obj_offset> from; // where each extent came from
+    std::vector<char*> to_free;
+    uint64_t t0 = 0;
+    friend class translate_impl;
+
+public:
+    gc_write_req(translate_impl *tx_, int32_t seq_) : tx(tx_), seq(seq_) {}
+    ~gc_write_req() {}
+    void notify(request *child) {
+	if (child)
+	    child->release();
+	if (tx->metrics)
+	    tx->metrics->add_time(H_GC_WRITE, m_now() - t0);
+	tx->gc_commit(this);
+	tx->notify_complete(seq);
+	for (auto ptr : to_free)
+	    free(ptr);
+	delete this;
+    }
+};
+
+/* once a chunk's reads are done, keep only the parts that the map
+ * still points to, then write them out with no locks held. Data is
+ * not copied - the output iovec points into the read buffers.
+ */
+void translate_impl::gc_write(gc_chunk *c, std::unique_lock<std::mutex> &lk) {
+    smartiov iovs;
+    char *hdr = (char*)malloc(1024*32); // 8MB / 4KB = 2K extents = 16KB
+    iovs.push_back((iovec){hdr, 0});
+    std::vector<bool> is_hot;
+    sector_t data_sectors = 0;
+
+    lk.lock();			// m
+    std::unique_lock objlock(*map_lock);
+    auto w = new gc_write_req(this, 0);
+
+    for (auto &e : c->extents) {
+	for (auto it = map->lookup(e.base);
+	     it != map->end() && it->base() < e.limit; it++) {
+	    auto [_base, _limit, _ptr] = it->vals(e.base, e.limit);
+	    if (_ptr.obj != e.ptr.obj ||
+		_ptr.offset != e.ptr.offset + (_base - e.base))
+		continue;	// overwritten since we looked
+	    sector_t _sectors = _limit - _base;
+	    is_hot.push_back(e.hot);
+	    char *ptr = e.buf + (_base - e.base)*512;
+	    auto last = iovs.size() - 1;
+	    if (last > 0 && (char*)iovs[last].iov_base +
+		iovs[last].iov_len == ptr) // same read buffer
+		iovs[last].iov_len += _sectors*512;
+	    else
+		iovs.push_back((iovec){ptr, (size_t)_sectors*512});
+	    w->extents.push_back((data_map){(uint64_t)_base,
+			(uint64_t)_sectors});
+	    w->from.push_back(_ptr);
+	    data_sectors += _sectors;
+	}
+    }
+    objlock.unlock();
+
+    if (data_sectors == 0) {
+	lk.unlock();
+	delete w;
+	free(hdr);
+	for (auto buf : c->bufs)
+	    free(buf);
+	return;
+    }
+	
+    int32_t _seq = w->seq = seq++;
+    gc_writes++;
+    gc_sectors_written += data_sectors;
+    count(M_GC_SECTORS_WRITTEN, data_sectors);
+    int n_chunks = compress_chunks_for(data_sectors*512);
+    int hdr_sectors = make_gc_hdr(hdr, _seq, data_sectors,
+				  w->extents.data(), w->extents.size(),
+				  n_chunks);
+    iovs[0].iov_len = hdr_sectors*512;
+    w->hdr_sectors = hdr_sectors;
+
+    /* live sectors get filled in by gc_commit
+     */
+    obj_info oi = {.hdr = hdr_sectors, .data = (int)data_sectors,
+		   .live = 0, .type = LSVD_DATA, .stored = (int)data_sectors};
+    object_info[_seq] = oi;
+    total_sectors += data_sectors;
+    total_stored += data_sectors;
+    lk.unlock();
+
+    std::vector<std::pair<int64_t,int64_t>> hot; // new object offsets
+    int64_t offset = hdr_sectors;
+    for (size_t i = 0; i < w->extents.size(); i++) {
+	auto len = w->extents[i].len;
+	if (is_hot[i] && hot.size() > 0 && hot.back().second == offset)
+	    hot.back().second += len;
+	else if (is_hot[i])
+	    hot.push_back(std::make_pair(offset, offset + len));
+	offset += len;
+    }
+
+    /* hot data goes back in the cache under its new location
+     */
+    if (hot.size() > 0)
+	for (auto gcc : gc_caches)
+	    gcc->gc_add(_seq, &iovs, hot);
+
+    w->to_free.push_back(hdr);
+    for (auto buf : c->bufs)
+	w->to_free.push_back(buf);
+
+    if (n_chunks > 0) {
+	auto data = iovs.slice(hdr_sectors*512, iovs.bytes());
+	auto [zbuf, zlen] = compress_chunks(data, cfg->compress_chunk / 512,
+					    obj_chunks(hdr));
+	w->to_free.push_back(zbuf);
+	iovs = smartiov();
+	iovs.push_back((iovec){hdr, (size_t)hdr_sectors*512});
+	iovs.push_back((iovec){zbuf, zlen});
+	set_stored(_seq, zlen / 512);
+    }
+
+    if (cfg->backend_crc)
+	obj_hdr_seal(hdr);
+    parser->add_data_hdr(_seq, hdr);
+
+    host_bucket.take(iovs.bytes());
+    objname name(prefix(), _seq);
+    auto [iov,iovcnt] = iovs.c_iov();
+    w->t0 = m_now();
+    auto req = objstore->make_write_req(name.c_str(), iov, iovcnt);
+    req->run(w);
+}
+
+/* GC object is durable: compare-and-swap each extent into the map,
+ * i.e. only the parts that still point where we copied them from.
  */
+void translate_impl::gc_commit(gc_write_req *w) {
+    std::unique_lock lk(m);
+    std::unique_lock objlock(*map_lock);
+
+    struct _move { int64_t base, limit; extmap::obj_offset ptr; };
+    std::vector<_move> moves;
+    int64_t offset = w->hdr_sectors;
+    for (size_t i = 0; i < w->extents.size(); i++) {
+	int64_t base = w->extents[i].lba, limit = base + w->extents[i].len;
+	auto from = w->from[i];
+	for (auto it = map->lookup(base);
+	     it != map->end() && it->base() < limit; it++) {
+	    auto [_base, _limit, _ptr] = it->vals(base, limit);
+	    if (_ptr.obj != from.obj ||
+		_ptr.offset != from.offset + (_base - base))
+		continue;
+	    extmap::obj_offset oo = {w->seq, offset + (_base - base)};
+	    moves.push_back((_move){_base, _limit, oo});
+	}
+	offset += (limit - base);
+    }
+
+    std::vector<extmap::lba2obj> deleted;
+    int live = 0;
+    for (auto [base, limit, ptr] : moves) {
+	map->update(base, limit, ptr, &deleted);
+	ckpt_dirty->update(base, limit, base);
+	live += (limit - base);
+    }
+    for (auto d : deleted) {	// moved, so total live doesn't change
+	auto [base, limit, ptr] = d.vals();
+	object_info[ptr.obj].live -= (limit - base);
+	assert(object_info[ptr.obj].live >= 0);
+    }
+    object_info[w->seq].live = live;
+
+    gc_writes--;
+    cv.notify_all();
+}
+
 void translate_impl::do_gc(std::unique_lock<std::mutex> &lk) {
     assert(!m.try_lock());	// must be locked
+    if (snap_pending)
+	return;
     gc_cycles++;
+    count(M_GC_CYCLES, 1);
     int max_obj = seq.load();
 
-    /* create list of object info in increasing order of 
-     * utilization, i.e. (live data) / (total size)
+    /* rank candidate objects, best victim first:
+     *  greedy:        utilization u = (live data) / (total size)
+     *  cost-benefit:  (1-u)*age / (1+u), age in objects since written
      */
-    std::set<std::tuple<double,int,int>> utilization;
+    std::set<std::tuple<double,int,int>> candidates;
+    const double threshold = cfg->gc_threshold / 100.0;
 
     for (auto p : object_info)  {
-	auto [hdrlen, datalen, live, type] = p.second;
-	if (type != LSVD_DATA)
+	auto [hdrlen, datalen, live, type, stored] = p.second;
+	if (type != LSVD_DATA || datalen == 0) // skip trim-only objects
+	    continue;
+	if (p.first <= snap_pin)
 	    continue;
 	double rho = 1.0 * live / datalen;
+	if (rho > threshold)
+	    continue;
 	sector_t sectors = hdrlen + datalen;
-	utilization.insert(std::make_tuple(rho, p.first, sectors));
 	assert(sectors <= 10*1024*1024/512);
+	double key = rho;
+	if (cfg->gc_policy == GC_COST_BENEFIT) {
+	    double age = max_obj - p.first;
+	    key = -(1 - rho) * age / (1 + rho);
+	}
+	candidates.insert(std::make_tuple(key, p.first, sectors));
     }
 
     /* gather list of objects needing cleaning, return if none
      */
-    const double threshold = 0.50;
     std::vector<std::pair<int,int>> objs_to_clean;
-    for (auto [u, o, n] : utilization) {
-	if (u > threshold)
-	    break;
-	if (objs_to_clean.size() > 32)
+    for (auto [key, o, n] : candidates) {
+	if ((int)objs_to_clean.size() >= cfg->gc_max_objs)
 	    break;
 	objs_to_clean.push_back(std::make_pair(o, n));
     }
     if (objs_to_clean.size() == 0) 
 	return;
+    gc_running = true;		// see clear_gc_caches
 	
-    /* find all live extents in objects listed in objs_to_clean:
-     * - make bitmap from objs_to_clean
-     * - find all entries in map pointing to those objects
+    /* find all live extents in objects listed in objs_to_clean. If
+     * all their headers are cached, look up just the LBAs each one
+     * wrote; otherwise scan the whole map for entries pointing to them.
      */
-    std::vector<bool> bitmap(max_obj+1);
-    for (auto it = objs_to_clean.begin(); it != objs_to_clean.end(); it++)
-	bitmap[it->first] = true;
+    std::vector<std::shared_ptr<const data_hdr_info>> hdrs;
+    for (auto [o, n] : objs_to_clean) {
+	auto hp = parser->cached_data_hdr(o);
+	if (hp == NULL) {
+	    hdrs.clear();
+	    break;
+	}
+	hdrs.push_back(hp);
+    }
 
-    std::unique_lock objlock(*map_lock); // TODO: might not need til later...
-    extmap::objmap live_extents;
-    for (auto it = map->begin(); it != map->end(); it++) {
-	auto [base, limit, ptr] = it->vals();
-	if (bitmap[ptr.obj])
-	    live_extents.update(base, limit, ptr);
+    std::vector<gc_extent> all_extents;
+    std::unique_lock objlock(*map_lock);
+    if (hdrs.size() > 0) {
+	for (auto &hp : hdrs) {
+	    int64_t obj = hp->h.seq, offset = hp->h.hdr_sectors;
+	    for (auto dm : hp->dmap) {
+		int64_t lba = dm.lba, limit = dm.lba + dm.len;
+		for (auto it = map->lookup(lba);
+		     it != map->end() && it->base() < limit; it++) {
+		    auto [_base, _limit, ptr] = it->vals(lba, limit);
+		    if (ptr.obj == obj && ptr.offset == offset + (_base - lba))
+			all_extents.push_back((gc_extent){_base, _limit,
+				    ptr, NULL});
+		}
+		offset += dm.len;
+	    }
+	}
+    }
+    else {
+	std::vector<bool> bitmap(max_obj+1);
+	for (auto it = objs_to_clean.begin(); it != objs_to_clean.end(); it++)
+	    bitmap[it->first] = true;
+	for (auto it = map->begin(); it != map->end(); it++) {
+	    auto [base, limit, ptr] = it->vals();
+	    if (bitmap[ptr.obj])
+		all_extents.push_back((gc_extent){base, limit, ptr, NULL});
+	}
     }
     objlock.unlock();
     lk.unlock();
@@ -722,143 +1844,104 @@ void translate_impl::do_gc(std::unique_lock<std::mutex> &lk) {
      * translation instance mutex held, doing no I/O.
      */
 
-    /* this is really gross. We really should check to see if data is
-     * in the read cache, and put retrieved data there...
+    /* read in object order, so neighboring extents share a read
      */
-    if (live_extents.size() > 0) {
-	/* temporary file, delete on close. 
-	 */
-	char temp[cfg->cache_dir.size() + 20];
-	sprintf(temp, "%s/gc.XXXXXX", cfg->cache_dir.c_str());
-	int fd = mkstemp(temp);
-	unlink(temp);
-
-	/* read all objects in completely. Someday we can check to see whether
-	 * (a) data is already in cache, or (b) sparse reading would be quicker
-	 */
-	extmap::cachemap file_map;
-	sector_t offset = 0;
-	char *buf = (char*)malloc(10*1024*1024);
-
-	for (auto [i,sectors] : objs_to_clean) {
-	    objname name(prefix(), i);
-	    iovec iov = {buf, (size_t)(sectors*512)};
-	    objstore->read_object(name.c_str(), &iov, 1, /*offset=*/ 0);
-	    gc_sectors_read += sectors;
-	    extmap::obj_offset _base = {i, 0}, _limit = {i, sectors};
-	    file_map.update(_base, _limit, offset);
-	    if (write(fd, buf, sectors*512) < 0)
-		throw("no space");
-	    offset += sectors;
-	}
-	free(buf);
-
-	struct _extent {
-	    int64_t base;
-	    int64_t limit;
-	    extmap::obj_offset ptr;
-	};
-	std::vector<_extent> all_extents;
-	for (auto it = live_extents.begin(); it != live_extents.end(); it++) {
-	    auto [base, limit, ptr] = it->vals();
-	    all_extents.push_back((_extent){base, limit, ptr});
+    std::sort(all_extents.begin(), all_extents.end(),
+	      [](const gc_extent &a, const gc_extent &b) {
+		  return a.ptr < b.ptr;
+	      });
+
+    /* split into output objects of up to 8MB, with few enough
+     * extents to stay under IOV_MAX for the write. With gc_cold_age
+     * set, data from victims older than that (cold) never shares an
+     * output object with younger (hot) data.
+     */
+    std::queue<gc_chunk*> chunks;
+    const sector_t max_sectors = 16 * 1024;
+    const size_t max_extents = 512;
+    auto is_cold = [&](const gc_extent &e) {
+	return cfg->gc_cold_age > 0 && max_obj - e.ptr.obj > cfg->gc_cold_age;
+    };
+    for (auto it = all_extents.begin(); it != all_extents.end(); ) {
+	auto c = new gc_chunk;
+	bool cold = is_cold(*it);
+	while (it != all_extents.end() && c->sectors < max_sectors &&
+	       c->extents.size() < max_extents && is_cold(*it) == cold) {
+	    c->extents.push_back(*it);
+	    c->sectors += (it->limit - it->base);
+	    it++;
 	}
-	
-	while (all_extents.size() > 0) {
-	    sector_t sectors = 0, max = 16 * 1024; // 8MB
-	    char *hdr = (char*)malloc(1024*32);	// 8MB / 4KB = 2K extents = 16KB
-
-	    auto it = all_extents.begin();
-	    while (it != all_extents.end() && sectors < max) {
-		auto [base, limit, ptr] = *it++;
-		sectors += (limit - base);
-		(void)ptr;	// suppress warning
-	    }
-	    std::vector<_extent> extents(std::make_move_iterator(all_extents.begin()),
-					 std::make_move_iterator(it));
-	    all_extents.erase(all_extents.begin(), it);
-	    
-	    /* lock the map while we read from the file. 
-	     * TODO: read everything in, put it in a bufmap, and then go 
-	     * back and construct an iovec for the subset that's still valid.
-	     */
-	    char *buf = (char*)aligned_alloc(512, sectors * 512);
-
-	    lk.lock();		// m
-	    objlock.lock();	// *map_lock
-	    off_t byte_offset = 0;
-	    sector_t data_sectors = 0;
-	    std::vector<data_map> obj_extents;
-	    
-	    for (auto [base, limit, ptr] : extents) {
-		for (auto it2 = map->lookup(base);
-		     it2->base() < limit && it2 != map->end(); it2++) {
-		    auto [_base, _limit, _ptr] = it2->vals(base, limit);
-		    if (_ptr.obj != ptr.obj)
-			continue;
-		    sector_t _sectors = _limit - _base;
-		    size_t bytes = _sectors*512;
-		    auto it3 = file_map.lookup(_ptr);
-		    auto file_sector = it3->ptr();
-
-		    auto err = pread(fd, buf+byte_offset, bytes, file_sector*512);
-		    if (err != (ssize_t)bytes) {
-			printf("\n\n");
-			printf("%ld != %ld, obj=%ld end=%s\n", err, bytes, _ptr.obj,
-			       it3 == file_map.end() ? "Y" : "n");
-			throw_fs_error("gc");
-		    }
-		    obj_extents.push_back((data_map){(uint64_t)_base, (uint64_t)_sectors});
-
-		    data_sectors += _sectors;
-		    byte_offset += bytes;
-		}
-	    }
-	    int32_t _seq = seq++;	    
-
-	    gc_sectors_written += data_sectors;
-	    int hdr_sectors = make_gc_hdr(hdr, _seq, data_sectors,
-					  obj_extents.data(), obj_extents.size());
-	    auto offset = hdr_sectors;
-
-	    int gc_sectors = byte_offset / 512;
-	    obj_info oi = {.hdr = hdr_sectors, .data = gc_sectors,
-		   .live = gc_sectors, .type = LSVD_DATA};
-	    object_info[_seq] = oi;
-	    
-	    for (auto e : obj_extents) {
-		extmap::obj_offset oo = {_seq, offset};
-		map->update(e.lba, e.lba+e.len, oo, NULL);
-		offset += e.len;
-	    }
-	    objlock.unlock();
-	    lk.unlock();
-
-	    smartiov iovs;
-	    iovs.push_back((iovec){hdr, (size_t)hdr_sectors*512});
-	    iovs.push_back((iovec){buf, (size_t)byte_offset});
-
-	    auto t_req = new translate_req(_seq, this);
-	    t_req->to_free.push_back(hdr);
-	    t_req->to_free.push_back(buf);
+	chunks.push(c);
+    }
 
-	    objname name(prefix(), _seq);
-	    auto [iov,iovcnt] = iovs.c_iov();
-	    auto req = objstore->make_write_req(name.c_str(), iov, iovcnt);
-	    req->run(t_req);
+    /* pipeline: keep reads outstanding for up to gc_window chunks
+     * (i.e. several victim objects) while earlier chunks are written
+     */
+    const size_t gc_window = 4;
+    std::queue<gc_chunk*> in_flight;
+    std::set<int> keep;		// victims of chunks that failed to read
+    while (chunks.size() > 0 || in_flight.size() > 0) {
+	while (chunks.size() > 0 && in_flight.size() < gc_window) {
+	    auto c = chunks.front();
+	    chunks.pop();
+	    gc_read(c);
+	    in_flight.push(c);
 	}
-	close(fd);
+	auto c = in_flight.front();
+	in_flight.pop();
+	c->wait();
+	if (!c->failed)
+	    gc_recheck(c);
+	if (metrics)
+	    metrics->add_time(H_GC_READ, m_now() - c->t0);
+
+	/* a read failed - leave this chunk's data where it is, and
+	 * its victims for a later pass to retry
+	 */
+	if (c->failed) {
+	    for (auto &e : c->extents)
+		keep.insert(e.ptr.obj);
+	    for (auto buf : c->bufs)
+		free(buf);
+	    delete c;
+	    continue;
+	}
+	gc_write(c, lk);
+	delete c;
     }
-
+    objs_to_clean.erase(std::remove_if(objs_to_clean.begin(),
+				       objs_to_clean.end(),
+				       [&](std::pair<int,int> &p) {
+					   return keep.count(p.first) > 0;
+				       }),
+			objs_to_clean.end());
+
+    /* victims can't go until nothing in the map points to them
+     */
     lk.lock();
-    for (auto it = objs_to_clean.begin(); it != objs_to_clean.end(); it++) 
-	object_info.erase(object_info.find(it->first));
+    while (gc_writes > 0)
+	cv.wait(lk);
+    for (auto it = objs_to_clean.begin(); it != objs_to_clean.end(); it++) {
+	auto oi = object_info.find(it->first);
+	total_sectors -= oi->second.data;
+	total_live_sectors -= oi->second.live;
+	total_stored -= oi->second.stored;
+	object_info.erase(oi);
+    }
 
     /* trim checkpoints
      */
     std::vector<int> ckpts_to_delete;
-    while (checkpoints.size() > 3) {
-	ckpts_to_delete.push_back(checkpoints.front());
+    auto is_snap = [&](uint32_t ck) {
+	for (auto &s : snaps)
+	    if (s.seq == ck)
+		return true;
+	return false;
+    };
+    while (checkpoints.size() > 3 && ckpt_chain.size() > 0 &&
+	   checkpoints.front() < ckpt_chain[0]) {
+	if (!is_snap(checkpoints.front()))
+	    ckpts_to_delete.push_back(checkpoints.front());
 	checkpoints.pop();
     }
     
@@ -867,6 +1950,7 @@ void translate_impl::do_gc(std::unique_lock<std::mutex> &lk) {
     for (auto it = objs_to_clean.begin(); it != objs_to_clean.end(); it++) {
 	objname name(prefix(), it->first);
 	objstore->delete_object(name.c_str());
+	parser->forget(it->first);
 	gc_deleted++;		// single-threaded, no lock needed
     }
 
@@ -875,12 +1959,60 @@ void translate_impl::do_gc(std::unique_lock<std::mutex> &lk) {
 	objstore->delete_object(name.c_str());
     }
     lk.lock();
+    gc_running = false;
+    cv.notify_all();
+}
+
+/* m held. Replay starts from the full checkpoint at the head of
+ * ckpt_chain, so trim-only objects before it can go once it's been
+ * written (i.e. the superblock points into its chain).
+ */
+void translate_impl::delete_trim_objs(std::unique_lock<std::mutex> &lk) {
+    if (snap_pending || ckpt_chain.size() == 0 ||
+	super_ckpt < (int)ckpt_chain[0])
+	return;
+    std::vector<int> objs;
+    auto it = trim_objs.upper_bound(std::max(snap_pin, base_last));
+    while (it != trim_objs.end() && *it < (int)ckpt_chain[0]) {
+	auto oi = object_info.find(*it);
+	if (oi != object_info.end()) {
+	    total_stored -= oi->second.stored;
+	    object_info.erase(oi);
+	}
+	objs.push_back(*it);
+	it = trim_objs.erase(it);
+    }
+    if (objs.size() == 0)
+	return;
+
+    lk.unlock();
+    for (auto o : objs) {
+	objname name(prefix(), o);
+	objstore->delete_object(name.c_str());
+	parser->forget(o);
+	gc_deleted++;
+    }
+    lk.lock();
+}
+
+void translate_impl::add_gc_cache(gc_cache *c) {
+    std::unique_lock lk(m);
+    gc_caches.push_back(c);
+}
+
+/* GC uses gc_caches without holding m, so wait until it's idle
+ */
+void translate_impl::clear_gc_caches(void) {
+    std::unique_lock lk(m);
+    while (gc_running)
+	cv.wait(lk);
+    gc_caches.clear();
 }
 
 
 void translate_impl::gc_thread(thread_pool<int> *p) {
     auto interval = std::chrono::milliseconds(100);
-    sector_t trigger = 128 * 1024 * 2; // 128 MB
+    sector_t trigger = cfg->gc_trigger / 512;
     const char *name = "gc_thread";
     pthread_setname_np(pthread_self(), name);
 	
@@ -889,9 +2021,13 @@ void translate_impl::gc_thread(thread_pool<int> *p) {
 	p->cv.wait_for(lk, interval);
 	if (!p->running)
 	    return;
-	if (total_sectors - total_live_sectors < trigger)
+	delete_trim_objs(lk);
+	double garbage = total_sectors - total_live_sectors;
+	if (total_sectors > 0)	// as stored, i.e. compressed
+	    garbage *= (double)total_stored / total_sectors;
+	if (garbage < trigger)
 	    continue;
-	if (((double)total_live_sectors / total_sectors) > 0.6)
+	if (((double)total_live_sectors / total_sectors) > cfg->gc_ratio / 100.0)
 	    continue;
 	do_gc(lk);
     }
@@ -946,7 +2082,7 @@ ssize_t translate_impl::readv(size_t offset, iovec *iov, int iovcnt) {
 	if (obj == -1)
 	    slice.zero();
 	else {
-	    objname name(prefix(), obj);
+	    objname name(prefix(obj), obj);
 	    auto [iov,iovcnt] = slice.c_iov();
 	    objstore->read_object(name.c_str(), iov, iovcnt, _offset);
 	}
@@ -981,6 +2117,10 @@ int translate_impl::frontier(void) {
 int translate_impl::batch_seq(void) {
     return seq;
 }
+int translate_impl::durable_seq(void) {
+    std::unique_lock lk(m);
+    return next_compln;
+}
 
 int batch_seq(translate *xlate_) {
     auto xlate = (translate_impl*)xlate_;
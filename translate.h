@@ -14,6 +14,37 @@
 struct iovec;
 class backend;
 class lsvd_config;
+class sharded_rwlock;
+class request;
+class smartiov;
+struct lsvd_metrics;
+
+/* cached copies of object data, which GC can use instead of reading
+ * from the backend. Implemented by the read and write caches.
+ */
+class gc_cache {
+public:
+    virtual ~gc_cache() {}
+
+    /* [lba, lba+sectors), found at oo in the object store. If the
+     * first n sectors are cached returns {n, tag, req}, where req (if
+     * not NULL) reads them into buf; otherwise {-n, 0, NULL}.
+     */
+    virtual std::tuple<int64_t,int64_t,request*>
+        gc_read(int64_t lba, extmap::obj_offset oo, int64_t sectors,
+                char *buf) = 0;
+
+    /* after the read completes: is the data from gc_read still valid?
+     */
+    virtual bool gc_check(int64_t lba, int64_t sectors, int64_t tag) {
+        return true;
+    }
+
+    /* GC wrote object 'obj'; [base,limit) ranges in 'hot' were cached
+     */
+    virtual void gc_add(int64_t obj, smartiov *data,
+                        std::vector<std::pair<int64_t,int64_t>> &hot) {}
+};
 
 class translate {
 public:
@@ -29,10 +60,50 @@ public:
     virtual int checkpoint(void) = 0; /* flush, then write checkpoint */
 
     virtual ssize_t writev(size_t offset, iovec *iov, int iovcnt) = 0;
+
+    /* a run of (offset, buffer) writes, in order, taking the lock
+     * once - for write cache replay
+     */
+    virtual void writev_list(std::vector<std::pair<size_t,iovec>> &w) = 0;
+    virtual ssize_t trim(size_t offset, size_t len) = 0;
     virtual void wait_for_room(void) = 0;
     virtual ssize_t readv(size_t offset, iovec *iov, int iovcnt) = 0;
 
-    virtual const char *prefix() = 0; /* for read cache */
+    virtual const char *prefix() = 0; /* superblock name */
+
+    /* name prefix for object 'seq' - in a clone, objects up to
+     * base_seq() come from the base image chain
+     */
+    virtual const char *prefix(int seq) = 0;
+
+    /* 0 if not a clone; otherwise the last base object, and the UUID
+     * of the image it was cloned from (for sharing a read cache with
+     * other clones of it)
+     */
+    virtual int base_seq(uuid_t &base_uuid) = 0;
+
+    /* snapshots are full checkpoints recorded in the superblock;
+     * see snap_info
+     */
+    virtual int snap_create(const char *name) = 0;
+    virtual int snap_remove(const char *name) = 0;
+    virtual void snap_list(std::vector<std::pair<std::string,int>> &snaps) = 0;
+
+    /* the batch being filled now will get batch_seq() or later; all
+     * objects before durable_seq() are in the backend
+     */
+    virtual int batch_seq(void) = 0;
+    virtual int durable_seq(void) = 0;
+
+    /* caches for GC to check before reading the backend. Caches must
+     * be removed (clear_gc_caches waits for GC) before deleting them
+     */
+    virtual void add_gc_cache(gc_cache *c) = 0;
+    virtual void clear_gc_caches(void) = 0;
+
+    /* counters and latencies are added here, if not NULL
+     */
+    virtual void set_metrics(lsvd_metrics *m) = 0;
     
     /* debug functions
      */
@@ -44,6 +115,6 @@ public:
 };
 
 extern translate *make_translate(backend *_io, lsvd_config *cfg,
-                                 extmap::objmap *map, std::shared_mutex *m);
+                                 extmap::objmap *map, sharded_rwlock *m);
 
 #endif
@@ -3,6 +3,7 @@
 // description: unit tests for extent.cc (first set?)
 //
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include "extent.h"
@@ -413,6 +414,146 @@ void test_9_delete(void)
     printf("%s: OK\n", __func__);
 }
 
+// test 10 - trim, including trimming an empty map
+//
+void test_10_trim(void)
+{
+    extmap::objmap map;
+    std::vector<extmap::lba2obj> v;
+    map.trim(0, 100, &v);
+    assert(map.size() == 0 && v.size() == 0);
+
+    extmap::obj_offset ptr = {1, 0};
+    map.update(0, 100, ptr);
+    map.trim(20, 30, &v);
+    assert(map.size() == 2 && v.size() == 1);
+    auto [base, limit, _ptr] = v[0].vals();
+    assert(base == 20 && limit == 30 && _ptr.offset == 20);
+
+    map.trim(0, 100);
+    assert(map.size() == 0);
+    map.trim(0, 100);
+    assert(map.size() == 0);
+    printf("%s: OK\n", __func__);
+}
+
+// test 11 - random updates and trims, checked against a plain array
+// of sectors, for both search layouts (flat_keys) and both key types.
+// obj_offset keys are packed into int64 search keys, so some ranges
+// sit at the top of the offset field or in a very large object.
+//
+static extmap::obj_offset mk_oo(int64_t obj, int64_t offset)
+{
+    extmap::obj_offset o;
+    o.obj = obj;
+    o.offset = offset;
+    return o;
+}
+
+template <class T_out> T_out mk_out(int64_t v);
+template <> int64_t mk_out<int64_t>(int64_t v) { return v; }
+template <> extmap::obj_offset mk_out<extmap::obj_offset>(int64_t v) {
+    return mk_oo(7, v);
+}
+static int64_t out_val(int64_t v) { return v; }
+static int64_t out_val(extmap::obj_offset o) { return o.offset; }
+
+template <class M, class T_in, class T_out>
+void _test_11_diff(std::vector<T_in> &origins, int width, std::mt19937 &rng)
+{
+    const int n_ops = 50000;
+    M map;
+    std::vector<std::vector<int64_t>> model(origins.size(),
+					    std::vector<int64_t>(width, -1));
+    std::uniform_int_distribution<int> u_seg(0, origins.size()-1),
+	u_off(0, width-1), u_len(1, 64), u_op(0, 9);
+    std::uniform_int_distribution<int64_t> u_val(0, 1000000);
+
+    // walk [origin, origin+width) from lookup() and compare
+    auto check = [&](int s) {
+	std::vector<int64_t> seen(width, -1);
+	T_in base = origins[s], limit = origins[s] + width;
+	for (auto it = map.lookup(base);
+	     it != map.end() && it->base() < limit; it++) {
+	    auto [_base, _limit, ptr] = it->vals(base, limit);
+	    int i0 = _base - base, i1 = _limit - base;
+	    assert(0 <= i0 && i0 < i1 && i1 <= width);
+	    for (int i = i0; i < i1; i++) {
+		assert(seen[i] == -1);
+		seen[i] = out_val(ptr) + (i - i0);
+	    }
+	}
+	assert(seen == model[s]);
+    };
+
+    for (int k = 0; k < n_ops; k++) {
+	int s = u_seg(rng), a = u_off(rng);
+	int len = std::min(u_len(rng), width - a);
+	T_in base = origins[s] + a, limit = base + len;
+	typename M::extent_vector deleted;
+	bool trim = (u_op(rng) < 3);
+	int64_t v = u_val(rng);
+	if (trim)
+	    map.trim(base, limit, &deleted);
+	else
+	    map.update(base, limit, mk_out<T_out>(v), &deleted);
+
+	// what came out is exactly what the range held
+	int n_mapped = 0, n_deleted = 0;
+	for (int i = a; i < a + len; i++)
+	    n_mapped += (model[s][i] != -1);
+	for (auto d : deleted) {
+	    T_out ptr = d.ptr();	// vals() can't take a bitfield ptr
+	    int i0 = d.base() - origins[s], i1 = d.limit() - origins[s];
+	    assert(a <= i0 && i0 < i1 && i1 <= a + len);
+	    for (int i = i0; i < i1; i++)
+		assert(model[s][i] == out_val(ptr) + (i - i0));
+	    n_deleted += i1 - i0;
+	}
+	assert(n_deleted == n_mapped);
+
+	for (int i = a; i < a + len; i++)
+	    model[s][i] = trim ? -1 : v + (i - a);
+
+	// point lookups: the first extent found must hold the sector,
+	// or start after it if it's unmapped
+	int x = u_off(rng);
+	auto it = map.lookup(origins[s] + x);
+	if (model[s][x] != -1) {
+	    assert(it != map.end());
+	    auto [_base, _limit, ptr] = it->vals(origins[s] + x,
+						 origins[s] + x + 1);
+	    assert(_base == origins[s] + x && _limit == origins[s] + x + 1);
+	    assert(out_val(ptr) == model[s][x]);
+	}
+	else if (it != map.end())
+	    assert(it->base() > origins[s] + x);
+
+	if (k % 2000 == 0)
+	    check(s);
+    }
+    for (size_t s = 0; s < origins.size(); s++)
+	check(s);
+}
+
+void test_11_diff(void)
+{
+    std::mt19937 rng(17);
+    const int w = 40000;	// sectors per range
+    std::vector<int64_t> lbas = {0, w + 7, (1L << 37) - w - 1};
+    std::vector<extmap::obj_offset> objs =
+	{mk_oo(1, 0), mk_oo(1, (1L << 27) - w - 1), mk_oo(2, 0),
+	 mk_oo((1L << 35) - 1, 0)};
+
+    typedef extmap::lba2obj l2o;
+    typedef extmap::obj2lba o2l;
+    typedef extmap::obj_offset oo;
+    _test_11_diff<extmap::extmap<l2o,int64_t,oo,true>,int64_t,oo>(lbas, w, rng);
+    _test_11_diff<extmap::extmap<l2o,int64_t,oo,false>,int64_t,oo>(lbas, w, rng);
+    _test_11_diff<extmap::extmap<o2l,oo,int64_t,true>,oo,int64_t>(objs, w, rng);
+    _test_11_diff<extmap::extmap<o2l,oo,int64_t,false>,oo,int64_t>(objs, w, rng);
+    printf("%s: OK\n", __func__);
+}
 
 int primes[] = { 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53, 59,
 		 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131,
@@ -453,6 +594,10 @@ int main(int argc, char **argv)
 	test_3_seq_merge();
     if (in_mask(mask, 7))
 	test_7_lookup();
+    if (in_mask(mask, 10))
+	test_10_trim();
+    if (in_mask(mask, 11))
+	test_11_diff();
 
     if (argc > 2)
 	return 0;
@@ -0,0 +1,187 @@
+/*
+ * file:        wcache_stripe.cc
+ * description: write cache striped over several journals
+ *
+ * author:      Peter Desnoyers, Northeastern University
+ * Copyright 2021, 2022 Peter Desnoyers
+ * license:     GNU LGPL v2.1 or newer
+ *              LGPL-2.1-or-later
+ */
+
+#include <uuid/uuid.h>
+
+#include <atomic>
+#include <vector>
+#include <mutex>
+#include <shared_mutex>
+#include <algorithm>
+
+#include "lsvd_types.h"
+
+#include "journal.h"
+#include "smartiov.h"
+#include "extent.h"
+#include "misc_cache.h"
+#include "backend.h"
+#include "translate.h"
+#include "request.h"
+#include "config.h"
+#include "write_cache.h"
+
+/* Each volume stripe lives in exactly one journal, so writes and
+ * trims for an LBA are ordered by that journal alone: there's no
+ * cross-journal sequence to keep, and each journal replays on its
+ * own. Requests that span stripes are split, and complete when all
+ * the pieces do.
+ */
+class striped_wcache : public write_cache {
+    std::vector<write_cache*> caches;
+    sector_t unit;
+
+    int pick(sector_t lba) {
+	return (lba / unit) % caches.size();
+    }
+    sector_t stripe_limit(sector_t lba) {
+	return (lba / unit + 1) * unit;
+    }
+
+    /* fan-out parent: notifies 'req' after n children
+     */
+    class stripe_req : public request {
+	std::atomic<int> n;
+	request *req;
+    public:
+	std::vector<smartiov> iovs;
+	stripe_req(request *req_, int n_) : n(n_), req(req_) {}
+	~stripe_req() {}
+	void notify(request *child) {
+	    if (--n == 0) {
+		req->notify(NULL);
+		delete this;
+	    }
+	}
+	void run(request *parent) {}
+	void wait() {}
+	void release() {}
+    };
+
+public:
+    striped_wcache(std::vector<write_cache*> &caches_, sector_t unit_) {
+	caches = caches_;
+	unit = unit_;
+    }
+    ~striped_wcache() {
+	for (auto c : caches)
+	    delete c;
+    }
+
+    /* the window is per journal, but we don't know here where the
+     * sectors will go; the first journal's is a safe bound for all
+     */
+    void get_room(sector_t sectors) {
+	caches[0]->get_room(sectors);
+    }
+    void release_room(sector_t sectors) {
+	caches[0]->release_room(sectors);
+    }
+    void flush(void) {
+	for (auto c : caches)
+	    c->flush();
+    }
+
+    void writev(request *req, sector_t lba, smartiov *iov) {
+	sector_t limit = lba + iov->bytes() / 512;
+	if (limit <= stripe_limit(lba)) {
+	    caches[pick(lba)]->writev(req, lba, iov);
+	    return;
+	}
+	int n = (limit - 1) / unit - lba / unit + 1;
+	auto s_req = new stripe_req(req, n);
+	s_req->iovs.reserve(n);	// children hold pointers into this
+	for (sector_t base = lba; base < limit; ) {
+	    sector_t _limit = std::min(limit, stripe_limit(base));
+	    s_req->iovs.push_back(iov->slice((base - lba)*512,
+					     (_limit - lba)*512));
+	    caches[pick(base)]->writev(s_req, base, &s_req->iovs.back());
+	    base = _limit;
+	}
+    }
+
+    /* every journal owning a stripe in the range logs a trim of the
+     * whole range: its map only holds its own stripes, and it only
+     * trims those in the backend. That's one record per journal even
+     * for a discard of the whole volume.
+     */
+    void trim(request *req, sector_t lba, sector_t sectors) {
+	sector_t first = lba / unit,
+	    n = (lba + sectors - 1) / unit - first + 1;
+	int n_caches = std::min((sector_t)caches.size(), n);
+	if (n_caches == 1) {
+	    caches[pick(lba)]->trim(req, lba, sectors);
+	    return;
+	}
+	auto s_req = new stripe_req(req, n_caches);
+	for (int i = 0; i < n_caches; i++)
+	    caches[(first + i) % caches.size()]->trim(s_req, lba, sectors);
+    }
+
+    void flush_async(request *req) {
+	auto s_req = new stripe_req(req, caches.size());
+	for (auto c : caches)
+	    c->flush_async(s_req);
+    }
+
+    /* the caller loops until it's read everything, so we just stop
+     * at the end of the stripe
+     */
+    std::tuple<size_t,size_t,request*>
+    async_read(size_t offset, char *buf, size_t len) {
+	sector_t lba = offset / 512;
+	len = std::min(len, (size_t)(stripe_limit(lba) - lba) * 512);
+	return caches[pick(lba)]->async_read(offset, buf, len);
+    }
+
+    std::tuple<int64_t,int64_t,request*>
+    gc_read(int64_t lba, extmap::obj_offset oo, int64_t sectors,
+	    char *buf) {
+	sectors = std::min(sectors, (int64_t)stripe_limit(lba) - lba);
+	return caches[pick(lba)]->gc_read(lba, oo, sectors, buf);
+    }
+    bool gc_check(int64_t lba, int64_t sectors, int64_t tag) {
+	return caches[pick(lba)]->gc_check(lba, sectors, tag);
+    }
+
+    void getmap(int base, int limit, int (*cb)(void*,int,int,int),
+		void *ptr) {
+	for (auto c : caches)
+	    c->getmap(base, limit, cb, ptr);
+    }
+    void reset(void) {
+	for (auto c : caches)
+	    c->reset();
+    }
+    void get_super(j_write_super *s) {
+	caches[0]->get_super(s);
+    }
+    page_t get_oldest(page_t blk, std::vector<j_extent> &extents) {
+	return caches[0]->get_oldest(blk, extents);
+    }
+    void do_write_checkpoint(void) {
+	for (auto c : caches)
+	    c->do_write_checkpoint();
+    }
+    void set_read_cache(read_cache *rc) {
+	for (auto c : caches)
+	    c->set_read_cache(rc);
+    }
+
+    void set_metrics(lsvd_metrics *m) {
+	for (auto c : caches)
+	    c->set_metrics(m);
+    }
+};
+
+write_cache *make_striped_wcache(std::vector<write_cache*> &caches,
+				 sector_t unit) {
+    return new striped_wcache(caches, unit);
+}
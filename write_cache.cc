@@ -9,12 +9,14 @@
  */
 
 #include <uuid/uuid.h>
+#include <sched.h>
 
 #include <atomic>
 
 #include <vector>
 #include <map>
 #include <stack>
+#include <deque>
 
 #include <mutex>
 #include <shared_mutex>
@@ -22,6 +24,7 @@
 #include <thread>
 #include <cassert>
 #include <algorithm>
+#include <chrono>
 
 #include "lsvd_types.h"
 
@@ -33,10 +36,14 @@
 #include "translate.h"
 #include "io.h"
 #include "request.h"
+#include "mempool.h"
 #include "nvme.h"
 
 #include "write_cache.h"
+#include "read_cache.h"
 #include "config.h"
+#include "crc32c.h"
+#include "metrics.h"
 
 typedef std::tuple<request*,sector_t,smartiov*> work_tuple;
 
@@ -52,17 +59,48 @@ class write_cache_impl : public write_cache {
      */
     int total_write_pages = 0;
     int max_write_pages = 0;
-    int outstanding_writes = 0;
-    size_t write_batch = 0;
     std::condition_variable write_cv;
 
+    /* group commit. writev() queues on a per-CPU shard without
+     * taking m. A journal record goes out right away if fewer than
+     * write_depth are in flight; otherwise writes wait for a
+     * completion (which sends everything queued), for a full batch
+     * (write_batch writes or batch_bytes), or for the flush thread
+     * once the oldest has waited batch_usecs.
+     */
+    struct wq_shard {
+	std::mutex m;
+	std::vector<std::pair<uint64_t,work_tuple>> w;
+    };
+    wq_shard *shards = NULL;
+    int n_shards = 1;
+    std::atomic<uint64_t> wq_seq = 0;	// keeps writes in issue order
+    std::atomic<int> queued = 0;
+    std::atomic<long> queued_bytes = 0;
+    std::atomic<long> first_queued = 0; // usecs, when queued went 0->1
+    std::atomic<int> outstanding_writes = 0;
+    int write_depth = 1;
+    size_t write_batch = 0;
+    long batch_bytes = 0;
+    long batch_usecs = 0;
+
     void evict(page_t base, page_t len);
     void send_writes(std::unique_lock<std::mutex> &lk);
+    std::vector<work_tuple> gather(void);
+    page_t alloc_record(page_t pages, page_t &pad, page_t &n_pad);
+    void trim_map(sector_t base, sector_t limit);
+
+    /* this journal's share of a striped cache (see wcache_stripe.cc):
+     * every n_stripes'th stripe of stripe_unit sectors, from 'stripe'
+     */
+    sector_t stripe_unit = 0;
+    int stripe = 0, n_stripes = 1;
+    void trim_backend(sector_t base, sector_t limit);
 
     /* initialization stuff
      */
     void read_map_entries();
-    int roll_log_forward();
+    int roll_log_forward(replay_progress *rp);
 
     /* track contents of the write cache. 
      */
@@ -73,34 +111,88 @@ class write_cache_impl : public write_cache {
     struct page_desc {
 	enum page_type type = WCACHE_NONE;
 	int            n_pages;
+	int            obj_seq = -1; // HDR: be->batch_seq() before handoff
     };
     page_desc *cache_blocks;
     extmap::cachemap2 rmap;	// reverse map: pLBA,len -> vLBA
 
+    /* pLBA ranges that have been read since they were written. On
+     * eviction these get copied to the read cache, if there is one.
+     * evict() only queues them, under m; promote_thread copies them
+     * without it, and a record reusing the space waits for that
+     * (wait_promoted) before it's written.
+     */
+    extmap::cachemap2 hot;
+    read_cache       *rcache = NULL;
+    struct promote_job {
+	sector_t lba;
+	sector_t sectors;
+	sector_t plba;
+	int      obj_seq;	// objects in [obj_seq,obj_limit) hold it
+	int      obj_limit;
+    };
+    std::vector<promote_job> to_promote;
+    uint64_t          promote_queued = 0;
+    std::atomic<uint64_t> promoted = 0;
+    std::condition_variable promote_cv;
+    void promote_thread(thread_pool<int> *p);
+    void wait_promoted(uint64_t ticket);
+
     /* track outstanding requests and point before which
      * all writes are durable in SSD
      */
-    std::vector<std::pair<page_t,page_t>> outstanding;
+    struct o_rec {
+	page_t   start;
+	page_t   len;
+	uint64_t seq;
+    };
+    std::vector<o_rec> outstanding;	// in issue order
+    uint64_t rec_seq = 0;
     page_t next_acked_page = 0;
     void notify_complete(page_t start, page_t len);
     void record_outstanding(page_t start, page_t len);
 
+    /* flush_async waiters: (last record issued before the flush, req)
+     */
+    std::vector<std::pair<uint64_t,request*>> flushes;
+    std::atomic<int> n_flushes = 0;
+    void get_flushed(std::vector<request*> &done);
+
+    /* records off 'outstanding' that are still running their write
+     * callbacks; a flush can't complete ahead of those
+     */
+    std::atomic<int> acking = 0;
+    void callbacks_done(void);
+
     thread_pool<int>          *misc_threads;
+    int                        ssd_fd;	// nvme_w's file
 
     void flush_thread(thread_pool<int> *p);
     void ckpt_thread(thread_pool<int> *p);
     bool ckpt_in_progress = false;
     void write_checkpoint(void);
+
+    /* map checkpoints are a full map + length table, followed by
+     * deltas (j_map_delta) until those outgrow it or their half of
+     * the metadata region. Changes are logged here under m; the full
+     * one is built a chunk at a time, with the deltas logged since it
+     * started going on top.
+     */
+    std::vector<j_map_delta> deltas;
+    bool need_full = false;
+    void log_delta(int type, uint64_t base, uint64_t len, uint64_t plba);
+    void scan_checkpoint(std::vector<j_map_extent> &extents,
+			 std::vector<j_length> &lengths);
     
     /* allocate journal entry, create a header
      */
     uint32_t allocate(page_t n, page_t &pad, page_t &n_pad);
-    std::vector<work_tuple> work;
     j_write_super *super;
 
-    /* these are used by wcache_write_req
+    /* these are used by wcache_write_req, wcache_trim_req
      */
     friend class wcache_write_req;
+    friend class wcache_trim_req;
     std::mutex                m;
     extmap::cachemap2 map;
     bool              map_dirty;
@@ -108,6 +200,12 @@ class write_cache_impl : public write_cache {
     j_hdr *mk_header(char *buf, uint32_t type, page_t blks);
     nvme 		      *nvme_w = NULL;
 
+    /* record CRC32C (j_hdr.crc32), filled in by the request just
+     * before it's submitted
+     */
+    void seal_record(char *hdr, smartiov *data);
+    bool check_record(char *hdr, char *data, size_t bytes);
+
 public:
 
     /* throttle writes with window of max_write_pages
@@ -117,13 +215,21 @@ public:
     void flush(void);
 
     write_cache_impl(uint32_t blkno, int _fd, translate *_be,
-		     lsvd_config *cfg);
+		     lsvd_config *cfg, replay_progress *rp,
+		     int stripe, int n_stripes);
     ~write_cache_impl();
 
     void writev(request *req, sector_t lba, smartiov *iov);
+    void trim(request *req, sector_t lba, sector_t sectors);
+    void flush_async(request *req);
     virtual std::tuple<size_t,size_t,request*> 
         async_read(size_t offset, char *buf, size_t bytes);
 
+    std::tuple<int64_t,int64_t,request*>
+        gc_read(int64_t lba, extmap::obj_offset oo, int64_t sectors,
+		char *buf);
+    bool gc_check(int64_t lba, int64_t sectors, int64_t tag);
+
     /* debug functions */
 
     /* getmap callback(ptr, base, limit, phys_lba)
@@ -139,12 +245,16 @@ public:
      */
     page_t get_oldest(page_t blk, std::vector<j_extent> &extents);
     void do_write_checkpoint(void);
+    void set_read_cache(read_cache *rc);
+
+    lsvd_metrics *metrics = NULL;
+    void set_metrics(lsvd_metrics *m) { metrics = m; }
 };
 
 
 /* ------------- batched write request ------------- */
 
-class wcache_write_req : public request {
+class wcache_write_req : public request, public pooled<wcache_write_req> {
     std::atomic<int> reqs = 0;
 
     sector_t      plba;
@@ -154,19 +264,20 @@ class wcache_write_req : public request {
     page_t        pad_page = 0;
     page_t        n_pad_pages;
     
-    std::vector<work_tuple> *work = NULL;
+    std::vector<work_tuple> work;
     request      *r_data = NULL;
     char         *hdr = NULL;
-    smartiov     *data_iovs = NULL;
+    smartiov      data_iovs;
 
     request      *r_pad = NULL;
     char         *pad_hdr = NULL;
     smartiov      pad_iov;
 
     write_cache_impl *wcache = NULL;
+    uint64_t      t0 = 0;	// for metrics
     
 public:
-    wcache_write_req(std::vector<work_tuple> *w, page_t n_pages, page_t page,
+    wcache_write_req(std::vector<work_tuple> &w, page_t n_pages, page_t page,
 		     page_t n_pad, page_t pad,
 		     write_cache *wcache);
     ~wcache_write_req();
@@ -177,20 +288,21 @@ public:
     void release() {}		// TODO: free properly
 };
 
-/* n_pages: number of 4KB data pages (not counting header)
+/* w:       queued writes; taken over (swapped) by the request
+ * n_pages: number of 4KB data pages (not counting header)
  * page:    page number to begin writing 
  * n_pad:   number of pages to skip (not counting header)
  * pad:     page number for pad entry (0 if none)
  */
-wcache_write_req::wcache_write_req(std::vector<work_tuple> *work_,
+wcache_write_req::wcache_write_req(std::vector<work_tuple> &work_,
 				       page_t n_pages, page_t page,
 				       page_t n_pad, page_t pad,
 				       write_cache* wcache_)  {
     wcache = (write_cache_impl*)wcache_;
-    work = work_;
+    work.swap(work_);
     
     if (pad != 0) {
-	pad_hdr = (char*)aligned_alloc(512, 4096);
+	pad_hdr = page_alloc(4096);
 	wcache->mk_header(pad_hdr, LSVD_J_PAD, n_pad+1);
 
 	pad_page = pad;	// track completion
@@ -203,12 +315,12 @@ wcache_write_req::wcache_write_req(std::vector<work_tuple> *work_,
     }
   
     std::vector<j_extent> extents;
-    for (auto [req,lba,iov] : *work) {
+    for (auto [req,lba,iov] : work) {
 	(void)req;
 	extents.push_back((j_extent){(uint64_t)lba, iov->bytes() / 512});
     }
   
-    hdr = (char*)aligned_alloc(512, 4096);
+    hdr = page_alloc(4096);
     j_hdr *j = wcache->mk_header(hdr, LSVD_J_DATA, 1+n_pages);
 
     hdr_page = page;		// track completion
@@ -222,23 +334,20 @@ wcache_write_req::wcache_write_req(std::vector<work_tuple> *work_,
 
     plba = (page+1) * 8;
 
-    data_iovs = new smartiov();
-    data_iovs->push_back((iovec){hdr, 4096});
-    for (auto [req,lba,iovs] : *work) {
+    data_iovs.push_back((iovec){hdr, 4096});
+    for (auto [req,lba,iovs] : work) {
 	(void)req; (void)lba;
 	auto [iov, iovcnt] = iovs->c_iov();
-	data_iovs->ingest(iov, iovcnt);
+	data_iovs.ingest(iov, iovcnt);
     }
     reqs++;
-    r_data = wcache->nvme_w->make_write_request(data_iovs, page*4096L);
+    r_data = wcache->nvme_w->make_write_request(&data_iovs, page*4096L);
 }
 
 wcache_write_req::~wcache_write_req() {
-    free(hdr);
+    page_free(hdr, 4096);
     if (pad_hdr) 
-        free(pad_hdr);
-    delete data_iovs;
-    delete work;
+        page_free(pad_hdr, 4096);
 }
 
 void do_log(const char*, ...);
@@ -247,6 +356,11 @@ void wcache_write_req::notify(request *child) {
     child->release();
     if(--reqs > 0)
 	return;
+    if (wcache->metrics) {
+	wcache->metrics->add_time(H_WC_COMMIT, m_now() - t0);
+	wcache->metrics->add(M_WC_RECORDS, 1);
+	wcache->metrics->add(M_WC_BYTES, 4096L * n_hdr_pages);
+    }
     {
 	std::unique_lock lk(wcache->m);
 	auto _plba = plba;
@@ -254,48 +368,169 @@ void wcache_write_req::notify(request *child) {
 	/* update the write cache forward and reverse maps
 	 */
         std::vector<extmap::lba2lba> garbage; 
-	for (auto [req,lba,iovs] : *work) {
+	for (auto [req,lba,iovs] : work) {
 	    (void)req;
 	    sector_t sectors = iovs->bytes() / 512;
 
-	    wcache->map.update(lba, lba + sectors, _plba, NULL);
+	    wcache->map.update(lba, lba + sectors, _plba, &garbage);
             wcache->rmap.update(_plba, _plba+sectors, lba);
-	    assert(wcache->map.size() <= 6354);
+	    wcache->log_delta(J_DELTA_MAP, lba, sectors, _plba);
 	    
 	    _plba += sectors;
 	    wcache->map_dirty = true;
 	}
-        for (auto it = garbage.begin(); it != garbage.end(); it++) 
-            wcache->rmap.trim(it->s.base, it->s.base+it->s.len);
+	/* overwritten data is garbage - take it out of the reverse
+	 * map, so that evicting it won't trim the new mapping
+	 */
+        for (auto g : garbage)
+            wcache->rmap.trim(g.s.ptr, g.s.ptr + g.s.len);
 
-	wcache->outstanding_writes--;
-	if (wcache->work.size() >= wcache->write_batch)
-	    wcache->send_writes(lk);
+	/* objects from here on might hold this record's data (see evict)
+	 */
+	auto &pd = wcache->cache_blocks[hdr_page - wcache->super->base];
+	if (pd.type == write_cache_impl::WCACHE_HDR)
+	    pd.obj_seq = wcache->be->batch_seq();
 
 	if (pad_page != 0)
 	    wcache->notify_complete(pad_page, n_pad_pages);
 	wcache->notify_complete(hdr_page, n_hdr_pages);
+	wcache->acking++;
+
+	/* group commit - whatever queued up behind us goes now
+	 */
+	wcache->outstanding_writes--;
+	if (wcache->queued > 0)
+	    wcache->send_writes(lk);
     }
 
     /* send data to backend, invoke callbacks, then clean up
      */
-    for (auto [req,lba,iovs] : *work) {
+    for (auto [req,lba,iovs] : work) {
 	auto [iov, iovcnt] = iovs->c_iov();
 	wcache->be->writev(lba*512, iov, iovcnt);
 	req->notify(NULL);	// don't release multiple times
     }
+    wcache->callbacks_done();
 
     /* we don't implement release or wait - just delete ourselves.
      */
     delete this;
 }
 
+/* pad and data records go to the SSD in one submission
+ */
 void wcache_write_req::run(request *parent /* unused */) {
+    if (pad_hdr)
+	wcache->seal_record(pad_hdr, NULL);
+    auto data = data_iovs.slice(4096, data_iovs.bytes());
+    wcache->seal_record(hdr, &data);
+    t0 = m_now();
+
+    io_batch batch;
     if(r_pad) 
 	r_pad->run(this);
     r_data->run(this);
 }
 
+/* ------------- trim (discard) request ------------- */
+
+/* header-only journal record listing the discarded extent. On
+ * completion we drop the extent from the maps and pass the trim on
+ * to the translation layer.
+ */
+class wcache_trim_req : public request, public pooled<wcache_trim_req> {
+    std::atomic<int> reqs = 0;
+
+    request      *req;
+    sector_t      lba;
+    sector_t      sectors;
+
+    page_t        hdr_page;
+    page_t        pad_page = 0;
+    page_t        n_pad_pages;
+
+    request      *r_hdr = NULL;
+    char         *hdr = NULL;
+    smartiov      hdr_iov;
+    request      *r_pad = NULL;
+    char         *pad_hdr = NULL;
+    smartiov      pad_iov;
+
+    write_cache_impl *wcache = NULL;
+
+public:
+    wcache_trim_req(request *req_, sector_t lba_, sector_t sectors_,
+		    page_t page, page_t n_pad, page_t pad,
+		    write_cache_impl *wcache_) {
+	req = req_;
+	lba = lba_;
+	sectors = sectors_;
+	wcache = wcache_;
+
+	if (pad != 0) {
+	    pad_hdr = page_alloc(4096);
+	    wcache->mk_header(pad_hdr, LSVD_J_PAD, n_pad+1);
+	    pad_page = pad;
+	    n_pad_pages = n_pad+1;
+	    wcache->record_outstanding(pad, n_pad+1);
+	    pad_iov.push_back((iovec){pad_hdr, 4096});
+	    reqs++;
+	    r_pad = wcache->nvme_w->make_write_request(&pad_iov, pad*4096L);
+	}
+
+	hdr = page_alloc(4096);
+	j_hdr *j = wcache->mk_header(hdr, LSVD_J_TRIM, 1);
+	j_extent e = {(uint64_t)lba, (uint64_t)sectors};
+	j->extent_offset = sizeof(*j);
+	j->extent_len = sizeof(e);
+	memcpy(hdr + sizeof(*j), &e, sizeof(e));
+
+	hdr_page = page;
+	wcache->record_outstanding(page, 1);
+	hdr_iov.push_back((iovec){hdr, 4096});
+	reqs++;
+	r_hdr = wcache->nvme_w->make_write_request(&hdr_iov, page*4096L);
+    }
+    ~wcache_trim_req() {
+	page_free(hdr, 4096);
+	if (pad_hdr)
+	    page_free(pad_hdr, 4096);
+    }
+
+    void run(request *parent /* unused */) {
+	if (pad_hdr)
+	    wcache->seal_record(pad_hdr, NULL);
+	wcache->seal_record(hdr, NULL);
+
+	io_batch batch;
+	if (r_pad)
+	    r_pad->run(this);
+	r_hdr->run(this);
+    }
+
+    void notify(request *child) {
+	child->release();
+	if (--reqs > 0)
+	    return;
+	{
+	    std::unique_lock lk(wcache->m);
+	    wcache->trim_map(lba, lba + sectors);
+	    wcache->map_dirty = true;
+	    if (pad_page != 0)
+		wcache->notify_complete(pad_page, n_pad_pages);
+	    wcache->notify_complete(hdr_page, 1);
+	    wcache->acking++;
+	}
+	wcache->trim_backend(lba, lba + sectors);
+	req->notify(NULL);
+	wcache->callbacks_done();
+	delete this;
+    }
+
+    void wait() {}
+    void release() {}
+};
+
 /* --------------- Write Cache ------------- */
 
 /* stall write requests using window of max_write_blocks, which should
@@ -349,23 +584,53 @@ void write_cache_impl::evict(page_t page, page_t limit) {
      */
     assert(cache_blocks[oldest - b].type == WCACHE_HDR);
 
+    /* live data that's been read: vLBA, sectors, pLBA, obj_seq
+     */
+    std::vector<std::tuple<sector_t,sector_t,sector_t,int>> promote;
+
     while (oldest < limit) {
 	page_t len = cache_blocks[oldest - b].n_pages;
+	int obj_seq = cache_blocks[oldest - b].obj_seq;
 	sector_t s_base = oldest*8, s_limit = s_base + len*8;
 	
 	for (auto it = rmap.lookup(s_base);
 	     it != rmap.end() && it->base() < s_limit; it++) {
 	    auto [_base, _limit, ptr] = it->vals(s_base, s_limit);
+	    if (rcache != NULL && obj_seq >= 0)
+		for (auto it2 = hot.lookup(_base);
+		     it2 != hot.end() && it2->base() < _limit; it2++) {
+		    auto [h_base, h_limit, _ptr] = it2->vals(_base, _limit);
+		    (void)_ptr;
+		    promote.push_back(std::make_tuple(ptr + (h_base - _base),
+						      h_limit - h_base,
+						      h_base, obj_seq));
+		}
 	    map.trim(ptr, ptr+(_limit-_base));
+	    log_delta(J_DELTA_TRIM, ptr, _limit-_base, 0);
 	}
 	rmap.trim(s_base, s_limit);
+	hot.trim(s_base, s_limit);
 
 	for (int i = 0; i < len; i++)
 	    cache_blocks[oldest - b + i].type = WCACHE_NONE;
+	log_delta(J_DELTA_FREE, oldest, len, 0);
 
 	oldest += len;
     }
 
+    /* anything written after this goes into a batch numbered
+     * batch_seq() or later, so objects before that can't hold newer
+     * data for these LBAs
+     */
+    if (promote.size() > 0) {
+	int obj_limit = be->batch_seq();
+	for (auto [lba, sectors, plba, obj_seq] : promote)
+	    to_promote.push_back((promote_job){lba, sectors, plba,
+			obj_seq, obj_limit});
+	promote_queued += promote.size();
+	misc_threads->cv.notify_all();
+    }
+
     assert(oldest <= (page_t)super->limit);
     if (oldest == (page_t)super->limit)
 	oldest = super->base;
@@ -400,40 +665,121 @@ uint32_t write_cache_impl::allocate(page_t n, page_t &pad, page_t &n_pad) {
 
 void write_cache_impl::notify_complete(page_t start, page_t len) {
     assert(!m.try_lock());	// must be locked
-    auto it = std::find(outstanding.begin(), outstanding.end(),
-			std::make_pair(start,len));
+    auto it = std::find_if(outstanding.begin(), outstanding.end(),
+			   [start,len](auto &o){return o.start == start &&
+						o.len == len;});
     assert(it != outstanding.end());
     outstanding.erase(it);
-    next_acked_page = outstanding.front().first;
+    if (outstanding.size() > 0)
+	next_acked_page = outstanding.front().start;
+    else
+	next_acked_page = super->next;
 }
 
 void write_cache_impl::record_outstanding(page_t start, page_t len) {
     assert(!m.try_lock());	// must be locked
-    outstanding.push_back(std::make_pair(start, len));
+    outstanding.push_back((o_rec){start, len, ++rec_seq});
+}
+
+/* move flush_async waiters with nothing older still outstanding to
+ * @done, for the caller to notify once it drops the lock
+ */
+void write_cache_impl::get_flushed(std::vector<request*> &done) {
+    assert(!m.try_lock());
+    if (acking.load() > 0)
+	return;
+    uint64_t oldest = outstanding.size() ? outstanding.front().seq : rec_seq+1;
+    auto it = flushes.begin();
+    for (; it != flushes.end() && it->first < oldest; it++)
+	done.push_back(it->second);
+    n_flushes -= (it - flushes.begin());
+    flushes.erase(flushes.begin(), it);
+}
+
+/* the last record to finish its callbacks picks up the flushes. A
+ * flush_async racing with us checks acking after bumping n_flushes,
+ * so one of us sees the other.
+ */
+void write_cache_impl::callbacks_done(void) {
+    std::vector<request*> flushed;
+    if (--acking == 0 && n_flushes.load() > 0) {
+	std::unique_lock lk(m);
+	get_flushed(flushed);
+    }
+    for (auto f : flushed)
+	f->notify(NULL);
 }
 
-/* call with lock held
+/* call with lock held. The CRC is left for seal_record, outside the lock
  */
 j_hdr *write_cache_impl::mk_header(char *buf, uint32_t type, page_t blks) {
     assert(!m.try_lock());
     memset(buf, 0, 4096);
     j_hdr *h = (j_hdr*)buf;
     // OH NO - am I using wcache->sequence or wcache->super->seq???
-    *h = (j_hdr){.magic = LSVD_MAGIC, .type = type, .version = 1,
+    *h = (j_hdr){.magic = LSVD_MAGIC, .type = type, .version = 2,
 		 .seq = sequence++, .len = (uint32_t)blks, .crc32 = 0,
 		 .extent_offset = 0, .extent_len = 0};
     return h;
 }
 
+static long now_usecs(void) {
+    auto t = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::microseconds>(t).count();
+}
+
+/* CRC32C of the 4KB header page (with crc32 = 0) followed by the
+ * record's data, i.e. the sectors its extents cover, not the padding
+ * out to a page.
+ */
+void write_cache_impl::seal_record(char *hdr, smartiov *data) {
+    auto t0 = m_now();
+    auto h = (j_hdr*)hdr;
+    h->crc32 = 0;
+    uint32_t crc = crc32c(0, hdr, 4096);
+    size_t bytes = 4096;
+    if (data != NULL) {
+	auto [iov, iovcnt] = data->c_iov();
+	for (int i = 0; i < iovcnt; i++)
+	    crc = crc32c(crc, iov[i].iov_base, iov[i].iov_len);
+	bytes += data->bytes();
+    }
+    h->crc32 = crc;
+    if (metrics) {
+	metrics->add(M_CRC_BYTES, bytes);
+	metrics->add(M_CRC_NSECS, m_now() - t0);
+    }
+}
+
+/* version 1 records don't have a CRC
+ */
+bool write_cache_impl::check_record(char *hdr, char *data, size_t bytes) {
+    auto h = (j_hdr*)hdr;
+    if (h->version < 2)
+	return true;
+    uint32_t crc = h->crc32;
+    h->crc32 = 0;
+    uint32_t _crc = crc32c(crc32c(0, hdr, 4096), data, bytes);
+    h->crc32 = crc;
+    return crc == _crc;
+}
+
+/* enforces the latency budget for queued writes
+ */
 void write_cache_impl::flush_thread(thread_pool<int> *p) {
     pthread_setname_np(pthread_self(), "wcache_flush");
     auto period = std::chrono::milliseconds(50);
+    auto budget = std::chrono::microseconds(batch_usecs);
     while (p->running) {
 	std::unique_lock lk(m);
-	p->cv.wait_for(lk, period);
+	if (queued > 0)
+	    p->cv.wait_for(lk, budget);
+	else
+	    p->cv.wait_for(lk, period);
 	if (!p->running)
 	    return;
-	if (outstanding_writes == 0 && work.size() > 0)
+	if (queued > 0 && (outstanding_writes < write_depth ||
+			   now_usecs() - first_queued >= batch_usecs))
 	    send_writes(lk);
     }
 }
@@ -463,119 +809,213 @@ void write_cache_impl::ckpt_thread(thread_pool<int> *p) {
     }
 }
 
+/* copies evicted hot data into the read cache (see evict) with
+ * no locks held
+ */
+void write_cache_impl::promote_thread(thread_pool<int> *p) {
+    pthread_setname_np(pthread_self(), "wcache_promote");
+    while (p->running) {
+	std::unique_lock lk(m);
+	if (to_promote.size() == 0)
+	    p->cv.wait(lk);
+	if (to_promote.size() == 0)
+	    continue;
+	std::vector<promote_job> jobs;
+	jobs.swap(to_promote);
+	auto rc = rcache;
+	lk.unlock();
+
+	for (auto j : jobs)
+	    rc->promote(j.lba, j.sectors, nvme_w, ssd_fd, j.plba*512L,
+			j.obj_seq, j.obj_limit);
+
+	lk.lock();
+	promoted += jobs.size();
+	promote_cv.notify_all();
+    }
+}
+
+/* wait until the copies queued before 'ticket' (promote_queued, read
+ * under m) are done, so the journal space they read can be reused.
+ * Call without m.
+ */
+void write_cache_impl::wait_promoted(uint64_t ticket) {
+    if (promoted >= ticket)
+	return;
+    std::unique_lock lk(m);
+    while (promoted < ticket)
+	promote_cv.wait(lk);
+}
+
+/* copy out the map and the journal record lengths a chunk at a time,
+ * so writers aren't held up for long. The result is fuzzy - pieced
+ * together from different moments - but every change since the scan
+ * started is in 'deltas', and applying those on top gives the map as
+ * of the end.
+ */
+void write_cache_impl::scan_checkpoint(std::vector<j_map_extent> &extents,
+				       std::vector<j_length> &lengths) {
+    const int chunk = 4096;
+    sector_t pos = 0;
+    for (bool done = false; !done; ) {
+	std::unique_lock lk(m);
+	auto it = map.lookup(pos);
+	for (int n = 0; n < chunk && it != map.end(); n++, it++) {
+	    auto [base, limit, plba] = it->vals(pos, it->limit());
+	    extents.push_back((j_map_extent){(uint64_t)base,
+					     (uint64_t)(limit - base),
+					     (uint64_t)plba});
+	    pos = limit;
+	}
+	done = (it == map.end());
+    }
+
+    page_t b = super->base;
+    for (int i = super->base; i < (int)super->limit; ) {
+	std::unique_lock lk(m);
+	for (int n = 0; n < chunk * 16 && i < (int)super->limit; n++, i++) {
+	    auto type = cache_blocks[i - b].type;
+	    auto n_pages = cache_blocks[i - b].n_pages;
+	    if (type == WCACHE_HDR && (i < (int)next_acked_page ||
+				       i >= (int)super->oldest))
+		lengths.push_back((j_length){i, n_pages});
+	}
+    }
+}
+
 void write_cache_impl::write_checkpoint(void) {
     std::unique_lock<std::mutex> lk(m);
     if (ckpt_in_progress)
 	return;
     ckpt_in_progress = true;
 
-    /* find all the journal record lengths in cache_blocks[.] first
+    /* deltas go after the full checkpoint they're based on, in the
+     * same half of the metadata region, until they outgrow it
      */
+    page_t mid = (super->meta_base + super->meta_limit) / 2;
+    auto delta_pages = [](size_t n) {
+	return (page_t)div_round_up(n * sizeof(j_map_delta), 4096);
+    };
+    auto delta_fits = [&](size_t n) {
+	page_t start = super->delta_start;
+	page_t total = (page_t)super->delta_blocks + delta_pages(n);
+	page_t end = (start < mid) ? mid : (page_t)super->meta_limit;
+	page_t ckpt = super->map_blocks + super->len_blocks;
+	return total <= std::max(ckpt, 16) && start + total <= end;
+    };
+    bool full = need_full || super->delta_start == 0 ||
+	!delta_fits(deltas.size());
+
+    std::vector<j_map_extent> extents;
     std::vector<j_length> lengths;
-    page_t b = super->base;
-    for (int i = super->base; i < (int)super->limit; i++) {
-	auto [type, n_pages] = cache_blocks[i - b];
-	if (type == WCACHE_HDR && (i < (int)next_acked_page ||
-				   i >= (int)super->oldest))
-	    lengths.push_back((j_length){i, n_pages});
+    if (full) {
+	need_full = true;
+	deltas.clear();
+	lk.unlock();
+	scan_checkpoint(extents, lengths);
+	lk.lock();
     }
-
-    size_t map_bytes = map.size() * sizeof(j_map_extent);
-    size_t len_bytes = lengths.size() * sizeof(j_length);
-    page_t map_pages = div_round_up(map_bytes, 4096),
-	len_pages = div_round_up(len_bytes, 4096),
-	ckpt_pages = map_pages + len_pages;
-
-    /* TODO - switch between top/bottom of metadata region so we
-     * don't leave in inconsistent state if we crash during checkpoint
-     */
-    page_t blockno = super->meta_base;
-    if (super->map_start == (uint32_t)blockno)
-	blockno = (super->meta_base + super->meta_limit) / 2;
-
-    char *e_buf = (char*)aligned_alloc(512, 4096L*map_pages);
-    auto jme = (j_map_extent*)e_buf;
-    int n_extents = 0;
-    if (map.size() > 0)
-	for (auto it = map.begin(); it != map.end(); it++)
-	    jme[n_extents++] = (j_map_extent){(uint64_t)it->s.base,
-					      (uint64_t)it->s.len, (uint32_t)it->s.ptr};
-    // valgrind:
-    int pad1 = 4096L*map_pages - map_bytes;
-    assert(map_bytes == n_extents * sizeof(j_map_extent));
-    assert(pad1 + map_bytes == 4096UL*map_pages);
-    if (pad1 > 0)
-	memset(e_buf + map_bytes, 0, pad1);
-
-    char *l_buf = (char*)aligned_alloc(512, 4096L * len_pages);
-    auto jl = (j_length*)l_buf;
-    int n_lens = 0;
-    for (auto l : lengths)
-	jl[n_lens++] = l;
-
-    // valgrind:
-    int pad2 = 4096L * len_pages - len_bytes;
-    assert(len_bytes + pad2 == len_pages*4096UL);
-    if (pad2 > 0)
-	memset(l_buf + len_bytes, 0, pad2);
+    std::vector<j_map_delta> _deltas;
+    _deltas.swap(deltas);
+    map_dirty = false;
 
     j_write_super *super_copy = (j_write_super*)aligned_alloc(512, 4096);
     memcpy(super_copy, super, 4096);
     super_copy->seq = sequence;
     super_copy->next = next_acked_page;
-
-    super_copy->map_start = super->map_start = blockno;
-    super_copy->map_blocks = super->map_blocks = map_pages;
-    super_copy->map_entries = super->map_entries = n_extents;
-
-    super_copy->len_start = super->len_start = blockno+map_pages;
-    super_copy->len_blocks = super->len_blocks = len_pages;
-    super_copy->len_entries = super->len_entries = n_lens;
-
     lk.unlock();
 
-    assert(4096UL*blockno + 4096UL*ckpt_pages <= dev_max);
-    iovec iov[] = {{e_buf, map_pages*4096UL},
-		   {l_buf, len_pages*4096UL}};
+    page_t map_pages = div_round_up(extents.size()*sizeof(j_map_extent), 4096),
+	len_pages = div_round_up(lengths.size()*sizeof(j_length), 4096),
+	d_pages = delta_pages(_deltas.size());
+
+    page_t blockno = super->delta_start + super->delta_blocks;
+    if (full) {
+	blockno = super->meta_base;
+	if (super->map_start == (uint32_t)blockno)
+	    blockno = mid;
+	if (map_pages + len_pages + d_pages > mid - (page_t)super->meta_base) {
+	    do_log("wcache: map checkpoint (%d pages) doesn't fit\n",
+		   map_pages + len_pages + d_pages);
+	    free(super_copy);
+	    lk.lock();
+	    map_dirty = true;
+	    ckpt_in_progress = false;
+	    return;
+	}
+	super_copy->map_start = blockno;
+	super_copy->map_blocks = map_pages;
+	super_copy->map_entries = extents.size();
+	super_copy->len_start = blockno + map_pages;
+	super_copy->len_blocks = len_pages;
+	super_copy->len_entries = lengths.size();
+	super_copy->delta_start = blockno + map_pages + len_pages;
+	super_copy->delta_blocks = d_pages;
+    }
+    else
+	super_copy->delta_blocks += d_pages;
 
-    if (nvme_w->writev(iov, 2, 4096L*blockno) < 0)
-	throw_fs_error("wckpt_e");
+    /* map, lengths and deltas go out in one write, zero-padded
+     * (deltas pad out to NOPs), then the superblock
+     */
+    size_t bytes = 4096UL * (map_pages + len_pages + d_pages);
+    if (bytes > 0) {
+	char *buf = (char*)aligned_alloc(512, bytes), *ptr = buf;
+	memset(buf, 0, bytes);
+	memcpy(ptr, extents.data(), extents.size()*sizeof(j_map_extent));
+	ptr += 4096L * map_pages;
+	memcpy(ptr, lengths.data(), lengths.size()*sizeof(j_length));
+	ptr += 4096L * len_pages;
+	memcpy(ptr, _deltas.data(), _deltas.size()*sizeof(j_map_delta));
+
+	assert(4096UL*blockno + bytes <= dev_max);
+	if (nvme_w->write(buf, bytes, 4096L*blockno) < 0)
+	    throw_fs_error("wckpt_e");
+	free(buf);
+    }
     if (nvme_w->write((char*)super_copy, 4096, 4096L*super_blkno) < 0)
 	throw_fs_error("wckpt_s");
 
+    lk.lock();
+    super->map_start = super_copy->map_start;
+    super->map_blocks = super_copy->map_blocks;
+    super->map_entries = super_copy->map_entries;
+    super->len_start = super_copy->len_start;
+    super->len_blocks = super_copy->len_blocks;
+    super->len_entries = super_copy->len_entries;
+    super->delta_start = super_copy->delta_start;
+    super->delta_blocks = super_copy->delta_blocks;
+    if (full)
+	need_full = false;
+    ckpt_in_progress = false;
     free(super_copy);
-    free(e_buf);
-    free(l_buf);
+}
 
-    map_dirty = false;
-    ckpt_in_progress = false;
+/* read @n entries of type T starting at page @blk
+ */
+template <class T>
+static void read_entries(nvme *dev, page_t blk, size_t n,
+			 std::vector<T> &entries, const char *what) {
+    if (n == 0)
+	return;
+    size_t bytes = n * sizeof(T), bytes_4k = round_up(bytes, 4096);
+    char *buf = (char*)aligned_alloc(512, bytes_4k);
+    if (dev->read(buf, bytes_4k, 4096L * blk) < 0)
+	throw_fs_error(what);
+    decode_offset_len<T>(buf, 0, bytes, entries);
+    free(buf);
 }
 
 void write_cache_impl::read_map_entries() {
-    size_t map_bytes = super->map_entries * sizeof(j_map_extent),
-	map_bytes_4k = round_up(map_bytes, 4096);
-    char *map_buf = (char*)aligned_alloc(512, map_bytes_4k);
     std::vector<j_map_extent> extents;
+    read_entries(nvme_w, super->map_start, super->map_entries, extents,
+		 "wcache_map");
+    for (auto e : extents)
+	map.update(e.lba, e.lba+e.len, e.plba);
 
-    if (nvme_w->read(map_buf, map_bytes_4k, 4096L * super->map_start) < 0)
-	throw_fs_error("wcache_map");
-    decode_offset_len<j_map_extent>(map_buf, 0, map_bytes, extents);
-
-    for (auto e : extents) {
-	map.update(e.lba, e.lba+e.len, e.plba); // forward map
-        rmap.update(e.plba, e.plba + e.len, e.lba); // reverse
-    }
-    free(map_buf);
-
-    size_t len_bytes = super->len_entries * sizeof(j_length),
-	len_bytes_4k = round_up(len_bytes, 4096);
-    char *len_buf = (char*)aligned_alloc(512, len_bytes_4k);
     std::vector<j_length> _lengths;
-
-    if (nvme_w->read(len_buf, len_bytes_4k, 4096L * super->len_start) < 0)
-	throw_fs_error("wcache_len");
-    decode_offset_len<j_length>(len_buf, 0, len_bytes, _lengths);
-
+    read_entries(nvme_w, super->len_start, super->len_entries, _lengths,
+		 "wcache_len");
     auto b = super->base;
     for (auto l : _lengths) {
 	cache_blocks[l.page - b] = (page_desc){WCACHE_HDR, l.len};
@@ -583,39 +1023,194 @@ void write_cache_impl::read_map_entries() {
 	    cache_blocks[l.page - b + i].type = WCACHE_DATA;
     }
 
-    free(len_buf);
+    std::vector<j_map_delta> _deltas;
+    read_entries(nvme_w, super->delta_start,
+		 super->delta_blocks * (4096 / sizeof(j_map_delta)), _deltas,
+		 "wcache_delta");
+    for (auto d : _deltas) {
+	page_t page = d.lba - b;
+	switch (d.type) {
+	case J_DELTA_MAP:
+	    map.update(d.lba, d.lba + d.len, d.plba);
+	    break;
+	case J_DELTA_TRIM:
+	    map.trim(d.lba, d.lba + d.len);
+	    break;
+	case J_DELTA_HDR:
+	    cache_blocks[page] = (page_desc){WCACHE_HDR, (int)d.len};
+	    for (int i = 1; i < (int)d.len; i++)
+		cache_blocks[page + i].type = WCACHE_DATA;
+	    break;
+	case J_DELTA_FREE:
+	    for (int i = 0; i < (int)d.len; i++)
+		cache_blocks[page + i].type = WCACHE_NONE;
+	    break;
+	}
+    }
+
+    /* reverse map from the result
+     */
+    for (auto it = map.begin(); it != map.end(); it++) {
+	auto [base, limit, plba] = it->vals(it->base(), it->limit());
+	rmap.update(plba, plba + (limit - base), base);
+    }
 }
 
-int write_cache_impl::roll_log_forward() {
-    // TODO
-    // start at write_super->next
-    // for each journal record:
-    //   read the whole record
-    //   verify it, quit if done
-    //   for each entry in it
-    //     put it in the map and cache_blocks[.]
-    //     send it to the backend
-    // if we moved write_super->next, write another checkpoint
+/* sequential read-ahead over the journal for replay: keeps up to
+ * 'window' reads of 'chunk' pages in flight, from the last page asked
+ * for towards the end of the cache. Reading behind that (i.e. the log
+ * wrapped) starts over there.
+ */
+class log_reader {
+    struct chunk {
+	page_t base, len;
+	char *buf;
+	request *req;
+    };
+    nvme *ssd;
+    page_t pos = 0, limit;
+    page_t chunk_pages;
+    size_t window;
+    std::deque<chunk> q;
+    std::vector<char*> bufs;
+
+    void fill(void) {
+	io_batch batch;
+	while (q.size() < window && pos < limit) {
+	    page_t len = std::min(chunk_pages, limit - pos);
+	    char *buf;
+	    if (bufs.size() > 0) {
+		buf = bufs.back();
+		bufs.pop_back();
+	    }
+	    else
+		buf = (char*)aligned_alloc(4096, 4096L * chunk_pages);
+	    auto req = ssd->make_read_request(buf, 4096L * len, 4096L * pos);
+	    q.push_back((chunk){pos, len, buf, req});
+	    req->run(NULL);
+	    pos += len;
+	}
+    }
+    void drop(void) {
+	auto &c = q.front();
+	c.req->wait();
+	c.req->release();
+	bufs.push_back(c.buf);
+	q.pop_front();
+    }
+    void restart(page_t p) {
+	while (q.size() > 0)
+	    drop();
+	pos = p;
+    }
+
+public:
+    log_reader(nvme *ssd_, page_t limit_, page_t chunk_, int window_) {
+	ssd = ssd_;
+	limit = limit_;
+	chunk_pages = chunk_;
+	window = std::max(1, window_);
+    }
+    ~log_reader() {
+	restart(limit);
+	for (auto b : bufs)
+	    free(b);
+    }
+
+    /* copy pages [p,p+n) to dst
+     */
+    void read(page_t p, page_t n, char *dst) {
+	if (q.size() == 0 || p < q.front().base || p >= pos)
+	    restart(p);
+	while (n > 0) {
+	    fill();
+	    auto &c = q.front();
+	    if (p >= c.base + c.len) {
+		drop();
+		continue;
+	    }
+	    c.req->wait();
+	    page_t k = std::min(n, c.base + c.len - p);
+	    memcpy(dst, c.buf + 4096L * (p - c.base), 4096L * k);
+	    p += k;
+	    n -= k;
+	    dst += 4096L * k;
+	}
+    }
+};
+
+/* replay the journal from super->next: the headers come out of a
+ * stream of large sequential reads (log_reader) so data reads overlap
+ * with map updates, and the writes go to the backend in a few large
+ * writev_list calls rather than one per extent.
+ */
+int write_cache_impl::roll_log_forward(replay_progress *rp) {
     bool dirty = false;
     char *buf = (char*)aligned_alloc(512, 4096);
+    log_reader log(nvme_w, super->limit, 256, cfg->replay_window);
+
+    /* data buffers stay allocated until their writes are sent
+     */
+    std::vector<std::pair<size_t,iovec>> writes;
+    std::vector<char*> data_bufs;
+    size_t write_bytes = 0;
+    auto send_writes = [&]() {
+	if (writes.size() > 0)
+	    be->writev_list(writes);
+	writes.clear();
+	for (auto d : data_bufs)
+	    free(d);
+	data_bufs.clear();
+	write_bytes = 0;
+    };
+
+    if (rp)
+	rp->max += super->limit - super->base;
 
     while (true) {
 	auto hdr = (j_hdr*)buf;
-	if (nvme_w->read(buf, sizeof(buf), 4096L * super->next) < 0)
-	    return -1;
+	log.read(super->next, 1, buf);
 	if (hdr->magic != LSVD_MAGIC ||
-	    (hdr->type != LSVD_J_DATA && hdr->type != LSVD_J_PAD) ||
-	    hdr->seq != sequence.load())
+	    (hdr->type != LSVD_J_DATA && hdr->type != LSVD_J_PAD &&
+	     hdr->type != LSVD_J_TRIM) ||
+	    hdr->seq != sequence.load() ||
+	    hdr->len < 1 || super->next + hdr->len > super->limit ||
+	    hdr->extent_offset + hdr->extent_len > 4096)
 	    break;
 
+	/* a torn write shows up as a bad CRC - that's the end of the
+	 * log, same as a stale header
+	 */
+	std::vector<j_extent> entries;
+	decode_offset_len<j_extent>(buf, hdr->extent_offset,
+				    hdr->extent_len, entries);
+	char *data = NULL;
+	size_t data_bytes = 0;
+	if (hdr->type == LSVD_J_DATA) {
+	    for (auto e : entries)
+		data_bytes += e.len * 512L;
+	    size_t data_len = 4096L * (hdr->len - 1);
+	    if (data_bytes > data_len)
+		break;
+	    data = (char*)aligned_alloc(512, std::max(data_len, 4096UL));
+	    log.read(super->next + 1, hdr->len - 1, data);
+	}
+	if (!check_record(buf, data, data_bytes)) {
+	    free(data);
+	    break;
+	}
+
 	sequence++;
+	if (rp)
+	    rp->pages += hdr->len;
 	page_t idx = super->next - super->base;
 	
 	if (hdr->type == LSVD_J_PAD) {
 	    cache_blocks[idx++] =
 		(page_desc){WCACHE_PAD, (int)(super->limit - super->next)};
-	    while (idx < (page_t)super->limit)
+	    while (idx < (page_t)(super->limit - super->base))
 		cache_blocks[idx++].type = WCACHE_NONE;
+	    log_delta(J_DELTA_FREE, super->next, super->limit - super->next, 0);
 	    
 	    super->next = super->base;
 	    continue;
@@ -624,16 +1219,24 @@ int write_cache_impl::roll_log_forward() {
 	cache_blocks[idx] = (page_desc){WCACHE_HDR, (int)hdr->len};
 	for (int i = 1; i < (int)hdr->len; i++)
 	    cache_blocks[idx+i].type = WCACHE_DATA;
+	log_delta(J_DELTA_HDR, super->next, hdr->len, 0);
 	
 	dirty = true;
-	std::vector<j_extent> entries;
-	decode_offset_len<j_extent>(buf, hdr->extent_offset,
-				    hdr->extent_len, entries);
+
+	if (hdr->type == LSVD_J_TRIM) {
+	    send_writes();	// keep trims in order with writes
+	    for (auto e : entries) {
+		trim_map(e.lba, e.lba + e.len);
+		trim_backend(e.lba, e.lba + e.len);
+	    }
+	    super->next += hdr->len;
+	    if (super->next == super->limit)
+		super->next = super->base;
+	    continue;
+	}
 
 	size_t data_len = 4096L * (hdr->len - 1);
-	char *data = (char*)aligned_alloc(512, data_len);
-	if (nvme_w->read(data, data_len, 4096L * (super->next + 1)) < 0)
-	    return -1;
+	data_bufs.push_back(data);
 
 	sector_t plba = (super->next+1) * 8;
 	size_t offset = 0;
@@ -642,21 +1245,27 @@ int write_cache_impl::roll_log_forward() {
 	for (auto e : entries) {
 	    map.update(e.lba, e.lba+e.len, plba, &garbage);
 	    rmap.update(plba, plba+e.len, e.lba);
+	    log_delta(J_DELTA_MAP, e.lba, e.len, plba);
 
 	    size_t bytes = e.len * 512;
-	    iovec iov = {data+offset, bytes};
-	    be->writev(e.lba*512, &iov, 1);
+	    writes.push_back(std::make_pair(e.lba*512L,
+					    (iovec){data+offset, bytes}));
 	    offset += bytes;
 	    plba += e.len;
 	}
-	for (auto g : garbage)
-	    rmap.trim(g.s.base, g.s.base+g.s.len);	    
+	for (auto g : garbage)	// pLBA range of the overwritten data
+	    rmap.trim(g.s.ptr, g.s.ptr + g.s.len);
 
-	free(data);
+	write_bytes += data_len;
+	if (write_bytes >= (size_t)cfg->batch_size)
+	    send_writes();
 	super->next += hdr->len;
-	
+	if (super->next == super->limit)	// same as allocate()
+	    super->next = super->base;
     }
+    send_writes();
     free(buf);
+    next_acked_page = super->next; // everything replayed is on SSD
 
     if (dirty)
 	write_checkpoint();
@@ -665,14 +1274,16 @@ int write_cache_impl::roll_log_forward() {
 }
 
 write_cache_impl::write_cache_impl( uint32_t blkno, int fd, translate *_be,
-				    lsvd_config *cfg_) {
+				    lsvd_config *cfg_, replay_progress *rp,
+				    int stripe_, int n_stripes_) {
     super_blkno = blkno;
     dev_max = getsize64(fd);
     be = _be;
     cfg = cfg_;
+    ssd_fd = fd;
     
     const char *name = "write_cache_cb";
-    nvme_w = make_nvme(fd, name);
+    nvme_w = make_nvme(fd, name, cfg);
 
     char *buf = (char*)aligned_alloc(512, 4096);
     if (nvme_w->read(buf, 4096, 4096L*blkno) < 4096)
@@ -682,51 +1293,125 @@ write_cache_impl::write_cache_impl( uint32_t blkno, int fd, translate *_be,
     map_dirty = false;
     sequence = super->seq;
 
+    /* a journal in a striped cache only has its own stripes, so the
+     * layout is fixed once it's been written to
+     */
+    stripe = stripe_;
+    n_stripes = n_stripes_;
+    stripe_unit = cfg->wcache_stripe / 512;
+    if (super->seq == 1 && super->next == super->base) {
+	super->stripe_sectors = (n_stripes > 1) ? stripe_unit : 0;
+	super->stripe_count = (n_stripes > 1) ? n_stripes : 0;
+	super->stripe_index = stripe;
+    }
+    else if (std::max(super->stripe_count, 1U) != (uint32_t)n_stripes ||
+	     (n_stripes > 1 && (super->stripe_sectors != stripe_unit ||
+				super->stripe_index != (uint32_t)stripe)))
+	throw("write cache striping doesn't match config");
+
     int n_pages = super->limit - super->base;
     cache_blocks = new page_desc[n_pages];
     
-    if (super->map_entries)
+    if (super->map_entries || super->delta_blocks)
 	read_map_entries();
 
-    roll_log_forward();
+    roll_log_forward(rp);
 
     max_write_pages = n_pages / 2;
     write_batch = cfg->wcache_batch;
+    batch_bytes = cfg->wcache_batch_bytes;
+    batch_usecs = cfg->wcache_batch_usecs;
+    write_depth = std::max(1, cfg->wcache_depth);
+    n_shards = std::clamp((int)std::thread::hardware_concurrency(), 1, 16);
+    shards = new wq_shard[n_shards];
     
     misc_threads = new thread_pool<int>(&m);
     misc_threads->pool.push(std::thread(&write_cache_impl::ckpt_thread,
 					this, misc_threads));
     misc_threads->pool.push(std::thread(&write_cache_impl::flush_thread,
 					this, misc_threads));
+    misc_threads->pool.push(std::thread(&write_cache_impl::promote_thread,
+					this, misc_threads));
 }
 
-write_cache *make_write_cache(uint32_t blkno, int fd,
-			      translate *be, lsvd_config *cfg) {
-    return new write_cache_impl(blkno, fd, be, cfg);
+write_cache *make_write_cache(uint32_t blkno, int fd, translate *be,
+			      lsvd_config *cfg, replay_progress *rp,
+			      int stripe, int n_stripes) {
+    return new write_cache_impl(blkno, fd, be, cfg, rp, stripe, n_stripes);
 }
 
 write_cache_impl::~write_cache_impl() {
     delete misc_threads;
     delete[] cache_blocks;
+    delete[] shards;
     free(super);
     delete nvme_w;
 }
 
+/* empty the per-CPU queues, back into issue order
+ */
+std::vector<work_tuple> write_cache_impl::gather(void) {
+    std::vector<std::pair<uint64_t,work_tuple>> all;
+    for (int i = 0; i < n_shards; i++) {
+	std::unique_lock lk(shards[i].m);
+	all.insert(all.end(), shards[i].w.begin(), shards[i].w.end());
+	shards[i].w.clear();
+    }
+    std::sort(all.begin(), all.end(),
+	      [](auto &a, auto &b){return a.first < b.first;});
+
+    std::vector<work_tuple> w;
+    long bytes = 0;
+    for (auto &[seq, t] : all) {
+	w.push_back(t);
+	bytes += std::get<2>(t)->bytes();
+    }
+    queued -= w.size();
+    queued_bytes -= bytes;
+    return w;
+}
+
+/* called with m held, returns with it released. Everything queued
+ * goes out, in records of up to write_batch writes / batch_bytes.
+ */
 void write_cache_impl::send_writes(std::unique_lock<std::mutex> &lk) {
-    auto w = new std::vector<work_tuple>(
-	std::make_move_iterator(work.begin()),
-	std::make_move_iterator(work.end()));
-    work.erase(work.begin(), work.end());
+    auto all = gather();
+    std::vector<request*> reqs;
+
+    for (size_t i = 0; i < all.size(); ) {
+	std::vector<work_tuple> w;
+	sector_t sectors = 0;
+	while (i < all.size() && w.size() < write_batch) {
+	    auto iov = std::get<2>(all[i]);
+	    if (w.size() > 0 && (long)(sectors*512 + iov->bytes()) > batch_bytes)
+		break;
+	    assert(iov->aligned(512));
+	    sectors += iov->bytes() / 512;
+	    w.push_back(all[i++]);
+	}
+	page_t pages = div_round_up(sectors, 8);
+	page_t pad, n_pad;
+	page_t page = alloc_record(pages, pad, n_pad);
 
-    sector_t sectors = 0;
-    for (auto [req,lba,iov] : *w) {
-	(void)lba; (void)req;
-        sectors += iov->bytes() / 512;
-        assert(iov->aligned(512));
+	reqs.push_back(new wcache_write_req(w, pages, page, n_pad-1, pad,
+					    this));
+	outstanding_writes++;
     }
-    
-    page_t pages = div_round_up(sectors, 8);
-    page_t pad, n_pad;
+    auto ticket = promote_queued;
+    lk.unlock();
+
+    wait_promoted(ticket);
+
+    io_batch batch;
+    for (auto req : reqs)
+	req->run(NULL);
+}
+
+/* allocate a journal record of @pages data pages plus header, and
+ * mark it (and the pad record, if we wrapped) in cache_blocks.
+ * must be called with lock held.
+ */
+page_t write_cache_impl::alloc_record(page_t pages, page_t &pad, page_t &n_pad) {
     page_t page = allocate(pages+1, pad, n_pad);
     auto b = super->base;
     
@@ -741,23 +1426,119 @@ void write_cache_impl::send_writes(std::unique_lock<std::mutex> &lk) {
     cache_blocks[page - b] = (page_desc){WCACHE_HDR, pages+1};
     for (int i = 0; i < pages; i++)
 	cache_blocks[page - b + 1 + i].type = WCACHE_DATA;
-    
+    log_delta(J_DELTA_HDR, page, pages+1, 0);
+    return page;
+}
 
-    auto req = new wcache_write_req(w, pages, page, n_pad-1, pad, this);
-    outstanding_writes++;
-    
+/* drop [base,limit) from the forward and reverse maps.
+ * must be called with lock held.
+ */
+void write_cache_impl::trim_map(sector_t base, sector_t limit) {
+    for (auto it = map.lookup(base);
+	 it != map.end() && it->base() < limit; it++) {
+	auto [_base, _limit, plba] = it->vals(base, limit);
+	rmap.trim(plba, plba + (_limit - _base));
+    }
+    map.trim(base, limit);
+    log_delta(J_DELTA_TRIM, base, limit - base, 0);
+}
+
+/* backend trim for [base,limit), limited to our own stripes - trims
+ * of other journals' stripes come from their journals, in order with
+ * their writes
+ */
+void write_cache_impl::trim_backend(sector_t base, sector_t limit) {
+    if (n_stripes == 1) {
+	be->trim(base*512, (limit - base)*512);
+	return;
+    }
+    sector_t s = base / stripe_unit;
+    s += (stripe - s % n_stripes + n_stripes) % n_stripes;
+    for (; s * stripe_unit < limit; s += n_stripes) {
+	sector_t _base = std::max(base, s * stripe_unit),
+	    _limit = std::min(limit, (s+1) * stripe_unit);
+	be->trim(_base*512, (_limit - _base)*512);
+    }
+}
+
+/* must be called with lock held
+ */
+void write_cache_impl::log_delta(int type, uint64_t base, uint64_t len,
+				 uint64_t plba) {
+    const uint64_t max_len = (1UL << 24) - 1;
+    while (len > 0) {
+	auto n = std::min(len, max_len);
+	deltas.push_back((j_map_delta){base, n, plba, (uint64_t)type});
+	base += n;
+	len -= n;
+	if (type == J_DELTA_MAP)
+	    plba += n;
+    }
+}
+
+/* discards go into the journal in order with writes, so we send
+ * any pending writes first.
+ */
+void write_cache_impl::trim(request *req, sector_t lba, sector_t sectors) {
+    std::unique_lock lk(m);
+    if (queued > 0) {
+	send_writes(lk);
+	lk.lock();
+    }
+    page_t pad, n_pad;
+    page_t page = alloc_record(0, pad, n_pad);
+    auto t_req = new wcache_trim_req(req, lba, sectors, page,
+				     n_pad-1, pad, this);
+    auto ticket = promote_queued;
     lk.unlock();
-    req->run(NULL);
+    wait_promoted(ticket);
+    t_req->run(NULL);
 }
 
+/* push, then count, then look at outstanding_writes; a completion
+ * decrements outstanding_writes and then looks at queued, so one of
+ * us always sees the other's write.
+ */
 void write_cache_impl::writev(request *req, sector_t lba, smartiov *iov) {
-    std::unique_lock lk(m);
-    work.push_back(std::make_tuple(req, lba, iov));
+    long bytes = iov->bytes();
+    int cpu = sched_getcpu();
+    auto &s = shards[(cpu < 0 ? 0 : cpu) % n_shards];
+    {
+	std::unique_lock lk(s.m);
+	s.w.push_back(std::make_pair(wq_seq++,
+				     std::make_tuple(req, lba, iov)));
+    }
+    queued_bytes += bytes;
+    int n = ++queued;
 
-    // if we're not under write pressure, send writes immediately; else
-    // batch them
-    if (outstanding_writes == 0 || work.size() >= write_batch)
+    if (outstanding_writes < write_depth || n >= (int)write_batch ||
+	queued_bytes >= batch_bytes) {
+	std::unique_lock lk(m);
+	if (queued > 0)
+	    send_writes(lk);
+    }
+    else if (n == 1) {
+	first_queued = now_usecs();
+	misc_threads->cv.notify_all();
+    }
+}
+
+/* anything still queued is "issued" - send it, then wait for the
+ * newest record so far and everything before it
+ */
+void write_cache_impl::flush_async(request *req) {
+    std::unique_lock lk(m);
+    if (queued > 0) {
 	send_writes(lk);
+	lk.lock();
+    }
+    flushes.push_back(std::make_pair(rec_seq, req));
+    n_flushes++;
+    std::vector<request*> flushed;
+    get_flushed(flushed);
+    lk.unlock();
+    for (auto f : flushed)
+	f->notify(NULL);
 }
 
 /* arguments:
@@ -786,6 +1567,8 @@ write_cache_impl::async_read(size_t offset, char *buf, size_t bytes) {
 	}
 	read_len = 512 * (_limit - _base);
 	nvme_offset = 512L * plba;
+	if (rcache != NULL)
+	    hot.update(plba, plba + read_len/512, plba);
     }
     lk.unlock();
 
@@ -795,6 +1578,38 @@ write_cache_impl::async_read(size_t offset, char *buf, size_t bytes) {
     return std::make_tuple(skip_len, read_len, rreq);
 }
 
+/* GC: the map always holds the newest data for an LBA, so it's
+ * good for a GC copy. Nothing pins it while the read is outstanding,
+ * so gc_check verifies it wasn't evicted in the meantime.
+ */
+std::tuple<int64_t,int64_t,request*>
+write_cache_impl::gc_read(int64_t lba, extmap::obj_offset oo,
+			  int64_t sectors, char *buf) {
+    sector_t base = lba, limit = lba + sectors;
+
+    std::unique_lock<std::mutex> lk(m);
+    auto it = map.lookup(base);
+    if (it == map.end() || it->base() >= limit)
+	return std::make_tuple(-sectors, 0, (request*)NULL);
+    auto [_base, _limit, plba] = it->vals(base, limit);
+    if (_base > base)
+	return std::make_tuple(-(_base - base), 0, (request*)NULL);
+    lk.unlock();
+
+    int64_t n = _limit - _base;
+    auto req = nvme_w->make_read_request(buf, n*512, 512L * plba);
+    return std::make_tuple(n, (int64_t)plba, req);
+}
+
+bool write_cache_impl::gc_check(int64_t lba, int64_t sectors, int64_t tag) {
+    std::unique_lock<std::mutex> lk(m);
+    auto it = map.lookup(lba);
+    if (it == map.end() || it->base() > lba)
+	return false;
+    auto [_base, _limit, plba] = it->vals(lba, lba + sectors);
+    return plba == tag && _limit == lba + sectors;
+}
+
 // debugging
 void write_cache_impl::getmap(int base, int limit, int (*cb)(void*, int, int, int),
 			 void *ptr) {
@@ -809,6 +1624,15 @@ void write_cache_impl::reset(void) {
     map.reset();
 }
 
+void write_cache_impl::set_read_cache(read_cache *rc) {
+    std::unique_lock<std::mutex> lk(m);
+    while (promoted < promote_queued)	// queued for the old one
+	promote_cv.wait(lk);
+    rcache = rc;
+    if (rc == NULL)
+	hot.reset();
+}
+
 void write_cache_impl::get_super(j_write_super *s) {
     *s = *super;
 }
@@ -829,7 +1653,7 @@ page_t write_cache_impl::get_oldest(page_t blk, std::vector<j_extent> &extents)
     if (h->magic != LSVD_MAGIC) {
 	printf("bad block: %d\n", blk);
     }
-    assert(h->magic == LSVD_MAGIC && h->version == 1);
+    assert(h->magic == LSVD_MAGIC && h->version >= 1);
 
     auto next_blk = blk + h->len;
     if (next_blk >= super->limit)
@@ -13,7 +13,10 @@
 
 /* all addresses are in units of 4KB blocks
  */
-class write_cache {
+class read_cache;
+struct lsvd_metrics;
+
+class write_cache : public gc_cache {
 public:
     virtual void get_room(sector_t sectors) = 0; 
     virtual void release_room(sector_t sectors) = 0;
@@ -22,6 +25,13 @@ public:
     virtual ~write_cache() {}
 
     virtual void writev(request *req, sector_t lba, smartiov *iov) = 0;
+    virtual void trim(request *req, sector_t lba, sector_t sectors) = 0;
+
+    /* req->notify(NULL) once every write and trim issued before the
+     * call is on the SSD and has been notified. Doesn't touch the
+     * backend.
+     */
+    virtual void flush_async(request *req) = 0;
     virtual std::tuple<size_t,size_t,request*>
         async_read(size_t,char*,size_t) = 0;
     
@@ -31,10 +41,37 @@ public:
     virtual void get_super(j_write_super *s) = 0; /* copies superblock */
     virtual page_t get_oldest(page_t blk, std::vector<j_extent> &extents) = 0;
     virtual void do_write_checkpoint(void) = 0;
+
+    /* read cache to promote data into on eviction; NULL to stop
+     */
+    virtual void set_read_cache(read_cache *rc) = 0;
+
+    /* counters and latencies are added here, if not NULL
+     */
+    virtual void set_metrics(lsvd_metrics *m) = 0;
+};
+
+/* journal replay at startup, in pages - can be read from another
+ * thread while make_write_cache runs. 'max' is the cache size, an
+ * upper bound on how much there is to replay.
+ */
+struct replay_progress {
+    std::atomic<int64_t> pages = 0;
+    std::atomic<int64_t> max = 0;
 };
 
 extern write_cache *make_write_cache(uint32_t blkno, int fd,
-                                     translate *be, lsvd_config *cfg);
+                                     translate *be, lsvd_config *cfg,
+                                     replay_progress *rp = NULL,
+                                     int stripe = 0, int n_stripes = 1);
+
+/* a write cache over several journals (e.g. on separate devices),
+ * each made with make_write_cache(..., i, caches.size()). Stripe i*N+j
+ * of 'unit' sectors goes to journal j, so writes to any LBA stay in
+ * order in one journal, and the journals replay independently.
+ */
+extern write_cache *make_striped_wcache(std::vector<write_cache*> &caches,
+                                        sector_t unit);
 
 #endif
 